@@ -1,128 +1,875 @@
 // Copyright 2020, Tim Crowder, All rights reserved.
 
+#pragma once
+
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <stdarg.h>
 #include <math.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <sched.h>
 
 //#include <typeinfo>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <vector>
 
+#include "Persist.hpp"
+#include "Probes.hpp"
 #include "StructArrayStore.hpp"
 #include "UDP.hpp"
+#include "UringSocket.hpp"
 
 #ifndef LISTEN_TIME
 #  define LISTEN_TIME 3000
 #endif
+// once every owned node-id got a high-water answer from a peer, only listen this much longer
+#ifndef LISTEN_GRACE_TIME
+#  define LISTEN_GRACE_TIME (LISTEN_TIME/10)
+#endif
+// peer table entries not renewed within this interval are free for leasing
+#ifndef LEASE_TIMEOUT_MS
+#  define LEASE_TIMEOUT_MS 60000
+#endif
+#define LEASE_RENEW_MS (LEASE_TIMEOUT_MS/4)
+#define LEASE_CLAIM_ATTEMPTS 8
+// time-lease (consistency-first) mode: timestamp ranges are leased from a server (see LeaseServer.hpp)
+#define TIME_LEASE_ADDR "127.0.0.1:26981"
+#ifndef TIME_LEASE_MS
+#  define TIME_LEASE_MS 10000       // requested lease length
+#endif
+#define TIME_LEASE_MAX_MS 600000    // longest lease the server grants
+#define TIME_LEASE_RETRY_MS 100     // request retransmission interval
+#define TIME_LEASE_TIMEOUT_MS 2000  // give up waiting for the first lease at startup
+// durable mode: the stored high-water mark is kept (synced) this far ahead of the timestamps in use
+#ifndef DURABLE_AHEAD_MS
+#  define DURABLE_AHEAD_MS 1000
+#endif
+#define DURABLE_TIMEOUT_MS 5000     // give up waiting for a durable high-water mark
+// the ID calls check for peer messages at most this often (a poll is a system call),
+// idle nodes call Poll()
+#ifndef PEER_POLL_MS
+#  define PEER_POLL_MS 1
+#endif
+// high-water replies to requests are delayed randomly by up to this much (in a full cluster,
+// proportionally less with fewer known peers), and dropped if another peer answers first
+#ifndef REPLY_DELAY_MS
+#  define REPLY_DELAY_MS 50
+#endif
+// at startup, nodes ask for a peer-table snapshot (answered by about this many peers, 
+// twice as many on every retry), and retry if none arrived after SNAPSHOT_RETRY_MS 
+// (only once a running peer was heard, so a cold start of the whole cluster doesn't)
+#define SNAPSHOT_RESPONDERS 2
+#ifndef SNAPSHOT_RETRY_MS
+#  define SNAPSHOT_RETRY_MS 100
+#endif
+#define SNAPSHOT_ATTEMPTS 3
+// load telemetry in UP messages is measured over windows of (at least) this length
+#ifndef LOAD_WINDOW_MS
+#  define LOAD_WINDOW_MS 1000
+#endif
 #define NODE_BITS 10
 #define MAX_NODES   (1<<NODE_BITS)
-#define NODE_MASK ((1<<(NODE_BITS+1)) - 1)
+#define NODE_MASK ((1<<NODE_BITS) - 1)
 #define COUNTER_BITS 10
 #define MAX_COUNTER  (1<<COUNTER_BITS)
-#define COUNTER_MASK ((1<<(COUNTER_BITS+1)) - 1)
+#define COUNTER_MASK ((1<<COUNTER_BITS) - 1)
+#define TIMESTAMP_BITS (64 - COUNTER_BITS - NODE_BITS)
+#define MAX_TIMESTAMP  ((1ull<<TIMESTAMP_BITS) - 1)
 
 // NOTE: port is hex for "id" :D
 //#define MULTICAST_ADDR "224.0.0.152:26980"
 #define MULTICAST_ADDR "239.0.0.152:26980"
 #define ANY_ADDR "0.0.0.0:0"
+// IPv6 equivalents (site-local scope, so an interface isn't required)
+#define MULTICAST_ADDR6 "[ff05::152]:26980"
+#define ANY_ADDR6 "[::]:0"
 
 int debug = 0;
 
+// Wire (and storage) format versions of IdNodeState.
+// Newer versions only append fields, so the common prefix is always valid.
+//   1 - timestamp, id, port, ipaddr, mode (24 bytes, incl. padding)
+//   2 - adds version, boot sequence and instance id (32 bytes)
+//   3 - adds load telemetry: QPS, throttles, counter use, clock drift (48 bytes)
+//   4 - adds the full IPv6 address (64 bytes)
+#define STATE_VERSION 4
+#define STATE_V1_SIZE 24
+#define STATE_V1_FIELDS 18  // bytes of v1 that hold actual fields (the rest is padding)
+#define STATE_V2_SIZE 32
+#define STATE_V3_SIZE 48
+
 // Compressed representation of the state of an ID node for serialization.
 struct IdNodeState {
   uint64_t timestamp; // millisecond granularity
   uint16_t id;        // node id
   uint16_t port;      // network port of the IdNode
-  uint32_t ipaddr;    // raw octet IPV4 address of the IdNode
-  uint16_t mode;      // mode for messages: "UP" (server up), "RQ" (request), "HW" (high-water response)
+  uint32_t ipaddr;    // raw octet IPV4 address of the IdNode (folded, for IPv6)
+  uint16_t mode;      // mode for messages: "UP" (server up), "RQ" (request), "HW" (high-water response),
+                      //                    "CL" (node-id lease claim), "SQ" (snapshot request, 'timestamp'
+                      //                    is the number of peers wanted to answer), "SN" (see IdSnapshot)
+  uint8_t  version;   // wire format version (STATE_VERSION, 1 for legacy messages)
+  uint8_t  flags;     // reserved (0)
+  uint32_t boot;      // boot sequence number of the node-id (persisted, bumped every incarnation)
+  uint64_t instance;  // random per-incarnation identifier (0 for legacy peers)
+  // load of the node-id, as announced in its UP messages (0 from older peers, see IdNode::GetClusterView())
+  uint32_t qps;       // IDs per second, over the last LOAD_WINDOW_MS (or longer, if the node idled)
+  int32_t  driftMs;   // high-water timestamp minus the sender's realtime clock (ahead if positive)
+  uint16_t throttles; // throttling sleeps in that window (saturating)
+  uint8_t  counterUse; // most IDs on one timestamp (millisecond) in that window, percent of MAX_COUNTER-1
+  uint8_t  reserved1; // (0)
+  uint32_t reserved2; // (0)
+  uint8_t  ip6[16];   // IPv6 address of the IdNode (network order; all 0 for IPv4, and from older peers)
+
+  // Fill in from a received message (or stored record) 'buf' of 'len' bytes.
+  // Accepts legacy (v1, v2) messages, and newer versions (ignoring appended fields).
+  // Returns false if it isn't a valid IdNodeState.
+  bool Decode(const char* buf, int len) {
+    memset(this, 0, sizeof(*this));
+    if (len == STATE_V1_SIZE) {
+      memcpy(this, buf, STATE_V1_FIELDS);
+      version = 1;
+      return true;
+    }
+    if (len < STATE_V2_SIZE) { return false; }
+    memcpy(this, buf, len < (int)sizeof(*this) ? len : sizeof(*this));
+    return version >= 2;
+  }
+
+  // Returns true if the announced load is close to throttling: 'usePct' percent 
+  // of the counters of a millisecond used, or throttling already happened.
+  bool IsHot(unsigned usePct=80) const { return counterUse >= usePct || throttles > 0; }
+
+  // Returns true if 'other' comes from the same incarnation (instance) of a node.
+  // Legacy peers don't have an instance, so fall back to the address.
+  bool SameInstance(const IdNodeState& other) const {
+    if (instance && other.instance) { return instance == other.instance; }
+    return ipaddr == other.ipaddr && port == other.port;
+  }
 
   // Set the mode field from a 2-character string 'm'.
   void SetMode(const char* m) {
     memcpy((char*)&mode, m, 2);
   }
   // returns true if the mode field matches the first two characters of 'm'.
-  bool HasMode(const char* m) {
+  bool HasMode(const char* m) const {
     return 0 == memcmp(m, (const char*)&mode, 2);
   }
 
-  // Set the ipaddr and port fields from 'addr'.
+  // Returns true if the address is IPv6 (in 'ip6').
+  bool IsV6() const {
+    static const uint8_t none[16] = { 0 };
+    return 0 != memcmp(ip6, none, sizeof(ip6));
+  }
+
+  // Set the ipaddr, ip6 and port fields from 'addr'.
+  // IPv6 addresses are also folded (xor) into the 32 bits of 'ipaddr', for older peers.
   void SetAddress(const IPAddress& addr) {
-    ipaddr = htonl(addr.ip.sin_addr.s_addr);
+    if (addr.IsV6()) {
+      uint32_t words[4];
+      memcpy(words, &addr.ip6.sin6_addr, sizeof(words));
+      ipaddr = ntohl(words[0] ^ words[1] ^ words[2] ^ words[3]);
+      memcpy(ip6, &addr.ip6.sin6_addr, sizeof(ip6));
+    } else {
+      ipaddr = htonl(addr.ip.sin_addr.s_addr);
+      memset(ip6, 0, sizeof(ip6));
+    }
     port = addr.GetPort();
   }
-  // Copy the ipaddr and port fields into 'addr'.
-  void GetAddress(IPAddress& addr) {
-    addr.ip.sin_addr.s_addr = htonl(ipaddr);
+  // Copy the address and port fields into 'addr' (IPv4 for older peers' IPv6 addresses,
+  // which only have the folded form).
+  void GetAddress(IPAddress& addr) const {
+    memset(&addr.ss, 0, sizeof(addr.ss));
+    if (IsV6()) {
+      addr.ip6.sin6_family = AF_INET6;
+      memcpy(&addr.ip6.sin6_addr, ip6, sizeof(ip6));
+    } else {
+      addr.ip.sin_family = AF_INET;
+      addr.ip.sin_addr.s_addr = htonl(ipaddr);
+    }
     addr.SetPort(port);
   }
 };
+static_assert(sizeof(IdNodeState) == 64, "IdNodeState is a wire (and storage) format");
 
-// Class which generates "globally" unique 64-bit IDs, 
-// and coordinates with peer nodes via Multicast.
-// Each running IdNode should have a unique 10 bit 'nodeId'.
-class IdNode {
+// Opens the IdNodeState table 'fname' in 'store', converting it from an older 
+// record size (v1, v2 or v3, the old file is kept as "<fname>.v1", ".v2" or ".v3") if needed.
+inline bool OpenStateStore(StructArrayStore<IdNodeState>& store, const char* fname) {
+  struct stat st;
+  if (0 == stat(fname, &st) && (st.st_size == (off_t)STATE_V1_SIZE*MAX_NODES || st.st_size == (off_t)STATE_V2_SIZE*MAX_NODES ||
+                                st.st_size == (off_t)STATE_V3_SIZE*MAX_NODES)) {
+    unsigned recSize = st.st_size / MAX_NODES;
+    fprintf(stderr, "NOTICE: Converting legacy state file '%s'.\n", fname);
+    std::vector<char> old(st.st_size);
+    FILE* f = fopen(fname, "rb");
+    bool ok = f && (1 == fread(&old[0], old.size(), 1, f));
+    if (f) { fclose(f); }
+    std::string backup = std::string(fname) + (recSize == STATE_V1_SIZE ? ".v1" : recSize == STATE_V2_SIZE ? ".v2" : ".v3");
+    if (!ok || 0 != rename(fname, backup.c_str())) {
+      fprintf(stderr, "ERROR: Failed to convert legacy state file '%s'!\n", fname);
+      return false;
+    }
+    if (!store.Open(fname, MAX_NODES)) { return false; }
+    for (unsigned i=0; i<MAX_NODES; ++i) {
+      IdNodeState rec;
+      rec.Decode(&old[i*recSize], recSize);
+      if (rec.timestamp) { store.Write(rec, i); }
+    }
+    return true;
+  }
+  return store.Open(fname, MAX_NODES);
+}
 
-private:
-  uint16_t nodeId;      // node identifier (0-1023)
+// Other Store policies (of BasicIdNode) have their own format.
+template<typename Store> bool OpenStateStore(Store& store, const char* fname) {
+  return store.Open(fname, MAX_NODES);
+}
+
+// Peer-table snapshot ("SN"), a peer's answer to a snapshot request ("SQ") of a starting node: 
+// the non-empty records of the peer's table (IdNodeState), in chunks of up to SNAPSHOT_CHUNK_RECORDS,
+// each a datagram of its own with this header, so none is fragmented (a lost fragment loses the datagram).
+struct IdSnapshot {
+  IdNodeState from;     // the sender (mode "SN")
+  uint32_t    count;    // records that follow
+  uint16_t    chunk;    // index of this datagram in the snapshot
+  uint16_t    chunks;   // datagrams of the snapshot (0: all of it in this one, e.g. relay digests)
+  uint64_t    checksum; // of the whole datagram (with this field 0)
+
+  // Returns the checksum (64-bit FNV-1a) of 'len' bytes of 'data'.
+  static uint64_t Checksum(const char* data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i=0; i<len; ++i) { h = (h ^ (uint8_t)data[i]) * 0x100000001b3ull; }
+    return h;
+  }
+};
+static_assert(sizeof(IdSnapshot) == 80, "IdSnapshot is a wire format");
+#define SNAPSHOT_MAX_SIZE (sizeof(IdSnapshot) + MAX_NODES*sizeof(IdNodeState))
+// records per snapshot chunk: 1232 bytes, the minimum IPv6 MTU (1280) less the IP/UDP headers
+#define SNAPSHOT_CHUNK_RECORDS 18
+#define SNAPSHOT_CHUNK_SIZE (sizeof(IdSnapshot) + SNAPSHOT_CHUNK_RECORDS*sizeof(IdNodeState))
+
+// Inclusive range of IDs [lo,hi] (e.g. for database range scans).
+struct IdRange {
+  uint64_t lo;
+  uint64_t hi;
+};
+
+// Time-lease request and reply (consistency-first mode, see LeaseServer.hpp).
+// A grant is an exclusive range of timestamps [start,end) for one node-id,
+// the server never grants overlapping ranges for a node-id.
+struct TimeLeaseMsg {
+  uint64_t start;    // first timestamp (ms) of the lease (requests: the lowest acceptable start)
+  uint64_t end;      // end (exclusive) of the lease (requests: the requested length)
+  uint64_t instance; // requester's instance id
+  uint32_t seq;      // request sequence number, echoed in replies (retransmissions get the same grant)
+  uint16_t id;       // node id
+  uint16_t mode;     // "TQ" (request), "TG" (granted), "TD" (denied)
+
+  void SetMode(const char* m) { memcpy((char*)&mode, m, 2); }
+  bool HasMode(const char* m) const { return 0 == memcmp(m, (const char*)&mode, 2); }
+};
+static_assert(sizeof(TimeLeaseMsg) == 32, "TimeLeaseMsg is a wire format");
+
+// Hot generator core: everything touched when handing out an ID.
+// Aligned (and padded) to a full cache line, so arrays of generators
+// (e.g. one per thread or shard) never false-share.
+struct alignas(64) IdGenerator {
   uint64_t minTimeMs;   // high-water mark timestamp
   uint64_t deltaTimeMs; // offset from monotonic clock to high-water mark
-  uint64_t idCounter;   // count of ID-requests since last timestamp update
-  IdNodeState state;    // packed node state for storage and transmission
-  StructArrayStore<IdNodeState> store;
+  uint32_t idCounter;   // count of ID-requests since last timestamp update
+  uint16_t nodeId;      // node identifier (0-1023)
+  bool     valid;       // initialized, and no colliding peer detected
+  uint8_t  busy;        // spin lock of the thread-safe ID calls (see IdNode::GetId(id, shard))
+
+  IdGenerator() : minTimeMs(0), deltaTimeMs(0), idCounter(0), nodeId(0), valid(false), busy(0) { }
+
+  // The shard lock is only held for a few instructions (or a timestamp update), so spin.
+  void Lock() {
+    while (__atomic_exchange_n(&busy, 1, __ATOMIC_ACQUIRE)) {
+      while (__atomic_load_n(&busy, __ATOMIC_RELAXED)) { sched_yield(); }
+    }
+  }
+  void Unlock() { __atomic_store_n(&busy, 0, __ATOMIC_RELEASE); }
+
+  // Returns true if the counter needs a timestamp update before the next ID
+  // (or, for a priority class, once it reaches the class's 'limit').
+  bool NeedsTimestamp(uint32_t limit=MAX_COUNTER-1) const { return idCounter >= limit || !minTimeMs; }
+
+  // Fast path: builds the next ID from the current fields (no validation).
+  // Callers must check NeedsTimestamp() first.
+  uint64_t NextId() {
+    uint64_t id = (((minTimeMs << COUNTER_BITS) + idCounter) << NODE_BITS) + nodeId;
+    ++idCounter;
+    return id;
+  }
+};
+static_assert(sizeof(IdGenerator) == 64, "IdGenerator must fill exactly one cache line");
+
+// Policies of BasicIdNode (see the IdNode aliases at the end):
+//   Clock       - time source: RtMs(), MonoMs(), SleepUs()
+//   Store       - peer table (state records): Open(), Read(), Write(), GetFd(), GetOffset()
+//   Transport   - peer messages: Open(), Wait(), Read(), Send(), Flush()
+//   Concurrency - lock()/unlock() around the ID calls (NoLock, or e.g. std::mutex)
+// The node holds its policies by value, so calls are bound (and inlined) at compile time.
+// IdClock and IdTransport are the virtual interfaces for policies that are replaced 
+// at runtime (DynamicClock, DynamicTransport), e.g. by the simulator.
+
+// Time source of an IdNode. Replaceable, e.g. by a virtual clock for simulations.
+struct IdClock {
+  virtual ~IdClock() { }
+  // Returns "Real" time (milliseconds), but subject to "warping" forward and back.
+  virtual uint64_t RtMs() = 0;
+  // Returns monotonic time (milliseconds), but with arbitrary origin.
+  virtual uint64_t MonoMs() = 0;
+  // Waits (at least) 'us' microseconds, when throttling.
+  virtual void SleepUs(unsigned us) = 0;
+};
+
+// The system clocks (default).
+struct SystemClock final : IdClock {
+  virtual uint64_t RtMs() { return Rt(); }
+  virtual uint64_t MonoMs() { return Mono(); }
+  virtual void SleepUs(unsigned us) { usleep(us); }
+
+  static uint64_t Rt() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t now = tv.tv_sec*1000;
+    now += (tv.tv_usec/1000);
+    return now;
+  }
+
+  static uint64_t Mono() {
+    struct timespec ts;
+    // NOTE: CLOCK_MONOTONIC (and BOOTTIME) has an arbitrary offset (origin)
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    //clock_gettime(CLOCK_BOOTTIME, &ts);
+    uint64_t now = ts.tv_sec*1000;
+    //now += ((int64_t)ts.tv_nsec)/(int64_t)1000000; // strangely, this doesn't work
+    now += roundl(ts.tv_nsec/1000000);               // but this does
+    return now;
+  }
+};
+
+// Clock policy that forwards to an IdClock, replaceable at runtime (SetClock()).
+struct DynamicClock {
+  SystemClock system;
+  IdClock*    clock; // (system, unless replaced)
+
+  DynamicClock() : clock(&system) { }
+  void Set(IdClock* c) { clock = c ? c : &system; }
+  uint64_t RtMs() { return clock->RtMs(); }
+  uint64_t MonoMs() { return clock->MonoMs(); }
+  void SleepUs(unsigned us) { clock->SleepUs(us); }
+};
+
+// Message transport between an IdNode and its peers (a multicast group).
+// Replaceable, e.g. by an in-process network for simulations.
+struct IdTransport {
+  virtual ~IdTransport() { }
+  // Opens the transport, and sets 'local' to the address peers see as the sender.
+  virtual bool Open(IPAddress& local) = 0;
+  // Returns true if a message is ready to be read (waiting up to 'waitUs' microseconds, -1 forever).
+  virtual bool Wait(int waitUs) = 0;
+  // Reads the next message into 'buf', and its sender into 'from'.
+  // Returns the message size (0 if nothing was read).
+  virtual int Read(char* buf, int maxSz, IPAddress& from) = 0;
+  // Sends 'sz' bytes of 'buf' to all peers (including this node).
+  // May be queued until the next Wait() or Flush().
+  virtual bool Send(const char* buf, int sz) = 0;
+  // Sends anything Send() queued.
+  virtual void Flush() { }
+  // Sends 'sz' bytes of 'buf' to peer 'to' alone, at once (may be larger than a peer message).
+  // Returns false if it failed (or the transport can't).
+  virtual bool SendTo(const IPAddress&, const char*, int) { return false; }
+  // Reads the next message sent to this node alone (SendTo()) into 'buf', without waiting.
+  // Returns the message size (0 if there's none).
+  virtual int ReadUnicast(char*, int, IPAddress&) { return 0; }
+};
+
+// UDP multicast transport (default).
+// Sends from a unicast socket, and receives on the multicast group.
+// With 'useUring', the same sockets are driven by io_uring (see UringSocket.hpp)
+// where the kernel supports it.
+struct SocketTransport final : IdTransport {
   MulticastSocket mcSocket;
   IPAddress       mcAddress; 
   UDPSocket       uSocket;
+  std::string     mcAddressStr; // multicast group "addr:port" (IPv4 or IPv6)
+  NetInterface    iface;        // interface to pin multicast traffic to (optional)
+  bool            useUring;
+  std::unique_ptr<UringSocket> uring; // (NULL if not used, or not supported)
+
+  SocketTransport() : mcAddressStr(MULTICAST_ADDR), useUring(false) { }
+
+  // Opens the unicast and multicast sockets.
+  virtual bool Open(IPAddress& local) {
+    const char* mcAddr = mcAddressStr.c_str();
+    if (0 != mcAddress.SetAddress(mcAddr)) {
+      fprintf(stderr, "ERROR: Invalid multicast address (%s)\n", mcAddr);
+      return false;
+    }
+    int family = mcAddress.GetFamily();
+    // bind to the interface address, if given (otherwise any interface)
+    uSocket.address.SetAddress(family == AF_INET6 ? ANY_ADDR6 : ANY_ADDR);
+    if (iface.IsSet()) { iface.GetAddress(uSocket.address, family); }
+    if (0 != uSocket.Open()) {
+      fprintf(stderr, "ERROR: Failed to open UDP socket (%s)\n", iface.IsSet() ? iface.name.c_str() : "any");
+      return false;
+    }
+    if (iface.IsSet()) {
+      mcSocket.iface = iface;
+      uSocket.SetMulticastInterface(iface);
+    }
+    if (0 != mcSocket.Open(mcAddr)) {
+      fprintf(stderr, "ERROR: Failed to open multicast socket (%s)\n", mcAddr);
+      return false;
+    }
+    mcSocket.SetTTL(3); // allow limited routing
+    uSocket.SetMulticastTTL(3); // (the unicast socket does the sending)
+    uSocket.GetAddress(local);
+    uring.reset();
+    if (useUring) {
+      uring.reset(new UringSocket());
+      if (!uring->Init(mcSocket.sock, uSocket.sock)) {
+        fprintf(stderr, "NOTICE: io_uring sockets unavailable, using plain socket calls.\n");
+        uring.reset();
+      }
+    }
+    return true;
+  }
+  // (microseconds, like UDPSocket::Wait() and UringSocket::Wait())
+  virtual bool Wait(int waitUs) { return uring ? uring->Wait(waitUs) : mcSocket.Wait(waitUs); }
+  virtual int Read(char* buf, int maxSz, IPAddress& from) {
+    return uring ? uring->Read(buf, maxSz, from) : mcSocket.Read(buf, maxSz, from);
+  }
+  virtual bool Send(const char* buf, int sz) {
+    //return sz == mcSocket.Write(buf, sz);
+    if (uring) { return uring->SendTo(mcAddress, buf, sz); }
+    return sz == uSocket.WriteTo(mcAddress, buf, sz);
+  }
+  virtual void Flush() { if (uring) { uring->Flush(); } }
+  // (plain socket calls on the unicast socket, as snapshots don't fit io_uring's buffers)
+  virtual bool SendTo(const IPAddress& to, const char* buf, int sz) {
+    IPAddress dest = to;
+    return sz == sendto(uSocket.sock, buf, sz, 0, dest.GetSockAddr(), dest.GetLength());
+  }
+  virtual int ReadUnicast(char* buf, int maxSz, IPAddress& from) {
+    socklen_t len = sizeof(from.ss);
+    int read = recvfrom(uSocket.sock, buf, maxSz, MSG_DONTWAIT, from.GetSockAddr(), &len);
+    return read > 0 ? read : 0;
+  }
+
+  // The sockets' options (SetMulticastAddress() etc.).
+  SocketTransport& Sockets() { return *this; }
+};
+
+// Transport policy that forwards to an IdTransport, replaceable at runtime (SetTransport()).
+struct DynamicTransport {
+  SocketTransport sockets;
+  IdTransport*    transport; // (sockets, unless replaced)
+
+  DynamicTransport() : transport(&sockets) { }
+  void Set(IdTransport* t) { transport = t ? t : &sockets; }
+  bool Open(IPAddress& local) { return transport->Open(local); }
+  bool Wait(int waitUs) { return transport->Wait(waitUs); }
+  int Read(char* buf, int maxSz, IPAddress& from) { return transport->Read(buf, maxSz, from); }
+  bool Send(const char* buf, int sz) { return transport->Send(buf, sz); }
+  void Flush() { transport->Flush(); }
+  bool SendTo(const IPAddress& to, const char* buf, int sz) { return transport->SendTo(to, buf, sz); }
+  int ReadUnicast(char* buf, int maxSz, IPAddress& from) { return transport->ReadUnicast(buf, maxSz, from); }
+  SocketTransport& Sockets() { return sockets; }
+};
+
+// Transport policy without peers, for single-host setups (a node-id nobody else uses).
+// Messages go nowhere, so startup only waits out the listen window (and trusts the
+// state store for high-water marks), and GetId() never polls a socket.
+struct NullTransport {
+  bool Open(IPAddress& local) { local.SetAddress("127.0.0.1:0"); return true; }
+  // (sleeps out the wait, as there's never a message)
+  bool Wait(int waitUs) { if (waitUs > 0) { usleep(waitUs); } return false; }
+  int Read(char*, int, IPAddress&) { return 0; }
+  bool Send(const char*, int) { return true; }
+  void Flush() { }
+  bool SendTo(const IPAddress&, const char*, int) { return true; }
+  int ReadUnicast(char*, int, IPAddress&) { return 0; }
+};
+
+// Transports that can deliver peer messages (so the ID calls poll them).
+template<typename Transport> struct HasPeers { static const bool value = true; };
+template<> struct HasPeers<NullTransport> { static const bool value = false; };
+
+// Concurrency policy of an IdNode that is only used by one thread at a time (default).
+struct NoLock {
+  void lock() { }
+  void unlock() { }
+};
+
+// Counters of the coordination work of an IdNode (see IdNode::GetStats()).
+struct IdNodeStats {
+  uint64_t polls;       // transport polls (e.g. select() calls), at most one per PEER_POLL_MS on the ID calls
+  uint64_t packetsIn;   // messages received
+  uint64_t packetsOut;  // messages sent
+  uint64_t storeWrites; // state store writes
+  uint64_t tsUpdates;   // timestamp updates (counter wraps, or new milliseconds)
+  uint64_t throttles;   // throttling sleeps (requests faster than MAX_COUNTER per millisecond)
+  uint64_t syncs;       // durable high-water mark writes (write + fdatasync, durable mode)
+  uint64_t syncWaits;   // timestamp updates that had to wait for a durable high-water mark
+  uint64_t shed;        // bulk requests refused (their share of the millisecond was used, see SetAdmission())
+  uint64_t replies;     // high-water replies sent (to requests or claims of peers)
+  uint64_t suppressed;  // high-water replies dropped, because another peer answered first
+  uint64_t snapshots;   // peer-table snapshots sent (to starting peers)
+  uint64_t snapshotRecords; // records taken from a received snapshot (newer than the stored ones)
+
+  IdNodeStats() { memset(this, 0, sizeof(*this)); }
+};
+
+// Timestamp leases of one generator shard (time-lease mode).
+struct TimeLeaseSlot {
+  uint64_t end;       // end (exclusive) of the current lease (0 if none)
+  uint64_t nextStart; // the following lease, once granted (nextEnd 0 if none)
+  uint64_t nextEnd;
+  uint64_t sentMs;    // when the pending request was (last) sent
+  uint32_t seq;       // pending request (0 if none)
+  bool     denied;    // the server refused the last request
+
+  TimeLeaseSlot() { memset(this, 0, sizeof(*this)); }
+};
+
+// Durable high-water mark of one generator shard (durable mode).
+// At most one write is in flight, and its timestamp is ahead of the timestamps in use, 
+// so the generator only waits when it catches up with the synced one.
+struct DurableSlot {
+  IdNodeState rec;        // latest own record (with the wanted timestamp)
+  uint64_t    wantMs;     // high-water mark to persist
+  uint64_t    inFlightMs; // high-water mark being written (0 if none)
+  uint64_t    syncedMs;   // durable high-water mark
+  bool        failed;
+
+  DurableSlot() { memset(this, 0, sizeof(*this)); }
+};
+
+// Request priority classes (see IdNode::GetPriorityId()).
+// Each class may use the counters of a millisecond up to its limit, so the
+// top of the counter range stays reserved for the classes above it.
+enum IdPriority { PRIORITY_CRITICAL, PRIORITY_NORMAL, PRIORITY_BULK, PRIORITY_CLASSES };
+
+// Load of one generator shard, measured on timestamp updates (off the fast path),
+// and announced in its UP messages once per LOAD_WINDOW_MS.
+struct LoadSlot {
+  uint64_t startMs;     // start of the current window (monotonic, 0 before the first update)
+  uint64_t ids;         // IDs handed out in the window
+  uint32_t throttles;   // throttling sleeps in the window
+  uint32_t peak;        // most IDs on one timestamp in the window
+  uint32_t qps;         // the last complete window (announced)
+  uint16_t lastThrottles;
+  uint8_t  counterUse;
+
+  LoadSlot() { memset(this, 0, sizeof(*this)); }
+};
+
+// A delayed high-water reply to a peer's request (see IdNode::ScheduleReply()).
+struct PendingReply {
+  IdNodeState rec;   // the answer ("HW")
+  uint64_t    dueMs; // when to send it (realtime)
+};
+
+// Startup phases of an IdNode (see IdNode::Step()).
+enum IdPhase { PHASE_IDLE, PHASE_LISTEN, PHASE_CLAIM, PHASE_UP, PHASE_FAILED };
+
+// Outcome of a timestamp update (see IdNode::UpdateTimestamp()). The ID calls retry throttled 
+// and unsynced updates once they let go of their locks (see IdNode::Backoff()).
+enum TsUpdate { TS_OK, TS_FAILED, TS_THROTTLED, TS_UNSYNCED };
+
+// Cold coordination state: storage, transport and peer bookkeeping.
+// Only touched on timestamp updates, startup and peer messages.
+template<typename Clock, typename Store, typename Transport> struct IdCoordinator {
+  IdNodeState state;    // packed node state for storage and transmission (address template)
+  uint16_t    firstNodeId; // first node-id in the owned block
+  uint16_t    nodeCount;   // number of contiguous node-ids owned (one generator each)
+  Store           store;
+  std::vector<IdNodeState>* storeMem; // keep the store in this vector, instead of a file (optional)
+  Clock           clock;       // time source
+  Transport       transport;   // peer messages
   IPAddress       uAddress;  // local socket address and port
   std::string     uAddressStr;
+  int             phase;       // IdPhase
+  uint64_t        phaseEndMs;  // end of the startup listen window
+  uint64_t        seed;        // fixed random seed (0 for truly random)
+  unsigned        incarnation; // number of times the transport was opened (for seeded instance ids)
+  unsigned        claimLosses; // lease claims lost since BeginLease()
+  IdNodeStats     stats;
   bool            initialized;
   bool            hasCollision;
+  bool            leased;      // node-ids were leased (vs. statically assigned)
+  bool            claiming;    // lease claim in progress
+  bool            claimLost;   // lease claim lost to another node
+  uint64_t        claimEndMs;  // end of the current claim window
+  uint64_t        lastRenewMs; // last lease renewal (realtime)
+  uint64_t        rng;         // random state for picking free node-ids
+  std::vector<bool> heard;     // per owned node-id, a trusted high-water answer arrived (startup)
+  std::vector<uint64_t> diskTimeMs; // per owned node-id, the stored high-water mark at startup
+  unsigned        answered;    // number of owned node-ids that were 'heard'
+  bool            timeLease;   // timestamps are leased from a server (no peers, no multicast)
+  UDPSocket       leaseSocket; // unicast socket to the lease server
+  IPAddress       leaseServer;
+  uint64_t        leaseLengthMs; // requested lease length
+  uint32_t        leaseSeq;    // last request sequence number
+  std::vector<TimeLeaseSlot> leases; // per owned node-id
+  std::unique_ptr<IdPersister> persister; // asynchronous durable writes of own records (durable mode)
+  std::vector<DurableSlot> durable; // per owned node-id
+  std::vector<LoadSlot> load;  // per owned node-id
+  std::vector<bool> announce;  // per owned node-id, a new timestamp to store and announce (IdNode::Announce())
+  unsigned        unannounced; // number of those (atomic)
+  std::vector<IdNodeState> outbox; // records being stored and announced (the I/O lock held)
+  std::vector<PendingReply> replies; // delayed high-water replies
+  unsigned        replyDelayMs; // reply delay window in a full cluster (0 to answer at once)
+  std::vector<bool> peerSeen;  // per node-id, a message about it arrived (to estimate the cluster size)
+  unsigned        peersSeen;
+  bool            snapshots;     // ask peers for a snapshot of their tables at startup
+  bool            snapshotWanted; // no complete snapshot received yet (this startup)
+  unsigned        snapshotAsks;  // snapshot requests sent (this startup)
+  uint64_t        snapshotAskMs; // when the last one was sent (realtime)
+  uint64_t        snapshotPollMs; // when to read the unicast socket next (monotonic)
+  IdNodeState     snapshotFrom;  // the peer whose snapshot is being completed
+  std::vector<bool> snapshotChunks; // its chunks, those that arrived
+  unsigned        snapshotMissing; // its chunks still missing (0: none tracked)
+  bool            peerRunning;   // a running peer was heard (this startup)
+
+  IdCoordinator() : firstNodeId(0), nodeCount(0), storeMem(NULL), 
+    phase(PHASE_IDLE), phaseEndMs(0), seed(0), incarnation(0), claimLosses(0), initialized(false), hasCollision(false), 
+    leased(false), claiming(false), claimLost(false), claimEndMs(0), lastRenewMs(0), rng(0), answered(0),
+    timeLease(false), leaseLengthMs(TIME_LEASE_MS), leaseSeq(0), unannounced(0), replyDelayMs(REPLY_DELAY_MS),
+    peerSeen(MAX_NODES, false), peersSeen(0), snapshots(true), snapshotWanted(false), snapshotAsks(0),
+    snapshotAskMs(0), snapshotPollMs(0), snapshotMissing(0), peerRunning(false) { memset(&snapshotFrom, 0, sizeof(snapshotFrom)); }
+
+  // Returns true if 'node' is in the block of node-ids owned by this process.
+  bool Owns(uint16_t node) const { return node >= firstNodeId && node < firstNodeId + nodeCount; }
+};
+
+// Class which generates "globally" unique 64-bit IDs, 
+// and coordinates with peer nodes via Multicast.
+// Each running IdNode should have a unique 10 bit 'nodeId', or own a unique 
+// contiguous block of node-ids (one generator "shard" per node-id), which 
+// multiplies the IDs available per millisecond.
+// Its clock, state store, transport and locking are policies (see above), 
+// use one of the IdNode aliases below.
+template<typename Clock=SystemClock, typename Store=StructArrayStore<IdNodeState>, 
+         typename Transport=SocketTransport, typename Concurrency=NoLock>
+class BasicIdNode {
+
+private:
+  typedef std::lock_guard<Concurrency> Guard;
+  Concurrency   lock;            // serializes the ID calls (nothing, by default)
+  std::mutex    ioLock;          // transport and store (after startup): polls, announcements (before coordLock)
+  std::mutex    coordLock;       // coordinator (after startup): timestamp and lease bookkeeping, peer state
+  std::vector<IdGenerator> gens; // hot, one cache line per shard
+  unsigned      nextShard;       // round-robin position for GetId()
+  uint64_t      pollDueMs;       // the ID calls check for peer messages from then on (monotonic, atomic)
+  uint32_t      counterLimit[PRIORITY_CLASSES]; // per priority class, counters usable per millisecond
+  bool          delayBulk;       // bulk requests wait for the next millisecond, instead of being shed
+  IdCoordinator<Clock, Store, Transport> coord; // cold, only touched off the fast path
 
 public:
 
   ////////////////////////////////////////////////////////////
   // public interface
 
-  IdNode() : nodeId(0), minTimeMs(0), deltaTimeMs(0), idCounter(0), initialized(false), hasCollision(false) { }
-  ~IdNode() { }
+  BasicIdNode() : nextShard(0), pollDueMs(0), delayBulk(false) {
+    for (auto& limit : counterLimit) { limit = MAX_COUNTER-1; }
+  }
+  ~BasicIdNode() { Announce(true); }
 
   // Returns true if the node has detected a peer with the same nodeId.
-  bool HasCollision() { return hasCollision; }
+  bool HasCollision() { return coord.hasCollision; }
+
+  // Called with every error message of the node (one line, "ERROR: ..."), instead of printing 
+  // it to stderr, if set: e.g. to log it elsewhere, or to count or silence it (simulations).
+  std::function<void(const char* msg)> onError;
 
   // Returns true if the node is fully initialized and ready to return IDs.
-  bool IsValid() { return initialized && !HasCollision(); }
+  bool IsValid() { return !gens.empty() && gens[0].valid; }
 
   // The whole reason for this class to exist...
   // Returns true if the node is able to generate a unique ID.
   // If so, the id is returned in the (output) parameter 'id'.
+  // With several owned node-ids, the shards are used round-robin.
   bool GetId(uint64_t& id) {
-    // handle any messages
-    while (ProcessMulticast(0)) { }
-    if (!IsValid()) { return false; }
+    Guard guard(lock);
+    unsigned shard = nextShard;
+    if (++nextShard >= gens.size()) { nextShard = 0; }
+    return GetShardId(id, shard);
+  }
 
-    if (idCounter >= (MAX_COUNTER-1) || !minTimeMs) {
-      if (debug) { fprintf(stderr, "INFO: Update timestamp...\n"); }
-      if (!UpdateTimestamp()) {
-        fprintf(stderr, "ERROR: Failed to get timestamp!\n");
+  // Returns true if shard 'shard' is able to generate a unique ID (in 'id').
+  // Thread-safe without a global lock, so callers can pin a shard per thread 
+  // (or per request class): a call only locks its shard's generator, and takes 
+  // the coordinator lock for the bookkeeping of timestamp updates (throttling 
+  // waits happen without either lock, and the new timestamps are stored and 
+  // announced in batches by the polls, see Announce()). Peer messages are polled 
+  // by whichever caller finds them due (PollDue()) while no other thread polls.
+  // Poll() may run alongside on another thread, the other ID calls may not.
+  bool GetId(uint64_t& id, unsigned shard) {
+    if (shard >= gens.size()) { return false; }
+    IdGenerator& gen = gens[shard];
+    uint32_t limit = counterLimit[PRIORITY_NORMAL];
+    DISTID_PROBE1(get_id_entry, gen.nodeId);
+    PollDue();
+    gen.Lock();
+    bool ok = gen.valid && !gen.NeedsTimestamp(limit);
+    for (int retry=0; !ok && gen.valid; ++retry) {
+      // (lock order: coordinator, then shard)
+      gen.Unlock();
+      int ts;
+      {
+        std::lock_guard<std::mutex> guard(coordLock);
+        gen.Lock();
+        ts = !gen.valid ? TS_FAILED : gen.NeedsTimestamp(limit) ? NewTimestamp(shard, retry) : TS_OK;
+        ok = TS_OK == ts;
+        if (ok || TS_FAILED == ts) { break; } // (with the shard locked)
+        gen.Unlock();
+      }
+      bool again = Backoff(shard, ts, retry);
+      gen.Lock();
+      if (!again) { break; }
+      ok = gen.valid && !gen.NeedsTimestamp(limit);
+    }
+    if (ok) { id = gen.NextId(); }
+    gen.Unlock();
+    DISTID_PROBE3(get_id_exit, gen.nodeId, ok ? id : 0, ok);
+    return ok;
+  }
+
+  // GetId() of shard 'shard', with the lock held.
+  // Only touches the shard's generator, unless peer messages are due (PollDue()) 
+  // or the timestamp needs an update.
+  bool GetShardId(uint64_t& id, unsigned shard) {
+    if (shard >= gens.size()) { return false; }
+    IdGenerator& gen = gens[shard];
+    DISTID_PROBE1(get_id_entry, gen.nodeId);
+    // handle any messages (at most once per PEER_POLL_MS)
+    PollDue();
+    if (!gen.valid) {
+      DISTID_PROBE3(get_id_exit, gen.nodeId, 0, 0);
+      return false;
+    }
+    if (gen.NeedsTimestamp(counterLimit[PRIORITY_NORMAL]) && !TakeTimestamp(shard)) {
+      DISTID_PROBE3(get_id_exit, gen.nodeId, 0, 0);
+      return false;
+    }
+    id = gen.NextId();
+    DISTID_PROBE3(get_id_exit, gen.nodeId, id, 1);
+    return true;
+  }
+
+  // Returns true if an ID of priority class 'prio' could be generated (in 'id').
+  // Picks the next shard (round-robin) with counters left for the class in the
+  // current millisecond, or one that can start a new millisecond right away.
+  // If there's none, critical and normal requests wait for the next millisecond
+  // (like GetId()), while bulk requests are shed (false, counted in 'shed'),
+  // unless SetAdmission() chose to delay them too.
+  bool GetPriorityId(uint64_t& id, IdPriority prio) {
+    Guard guard(lock);
+    if (gens.empty() || prio < 0 || prio >= PRIORITY_CLASSES) { return false; }
+    DISTID_PROBE1(get_id_entry, gens[nextShard].nodeId);
+    PollDue();
+    uint32_t limit = counterLimit[prio];
+    uint64_t now = 0;
+    unsigned shard = nextShard;
+    bool room = false;
+    for (unsigned i=0; i<gens.size() && !room; ++i) {
+      shard = (nextShard + i) % gens.size();
+      room = ShardHeadroom(shard, limit, now) > 0;
+    }
+    if (!room) {
+      if (prio == PRIORITY_BULK && !delayBulk) {
+        ++coord.stats.shed;
+        DISTID_PROBE3(get_id_exit, gens[shard].nodeId, 0, 0);
         return false;
       }
-      idCounter = 0;
+      shard = nextShard;
     }
-    id = FieldsToId(minTimeMs, idCounter, nodeId);
-    ++idCounter;
+    nextShard = (shard + 1) % gens.size();
+    IdGenerator& gen = gens[shard];
+    if (!gen.valid) {
+      DISTID_PROBE3(get_id_exit, gen.nodeId, 0, 0);
+      return false;
+    }
+    if (gen.NeedsTimestamp(limit) && !TakeTimestamp(shard)) {
+      DISTID_PROBE3(get_id_exit, gen.nodeId, 0, 0);
+      return false;
+    }
+    id = gen.NextId();
+    DISTID_PROBE3(get_id_exit, gen.nodeId, id, 1);
     return true;
   }
 
+  // Reserves counters of each millisecond for the higher priority classes:
+  // the top 'criticalReserve' counters only for critical requests, and the 
+  // 'normalReserve' below them for normal and critical requests (GetId() is normal).
+  // Bulk requests get the rest, and are shed when it's used (or wait, with 'waitBulk').
+  // Returns false if no counters would be left for bulk requests.
+  bool SetAdmission(uint16_t criticalReserve, uint16_t normalReserve, bool waitBulk=false) {
+    if ((uint32_t)criticalReserve + normalReserve >= MAX_COUNTER-1) {
+      LogError("ERROR: Reserved counters (%u+%u) leave none for bulk requests (of %d)\n",
+          criticalReserve, normalReserve, MAX_COUNTER-1);
+      return false;
+    }
+    counterLimit[PRIORITY_CRITICAL] = MAX_COUNTER-1;
+    counterLimit[PRIORITY_NORMAL] = MAX_COUNTER-1 - criticalReserve;
+    counterLimit[PRIORITY_BULK] = MAX_COUNTER-1 - criticalReserve - normalReserve;
+    delayBulk = waitBulk;
+    return true;
+  }
+
+  // Returns the number of IDs priority class 'prio' can get right now without waiting 
+  // (over all shards), so callers can back off before they're delayed or shed.
+  // A shard that can start a new millisecond counts with the class's full share.
+  unsigned GetHeadroom(IdPriority prio=PRIORITY_NORMAL) {
+    if (prio < 0 || prio >= PRIORITY_CLASSES) { return 0; }
+    Guard guard(lock);
+    uint64_t now = 0;
+    unsigned headroom = 0;
+    for (unsigned shard=0; shard<gens.size(); ++shard) {
+      headroom += ShardHeadroom(shard, counterLimit[prio], now);
+    }
+    return headroom;
+  }
+
+  // Fills 'ids' with up to 'count' IDs (shards round-robin, like GetId()).
+  // Peer messages are processed once per batch (when due), instead of once per ID.
+  // Returns the number of IDs generated (less than 'count' on failures).
+  size_t GetIds(uint64_t* ids, size_t count) {
+    Guard guard(lock);
+    PollDue();
+    for (size_t i=0; i<count; ++i) {
+      unsigned shard = nextShard;
+      if (++nextShard >= gens.size()) { nextShard = 0; }
+      if (shard >= gens.size() || !gens[shard].valid) { return i; }
+      IdGenerator& gen = gens[shard];
+      if (gen.NeedsTimestamp(counterLimit[PRIORITY_NORMAL]) && !TakeTimestamp(shard)) { return i; }
+      ids[i] = gen.NextId();
+    }
+    return count;
+  }
+
   // Prepares the node for use.
   // Returns false if it can't be initialized, or a colliding peer is detected.
-  bool Initialize(uint16_t node) {
-    if (InitNode(node)) {
+  //   'node'  - the first (or only) node-id
+  //   'count' - number of contiguous node-ids to own, starting at 'node'
+  bool Initialize(uint16_t node, uint16_t count=1) {
+    if (InitNode(node, count)) {
       return InitNetwork();
     } else {
-      fprintf(stderr, "ERROR: InitNode failed! (id:%u)\n", node);
+      LogError("ERROR: InitNode failed! (id:%u count:%u)\n", node, count);
     }
     return false;
   }
@@ -142,6 +889,14 @@ public:
     return id;
   }
 
+  // Same as FieldsToId(), without exceptions (e.g. behind a C interface).
+  // Returns false (and leaves 'id' unchanged) if a field is out of range.
+  static bool TryFieldsToId(uint64_t& id, uint64_t timestamp, uint16_t counter, uint16_t node) {
+    if (node >= MAX_NODES || counter >= MAX_COUNTER || timestamp > MAX_TIMESTAMP) { return false; }
+    id = (((timestamp << COUNTER_BITS) + counter) << NODE_BITS) + node;
+    return true;
+  }
+
   // Split out an ID to it's fields, This function is just for troubleshooting.
   static void IdToFields(uint64_t &timestamp, uint16_t &counter, uint16_t &node, uint64_t id) {
     node    = id &  NODE_MASK;
@@ -151,153 +906,1187 @@ public:
     timestamp = id;
   }
 
-  // Returns minimum (high-water mark) timestamp. This is just for testing.
-  uint64_t GetMinTimestamp() { return minTimeMs; }
+  // Returns the creation timestamp of 'id' (milliseconds since the Unix epoch).
+  // This is the node's high-water clock (monotonic time plus deltaTimeMs), which 
+  // never runs behind the wall clock at startup, but may run ahead of it (see TimeRangeToIdRange()).
+  static uint64_t IdToTimestamp(uint64_t id) { return id >> (COUNTER_BITS + NODE_BITS); }
+
+  // Extracts the creation timestamps of 'count' IDs into 'timesMs' (a plain shift, so it vectorizes).
+  static void IdsToTimestamps(const uint64_t* ids, uint64_t* timesMs, size_t count) {
+    for (size_t i=0; i<count; ++i) { timesMs[i] = ids[i] >> (COUNTER_BITS + NODE_BITS); }
+  }
+
+  // Converts the time window [t1,t2] (inclusive, milliseconds since the epoch) into 
+  // the inclusive bounds [lo,hi] of all IDs created in it (on any node).
+  // ID timestamps can run ahead of the wall clock (throttling, high-water marks 
+  // from a faster peer or clock, time-leases), 'aheadMs' widens the upper end to 
+  // still include IDs from nodes that are up to that far ahead.
+  // Returns false if the window is empty.
+  static bool TimeRangeToIdRange(uint64_t t1, uint64_t t2, uint64_t& lo, uint64_t& hi, uint64_t aheadMs=0) {
+    t2 = (t2 > MAX_TIMESTAMP - aheadMs || aheadMs > MAX_TIMESTAMP) ? MAX_TIMESTAMP : t2 + aheadMs;
+    if (t1 > t2) { return false; }
+    lo = FieldsToId(t1, 0, 0);
+    hi = FieldsToId(t2, MAX_COUNTER-1, MAX_NODES-1);
+    return true;
+  }
+
+  // Like TimeRangeToIdRange(), but for IDs of the node-ids in 'nodes' only.
+  // The bounds are tight (from the lowest and highest node-id), but include other node-ids in between.
+  static bool TimeRangeToIdRange(uint64_t t1, uint64_t t2, const std::vector<uint16_t>& nodes, 
+                                 uint64_t& lo, uint64_t& hi, uint64_t aheadMs=0) {
+    if (nodes.empty() || !TimeRangeToIdRange(t1, t2, lo, hi, aheadMs)) { return false; }
+    uint16_t minNode = MAX_NODES-1, maxNode = 0;
+    for (uint16_t n : nodes) {
+      if (n >= MAX_NODES) { throw std::out_of_range("TimeRangeToIdRange(): Invalid node id!"); }
+      if (n < minNode) { minNode = n; }
+      if (n > maxNode) { maxNode = n; }
+    }
+    lo += minNode;
+    hi -= MAX_NODES-1 - maxNode;
+    return true;
+  }
+
+  // Converts the time window [t1,t2] and node-ids 'nodes' (empty for all) into sorted, 
+  // disjoint ID ranges in 'ranges', which contain exactly the IDs of those node-ids, 
+  // if that takes at most 'maxRanges' ranges (one per millisecond, counter and run 
+  // of consecutive node-ids, before merging adjacent ones), otherwise into a single bounding range.
+  // Returns the number of ranges (0 if the window is empty).
+  static size_t TimeRangeToIdRanges(uint64_t t1, uint64_t t2, const std::vector<uint16_t>& nodes, 
+                                    std::vector<IdRange>& ranges, size_t maxRanges=4096, uint64_t aheadMs=0) {
+    ranges.clear();
+    IdRange bounds;
+    if (nodes.empty()) {
+      if (!TimeRangeToIdRange(t1, t2, bounds.lo, bounds.hi, aheadMs)) { return 0; }
+      ranges.push_back(bounds);
+      return 1;
+    }
+    if (!TimeRangeToIdRange(t1, t2, nodes, bounds.lo, bounds.hi, aheadMs)) { return 0; }
+    // runs of consecutive node-ids
+    std::vector<bool> used(MAX_NODES, false);
+    for (uint16_t n : nodes) { used[n] = true; }
+    std::vector<IdRange> runs;
+    for (unsigned n=0; n<MAX_NODES; ++n) {
+      if (!used[n]) { continue; }
+      if (!runs.empty() && runs.back().hi + 1 == n) { runs.back().hi = n; }
+      else { runs.push_back(IdRange{n, n}); }
+    }
+    uint64_t t2Ahead = IdToTimestamp(bounds.hi);
+    bool all = runs.size() == 1 && runs[0].lo == 0 && runs[0].hi == MAX_NODES-1;
+    if (all || (t2Ahead - t1 + 1) > maxRanges || (t2Ahead - t1 + 1) * MAX_COUNTER * runs.size() > maxRanges) {
+      ranges.push_back(bounds);
+      return 1;
+    }
+    for (uint64_t ts=t1; ts<=t2Ahead; ++ts) {
+      for (uint16_t c=0; c<MAX_COUNTER; ++c) {
+        for (const IdRange& run : runs) {
+          IdRange r = { FieldsToId(ts, c, run.lo), FieldsToId(ts, c, run.hi) };
+          // (a run up to the last node-id continues with node-id 0 of the next counter)
+          if (!ranges.empty() && ranges.back().hi + 1 == r.lo) { ranges.back().hi = r.hi; }
+          else { ranges.push_back(r); }
+        }
+      }
+    }
+    return ranges.size();
+  }
+
+  // Returns minimum (high-water mark) timestamp of a shard. This is just for testing.
+  uint64_t GetMinTimestamp(unsigned shard=0) { return shard < gens.size() ? gens[shard].minTimeMs : 0; }
+
+  // Sets the multicast group, e.g. MULTICAST_ADDR6 (call before initializing).
+  void SetMulticastAddress(const char* addr) { coord.transport.Sockets().mcAddressStr = addr; }
+
+  // Pins multicast traffic to interface 'ifname' (call before initializing).
+  // The unicast socket is bound to that interface's address, so peers 
+  // (and collision checks) see an exact source address.
+  bool SetInterface(const char* ifname) { return coord.transport.Sockets().iface.Lookup(ifname); }
+
+  // Drives the multicast sockets with io_uring (multishot receive into provided 
+  // buffers, batched sends), falling back to plain socket calls on older kernels.
+  // Call before initializing.
+  void SetIoUring(bool use=true) { coord.transport.Sockets().useUring = use; }
+
+  // Replaces the time source (not owned, call before initializing). DynamicClock only.
+  void SetClock(IdClock* clock) { coord.clock.Set(clock); }
+
+  // Replaces the multicast sockets with another transport (not owned, call before initializing).
+  // DynamicTransport only.
+  void SetTransport(IdTransport* transport) { coord.transport.Set(transport); }
+
+  // Keeps the state store in 'records' instead of a file (call before initializing).
+  // The records outlive the IdNode, e.g. to simulate restarts.
+  void SetStateMemory(std::vector<IdNodeState>* records) { coord.storeMem = records; }
+
+  // Makes instance ids and lease picks deterministic (for simulations), 0 for truly random.
+  void SetRandomSeed(uint64_t seed) { coord.seed = seed; }
+
+  // Makes the stored high-water marks of the owned node-ids crash safe (call before initializing): 
+  // they are written ahead of the timestamps in use (DURABLE_AHEAD_MS) and synced asynchronously, 
+  // with io_uring if 'useUring' and available, otherwise by a background thread.
+  // GetId() only waits if it is about to pass the last synced high-water mark.
+  // Returns the persister name ("io_uring" or "thread").
+  const char* SetDurable(bool useUring=true) {
+    coord.persister.reset(IdPersister::Create(useUring));
+    return coord.persister->Name();
+  }
+
+  // Sets the window of random delays for high-water replies to peers' requests, in a full cluster
+  // (smaller clusters use a proportional part). A reply is dropped when another peer's reply, 
+  // at least as recent, arrives first, so a restart isn't answered by every peer at once.
+  // 0 answers at once (every peer replies).
+  void SetReplyDelay(unsigned ms) { coord.replyDelayMs = ms; }
+
+  // Asks peers for a snapshot of their peer tables at startup (default), so a node with an 
+  // empty (or stale) table holds every peer's high-water mark right away, instead of learning 
+  // them from UP messages over time. One or two peers answer (see IdSnapshot), and the 
+  // records are merged by newest timestamp. Call before initializing.
+  void SetSnapshots(bool use=true) { coord.snapshots = use; }
+
+  // Returns the synced (durable) high-water mark of 'shard' (durable mode).
+  uint64_t GetDurableTimestamp(unsigned shard=0) { return shard < coord.durable.size() ? SyncedMs(shard) : 0; }
+
+  // Returns the current startup phase (IdPhase).
+  int GetPhase() { return coord.phase; }
+
+  // Returns counters of the node's coordination work (packets, store writes, throttling).
+  const IdNodeStats& GetStats() { return coord.stats; }
+
+  // Returns the number of owned node-ids (generator shards).
+  unsigned GetShardCount() { return gens.size(); }
+
+  // Returns the node-id used by generator shard 'shard'.
+  uint16_t GetNodeId(unsigned shard=0) { return coord.firstNodeId + shard; }
+
+  // Fills 'view' with the latest record of every known node-id (own and peers', from the
+  // peer table), including the load they announce in their UP messages (IdNodeState::IsHot()).
+  // Records with a high-water mark older than 'maxAgeMs' (if not 0) are skipped, e.g. stopped nodes.
+  // Returns the number of records.
+  unsigned GetClusterView(std::vector<IdNodeState>& view, uint64_t maxAgeMs=0) {
+    view.clear();
+    uint64_t now = RtMs();
+    for (unsigned i=0; i<MAX_NODES; ++i) {
+      IdNodeState rec;
+      if (!coord.store.Read(rec, i) || !rec.timestamp) { continue; }
+      if (maxAgeMs && rec.timestamp + maxAgeMs < now) { continue; }
+      view.push_back(rec);
+    }
+    return view.size();
+  }
 
   // Initializes the (fast) local data of the node.
-  //   'node' - a 10-bit identifier for the node.
-  bool InitNode(uint16_t node) {
-    if (node >= MAX_NODES) {
-      fprintf(stderr, "ERROR: Invalid Node-Id %d >= %d\n", node, MAX_NODES);
+  //   'node'  - a 10-bit identifier for the (first) node.
+  //   'count' - number of contiguous node-ids owned, starting at 'node'.
+  bool InitNode(uint16_t node, uint16_t count=1) {
+    if (node >= MAX_NODES || count < 1 || node + count > MAX_NODES) {
+      LogError("ERROR: Invalid Node-Id %d (count %d) >= %d\n", node, count, MAX_NODES);
       return false;
     }
-    nodeId = node;
-
     char buf[64];
-    snprintf(buf, 64, "%04d.state", nodeId);
-    if (!store.Open(buf, MAX_NODES)) { return false; }
-    if (!store.Read(state, nodeId)) {
-      fprintf(stderr, "ERROR: Failed to read state for Node-Id %d\n", node);
+    snprintf(buf, 64, "%04d.state", node);
+    if (!OpenStore(buf)) { return false; }
+    if (!InitSockets()) { return false; }
+
+    // startup, request (via multicast) info from peers
+    if (!InitShards(node, count, "RQ")) { return false; }
+    coord.phase = PHASE_LISTEN;
+    coord.phaseEndMs = RtMs() + LISTEN_TIME;
+    return true;
+  }
+
+  // Perform the slower network based initialization of the node. 
+  // Waits and processes any messages from peers, to set the high-water timestamp and detect redundant peers.
+  bool InitNetwork() {
+    // give some time for multicast replies from peers (updates high-water timestamp)
+    coord.phaseEndMs = RtMs() + LISTEN_TIME;
+    while (PHASE_LISTEN == Step()) { coord.transport.Wait(100); }
+    return PHASE_UP == coord.phase;
+  }
+
+  // Advances the node without blocking: processes queued messages, ends the 
+  // startup listen window (or lease claim) when it's due, and renews leases.
+  // Blocking callers (InitNetwork(), FinishLease()) just wait for messages in 
+  // between, simulations call it when a message arrived or NextStepMs() is due.
+  // Returns the current phase (IdPhase).
+  int Step() {
+    switch (coord.phase) {
+    case PHASE_LISTEN: {
+      while (ProcessMulticast(0)) { }
+      if (HasCollision()) { coord.phase = PHASE_FAILED; break; }
+      uint64_t now = RtMs();
+      // peers answered for every owned node-id (with exact instance info), 
+      // so a live owner would answer just as quickly
+      if (coord.answered >= coord.nodeCount && now + LISTEN_GRACE_TIME < coord.phaseEndMs) {
+        if (debug) { fprintf(stderr, "INFO: All node-ids answered, shortening listen window.\n"); }
+        coord.phaseEndMs = now + LISTEN_GRACE_TIME;
+      }
+      if (now >= coord.phaseEndMs) { StartShards(coord.phaseEndMs); }
+      break;
+    }
+    case PHASE_CLAIM:
+      // anything already queued (the claim window may have passed already)
+      while (!coord.claimLost && ProcessMulticast(0)) { }
+      if (coord.claimLost) {
+        if (debug) { fprintf(stderr, "INFO: Lost claim on node-id %u, retrying.\n", coord.firstNodeId); }
+        // catch up on queued messages, so the next pick sees them
+        while (ProcessMulticast(0)) { }
+        if (++coord.claimLosses >= LEASE_CLAIM_ATTEMPTS) {
+          LogError("ERROR: Failed to lease node-ids after %d attempts!\n", LEASE_CLAIM_ATTEMPTS);
+          coord.phase = PHASE_FAILED;
+        } else if (!ClaimBlock(coord.nodeCount)) {
+          coord.phase = PHASE_FAILED;
+        }
+      } else if (RtMs() >= coord.claimEndMs) {
+        coord.claiming = false;
+        StartShards(coord.claimEndMs);
+        coord.lastRenewMs = RtMs();
+      }
+      break;
+    case PHASE_UP:
+      while (ProcessMulticast(0)) { }
+      Announce(true);
+      if (HasCollision()) { coord.phase = PHASE_FAILED; break; }
+      RenewLease();
+      break;
+    }
+    // (replies to a burst of messages go out together)
+    coord.transport.Flush();
+    return coord.phase;
+  }
+
+  // Returns when Step() next has something to do if no message arrives (realtime, as RtMs()):
+  // the end of the listen window or lease claim, a delayed reply, a snapshot retry or a lease
+  // renewal; RtMs() if it may have already, UINT64_MAX if only a message can wake the node.
+  // Simulations step the node only then, or when a message arrived (see SimCluster::Run()).
+  uint64_t NextStepMs() {
+    uint64_t now = RtMs(), next = UINT64_MAX;
+    switch (coord.phase) {
+    case PHASE_LISTEN: next = coord.phaseEndMs; break;
+    case PHASE_CLAIM:  next = coord.claimLost ? now : coord.claimEndMs; break;
+    case PHASE_UP:
+      if (coord.persister || coord.timeLease || coord.unannounced) { return now; }
+      if (coord.leased) { next = coord.lastRenewMs + LEASE_RENEW_MS; }
+      break;
+    default: return UINT64_MAX;
+    }
+    if (HasCollision()) { return now; }
+    for (const PendingReply& reply : coord.replies) { next = std::min(next, reply.dueMs); }
+    if (coord.snapshotWanted) { next = std::min(next, coord.snapshotAsks ? coord.snapshotAskMs + SNAPSHOT_RETRY_MS : now); }
+    return next;
+  }
+
+  ////////////////////////////////////////////////////////////
+  // node-id lease mode
+
+  // Prepares the node for use, leasing 'count' free contiguous node-ids
+  // (instead of being handed a static node-id).
+  // Returns false if no free node-ids could be claimed.
+  //   'stateFile' - StructArrayStore filename (peer table, used to find free node-ids)
+  bool InitializeLease(const char* stateFile, uint16_t count=1) {
+    if (BeginLease(stateFile, count)) {
+      return FinishLease();
+    } else {
+      LogError("ERROR: BeginLease failed! (count:%u)\n", count);
+    }
+    return false;
+  }
+
+  // Opens the store and sockets, picks a free block of node-ids from the 
+  // peer table, and claims it (via a multicast "CL" message).
+  bool BeginLease(const char* stateFile, uint16_t count=1) {
+    if (count < 1 || count > MAX_NODES) {
+      LogError("ERROR: Invalid lease count %d\n", count);
       return false;
     }
-    state.id = node;
-    if (state.timestamp == 0) {
-      // Never initialized, so write it back...
-      store.Write(state, nodeId);
+    if (!OpenStore(stateFile)) { return false; }
+    if (!InitSockets()) { return false; }
+    coord.leased = true;
+    coord.claimLosses = 0;
+    coord.rng = coord.seed ? Mix64(coord.seed ^ coord.state.instance) :
+      (RtMs() << 16) ^ ((uint64_t)getpid() << 32) ^ coord.uAddress.GetPort() ^ (uint64_t)(uintptr_t)this;
+    return ClaimBlock(count);
+  }
+
+  // Waits for conflicting claims or owners of the claimed node-ids.
+  // If the claim is lost, another free block is picked and claimed.
+  // Returns true once the node owns its (uncontested) block.
+  bool FinishLease() {
+    while (PHASE_CLAIM == Step()) { coord.transport.Wait(100); }
+    return PHASE_UP == coord.phase;
+  }
+
+  // Process pending messages, waiting up to 'waitUs' microseconds for the first one
+  // (-1 forever), and renew the lease (via 'UP' messages) when it's due.
+  // Idle lease holders must call this periodically, or peers will consider 
+  // their node-ids free after LEASE_TIMEOUT_MS.
+  // Thread-safe with the per-shard ID calls (it waits in slices of PEER_POLL_MS, 
+  // without the coordinator lock, so their timestamp updates go on meanwhile).
+  void Poll(int waitUs=0) {
+    while (true) {
+      int slice = waitUs < 0 || waitUs > PEER_POLL_MS*1000 ? PEER_POLL_MS*1000 : waitUs;
+      bool got;
+      {
+        std::lock_guard<std::mutex> io(ioLock);
+        got = ProcessQueued();
+        if (!got && slice && !coord.timeLease && !HasCollision() && coord.transport.Wait(slice)) { got = ProcessQueued(); }
+      }
+      if (got || (waitUs >= 0 && waitUs <= slice)) { break; }
+      if (waitUs > 0) { waitUs -= slice; }
+    }
+    RenewLease();
+  }
+
+  // Processes pending peer messages, and stores and announces new timestamps (Announce()), 
+  // if the last check by an ID call is PEER_POLL_MS old.
+  // Keeps the system calls of polling off most ID calls (a clock read decides).
+  // Skipped if another thread is polling (or updating a timestamp) right now.
+  // In time-lease mode, it collects lease grants, and renews leases ahead of time.
+  void PollDue() {
+    if (!HasPeers<Transport>::value && !__atomic_load_n(&coord.unannounced, __ATOMIC_RELAXED)) { return; }
+    uint64_t now = MonoMs();
+    if (now < __atomic_load_n(&pollDueMs, __ATOMIC_RELAXED)) { return; }
+    std::unique_lock<std::mutex> io(ioLock, std::try_to_lock);
+    if (!io.owns_lock()) { return; }
+    std::unique_lock<std::mutex> guard(coordLock, std::try_to_lock);
+    if (!guard.owns_lock()) { return; }
+    __atomic_store_n(&pollDueMs, now + PEER_POLL_MS, __ATOMIC_RELAXED);
+    if (coord.timeLease) { 
+      if (IsValid()) { RenewTimeLeases(); }
+      return;
+    }
+    while (ProcessMulticast(0)) { }
+    CollectAnnouncements();
+    guard.unlock();
+    SendAnnouncements(0);
+  }
+
+  // Processes the queued peer messages, and stores and announces new timestamps.
+  // Returns true if there were messages. The I/O lock must be held.
+  bool ProcessQueued() {
+    bool got = false;
+    {
+      std::lock_guard<std::mutex> guard(coordLock);
+      while (ProcessMulticast(0)) { got = true; }
+      CollectAnnouncements();
+    }
+    SendAnnouncements(0);
+    return got;
+  }
+
+  // Stores the new timestamps of the shards, and announces them to peers ("UP"): 
+  // the timestamp updates of the ID calls only mark them (UpdateTimestamp()), 
+  // so the writes and sends happen here, in one batch per poll, outside the 
+  // coordinator lock (the ID calls only wait for the records to be copied).
+  // The polls call it, and the ID calls' PollDue(). Without 'wait', it's skipped 
+  // if another thread is polling or announcing right now (the next poll does it).
+  // Durable mode: then collects write completions, waiting up to 'reapUs' for the first.
+  void Announce(bool wait, int reapUs=0) {
+    std::unique_lock<std::mutex> io(ioLock, std::defer_lock);
+    if (wait) { io.lock(); } else if (!io.try_lock()) { return; }
+    {
+      std::lock_guard<std::mutex> guard(coordLock);
+      CollectAnnouncements();
     }
+    SendAnnouncements(reapUs);
+  }
 
-    if (0 != uSocket.Open(ANY_ADDR)) {
-      fprintf(stderr, "ERROR: Failed to open UDP socket (%s)\n", ANY_ADDR);
+  // Re-announce owned node-ids if the last renewal is older than LEASE_RENEW_MS.
+  // Returns true if a renewal was sent.
+  bool RenewLease() {
+    {
+      std::lock_guard<std::mutex> guard(coordLock);
+      if (coord.timeLease && IsValid()) { return RenewTimeLeases(); }
+      if (!coord.leased || !IsValid()) { return false; }
+      uint64_t now = RtMs();
+      if (now < coord.lastRenewMs + LEASE_RENEW_MS) { return false; }
+      for (unsigned i=0; i<gens.size(); ++i) {
+        // bump the timestamp to "now", so peers see a fresh entry (it's "now" already if throttled)
+        gens[i].Lock();
+        if (TS_FAILED != NewTimestamp(i)) { MarkAnnounce(i); }
+        gens[i].Unlock();
+      }
+      coord.lastRenewMs = now;
+    }
+    Announce(true);
+    return true;
+  }
+
+  // Returns true if the peer table entry 'rec' is unused, or its owner hasn't renewed recently.
+  // Unresolved claims ("CL" entries) only block a node-id for a couple of claim windows.
+  static bool IsLeaseFree(const IdNodeState& rec, uint64_t now) {
+    if (rec.timestamp == 0) { return true; }
+    uint64_t timeout = rec.HasMode("CL") ? 2*LISTEN_TIME : LEASE_TIMEOUT_MS;
+    return rec.timestamp + timeout < now;
+  }
+
+  // Finds 'count' contiguous free node-ids in the peer table, scanning from a random start.
+  // Returns the first node-id, or -1 if none are free.
+  int FindFreeBlock(uint16_t count) {
+    uint64_t now = RtMs();
+    unsigned slots = MAX_NODES - count + 1;
+    unsigned start = NextRandom() % slots;
+    for (unsigned n=0; n<slots; ++n) {
+      unsigned first = (start + n) % slots;
+      unsigned i = 0;
+      for (; i<count; ++i) {
+        IdNodeState rec;
+        if (!coord.store.Read(rec, first + i) || !IsLeaseFree(rec, now)) { break; }
+      }
+      if (i == count) { return first; }
+    }
+    return -1;
+  }
+
+  // Picks a free block of node-ids and claims it.
+  bool ClaimBlock(uint16_t count) {
+    int first = FindFreeBlock(count);
+    if (first < 0) {
+      LogError("ERROR: No free block of %u node-ids to lease!\n", count);
       return false;
     }
-    if (0 != mcSocket.Open(MULTICAST_ADDR)) {
-      fprintf(stderr, "ERROR: Failed to open multicast socket (%s)\n", MULTICAST_ADDR);
+    coord.claiming = true;
+    coord.claimLost = false;
+    coord.hasCollision = false;
+    coord.claimEndMs = RtMs() + LISTEN_TIME;
+    coord.phase = PHASE_CLAIM;
+    return InitShards(first, count, "CL");
+  }
+
+  // Returns true if our claim beats the conflicting claim 'msg' 
+  // (lowest instance wins, or lowest address for legacy peers).
+  bool ClaimWins(const IdNodeState& msg) {
+    if (coord.state.instance && msg.instance) { return coord.state.instance < msg.instance; }
+    if (coord.state.ipaddr != msg.ipaddr) { return coord.state.ipaddr < msg.ipaddr; }
+    return coord.state.port < msg.port;
+  }
+
+  ////////////////////////////////////////////////////////////
+  // time-lease (consistency-first) mode
+
+  // Prepares the node for use, leasing timestamp ranges for node-ids 'node'..'node'+'count'-1
+  // from the lease server at 'server' (e.g. TIME_LEASE_ADDR), instead of coordinating with peers.
+  // IDs stay unique as long as the server keeps its state, even with duplicate node-ids or 
+  // network partitions, but are unavailable while the server can't be reached.
+  // No listen window: startup takes one round trip.
+  bool InitializeTimeLease(const char* server, uint16_t node, uint16_t count=1) {
+    if (node >= MAX_NODES || count < 1 || node + count > MAX_NODES) {
+      LogError("ERROR: Invalid Node-Id %d (count %d) >= %d\n", node, count, MAX_NODES);
       return false;
     }
-    mcSocket.SetTTL(3); // allow limited routing
+    if (0 != coord.leaseServer.SetAddress(server)) {
+      LogError("ERROR: Invalid lease server address (%s)\n", server);
+      return false;
+    }
+    // the server persists the leases, the local store is only a cache
+    if (!coord.store.Open(NULL, MAX_NODES)) { return false; }
+    coord.leaseSocket.Close();
+    coord.leaseSocket.address.SetAddress(coord.leaseServer.IsV6() ? ANY_ADDR6 : ANY_ADDR);
+    if (0 != coord.leaseSocket.Open()) {
+      LogError("ERROR: Failed to open UDP socket for the lease server\n");
+      return false;
+    }
+    coord.leaseSocket.GetAddress(coord.uAddress);
+    coord.uAddress.GetString(coord.uAddressStr);
+    ++coord.incarnation;
+    memset(&coord.state, 0, sizeof(coord.state));
+    coord.state.SetAddress(coord.uAddress);
+    coord.state.version = STATE_VERSION;
+    coord.state.instance = NewInstanceId();
+    coord.timeLease = true;
 
-    mcAddress.SetAddress(MULTICAST_ADDR);
-    uSocket.GetAddress(uAddress);
-    uAddress.GetString(uAddressStr);
-    state.SetAddress(uAddress);
+    coord.firstNodeId = node;
+    coord.nodeCount = count;
+    coord.leases.assign(count, TimeLeaseSlot());
+    coord.load.assign(count, LoadSlot());
+    gens.assign(count, IdGenerator());
+    nextShard = 0;
+    for (unsigned i=0; i<count; ++i) {
+      gens[i].nodeId = node + i;
+      SendTimeLeaseRequest(i, RtMs());
+    }
+    // all requests are out, wait for the grants
+    for (unsigned i=0; i<count; ++i) {
+      if (!AwaitTimeLease(i)) { coord.phase = PHASE_FAILED; return false; }
+    }
+    for (unsigned i=0; i<count; ++i) {
+      TimeLeaseSlot& lease = coord.leases[i];
+      AdjustTimetamp(i, lease.nextStart);
+      lease.end = lease.nextEnd;
+      lease.nextEnd = 0;
+      gens[i].valid = true;
+    }
+    coord.initialized = true;
+    coord.phase = PHASE_UP;
+    return true;
+  }
 
-    // startup, request (via multicast) info from peers
-    state.SetMode("RQ");
-    EmitState(state);
-    // start off with stored high-water timestamp (which might be 0)
-    AdjustTimetamp(state.timestamp);
+  // Sets the requested time-lease length (call before initializing).
+  // Longer leases survive longer server outages, but may waste more timestamps.
+  void SetTimeLeaseLength(uint64_t ms) { coord.leaseLengthMs = ms ? ms : TIME_LEASE_MS; }
+
+  // Returns the end (exclusive) of the current timestamp lease of 'shard' (0 if none).
+  uint64_t GetTimeLeaseEnd(unsigned shard=0) { return shard < coord.leases.size() ? coord.leases[shard].end : 0; }
+
+  // Sends a (new) lease request for 'shard', for timestamps from at least 'minStart'.
+  bool SendTimeLeaseRequest(unsigned shard, uint64_t minStart) {
+    TimeLeaseSlot& lease = coord.leases[shard];
+    if (0 == ++coord.leaseSeq) { ++coord.leaseSeq; }
+    lease.seq = coord.leaseSeq;
+    lease.denied = false;
+    TimeLeaseMsg req;
+    memset(&req, 0, sizeof(req));
+    req.start = minStart;
+    req.end = coord.leaseLengthMs;
+    return SendTimeLeaseMsg(shard, req);
+  }
+
+  // (Re-)sends the pending lease request of 'shard', with the request fields in 'req'.
+  bool SendTimeLeaseMsg(unsigned shard, TimeLeaseMsg& req) {
+    TimeLeaseSlot& lease = coord.leases[shard];
+    req.instance = coord.state.instance;
+    req.seq = lease.seq;
+    req.id = gens[shard].nodeId;
+    req.SetMode("TQ");
+    lease.sentMs = MonoMs();
+    ++coord.stats.packetsOut;
+    return sizeof(req) == coord.leaseSocket.WriteTo(coord.leaseServer, (const char*)&req, sizeof(req));
+  }
 
+  // Processes lease server replies (waiting up to 'waitUs' for the first one), 
+  // and retransmits overdue requests.
+  void PollTimeLeases(int waitUs=0) {
+    ++coord.stats.polls;
+    while (coord.leaseSocket.Wait(waitUs)) {
+      waitUs = 0;
+      TimeLeaseMsg msg;
+      IPAddress from;
+      int read = coord.leaseSocket.Read((char*)&msg, sizeof(msg), from);
+      ++coord.stats.packetsIn;
+      if (read != sizeof(msg) || msg.instance != coord.state.instance || !coord.Owns(msg.id)) { continue; }
+      TimeLeaseSlot& lease = coord.leases[msg.id - coord.firstNodeId];
+      if (msg.seq != lease.seq) { continue; } // late, or duplicate
+      lease.seq = 0;
+      if (msg.HasMode("TG") && msg.start < msg.end) {
+        lease.nextStart = msg.start;
+        lease.nextEnd = msg.end;
+      } else {
+        lease.denied = true;
+      }
+    }
+    uint64_t now = MonoMs();
+    for (unsigned i=0; i<coord.leases.size(); ++i) {
+      TimeLeaseSlot& lease = coord.leases[i];
+      if (lease.seq && now >= lease.sentMs + TIME_LEASE_RETRY_MS) {
+        TimeLeaseMsg req;
+        memset(&req, 0, sizeof(req));
+        req.start = lease.end > gens[i].minTimeMs ? lease.end : gens[i].minTimeMs;
+        req.end = coord.leaseLengthMs;
+        SendTimeLeaseMsg(i, req);
+      }
+    }
+  }
+
+  // Waits for the pending lease request of 'shard' to be granted.
+  // Returns false if the server denied it, or didn't answer within TIME_LEASE_TIMEOUT_MS.
+  bool AwaitTimeLease(unsigned shard) {
+    TimeLeaseSlot& lease = coord.leases[shard];
+    uint64_t deadline = MonoMs() + TIME_LEASE_TIMEOUT_MS;
+    while (lease.seq && MonoMs() < deadline) { PollTimeLeases(10000); }
+    if (lease.denied) {
+      LogError("ERROR: Lease server denied a time-lease for Node-Id %u!\n", gens[shard].nodeId);
+      return false;
+    }
+    if (!lease.nextEnd) {
+      LogError("ERROR: No time-lease for Node-Id %u (lease server unreachable)!\n", gens[shard].nodeId);
+      return false;
+    }
     return true;
   }
 
-  // Perform the slower network based initialization of the node. 
-  // Waits and processes any messages from peers, to set the high-water timestamp and detect redundant peers.
-  bool InitNetwork() {
-    // give some time for multicast replies from peers (updates high-water timestamp)
-    uint64_t endTs = GetRtTimestampMs() + LISTEN_TIME;
-    while (GetRtTimestampMs() < endTs) {
-      ProcessMulticast(100);
-      if (HasCollision()) { return false; }
+  // Requests the next time-lease of shards that used half of their current one (by the clock),
+  // so idle nodes don't wait for a round trip when they resume. 
+  // Returns true if a request was sent.
+  bool RenewTimeLeases() {
+    PollTimeLeases(0);
+    bool sent = false;
+    for (unsigned i=0; i<gens.size(); ++i) {
+      TimeLeaseSlot& lease = coord.leases[i];
+      uint64_t now = MonoMs() + gens[i].deltaTimeMs;
+      // (the next lease is of no use once the clock passed it)
+      if (lease.nextEnd && now >= lease.nextEnd) { lease.nextEnd = 0; }
+      if (!lease.nextEnd && !lease.seq && now + coord.leaseLengthMs/2 >= lease.end) {
+        sent = SendTimeLeaseRequest(i, lease.end > now ? lease.end : now) || sent;
+      }
+    }
+    return sent;
+  }
+
+  // Keeps the new timestamp of 'shard' within its leases: moves on to the next 
+  // lease when the current one is used up, and requests the next lease once half 
+  // of the current one is used. Never waits: returns false (IDs are unavailable, 
+  // not duplicated) while the next lease isn't granted yet, which Poll() and the 
+  // ID calls' peer polls pick up (and request ahead of time, see RenewTimeLeases()).
+  bool UseTimeLease(unsigned shard) {
+    IdGenerator& gen = gens[shard];
+    TimeLeaseSlot& lease = coord.leases[shard];
+    if (lease.seq) { PollTimeLeases(0); }
+    while (gen.minTimeMs >= lease.end) {
+      if (!lease.nextEnd) {
+        if (lease.denied) {
+          LogError("ERROR: Lease server denied a time-lease for Node-Id %u!\n", gen.nodeId);
+          lease.denied = false;
+        }
+        // (asks again after a denial, but not on every call)
+        if (!lease.seq && MonoMs() >= lease.sentMs + TIME_LEASE_RETRY_MS) { SendTimeLeaseRequest(shard, gen.minTimeMs); }
+        return false;
+      }
+      if (gen.minTimeMs < lease.nextEnd) {
+        if (lease.nextStart > gen.minTimeMs) { AdjustTimetamp(shard, lease.nextStart); }
+        lease.end = lease.nextEnd;
+      }
+      // (otherwise the next lease is used up as well, e.g. after idling, so get another one)
+      lease.nextEnd = 0;
+    }
+    if (!lease.nextEnd && !lease.seq && gen.minTimeMs + coord.leaseLengthMs/2 >= lease.end) {
+      SendTimeLeaseRequest(shard, lease.end);
+    }
+    return true;
+  }
+
+  ////////////////////////////////////////////////////////////
+  // internals
+
+  // Writes state record 'rec' to the store at 'index'.
+  bool WriteState(const IdNodeState& rec, unsigned index) {
+    ++coord.stats.storeWrites;
+    // own records go through the persister (ahead, and in order)
+    if (coord.persister && coord.Owns(index) && rec.instance == coord.state.instance && coord.store.GetFd() >= 0) {
+      return PersistOwn(rec, index - coord.firstNodeId);
+    }
+    return coord.store.Write(rec, index);
+  }
+
+  // Durable mode: raises the wanted high-water mark of 'shard' to (ahead of) 'rec', and writes it when possible.
+  bool PersistOwn(const IdNodeState& rec, unsigned shard) {
+    DurableSlot& d = coord.durable[shard];
+    d.rec = rec;
+    if (rec.timestamp + DURABLE_AHEAD_MS/2 > d.wantMs) { d.wantMs = rec.timestamp + DURABLE_AHEAD_MS; }
+    d.rec.timestamp = d.wantMs;
+    ReapDurable(0);
+    return PumpDurable(shard);
+  }
+
+  // Starts writing the wanted high-water mark of 'shard', unless a write is in flight, or it's synced already.
+  bool PumpDurable(unsigned shard) {
+    DurableSlot& d = coord.durable[shard];
+    if (d.inFlightMs || d.wantMs <= d.syncedMs) { return true; }
+    unsigned index = coord.firstNodeId + shard;
+    if (!coord.persister->Submit(coord.store.GetFd(), &d.rec, sizeof(d.rec), coord.store.GetOffset(index), shard)) {
+      return false; // (retried on the next reap)
     }
+    d.inFlightMs = d.wantMs;
+    return true;
+  }
 
-    // consider current time as high-water mark
-    if (endTs > minTimeMs) { AdjustTimetamp(endTs); }
-    initialized = true;
+  // Collects durable write completions (waiting up to 'waitUs' for the first one).
+  void ReapDurable(int waitUs) {
+    uint64_t shard;
+    bool ok;
+    while (coord.persister->Reap(shard, ok, waitUs)) {
+      waitUs = 0;
+      if (shard >= coord.durable.size()) { continue; }
+      DurableSlot& d = coord.durable[shard];
+      if (ok) {
+        ++coord.stats.syncs;
+        // (read by the timestamp updates, without the I/O lock)
+        if (d.inFlightMs > d.syncedMs) { __atomic_store_n(&d.syncedMs, d.inFlightMs, __ATOMIC_RELEASE); }
+      } else {
+        LogError("ERROR: Failed to persist the high-water mark of Node-Id %u!\n", coord.firstNodeId + (unsigned)shard);
+        __atomic_store_n(&d.failed, true, __ATOMIC_RELEASE);
+      }
+      d.inFlightMs = 0;
+      PumpDurable(shard);
+    }
+  }
 
-    // announce that we're up
-    state.SetMode("UP");
-    EmitState(state);
+  // Returns the synced high-water mark of 'shard' (durable mode, any thread).
+  uint64_t SyncedMs(unsigned shard) { return __atomic_load_n(&coord.durable[shard].syncedMs, __ATOMIC_ACQUIRE); }
 
+  // Waits until the synced high-water mark of 'shard' covers its current timestamp, 
+  // storing the new timestamps meanwhile (no coordinator or shard lock may be held).
+  // Returns false if it failed, or took longer than DURABLE_TIMEOUT_MS.
+  bool AwaitDurable(unsigned shard) {
+    DurableSlot& d = coord.durable[shard];
+    uint64_t ts;
+    {
+      std::lock_guard<std::mutex> guard(coordLock);
+      ts = gens[shard].minTimeMs;
+    }
+    uint64_t deadline = MonoMs() + DURABLE_TIMEOUT_MS;
+    while (SyncedMs(shard) < ts && !__atomic_load_n(&d.failed, __ATOMIC_ACQUIRE) && MonoMs() < deadline) {
+      Announce(true, 1000);
+    }
+    if (SyncedMs(shard) < ts) {
+      LogError("ERROR: No durable high-water mark for Node-Id %u!\n", coord.firstNodeId + shard);
+      return false;
+    }
     return true;
   }
 
-  // Send serialized node state object 'state' out to peers.
-  bool EmitState(const IdNodeState& state) {
-    //return 0 == mcSocket.Write((const char*)&state, sizeof(state));
-    return 0 == uSocket.WriteTo(mcAddress, (const char*)&state, sizeof(state));
+  // Opens the StructArrayStore 'fname', converting it from a legacy record size if needed.
+  bool OpenStore(const char* fname) {
+    if (coord.storeMem) { return coord.store.Open(*coord.storeMem, MAX_NODES); }
+    return OpenStateStore(coord.store, fname);
+  }
+
+  // Opens the transport (the unicast and multicast sockets, by default).
+  bool InitSockets() {
+    if (!coord.transport.Open(coord.uAddress)) { return false; }
+    ++coord.incarnation;
+    coord.uAddress.GetString(coord.uAddressStr);
+    memset(&coord.state, 0, sizeof(coord.state));
+    coord.state.SetAddress(coord.uAddress);
+    coord.state.version = STATE_VERSION;
+    coord.state.instance = NewInstanceId();
+    coord.rng = Mix64(coord.state.instance); // (reply delays, differs per node)
+    coord.snapshotWanted = coord.snapshots;
+    coord.snapshotAsks = 0;
+    coord.snapshotAskMs = 0;
+    coord.snapshotPollMs = 0;
+    coord.snapshotMissing = 0;
+    coord.peerRunning = false;
+    return true;
+  }
+
+  // Sets up one generator per owned node-id, loads their stored high-water 
+  // marks, and announces them to peers with 'mode' ("RQ" or "CL").
+  bool InitShards(uint16_t node, uint16_t count, const char* mode) {
+    coord.firstNodeId = node;
+    coord.nodeCount = count;
+    coord.heard.assign(count, false);
+    coord.diskTimeMs.assign(count, 0);
+    coord.durable.assign(count, DurableSlot());
+    coord.load.assign(count, LoadSlot());
+    coord.announce.assign(count, false);
+    coord.unannounced = 0;
+    coord.answered = 0;
+    gens.assign(count, IdGenerator());
+    nextShard = 0;
+
+    std::vector<IdNodeState> stored(count);
+    coord.state.boot = 0;
+    for (unsigned i=0; i<count; ++i) {
+      if (!coord.store.Read(stored[i], node + i)) {
+        LogError("ERROR: Failed to read state for Node-Id %d\n", node + i);
+        return false;
+      }
+      // this is a new incarnation of all the owned node-ids
+      if (stored[i].boot >= coord.state.boot) { coord.state.boot = stored[i].boot + 1; }
+      coord.diskTimeMs[i] = stored[i].timestamp;
+    }
+
+    uint64_t now = RtMs();
+    for (unsigned i=0; i<count; ++i) {
+      IdNodeState rec = coord.state;
+      gens[i].nodeId = node + i;
+      rec.id = node + i;
+      rec.timestamp = stored[i].timestamp;
+      // a claim must look fresh to peers, so they skip this node-id
+      if (0 == strcmp(mode, "CL") && rec.timestamp < now) { rec.timestamp = now; }
+      rec.SetMode(mode);
+      EmitState(rec);
+      // start off after the stored high-water timestamp (which might be 0), it was already used
+      AdjustTimetamp(i, rec.timestamp ? rec.timestamp + 1 : 0);
+    }
+    if (coord.snapshotWanted && !coord.snapshotAsks) { AskSnapshot(); }
+    coord.transport.Flush();
+    return true;
+  }
+
+  // Marks all shards valid, with at least 'startTs' as high-water mark, 
+  // and announces them to peers.
+  void StartShards(uint64_t startTs) {
+    coord.initialized = true;
+    coord.phase = PHASE_UP;
+    for (unsigned i=0; i<gens.size(); ++i) {
+      // consider current time as high-water mark
+      if (startTs > gens[i].minTimeMs) { AdjustTimetamp(i, startTs); }
+      gens[i].valid = true;
+
+      // announce that we're up
+      EmitShardState(i, "UP");
+    }
+  }
+
+  // Returns a random (non-zero) identifier for this incarnation of the node.
+  uint64_t NewInstanceId() {
+    uint64_t id = 0;
+    if (coord.seed) {
+      id = Mix64(coord.seed + coord.incarnation);
+    } else if (sizeof(id) != getrandom(&id, sizeof(id), GRND_NONBLOCK)) {
+      id = (RtMs() << 20) ^ ((uint64_t)getpid() << 40) ^ MonoMs() ^ (uint64_t)(uintptr_t)this;
+    }
+    return id ? id : 1;
+  }
+
+  // Returns a well-mixed 64-bit hash of 'x' (splitmix64 finalizer).
+  static uint64_t Mix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+  }
+
+  // Returns true if 'msg' was sent by this node (i.e. looped back multicast).
+  bool IsSelf(const IdNodeState& msg, IPAddress& sourceIp) {
+    if (msg.instance) { return msg.instance == coord.state.instance; }
+    // legacy peer, compare addresses instead:
+    // exact, when bound to an interface, otherwise uAddress is the "any" address (and a real port)
+    return coord.uAddress.IsAny() ? coord.uAddress.GetPort() == sourceIp.GetPort() 
+                                  : coord.uAddress == sourceIp;
+  }
+
+  // Returns the next value of a (per-node) xorshift random number generator.
+  uint64_t NextRandom() {
+    uint64_t x = coord.rng ? coord.rng : 0x9E3779B97F4A7C15ull;
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    coord.rng = x;
+    return x;
+  }
+
+  // Send the current state of generator 'shard' out to peers, with mode 'mode'.
+  bool EmitShardState(unsigned shard, const char* mode) {
+    IdNodeState msg = coord.state;
+    msg.id = gens[shard].nodeId;
+    msg.timestamp = gens[shard].minTimeMs;
+    msg.SetMode(mode);
+    return EmitState(msg);
+  }
+
+  // Sends high-water reply 'rec' after a random delay, in a window proportional to the number
+  // of peers heard from (all of them may hold the record, and answer), so the first replies
+  // go out early, and are overheard by the other peers before their own are due (SRM-style).
+  // In small clusters the window rounds down to 0, and the reply goes out at once.
+  void ScheduleReply(const IdNodeState& rec) {
+    uint64_t window = (uint64_t)coord.replyDelayMs * coord.peersSeen / MAX_NODES;
+    if (!window) {
+      ++coord.stats.replies;
+      EmitState(rec);
+      return;
+    }
+    for (auto& r : coord.replies) {
+      if (r.rec.id == rec.id) { return; } // (already due, e.g. a retransmitted request)
+    }
+    PendingReply r;
+    r.rec = rec;
+    r.dueMs = RtMs() + NextRandom() % (window + 1);
+    coord.replies.push_back(r);
+  }
+
+  // Drops pending replies for the node-id of peer reply 'msg', if it's at least as recent.
+  void SuppressReply(const IdNodeState& msg) {
+    for (size_t i=0; i<coord.replies.size(); ) {
+      if (coord.replies[i].rec.id == msg.id && msg.timestamp >= coord.replies[i].rec.timestamp) {
+        ++coord.stats.suppressed;
+        coord.replies.erase(coord.replies.begin() + i);
+      } else {
+        ++i;
+      }
+    }
+  }
+
+  // Sends the pending replies that are due.
+  // Returns 'waitUs' (Wait() units), shortened to the next reply that isn't due yet.
+  int SendDueReplies(int waitUs) {
+    uint64_t now = RtMs();
+    uint64_t next = UINT64_MAX;
+    for (size_t i=0; i<coord.replies.size(); ) {
+      if (coord.replies[i].dueMs <= now) {
+        ++coord.stats.replies;
+        EmitState(coord.replies[i].rec);
+        coord.replies.erase(coord.replies.begin() + i);
+      } else {
+        if (coord.replies[i].dueMs < next) { next = coord.replies[i].dueMs; }
+        ++i;
+      }
+    }
+    if (next != UINT64_MAX && (waitUs < 0 || (uint64_t)waitUs > (next - now)*1000)) { waitUs = (next - now)*1000; }
+    return waitUs;
+  }
+
+  // Asks peers (via multicast) for a snapshot of their tables, to be answered by about
+  // SNAPSHOT_RESPONDERS of them, twice as many on every retry.
+  void AskSnapshot() {
+    IdNodeState req = coord.state;
+    req.id = coord.firstNodeId;
+    req.timestamp = SNAPSHOT_RESPONDERS << coord.snapshotAsks;
+    req.SetMode("SQ");
+    ++coord.snapshotAsks;
+    coord.snapshotAskMs = RtMs();
+    coord.snapshotMissing = 0; // (complete the first answer to this request)
+    EmitState(req);
+  }
+
+  // Merges the snapshot chunks that arrived, or asks again if the last request went unanswered
+  // (or a chunk of its answer was lost). Called at most every PEER_POLL_MS (see ProcessMulticast()).
+  void PollSnapshot() {
+    char buf[SNAPSHOT_MAX_SIZE];
+    IPAddress from;
+    int read;
+    while (coord.snapshotWanted && (read = coord.transport.ReadUnicast(buf, sizeof(buf), from)) > 0) {
+      MergeSnapshot(buf, read, from);
+    }
+    if (coord.snapshotWanted && coord.snapshotAsks && RtMs() >= coord.snapshotAskMs + SNAPSHOT_RETRY_MS) {
+      if (coord.snapshotAsks < SNAPSHOT_ATTEMPTS && coord.peerRunning) {
+        AskSnapshot();
+      } else {
+        if (debug) { fprintf(stderr, "INFO: No complete peer-table snapshot after %u requests.\n", coord.snapshotAsks); }
+        coord.snapshotWanted = false;
+      }
+    }
+  }
+
+  // Sends the peer table (its non-empty records) to 'to', in chunks of SNAPSHOT_CHUNK_RECORDS (see IdSnapshot).
+  bool SendSnapshot(const IPAddress& to) {
+    std::vector<IdNodeState> recs;
+    for (unsigned i=0; i<MAX_NODES; ++i) {
+      IdNodeState rec;
+      if (!coord.store.Read(rec, i) || !rec.timestamp) { continue; }
+      recs.push_back(rec);
+    }
+    IdSnapshot hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.from = coord.state;
+    hdr.from.id = coord.firstNodeId;
+    hdr.from.SetMode("SN");
+    hdr.chunks = recs.empty() ? 1 : (recs.size() + SNAPSHOT_CHUNK_RECORDS - 1) / SNAPSHOT_CHUNK_RECORDS;
+    char buf[SNAPSHOT_CHUNK_SIZE];
+    bool sent = true;
+    for (hdr.chunk=0; hdr.chunk<hdr.chunks; ++hdr.chunk) {
+      size_t first = hdr.chunk * SNAPSHOT_CHUNK_RECORDS;
+      hdr.count = std::min(recs.size() - first, (size_t)SNAPSHOT_CHUNK_RECORDS);
+      hdr.checksum = 0;
+      memcpy(buf, &hdr, sizeof(hdr));
+      if (hdr.count) { memcpy(buf + sizeof(hdr), &recs[first], hdr.count*sizeof(IdNodeState)); }
+      size_t len = sizeof(hdr) + hdr.count*sizeof(IdNodeState);
+      hdr.checksum = IdSnapshot::Checksum(buf, len);
+      memcpy(buf, &hdr, sizeof(hdr));
+      ++coord.stats.packetsOut;
+      sent = coord.transport.SendTo(to, buf, len) && sent;
+    }
+    ++coord.stats.snapshots;
+    return sent;
+  }
+
+  // Merges snapshot chunk 'buf' ('len' bytes, from 'from') into the peer table: every record newer 
+  // than the stored one, except for owned node-ids (those are answered by "HW" messages).
+  // Chunks merge on their own, in any order; the snapshot is complete (and no longer wanted) once
+  // every chunk of one peer's answer arrived, as others only repeat it (see PollSnapshot()).
+  // Returns false if it isn't a valid snapshot chunk.
+  bool MergeSnapshot(char* buf, int len, IPAddress& from) {
+    IdSnapshot hdr;
+    if (len < (int)sizeof(hdr)) { return false; }
+    memcpy(&hdr, buf, sizeof(hdr));
+    // (the checksum covers the datagram with its own field 0)
+    uint64_t checksum = hdr.checksum;
+    hdr.checksum = 0;
+    memcpy(buf, &hdr, sizeof(hdr));
+    bool valid = checksum == IdSnapshot::Checksum(buf, len);
+    hdr.checksum = checksum;
+    memcpy(buf, &hdr, sizeof(hdr));
+    if (hdr.chunks) { valid = valid && hdr.chunk < hdr.chunks && hdr.count <= SNAPSHOT_CHUNK_RECORDS; }
+    if (!valid || !hdr.from.HasMode("SN") || hdr.count > MAX_NODES || len != (int)(sizeof(hdr) + hdr.count*sizeof(IdNodeState))) {
+      std::string addr;
+      from.GetString(addr);
+      LogError("ERROR: Invalid peer-table snapshot (%d bytes from %s)!\n", len, addr.c_str());
+      return false;
+    }
+    ++coord.stats.packetsIn;
+    coord.peerRunning = true; // (so a snapshot that lost chunks is asked for again)
+    for (unsigned i=0; i<hdr.count; ++i) {
+      IdNodeState rec, prev;
+      memcpy(&rec, buf + sizeof(hdr) + i*sizeof(rec), sizeof(rec));
+      if (rec.id >= MAX_NODES || !rec.timestamp || coord.Owns(rec.id)) { continue; }
+      if (coord.store.Read(prev, rec.id) && prev.timestamp >= rec.timestamp) { continue; }
+      WriteState(rec, rec.id);
+      ++coord.stats.snapshotRecords;
+      if (!coord.peerSeen[rec.id]) { coord.peerSeen[rec.id] = true; ++coord.peersSeen; }
+    }
+    if (debug) { fprintf(stderr, "INFO: Merged peer-table snapshot chunk %u/%u (%u records).\n", hdr.chunk + 1, hdr.chunks ? hdr.chunks : 1, hdr.count); }
+    if (!hdr.chunks) {
+      coord.snapshotWanted = false;
+    } else {
+      if (!coord.snapshotMissing) {
+        coord.snapshotFrom = hdr.from;
+        coord.snapshotChunks.assign(hdr.chunks, false);
+        coord.snapshotMissing = hdr.chunks;
+      }
+      if (hdr.from.SameInstance(coord.snapshotFrom) && hdr.chunks == coord.snapshotChunks.size() && !coord.snapshotChunks[hdr.chunk]) {
+        coord.snapshotChunks[hdr.chunk] = true;
+        if (!--coord.snapshotMissing) { coord.snapshotWanted = false; }
+      }
+    }
+    return true;
+  }
+
+  // Reports an error message (printf format 'fmt'), see 'onError'.
+  __attribute__((format(printf, 2, 3))) void LogError(const char* fmt, ...) {
+    char msg[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    size_t len = strlen(msg);
+    if (len && msg[len-1] == '\n') { msg[len-1] = 0; }
+    if (onError) { onError(msg); } else { fprintf(stderr, "%s\n", msg); }
+  }
+
+  // Send serialized node state object 'msg' out to peers.
+  bool EmitState(const IdNodeState& msg) {
+    ++coord.stats.packetsOut;
+    return coord.transport.Send((const char*)&msg, sizeof(msg));
   }
 
   // Wait for a message to be available on the multicast socket, 
   // and process it (store state, answer requests, etc.).
   // Returns false if no messages were received
-  //   waitMs - maximum milliseconds to wait for a message
-  bool ProcessMulticast(int waitMs) {
-    if (HasCollision()) { return false; }
-    if (!mcSocket.Wait(waitMs)) { return false; }
+  //   waitUs - maximum microseconds to wait for a message (-1 forever)
+  bool ProcessMulticast(int waitUs) {
+    if (HasCollision() || coord.timeLease) { return false; }
+    if (!coord.replies.empty()) { waitUs = SendDueReplies(waitUs); }
+    if (coord.snapshotWanted && MonoMs() >= coord.snapshotPollMs) {
+      // (the unicast socket only carries snapshots: read it on the throttled schedule, not on every poll)
+      coord.snapshotPollMs = MonoMs() + PEER_POLL_MS;
+      PollSnapshot();
+    }
+    ++coord.stats.polls;
+    if (!coord.transport.Wait(waitUs)) { return false; }
     char buf[65536];
     IPAddress sourceIp;
     std::string sourceIpStr;
-    int read = mcSocket.Read(buf, 65536, sourceIp);
+    int read = coord.transport.Read(buf, 65536, sourceIp);
+    ++coord.stats.packetsIn;
     sourceIp.GetString(sourceIpStr);
     if (debug) { fprintf(stderr, "INFO: Received multicast message (%d bytes from %s).\n", read, sourceIpStr.c_str()); }
-    if (sizeof(IdNodeState) != read) {
+    IdNodeState msgState;
+    if (!msgState.Decode(buf, read)) {
       if (debug) { fprintf(stderr, "INFO: Received unexpected multicast message (%d bytes).\n", read); }
       return true;
     }
-
-    IdNodeState msgState;
-    memcpy(&msgState, buf, sizeof(IdNodeState));
+    char mode[3] = { 0, 0, 0 };
+    memcpy(mode, &msgState.mode, 2);
+    DISTID_PROBE4(message, (uintptr_t)mode, msgState.id, msgState.timestamp, sourceIp.GetPort());
+    if (!coord.peerSeen[msgState.id % MAX_NODES] && !coord.Owns(msgState.id)) {
+      coord.peerSeen[msgState.id % MAX_NODES] = true;
+      ++coord.peersSeen;
+    }
+    if ((msgState.HasMode("UP") || msgState.HasMode("HW")) && !msgState.SameInstance(coord.state)) { coord.peerRunning = true; }
+    // snapshot request from a starting peer, answered by about as many (running) peers as it wants
+    if (msgState.HasMode("SQ")) {
+      if (coord.initialized && !msgState.SameInstance(coord.state) &&
+          NextRandom() % (coord.peersSeen ? coord.peersSeen : 1) < msgState.timestamp) { SendSnapshot(sourceIp); }
+      return true;
+    }
+    // another peer answered a request we're about to answer
+    if (msgState.HasMode("HW") && !coord.replies.empty()) { SuppressReply(msgState); }
     // handle UP messages (and node collisions)
     if (msgState.HasMode("UP")) {
-      if (msgState.id == nodeId) {
-        // check if the address matches this node
-        //if (uAddress != sourceIp) { // } FIXME uAddress ends up being 0.0.0.0 (any interface) and a real port
-        if (uAddress.GetPort() != sourceIp.GetPort()) {
-          fprintf(stderr, "ERROR: node-id collision detected (%s vs %s)!\nExiting...\n", uAddressStr.c_str(), sourceIpStr.c_str());
-          hasCollision = true;
+      if (coord.claiming && coord.Owns(msgState.id)) {
+        // a live owner, give up the claim
+        WriteState(msgState, msgState.id);
+        coord.claimLost = true;
+      } else if (coord.Owns(msgState.id)) {
+        // check if the message came from this node (instance), 
+        // or from a previous incarnation on this host (it stored every timestamp before sending it)
+        unsigned shard = msgState.id - coord.firstNodeId;
+        bool stale = msgState.instance && msgState.boot < coord.state.boot && 
+                     msgState.timestamp <= coord.diskTimeMs[shard];
+        if (stale) {
+          if (debug) { fprintf(stderr, "INFO: Ignoring stale 'UP' from a previous incarnation (boot %u).\n", msgState.boot); }
+        } else if (!IsSelf(msgState, sourceIp)) {
+          LogError("ERROR: node-id %u collision detected (%s vs %s)! No more IDs from this node.\n", msgState.id, coord.uAddressStr.c_str(), sourceIpStr.c_str());
+          DISTID_PROBE2(collision, msgState.id, sourceIp.GetPort());
+          coord.hasCollision = true;
+          for (auto& gen : gens) { gen.Lock(); gen.valid = false; gen.Unlock(); }
           return false;
         }
       } else {
         // most recent data from that node, store it
-        // FIXME: technically UDP packets can be re-ordered, 
-        //   so load the old state, and take the one with max timestamp
-        store.Write(msgState, msgState.id);
+        // (unless it's from an older incarnation, or re-ordered behind a newer update)
+        IdNodeState prev;
+        bool older = coord.store.Read(prev, msgState.id) && msgState.instance && prev.instance &&
+          (msgState.boot < prev.boot || (msgState.boot == prev.boot && msgState.timestamp < prev.timestamp));
+        if (!older) { WriteState(msgState, msgState.id); }
+      }
+    }
+    // Lease claim from a peer (or ourselves, via multicast loopback)...
+    bool isClaim = msgState.HasMode("CL");
+    if (isClaim && msgState.SameInstance(coord.state)) {
+      return true;
+    }
+    if (isClaim && coord.claiming && coord.Owns(msgState.id)) {
+      // competing claim, lowest address wins, and re-asserts its claim
+      if (ClaimWins(msgState)) {
+        EmitShardState(msgState.id - coord.firstNodeId, "CL");
+      } else {
+        WriteState(msgState, msgState.id);
+        coord.claimLost = true;
       }
+      return true;
     }
-    // Request from peer for stored state...
-    if (msgState.HasMode("RQ")) {
+    // Request (or claim) from peer for stored state...
+    if (msgState.HasMode("RQ") || isClaim) {
       if (debug) { fprintf(stderr, "INFO: Received 'RQ' multicast message (node %d from %s).\n", msgState.id, sourceIpStr.c_str()); }
       IdNodeState peerState;
       // look it up
-      if (!store.Read(peerState, msgState.id)) {
+      if (!coord.store.Read(peerState, msgState.id)) {
         return true;
       }
-      // don't forward un-initialized entries
-      if (0 == msgState.timestamp) { return true; }
+      // remember claims (after looking up the previous holder)
+      if (isClaim && !coord.Owns(msgState.id)) {
+        WriteState(msgState, msgState.id);
+      }
+      // don't forward un-initialized entries (or unresolved claims)
+      if (0 == peerState.timestamp) { return true; }
+      if (isClaim && peerState.HasMode("CL")) { return true; }
       // send it out
-      if (initialized && msgState.id == nodeId) {
-        // as a collision
+      if (coord.initialized && coord.Owns(msgState.id)) {
+        // as a collision (at once)
         peerState.SetMode("UP");
+        EmitState(peerState);
       } else {
-        // as a state update
+        // as a state update (after a random delay, unless another peer answers first)
         peerState.SetMode("HW");
+        if (debug) { 
+          fprintf(stderr, "INFO: Emitting 'HW' multicast message (to node %d from %d).\n", msgState.id, coord.firstNodeId);
+          fprintf(stderr, "INFO:   timestamp %" PRIx64 ".\n", msgState.timestamp);
+        }
+        ScheduleReply(peerState);
       }
-      if (debug) { 
-        fprintf(stderr, "INFO: Emitting 'HW' multicast message (to node %d from %d).\n", msgState.id, nodeId);
-        fprintf(stderr, "INFO:   timestamp %" PRIx64 " vs local %" PRIx64 ".\n", msgState.timestamp, minTimeMs);
-      }
-      EmitState(peerState);
     }
     // high-water timestamp
     if (msgState.HasMode("HW")) {
       if (debug) { 
-        fprintf(stderr, "INFO: Node %u Received 'HW' multicast message (node %d from %s).\n", nodeId, msgState.id, sourceIpStr.c_str());
-        fprintf(stderr, "INFO:   timestamp %" PRIx64 " vs local %" PRIx64 ".\n", msgState.timestamp, minTimeMs);
+        fprintf(stderr, "INFO: Node %u Received 'HW' multicast message (node %d from %s).\n", coord.firstNodeId, msgState.id, sourceIpStr.c_str());
+        fprintf(stderr, "INFO:   timestamp %" PRIx64 ".\n", msgState.timestamp);
       }
-      if (msgState.id == nodeId) {
+      if (coord.claiming && coord.Owns(msgState.id) && 
+          !msgState.SameInstance(coord.state) &&
+          !IsLeaseFree(msgState, RtMs())) {
+        // a peer knows of a recent holder of this node-id, give up the claim
+        WriteState(msgState, msgState.id);
+        coord.claimLost = true;
+      } else if (coord.Owns(msgState.id)) {
         // update timestamp/delta
-        if (msgState.timestamp > minTimeMs) {
-          AdjustTimetamp(msgState.timestamp);
+        unsigned shard = msgState.id - coord.firstNodeId;
+        // (the peer's high-water timestamp was already used by a previous incarnation)
+        gens[shard].Lock();
+        if (msgState.timestamp + 1 > gens[shard].minTimeMs) {
+          AdjustTimetamp(shard, msgState.timestamp + 1);
+        }
+        gens[shard].Unlock();
+        if (!coord.initialized && msgState.instance && !msgState.SameInstance(coord.state)) {
+          // a peer remembers a previous incarnation, make sure ours is newer
+          if (msgState.boot >= coord.state.boot) { coord.state.boot = msgState.boot + 1; }
+          if (!coord.heard[shard]) { coord.heard[shard] = true; ++coord.answered; }
         }
       }
     }
@@ -305,47 +2094,41 @@ public:
     return true;
   }
 
-  // Sets new high-water timestamp, calculating a new delta from the monotonic time source.
-  void AdjustTimetamp(uint64_t timestamp) {
-    uint64_t base = GetMonoTimestampMs();
-    minTimeMs = timestamp;
+  // Sets new high-water timestamp of generator 'shard', 
+  // calculating a new delta from the monotonic time source.
+  void AdjustTimetamp(unsigned shard, uint64_t timestamp) {
+    IdGenerator& gen = gens[shard];
+    uint64_t base = MonoMs();
+    gen.minTimeMs = timestamp;
     // TODO  assert( base < timestamp );
-    deltaTimeMs  = timestamp - base;
+    gen.deltaTimeMs  = timestamp - base;
     // update the local state store
-    state.timestamp = timestamp;
-    store.Write(state, nodeId);
+    IdNodeState rec = coord.state;
+    rec.id = gen.nodeId;
+    rec.timestamp = timestamp;
+    WriteState(rec, gen.nodeId);
   }
 
-  // Returns "Real" time (milliseconds), but subject to "warping" forward and back.
-  static uint64_t GetRtTimestampMs() {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    uint64_t now = tv.tv_sec*1000;
-    now += (tv.tv_usec/1000);
-    return now;
-  }
+  // Returns system "Real" time (milliseconds), but subject to "warping" forward and back.
+  static uint64_t GetRtTimestampMs() { return SystemClock::Rt(); }
 
-  // Returns monotonic time (milliseconds), but with arbitrary origin.
-  static uint64_t GetMonoTimestampMs() {
-    struct timespec ts;
-    // NOTE: CLOCK_MONOTONIC (and BOOTTIME) has an arbitrary offset (origin)
-    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
-    //clock_gettime(CLOCK_BOOTTIME, &ts);
-    uint64_t now = ts.tv_sec*1000;
-    //now += ((int64_t)ts.tv_nsec)/(int64_t)1000000; // strangely, this doesn't work
-    now += roundl(ts.tv_nsec/1000000);               // but this does
-    return now;
-  }
+  // Returns system monotonic time (milliseconds), but with arbitrary origin.
+  static uint64_t GetMonoTimestampMs() { return SystemClock::Mono(); }
+
+  // The node's own clock (the Clock policy).
+  uint64_t RtMs() { return coord.clock.RtMs(); }
+  uint64_t MonoMs() { return coord.clock.MonoMs(); }
 
   // Bumps the current timestamp.
   // Returns:
   //    0 - if successfull
   //    1 - on error
   //   -1 - when throttling (delay) is required. 
-  int GetCheckedTimestampMs(uint64_t &timeMs) {
-    uint64_t now = GetMonoTimestampMs() + deltaTimeMs;
+  int GetCheckedTimestampMs(uint64_t &timeMs, uint64_t deltaTimeMs) {
+    uint64_t now = MonoMs() + deltaTimeMs;
     if (now < timeMs) {
-      fprintf(stderr, "ERROR: Non-monotonic clock! (%d)\n", (int)(now-timeMs));
+      DISTID_PROBE2(clock_backwards, now, timeMs);
+      LogError("ERROR: Non-monotonic clock! (%d)\n", (int)(now-timeMs));
       return -1;
     } else if (now == timeMs) {
       if (debug) { fprintf(stderr, "NOTICE: Request-rate exceeded!\n"); }
@@ -355,38 +2138,156 @@ public:
     return 0;
   }
 
-  // Bumps the current timestamp with throttling delay.
-  // Returns false on error.
-  bool UpdateTimestampInner() {
-    for (int retry=0; retry<=10; ++retry) {
-      if (0 == GetCheckedTimestampMs(minTimeMs)) {
-        return true;
-      }
+  // Returns the counters left below 'limit' on 'shard' without waiting: the rest of its
+  // millisecond, or all of them if the clock has moved on. 'now' caches the clock (0 if not read yet).
+  unsigned ShardHeadroom(unsigned shard, uint32_t limit, uint64_t& now) {
+    const IdGenerator& gen = gens[shard];
+    if (!gen.valid) { return 0; }
+    if (!gen.NeedsTimestamp(limit)) { return limit - gen.idCounter; }
+    if (!now) { now = MonoMs(); }
+    return now + gen.deltaTimeMs > gen.minTimeMs ? limit : 0;
+  }
+
+  // Waits, without any lock of the node held, before an ID call retries a timestamp update 
+  // turned down with 'ts' (TS_THROTTLED or TS_UNSYNCED): a .1 ms sleep for the clock to move on, 
+  // or until the timestamp is durable. Returns false (and reports it) when the retries are used up.
+  bool Backoff(unsigned shard, int ts, int retry) {
+    if (TS_UNSYNCED == ts) { return AwaitDurable(shard); }
+    if (retry < 10) {
       if (debug) { fprintf(stderr, "WARN: Throttling (.1 ms sleep)!\n"); }
-      usleep(100);
+      coord.clock.SleepUs(100);
+      return true;
+    }
+    {
+      std::lock_guard<std::mutex> guard(coordLock);
+      DISTID_PROBE2(throttle_fail, gens[shard].nodeId, gens[shard].minTimeMs);
     }
+    LogError("ERROR: Failed to update timestamp! Check date and high-water mark.\n");
     return false;
   }
 
-  // Bumps the current timestamp, and serializes it to disk and network.
-  bool UpdateTimestamp() {
-    if (!UpdateTimestampInner()) {
-      fprintf(stderr, "ERROR: Failed to update timestamp! Check date and high-water mark.\n");
-      return false;
+  // Starts a new timestamp on 'shard', for the ID calls that don't lock shards (they're serialized):
+  // takes the coordinator lock for the update, and retries throttled ones without it (Backoff()).
+  // Returns false on error.
+  bool TakeTimestamp(unsigned shard) {
+    for (int retry=0; ; ++retry) {
+      int ts;
+      {
+        std::lock_guard<std::mutex> guard(coordLock);
+        ts = NewTimestamp(shard, retry);
+      }
+      if (TS_OK == ts) { return true; }
+      if (TS_FAILED == ts || !Backoff(shard, ts, retry)) { return false; }
     }
-    //  update stored state 
-    state.timestamp = minTimeMs;
-    if (!store.Write(state, nodeId)) {
-      fprintf(stderr, "ERROR: Failed to write state for Node-Id %d\n", nodeId);
-      return false;
+  }
+
+  // Accounts 'used' IDs (of the previous timestamp) to the load of 'shard', 
+  // and completes the window once it's LOAD_WINDOW_MS long.
+  void UpdateLoad(unsigned shard, uint32_t used) {
+    LoadSlot& l = coord.load[shard];
+    uint64_t now = MonoMs();
+    if (!l.startMs) { l.startMs = now; }
+    l.ids += used;
+    if (used > l.peak) { l.peak = used; }
+    if (now < l.startMs + LOAD_WINDOW_MS) { return; }
+    uint64_t qps = l.ids * 1000 / (now - l.startMs);
+    l.qps = qps > UINT32_MAX ? UINT32_MAX : qps;
+    l.lastThrottles = l.throttles > UINT16_MAX ? UINT16_MAX : l.throttles;
+    l.counterUse = l.peak * 100 / (MAX_COUNTER-1);
+    l.startMs = now;
+    l.ids = l.throttles = l.peak = 0;
+  }
+
+  // Copies the announced load of 'shard' into 'rec'.
+  void FillLoad(IdNodeState& rec, unsigned shard) {
+    const LoadSlot& l = coord.load[shard];
+    rec.qps = l.qps;
+    rec.throttles = l.lastThrottles;
+    rec.counterUse = l.counterUse;
+    int64_t drift = (int64_t)(rec.timestamp - RtMs());
+    rec.driftMs = drift > INT32_MAX ? INT32_MAX : drift < INT32_MIN ? INT32_MIN : drift;
+  }
+
+  // Starts a new timestamp on 'shard' for the next ID (the coordinator lock held, and the 
+  // shard's lock, if the caller locks shards). Returns a TsUpdate (see UpdateTimestamp()).
+  int NewTimestamp(unsigned shard, int retry=0) {
+    if (debug) { fprintf(stderr, "INFO: Update timestamp...\n"); }
+    int ts = UpdateTimestamp(shard, retry);
+    if (TS_OK == ts) { gens[shard].idCounter = 0; }
+    return ts;
+  }
+
+  // Bumps the current timestamp (attempt 'retry' of the caller), and marks it to be stored 
+  // and announced (Announce()). Only bookkeeping, it never waits (the coordinator lock is held): 
+  // returns TS_THROTTLED if the clock hasn't moved on (or went back), and TS_UNSYNCED if the new 
+  // timestamp isn't durable yet (durable mode), for the caller to wait without its locks (Backoff()).
+  int UpdateTimestamp(unsigned shard, int retry=0) {
+    IdGenerator& gen = gens[shard];
+    if (!retry) { DISTID_PROBE3(counter_wrap, gen.nodeId, gen.idCounter, gen.minTimeMs); }
+    if (0 != GetCheckedTimestampMs(gen.minTimeMs, gen.deltaTimeMs)) {
+      DISTID_PROBE3(throttle, gen.nodeId, retry, gen.minTimeMs);
+      ++coord.stats.throttles;
+      ++coord.load[shard].throttles;
+      return TS_THROTTLED;
     }
-    if (debug) { fprintf(stderr, "INFO: emitting MC update...\n"); }
-    // emit multicast update
-    state.SetMode("UP");
-    EmitState(state);
-    return true;
+    // time-lease mode: the lease server keeps the state, and there are no peers to tell
+    // (no lease right now is reported by UseTimeLease())
+    if (coord.timeLease && !UseTimeLease(shard)) { return TS_FAILED; }
+    if (!coord.timeLease) { MarkAnnounce(shard); }
+    // durable mode: never hand out timestamps past the synced high-water mark
+    if (coord.persister && coord.store.GetFd() >= 0 && SyncedMs(shard) < gen.minTimeMs) {
+      ++coord.stats.syncWaits;
+      return TS_UNSYNCED;
+    }
+    ++coord.stats.tsUpdates;
+    UpdateLoad(shard, gen.idCounter);
+    return TS_OK;
   }
 
-};
+  // Marks the timestamp of 'shard' to be stored and announced (the coordinator lock held).
+  void MarkAnnounce(unsigned shard) {
+    if (shard >= coord.announce.size() || coord.announce[shard]) { return; }
+    coord.announce[shard] = true;
+    __atomic_store_n(&coord.unannounced, coord.unannounced + 1, __ATOMIC_RELAXED);
+  }
 
+  // Copies the records of the marked timestamps (with the load, so peers see it) to the outbox,
+  // the I/O and coordinator locks held.
+  void CollectAnnouncements() {
+    if (!coord.unannounced) { return; }
+    for (unsigned i=0; i<gens.size(); ++i) {
+      if (!coord.announce[i]) { continue; }
+      coord.announce[i] = false;
+      IdNodeState rec = coord.state;
+      rec.id = gens[i].nodeId;
+      rec.timestamp = gens[i].minTimeMs;
+      FillLoad(rec, i);
+      coord.outbox.push_back(rec);
+    }
+    __atomic_store_n(&coord.unannounced, 0, __ATOMIC_RELAXED);
+  }
+
+  // Stores the records in the outbox, and sends them to peers ("UP"), the I/O lock held 
+  // (not the coordinator lock). Durable mode: then collects write completions (see ReapDurable()).
+  void SendAnnouncements(int reapUs) {
+    for (IdNodeState& rec : coord.outbox) {
+      if (!WriteState(rec, rec.id)) { LogError("ERROR: Failed to write state for Node-Id %d\n", rec.id); }
+      if (debug) { fprintf(stderr, "INFO: emitting MC update...\n"); }
+      rec.SetMode("UP");
+      EmitState(rec);
+    }
+    if (!coord.outbox.empty()) { coord.transport.Flush(); }
+    coord.outbox.clear();
+    if (coord.persister) { ReapDurable(reapUs); }
+  }
+
+};
 
+// The default IdNode: system clocks, a state file, UDP multicast, not thread-safe.
+typedef BasicIdNode<> IdNode;
+// Same, but the ID calls can be shared by threads (a mutex around each).
+typedef BasicIdNode<SystemClock, StructArrayStore<IdNodeState>, SocketTransport, std::mutex> SharedIdNode;
+// Clock and transport replaceable at runtime (SetClock(), SetTransport()), e.g. for simulations.
+typedef BasicIdNode<DynamicClock, StructArrayStore<IdNodeState>, DynamicTransport> DynamicIdNode;
+// No peers (single-host setups): the node-ids must not be used anywhere else.
+typedef BasicIdNode<SystemClock, StructArrayStore<IdNodeState>, NullTransport> LocalIdNode;
@@ -0,0 +1,232 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include "DistId.hpp"
+
+// Counters of an IdDupDetector.
+struct IdDupStats {
+  uint64_t count;     // IDs checked
+  uint64_t suspects;  // IDs (probably) seen before: duplicates, or false positives
+  uint64_t late;      // IDs older than the oldest window (not checked)
+  uint64_t rotations; // windows dropped, to make room for newer ones
+  std::vector<uint64_t> samples; // the first few suspected IDs
+
+  IdDupStats() : count(0), suspects(0), late(0), rotations(0) { }
+};
+
+// Streaming duplicate-ID detector for live traffic (consumers, or sampled
+// GetId() results), in bounded memory. Unlike IdVerifier it doesn't keep the
+// IDs: it never misses a duplicate within the time it covers, but may report
+// false positives.
+// IDs are binned by their timestamp into windows of 'windowMs' milliseconds,
+// each with its own Bloom filter; a ring of 'windows' filters covers the newest
+// windows*windowMs milliseconds of ID timestamps, and when an ID starts a newer
+// window, the oldest filter is cleared for it. IDs older than that are counted
+// as late. Dropping whole windows keeps the fill (and so the false positive rate)
+// of each filter at its design point, however long the detector runs.
+// The filters are blocked: all probes of an ID are in one 64-byte block (a cache
+// line), so a check-and-insert is one cache miss, and is done as a mask compare
+// over the block, which compilers vectorize. One multiply-xorshift hash (Mix64)
+// picks the block and the bits. AddBatch() hashes ahead and prefetches the blocks,
+// to overlap the misses of large filters.
+class IdDupDetector {
+private:
+  enum { BLOCK_WORDS = 8, BLOCK_BITS = BLOCK_WORDS * 64, MAX_HASHES = 16, MAX_SAMPLES = 10, BATCH = 16 };
+  struct alignas(64) Block { uint64_t words[BLOCK_WORDS]; };
+
+  std::vector<Block>    blocks;    // 'windows' filters of 'blockCount' blocks each
+  std::vector<uint64_t> windowOf;  // per filter, the window it holds
+  uint64_t      windowMs;
+  unsigned      windows;
+  uint64_t      blockCount;        // blocks per filter
+  unsigned      hashes;            // bits set per ID
+  uint64_t      newest;            // newest window (UINT64_MAX before the first ID)
+  uint64_t      curStart, curEnd;  // timestamp range of the last ID's window (saves a division per ID)
+  Block*        curFilter;         // and its filter
+  IdDupStats    stats;
+
+  // Returns the filter of window 'w', rotating older ones out if it's new, or NULL if it's too old.
+  Block* Filter(uint64_t w) {
+    if (newest == UINT64_MAX || w > newest) {
+      uint64_t first = w >= windows - 1 ? w - (windows - 1) : 0;
+      if (newest != UINT64_MAX && newest + 1 > first) { first = newest + 1; }
+      for (uint64_t v=first; v<=w; ++v) {
+        unsigned slot = v % windows;
+        if (windowOf[slot] != UINT64_MAX) { ++stats.rotations; }
+        memset(&blocks[slot * blockCount], 0, blockCount * sizeof(Block));
+        windowOf[slot] = v;
+      }
+      newest = w;
+      curStart = curEnd = 0;
+    } else if (w + windows <= newest) {
+      return NULL;
+    }
+    return &blocks[(w % windows) * blockCount];
+  }
+
+  // Returns the filter for the timestamp of 'id' (NULL if it's too old).
+  Block* FilterOf(uint64_t id) {
+    uint64_t ts = IdNode::IdToTimestamp(id);
+    if (ts >= curStart && ts < curEnd) { return curFilter; }
+    uint64_t w = ts / windowMs;
+    Block* filter = Filter(w);
+    if (filter) {
+      curStart = w * windowMs;
+      curEnd = curStart + windowMs;
+      curFilter = filter;
+    }
+    return filter;
+  }
+
+  // Builds the bit mask of hash 'h' within its block (double hashing, 9 bits per probe).
+  void Mask(uint64_t h, uint64_t mask[BLOCK_WORDS]) const {
+    uint64_t g = h * 0x9e3779b97f4a7c15ull;
+    uint32_t a = (uint32_t)(g >> 32), b = (uint32_t)g | 1;
+    memset(mask, 0, BLOCK_WORDS * sizeof(uint64_t));
+    for (unsigned i=0; i<hashes; ++i) {
+      unsigned bit = (a + i * b) >> (32 - 9);
+      mask[bit >> 6] |= 1ull << (bit & 63);
+    }
+  }
+
+  // Sets the bits of 'mask' in 'block', returns true if all were already set.
+  static bool TestAndSet(Block& block, const uint64_t mask[BLOCK_WORDS]) {
+    uint64_t missing = 0;
+    for (unsigned i=0; i<BLOCK_WORDS; ++i) {
+      missing |= mask[i] & ~block.words[i];
+      block.words[i] |= mask[i];
+    }
+    return missing == 0;
+  }
+
+  Block& BlockOf(Block* filter, uint64_t h) const {
+    return filter[((h >> 32) * blockCount) >> 32];
+  }
+
+  bool Suspect(uint64_t id) {
+    ++stats.suspects;
+    if (stats.samples.size() < MAX_SAMPLES) { stats.samples.push_back(id); }
+    if (alert) { alert(id); }
+    return true;
+  }
+
+public:
+  // Called with every suspected duplicate (e.g. to log it, or page someone), if set.
+  std::function<void(uint64_t id)> alert;
+
+  //   'idsPerWindow' - expected IDs per window (the filters are sized for it)
+  //   'fpRate'       - false positive rate per ID at that load (e.g. 0.001)
+  //   'windowMs'     - window length, in milliseconds of ID timestamps
+  //   'windows'      - windows kept (IDs are checked against the last windows*windowMs ms)
+  //   'maxBytes'     - caps the memory of all filters (0 for no cap), at a higher false positive rate
+  IdDupDetector(uint64_t idsPerWindow, double fpRate = 0.001, uint64_t windowMs = 1000, unsigned windows = 8,
+      size_t maxBytes = 0) : windowMs(windowMs ? windowMs : 1), windows(windows > 1 ? windows : 2),
+      newest(UINT64_MAX), curStart(0), curEnd(0), curFilter(NULL) {
+    if (idsPerWindow < 1) { idsPerWindow = 1; }
+    if (fpRate <= 0 || fpRate >= 1) { fpRate = 0.001; }
+    // start at m = -n ln(p) / ln(2)^2 bits (a classic Bloom filter), and grow it until the
+    // uneven load of the blocks is paid for, or the memory cap is reached
+    double bits = -(double)idsPerWindow * log(fpRate) / (M_LN2 * M_LN2);
+    uint64_t maxBlocks = maxBytes ? std::max((uint64_t)1, (uint64_t)(maxBytes / this->windows / sizeof(Block))) : UINT32_MAX;
+    blockCount = std::min(maxBlocks, std::max((uint64_t)1, (uint64_t)ceil(bits / BLOCK_BITS)));
+    while (true) {
+      double best = 2;
+      for (unsigned k=1; k<=MAX_HASHES; ++k) {
+        double fp = FpRate(idsPerWindow, blockCount, k);
+        if (fp < best) { best = fp; hashes = k; }
+      }
+      if (best <= fpRate || blockCount >= maxBlocks) { break; }
+      blockCount = std::min(maxBlocks, blockCount + blockCount / 16 + 1);
+    }
+    blocks.resize(blockCount * this->windows);
+    windowOf.assign(this->windows, UINT64_MAX);
+  }
+
+  // Checks 'id', and adds it. Returns true if it was (probably) seen before.
+  bool Add(uint64_t id) {
+    ++stats.count;
+    Block* filter = FilterOf(id);
+    if (!filter) {
+      ++stats.late;
+      return false;
+    }
+    uint64_t h = IdNode::Mix64(id);
+    uint64_t mask[BLOCK_WORDS];
+    Mask(h, mask);
+    return TestAndSet(BlockOf(filter, h), mask) && Suspect(id);
+  }
+
+  // Adds 'count' IDs, prefetching ahead. Returns the number of suspected duplicates.
+  size_t AddBatch(const uint64_t* ids, size_t count) {
+    uint64_t before = stats.suspects;
+    Block* filters[BATCH];
+    uint64_t hs[BATCH];
+    for (size_t i=0; i<count; i+=BATCH) {
+      size_t n = count - i < BATCH ? count - i : BATCH;
+      uint64_t rotations = stats.rotations;
+      for (size_t j=0; j<n; ++j) {
+        filters[j] = FilterOf(ids[i+j]);
+        hs[j] = IdNode::Mix64(ids[i+j]);
+        if (filters[j]) { __builtin_prefetch(&BlockOf(filters[j], hs[j]), 1); }
+      }
+      if (stats.rotations != rotations) {
+        // a window started within the batch, and may have replaced one used before it
+        for (size_t j=0; j<n; ++j) { Add(ids[i+j]); }
+        continue;
+      }
+      stats.count += n;
+      for (size_t j=0; j<n; ++j) {
+        if (!filters[j]) {
+          ++stats.late;
+          continue;
+        }
+        uint64_t mask[BLOCK_WORDS];
+        Mask(hs[j], mask);
+        if (TestAndSet(BlockOf(filters[j], hs[j]), mask)) { Suspect(ids[i+j]); }
+      }
+    }
+    return stats.suspects - before;
+  }
+
+  // Forgets all IDs (the counters are kept).
+  void Clear() {
+    memset(&blocks[0], 0, blocks.size() * sizeof(Block));
+    windowOf.assign(windows, UINT64_MAX);
+    newest = UINT64_MAX;
+    curStart = curEnd = 0;
+    curFilter = NULL;
+  }
+
+  // Returns the false positive rate of an ID checked against 'ids' IDs, in 'blocks' blocks of 'k' bits
+  // per ID: the rate of a single block, averaged over the (Poisson distributed) number of IDs per block.
+  // The Poisson terms are computed in log space, as exp(-mean) underflows for overloaded filters.
+  static double FpRate(uint64_t ids, uint64_t blocks, unsigned k) {
+    double mean = (double)ids / blocks, spread = 12 * sqrt(mean) + 20;
+    // (every block is saturated: each term is 1 to within rounding)
+    if (mean - spread > 40 * BLOCK_BITS) { return 1; }
+    uint64_t first = mean > spread ? (uint64_t)(mean - spread) : 0, last = (uint64_t)(mean + spread);
+    double logMean = mean > 0 ? log(mean) : 0, fp = 0;
+    for (uint64_t n=first; n<=last; ++n) {
+      double p = mean > 0 ? exp(n * logMean - mean - lgamma(n + 1.0)) : (n == 0);
+      fp += p * pow(1 - exp(-(double)k * n / BLOCK_BITS), k);
+    }
+    return std::min(fp, 1.0);
+  }
+
+  // Returns the false positive rate per ID, with 'ids' IDs in its window.
+  double FpRate(uint64_t ids) const { return FpRate(ids, blockCount, hashes); }
+
+  size_t MemoryBytes() const { return blocks.size() * sizeof(Block); }
+  unsigned GetHashes() const { return hashes; }
+  uint64_t CoveredMs() const { return windowMs * windows; }
+  const IdDupStats& GetStats() const { return stats; }
+};
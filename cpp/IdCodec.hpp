@@ -0,0 +1,329 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <vector>
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+#include "DistId.hpp"
+
+// Compact encoding of ID batches and streams (e.g. client output, ID log archives).
+//
+// IDs are grouped by node-id, and the node-id bits are dropped, leaving the
+// (timestamp, counter) part 'v', which increases by (mostly) 1 from one ID of a
+// node to the next. Each block holds up to CODEC_BLOCK IDs of one node-id:
+//   varint   node-id
+//   varint   count
+//   varint   zigzag(first v - last v of the node's previous block)
+//   full blocks (count == CODEC_BLOCK):
+//     byte     bit width 'b' (0-32)
+//     16*b     the low 'b' bits of the gaps (v[i] - v[i-1] - 1), bit-packed in
+//              4 interleaved 32-bit lanes (SIMD friendly, see Unpack())
+//     varint   number of exceptions (gaps that don't fit in 'b' bits)
+//     per exception: byte position, varint high bits (gap >> b)
+//   partial blocks: a varint per gap
+// A stream starts with CODEC_MAGIC. Dense runs take well under 0.1 bytes per ID.
+// Within a node-id the order of IDs is kept, the order across node-ids isn't.
+// IDs that aren't increasing (within a node-id) just start a new block.
+#define CODEC_MAGIC "IDZ1"
+#define CODEC_BLOCK 128
+
+// Encodes IDs (added one at a time) into a byte stream.
+class IdEncoder {
+private:
+  std::vector<uint8_t>                out;
+  std::vector<std::vector<uint64_t> > pending; // per node-id, v values of the current block
+  std::vector<uint64_t>               lastV;   // per node-id, last v of the previous block
+  uint64_t                            count;
+
+public:
+  IdEncoder() : pending(MAX_NODES), lastV(MAX_NODES, 0), count(0) {
+    out.insert(out.end(), CODEC_MAGIC, CODEC_MAGIC + 4);
+  }
+
+  // Adds 'id' to the stream.
+  void Add(uint64_t id) {
+    unsigned node = id & NODE_MASK;
+    uint64_t v = id >> NODE_BITS;
+    std::vector<uint64_t>& p = pending[node];
+    if (!p.empty() && v <= p.back()) { FlushNode(node); }
+    if (p.capacity() < CODEC_BLOCK) { p.reserve(CODEC_BLOCK); }
+    p.push_back(v);
+    ++count;
+    if (p.size() == CODEC_BLOCK) { FlushNode(node); }
+  }
+
+  // Adds 'n' IDs from 'ids'.
+  void Add(const uint64_t* ids, size_t n) {
+    for (size_t i=0; i<n; ++i) { Add(ids[i]); }
+  }
+
+  // Encodes all pending (partial) blocks, e.g. at the end of a stream or batch.
+  void Flush() {
+    for (unsigned n=0; n<MAX_NODES; ++n) {
+      if (!pending[n].empty()) { FlushNode(n); }
+    }
+  }
+
+  // Encoded bytes so far (complete blocks only, until Flush()).
+  const std::vector<uint8_t>& Data() const { return out; }
+
+  // Discards the encoded bytes (e.g. after writing them out), the stream continues.
+  void Clear() { out.clear(); }
+
+  // Writes the encoded bytes to 'f', and discards them. Returns false on errors.
+  bool Drain(FILE* f) {
+    bool ok = out.empty() || 1 == fwrite(&out[0], out.size(), 1, f);
+    out.clear();
+    return ok;
+  }
+
+  uint64_t GetCount() const { return count; }
+
+  // Encodes 'n' IDs from 'ids' into 'buf' (a complete stream).
+  static void Encode(const uint64_t* ids, size_t n, std::vector<uint8_t>& buf) {
+    IdEncoder enc;
+    enc.Add(ids, n);
+    enc.Flush();
+    buf = enc.out;
+  }
+
+  static void PutVarint(std::vector<uint8_t>& buf, uint64_t x) {
+    while (x >= 0x80) {
+      buf.push_back((uint8_t)(x | 0x80));
+      x >>= 7;
+    }
+    buf.push_back((uint8_t)x);
+  }
+
+  static unsigned VarintSize(uint64_t x) {
+    unsigned n = 1;
+    while (x >= 0x80) { x >>= 7; ++n; }
+    return n;
+  }
+
+  // Bit-packs the low 'b' bits of the CODEC_BLOCK values 'vals' into 'words' (4*b words),
+  // value i goes to lane i%4, and each lane is packed sequentially.
+  static void Pack(const uint32_t* vals, unsigned b, uint32_t* words) {
+    memset(words, 0, 4*b*sizeof(uint32_t));
+    if (!b) { return; }
+    uint32_t mask = b == 32 ? 0xFFFFFFFFu : (1u << b) - 1;
+    for (unsigned j=0; j<CODEC_BLOCK/4; ++j) {
+      unsigned bit = j*b;
+      unsigned k = bit >> 5, s = bit & 31;
+      for (unsigned lane=0; lane<4; ++lane) {
+        uint32_t x = vals[4*j + lane] & mask;
+        words[4*k + lane] |= x << s;
+        if (s + b > 32) { words[4*(k+1) + lane] |= x >> (32 - s); }
+      }
+    }
+  }
+
+private:
+  void FlushNode(unsigned node) {
+    std::vector<uint64_t>& p = pending[node];
+    unsigned n = p.size();
+    PutVarint(out, node);
+    PutVarint(out, n);
+    int64_t first = (int64_t)(p[0] - lastV[node]);
+    PutVarint(out, ((uint64_t)first << 1) ^ (uint64_t)(first >> 63)); // zigzag
+    uint64_t gaps[CODEC_BLOCK];
+    for (unsigned i=1; i<n; ++i) { gaps[i] = p[i] - p[i-1] - 1; }
+    gaps[0] = 0;
+    if (n < CODEC_BLOCK) {
+      for (unsigned i=1; i<n; ++i) { PutVarint(out, gaps[i]); }
+    } else {
+      // pick the bit width with the smallest encoding (packed bits, plus exceptions)
+      unsigned maxBits = 0;
+      for (unsigned i=1; i<n; ++i) {
+        unsigned bits = gaps[i] ? 64 - __builtin_clzll(gaps[i]) : 0;
+        if (bits > maxBits) { maxBits = bits; }
+      }
+      unsigned best = 0;
+      size_t bestSize = SIZE_MAX;
+      for (unsigned b=0; b<=maxBits && b<=32; ++b) {
+        size_t size = 16*b + 1;
+        for (unsigned i=1; i<n; ++i) {
+          if (gaps[i] >> b) { size += 1 + VarintSize(gaps[i] >> b); }
+        }
+        if (size < bestSize) { bestSize = size; best = b; }
+      }
+      uint32_t low[CODEC_BLOCK];
+      unsigned exceptions = 0;
+      for (unsigned i=0; i<n; ++i) {
+        low[i] = (uint32_t)gaps[i];
+        if (gaps[i] >> best) { ++exceptions; }
+      }
+      out.push_back(best);
+      size_t at = out.size();
+      out.resize(at + 16*best);
+      uint32_t words[4*32];
+      Pack(low, best, words);
+      memcpy(&out[at], words, 16*best);
+      PutVarint(out, exceptions);
+      for (unsigned i=0; i<n; ++i) {
+        if (gaps[i] >> best) {
+          out.push_back(i);
+          PutVarint(out, gaps[i] >> best);
+        }
+      }
+    }
+    lastV[node] = p[n-1];
+    p.clear();
+  }
+};
+
+// Decodes a byte stream of IdEncoder, one block at a time.
+class IdDecoder {
+private:
+  const uint8_t*        p;
+  const uint8_t*        end;
+  std::vector<uint64_t> lastV; // per node-id, last v of the previous block
+  bool                  error;
+
+public:
+  // Decodes the 'len' bytes at 'data' (a complete stream, starting with CODEC_MAGIC).
+  IdDecoder(const uint8_t* data, size_t len) : p(data), end(data + len), lastV(MAX_NODES, 0), error(false) {
+    if (len < 4 || 0 != memcmp(data, CODEC_MAGIC, 4)) {
+      fprintf(stderr, "ERROR: Not an encoded ID stream!\n");
+      error = true;
+    } else {
+      p += 4;
+    }
+  }
+
+  // Returns true if the stream was invalid (or truncated).
+  bool HasError() const { return error; }
+
+  // Decodes the next block into 'ids' (room for CODEC_BLOCK IDs).
+  // Returns the number of IDs, 0 at the end of the stream (or on errors).
+  unsigned Next(uint64_t* ids) {
+    if (error || p >= end) { return 0; }
+    uint64_t node, n, zz;
+    if (!GetVarint(node) || !GetVarint(n) || !GetVarint(zz) || node >= MAX_NODES || n < 1 || n > CODEC_BLOCK) {
+      return Fail();
+    }
+    uint64_t v = lastV[node] + (uint64_t)((int64_t)(zz >> 1) ^ -(int64_t)(zz & 1));
+    ids[0] = (v << NODE_BITS) | node;
+    if (n < CODEC_BLOCK) {
+      for (unsigned i=1; i<n; ++i) {
+        uint64_t gap;
+        if (!GetVarint(gap)) { return Fail(); }
+        v += gap + 1;
+        ids[i] = (v << NODE_BITS) | node;
+      }
+    } else {
+      if (p >= end) { return Fail(); }
+      unsigned b = *p++;
+      if (b > 32 || end - p < 16*b) { return Fail(); }
+      uint32_t low[CODEC_BLOCK];
+      Unpack(p, b, low);
+      p += 16*b;
+      uint64_t exceptions;
+      if (!GetVarint(exceptions) || exceptions > CODEC_BLOCK) { return Fail(); }
+      // exceptions are in position order, so patch them in while summing up
+      unsigned nextPos = CODEC_BLOCK;
+      uint64_t high = 0;
+      if (exceptions && !NextException(nextPos, high)) { return Fail(); }
+      for (unsigned i=1; i<CODEC_BLOCK; ++i) {
+        uint64_t gap = low[i];
+        if (i == nextPos) {
+          gap |= high << b;
+          nextPos = CODEC_BLOCK;
+          if (--exceptions && !NextException(nextPos, high)) { return Fail(); }
+        }
+        v += gap + 1;
+        ids[i] = (v << NODE_BITS) | node;
+      }
+    }
+    lastV[node] = v;
+    return n;
+  }
+
+  // Decodes 'len' bytes at 'data' (a complete stream), appending the IDs to 'ids'.
+  // Returns false if the stream is invalid.
+  static bool Decode(const uint8_t* data, size_t len, std::vector<uint64_t>& ids) {
+    IdDecoder dec(data, len);
+    uint64_t block[CODEC_BLOCK];
+    while (unsigned n = dec.Next(block)) { ids.insert(ids.end(), block, block + n); }
+    return !dec.HasError();
+  }
+
+  // Unpacks CODEC_BLOCK values of 'b' bits from the (4 interleaved lanes of)
+  // 32-bit words at 'in' into 'vals' (see IdEncoder::Pack()).
+  static void Unpack(const uint8_t* in, unsigned b, uint32_t* vals) {
+#ifdef __SSE2__
+    UnpackSSE2(in, b, vals);
+#else
+    UnpackScalar(in, b, vals);
+#endif
+  }
+
+  static void UnpackScalar(const uint8_t* in, unsigned b, uint32_t* vals) {
+    if (!b) { memset(vals, 0, CODEC_BLOCK*sizeof(uint32_t)); return; }
+    uint32_t words[4*32];
+    memcpy(words, in, 16*b);
+    uint32_t mask = b == 32 ? 0xFFFFFFFFu : (1u << b) - 1;
+    for (unsigned j=0; j<CODEC_BLOCK/4; ++j) {
+      unsigned bit = j*b;
+      unsigned k = bit >> 5, s = bit & 31;
+      for (unsigned lane=0; lane<4; ++lane) {
+        uint32_t x = words[4*k + lane] >> s;
+        if (s + b > 32) { x |= words[4*(k+1) + lane] << (32 - s); }
+        vals[4*j + lane] = x & mask;
+      }
+    }
+  }
+
+#ifdef __SSE2__
+  // All 4 lanes share the bit offsets, so each row of 4 values is a shift (or two) and a mask.
+  static void UnpackSSE2(const uint8_t* in, unsigned b, uint32_t* vals) {
+    if (!b) { memset(vals, 0, CODEC_BLOCK*sizeof(uint32_t)); return; }
+    const __m128i* words = (const __m128i*)in;
+    __m128i mask = _mm_set1_epi32(b == 32 ? -1 : (int)((1u << b) - 1));
+    __m128i cur = _mm_loadu_si128(words);
+    unsigned k = 0;
+    for (unsigned j=0; j<CODEC_BLOCK/4; ++j) {
+      unsigned bit = j*b;
+      unsigned s = bit & 31;
+      if ((bit >> 5) != k) { k = bit >> 5; cur = _mm_loadu_si128(words + k); }
+      __m128i x = _mm_srl_epi32(cur, _mm_cvtsi32_si128(s));
+      if (s + b > 32) {
+        __m128i next = _mm_loadu_si128(words + k + 1);
+        x = _mm_or_si128(x, _mm_sll_epi32(next, _mm_cvtsi32_si128(32 - s)));
+      }
+      _mm_storeu_si128((__m128i*)(vals + 4*j), _mm_and_si128(x, mask));
+    }
+  }
+#endif
+
+private:
+  unsigned Fail() {
+    if (!error) { fprintf(stderr, "ERROR: Corrupt (or truncated) ID stream!\n"); }
+    error = true;
+    return 0;
+  }
+
+  bool GetVarint(uint64_t& x) {
+    x = 0;
+    for (unsigned shift=0; shift<64 && p<end; shift+=7) {
+      uint8_t c = *p++;
+      x |= (uint64_t)(c & 0x7F) << shift;
+      if (!(c & 0x80)) { return true; }
+    }
+    return false;
+  }
+
+  bool NextException(unsigned& pos, uint64_t& high) {
+    if (p >= end) { return false; }
+    pos = *p++;
+    return pos > 0 && pos < CODEC_BLOCK && GetVarint(high);
+  }
+};
@@ -0,0 +1,348 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DistId.hpp"
+#include "DupDetector.hpp"
+
+// Results of an IdVerifier run.
+struct IdVerifyStats {
+  uint64_t count;        // IDs checked
+  uint64_t duplicates;   // extra occurrences of IDs (0 if all are unique)
+  uint64_t nonMonotonic; // IDs not greater than the previous ID of the same node-id (in input order)
+  unsigned nodes;        // distinct node-ids seen
+  uint64_t minTs;        // timestamp range of the IDs (milliseconds)
+  uint64_t maxTs;
+  unsigned runs;         // sorted runs spilled to disk (0 if verified in memory)
+  std::vector<uint64_t> dupSamples;   // the first few duplicated IDs
+  std::vector<uint64_t> orderSamples; // the first few non-monotonic IDs
+
+  IdVerifyStats() : count(0), duplicates(0), nonMonotonic(0), nodes(0), minTs(UINT64_MAX), maxTs(0), runs(0) { }
+};
+
+// Verifies uniqueness (and per node-id monotonicity) of large ID streams.
+// IDs are buffered, and sorted with a parallel radix sort, so duplicates end up
+// next to each other. When the buffer is full, it is sorted and spilled to a
+// temporary file (a "run"), and Finish() merges the mmap'd runs instead.
+// Memory use is about 16 bytes per buffered ID (the buffer, plus sort scratch).
+class IdVerifier {
+private:
+  std::vector<uint64_t> buf;     // IDs not yet sorted
+  std::vector<uint64_t> scratch; // radix sort scratch
+  size_t        maxBuffered;     // IDs per in-memory sort (and per run)
+  unsigned      threads;
+  std::string   tmpDir;
+  std::vector<std::string> runFiles;
+  std::vector<uint64_t> lastId;  // per node-id, last ID seen (input order)
+  std::vector<bool>     seen;    // per node-id, any ID seen (in the current stream)
+  std::vector<bool>     known;   // per node-id, any ID seen (at all)
+  IdVerifyStats stats;
+  bool          ioError;         // failed to spill (or map) a run
+  IdDupDetector* detector;       // checks IDs as they're added, instead of sorting (NULL to sort)
+  enum { MAX_SAMPLES = 10 };
+
+public:
+  //   'maxBuffered' - IDs to sort in memory, before spilling sorted runs to disk
+  //   'threads'     - sort threads (0 for one per CPU)
+  //   'tmpDir'      - directory for spilled runs
+  IdVerifier(size_t maxBuffered=(1<<26), unsigned threads=0, const char* tmpDir="/tmp")
+    : maxBuffered(maxBuffered ? maxBuffered : 1), threads(threads), tmpDir(tmpDir), lastId(MAX_NODES, 0), seen(MAX_NODES, false), known(MAX_NODES, false), ioError(false), detector(NULL) {
+    if (!this->threads) { this->threads = std::max(1u, std::thread::hardware_concurrency()); }
+  }
+  ~IdVerifier() { RemoveRuns(); }
+
+  // Checks uniqueness with 'detector' as IDs are added (NULL to sort them, the default).
+  // Memory is bounded and nothing is spilled, but duplicates further apart (in ID
+  // timestamps) than the detector covers are missed, and false positives are possible.
+  void SetDetector(IdDupDetector* detector) { this->detector = detector; }
+
+  // Adds a single ID (in the order it was generated, for the monotonicity check).
+  void Add(uint64_t id) {
+    uint64_t ts;
+    uint16_t counter, node;
+    IdNode::IdToFields(ts, counter, node, id);
+    if (seen[node] && id <= lastId[node]) {
+      if (stats.orderSamples.size() < MAX_SAMPLES) { stats.orderSamples.push_back(id); }
+      ++stats.nonMonotonic;
+    }
+    seen[node] = true;
+    if (!known[node]) { known[node] = true; ++stats.nodes; }
+    lastId[node] = id;
+    if (ts < stats.minTs) { stats.minTs = ts; }
+    if (ts > stats.maxTs) { stats.maxTs = ts; }
+    ++stats.count;
+    if (detector) {
+      if (detector->Add(id)) {
+        if (stats.dupSamples.size() < MAX_SAMPLES) { stats.dupSamples.push_back(id); }
+        ++stats.duplicates;
+      }
+      return;
+    }
+    if (buf.empty()) { buf.reserve(std::min(maxBuffered, (size_t)1<<20)); }
+    buf.push_back(id);
+    if (buf.size() >= maxBuffered && !SpillRun()) { ioError = true; }
+  }
+
+  // Starts a new input stream (e.g. another file): the monotonicity check
+  // restarts for every node-id, since streams may overlap in time.
+  void NewStream() { seen.assign(MAX_NODES, false); }
+
+  // Adds IDs from a text stream with one hex ID per line (i.e. 'client' output).
+  // Returns false on malformed input.
+  bool AddHexStream(FILE* f) {
+    char line[128];
+    uint64_t lineNo = 0;
+    while (fgets(line, sizeof(line), f)) {
+      ++lineNo;
+      char* end = NULL;
+      uint64_t id = strtoull(line, &end, 16);
+      if (end == line) {
+        if (line[0] == '\n' || line[0] == '#') { continue; }
+        fprintf(stderr, "ERROR: Invalid ID on line %" PRIu64 ": %s", lineNo, line);
+        return false;
+      }
+      Add(id);
+    }
+    return true;
+  }
+
+  // Adds IDs from a binary file of native-endian 64-bit IDs.
+  // Returns false if the file can't be read.
+  bool AddBinaryFile(const char* fname) {
+    size_t count = 0;
+    const uint64_t* ids = MapFile(fname, count);
+    if (!ids && count) { return false; }
+    for (size_t i=0; i<count; ++i) { Add(ids[i]); }
+    if (ids) { munmap((void*)ids, count*sizeof(uint64_t)); }
+    return true;
+  }
+
+  // Sorts (and merges) all added IDs, and counts duplicates.
+  // Returns true if all IDs are unique, and monotonic per node-id
+  // (and false on I/O errors, see HasError()).
+  bool Finish() {
+    if (runFiles.empty()) {
+      // everything fits in memory
+      Sort(buf);
+      CountAdjacentDuplicates(buf.data(), buf.size());
+    } else {
+      if (!buf.empty() && !SpillRun()) { ioError = true; }
+      if (!ioError && !MergeRuns()) { ioError = true; }
+    }
+    buf.clear();
+    buf.shrink_to_fit();
+    scratch.clear();
+    scratch.shrink_to_fit();
+    stats.runs = runFiles.size();
+    RemoveRuns();
+    return !ioError && 0 == stats.duplicates && 0 == stats.nonMonotonic;
+  }
+
+  const IdVerifyStats& GetStats() const { return stats; }
+
+  // Returns true if spilling or merging runs failed (the results are incomplete).
+  bool HasError() const { return ioError; }
+
+  // Prints a summary of the stats to 'f'.
+  void Report(FILE* f) const {
+    fprintf(f, "IDs:           %" PRIu64 " (%u node-ids", stats.count, stats.nodes);
+    if (stats.count) { fprintf(f, ", timestamps %" PRIu64 "-%" PRIu64, stats.minTs, stats.maxTs); }
+    fprintf(f, ")\n");
+    fprintf(f, "Duplicates:    %" PRIu64 "\n", stats.duplicates);
+    PrintSamples(f, stats.dupSamples);
+    fprintf(f, "Non-monotonic: %" PRIu64 "\n", stats.nonMonotonic);
+    PrintSamples(f, stats.orderSamples);
+    if (stats.runs) { fprintf(f, "Sorted runs:   %u (external merge)\n", stats.runs); }
+    if (detector) {
+      fprintf(f, "Probabilistic: %.1f MiB, %" PRIu64 " ms covered, %" PRIu64 " IDs too old to check\n",
+          detector->MemoryBytes() / 1048576.0, detector->CoveredMs(), detector->GetStats().late);
+    }
+  }
+
+  // Sorts 'data' in place (parallel radix sort, using 'scratch' as temporary space).
+  void Sort(std::vector<uint64_t>& data) {
+    scratch.resize(data.size());
+    RadixSort(data.data(), scratch.data(), data.size(), threads);
+  }
+
+  // Sorts 'n' IDs of 'data' (LSD radix sort, 8-bit digits), with 'tmp' as scratch space
+  // (also 'n' elements). Digits that are the same for all IDs (e.g. the high timestamp bits)
+  // are skipped. Each pass is split across 'threads' threads.
+  static void RadixSort(uint64_t* data, uint64_t* tmp, size_t n, unsigned threads) {
+    if (n < 2) { return; }
+    if (n < ((size_t)1 << 16)) { threads = 1; } // not worth the threads
+    size_t chunk = (n + threads - 1) / threads;
+
+    // find the bits that differ between IDs
+    std::vector<uint64_t> diffs(threads, 0);
+    Parallel(threads, [&](unsigned t) {
+      uint64_t diff = 0;
+      size_t end = std::min(n, (t+1)*chunk);
+      for (size_t i=t*chunk; i<end; ++i) { diff |= data[i] ^ data[0]; }
+      diffs[t] = diff;
+    });
+    uint64_t diff = 0;
+    for (auto d : diffs) { diff |= d; }
+
+    std::vector<size_t> counts(threads*256);
+    uint64_t* src = data;
+    uint64_t* dst = tmp;
+    for (unsigned shift=0; shift<64; shift+=8) {
+      if (0 == ((diff >> shift) & 0xff)) { continue; }
+      // per-thread histograms of the digit
+      std::fill(counts.begin(), counts.end(), 0);
+      Parallel(threads, [&](unsigned t) {
+        size_t* count = &counts[t*256];
+        size_t end = std::min(n, (t+1)*chunk);
+        for (size_t i=t*chunk; i<end; ++i) { ++count[(src[i] >> shift) & 0xff]; }
+      });
+      // turn them into output offsets, digit-major, then thread (keeps the sort stable)
+      size_t offset = 0;
+      for (unsigned d=0; d<256; ++d) {
+        for (unsigned t=0; t<threads; ++t) {
+          size_t c = counts[t*256 + d];
+          counts[t*256 + d] = offset;
+          offset += c;
+        }
+      }
+      // scatter
+      Parallel(threads, [&](unsigned t) {
+        size_t* pos = &counts[t*256];
+        size_t end = std::min(n, (t+1)*chunk);
+        for (size_t i=t*chunk; i<end; ++i) { dst[pos[(src[i] >> shift) & 0xff]++] = src[i]; }
+      });
+      std::swap(src, dst);
+    }
+    if (src != data) { memcpy(data, src, n*sizeof(uint64_t)); }
+  }
+
+  // Runs 'fn(t)' for each t in [0, threads), one thread each (inline, for a single thread).
+  template<typename F> static void Parallel(unsigned threads, F fn) {
+    if (threads <= 1) { fn(0); return; }
+    std::vector<std::thread> workers;
+    for (unsigned t=0; t<threads; ++t) { workers.push_back(std::thread(fn, t)); }
+    for (auto& w : workers) { w.join(); }
+  }
+
+private:
+  void CountDuplicate(uint64_t id) {
+    if (stats.dupSamples.size() < MAX_SAMPLES) { stats.dupSamples.push_back(id); }
+    ++stats.duplicates;
+  }
+
+  // Counts duplicates in the sorted array 'ids'.
+  void CountAdjacentDuplicates(const uint64_t* ids, size_t n) {
+    for (size_t i=1; i<n; ++i) {
+      if (ids[i] == ids[i-1]) { CountDuplicate(ids[i]); }
+    }
+  }
+
+  // Sorts the buffered IDs, and writes them to a new run file.
+  bool SpillRun() {
+    Sort(buf);
+    std::string name = tmpDir + "/idverify.XXXXXX";
+    int fd = mkstemp(&name[0]);
+    if (fd < 0) {
+      fprintf(stderr, "ERROR: Failed to create run file in '%s'!\n", tmpDir.c_str());
+      return false;
+    }
+    runFiles.push_back(name);
+    size_t bytes = buf.size()*sizeof(uint64_t);
+    const char* p = (const char*)&buf[0];
+    while (bytes) {
+      ssize_t ret = write(fd, p, bytes);
+      if (ret <= 0) {
+        fprintf(stderr, "ERROR: Failed to write run file '%s'!\n", name.c_str());
+        close(fd);
+        return false;
+      }
+      p += ret;
+      bytes -= ret;
+    }
+    close(fd);
+    buf.clear();
+    return true;
+  }
+
+  // Maps file 'fname' (read-only), setting 'count' to the number of IDs in it.
+  // Returns NULL on error (or for an empty file, with 'count' 0).
+  static const uint64_t* MapFile(const char* fname, size_t& count) {
+    count = 0;
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || 0 != fstat(fd, &st)) {
+      fprintf(stderr, "ERROR: Failed to open '%s'!\n", fname);
+      if (fd >= 0) { close(fd); }
+      count = 1; // error, not empty
+      return NULL;
+    }
+    count = st.st_size / sizeof(uint64_t);
+    if (!count) { close(fd); return NULL; }
+    void* p = mmap(NULL, count*sizeof(uint64_t), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+      fprintf(stderr, "ERROR: Failed to map '%s'!\n", fname);
+      return NULL;
+    }
+    madvise(p, count*sizeof(uint64_t), MADV_SEQUENTIAL);
+    return (const uint64_t*)p;
+  }
+
+  // K-way merge of the (sorted) runs, counting duplicates across all of them.
+  bool MergeRuns() {
+    struct Run { const uint64_t* ids; size_t count; size_t pos; };
+    std::vector<Run> runs;
+    bool ok = true;
+    for (auto& name : runFiles) {
+      Run run = { NULL, 0, 0 };
+      run.ids = MapFile(name.c_str(), run.count);
+      if (!run.ids) { ok = false; break; }
+      runs.push_back(run);
+    }
+    typedef std::pair<uint64_t, unsigned> Head; // (next ID, run)
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head> > heads;
+    for (unsigned r=0; ok && r<runs.size(); ++r) { heads.push(Head(runs[r].ids[0], r)); }
+    bool first = true;
+    uint64_t prev = 0;
+    while (!heads.empty()) {
+      Head h = heads.top();
+      heads.pop();
+      if (!first && h.first == prev) { CountDuplicate(h.first); }
+      first = false;
+      prev = h.first;
+      Run& run = runs[h.second];
+      if (++run.pos < run.count) { heads.push(Head(run.ids[run.pos], h.second)); }
+    }
+    for (auto& run : runs) { munmap((void*)run.ids, run.count*sizeof(uint64_t)); }
+    return ok;
+  }
+
+  void RemoveRuns() {
+    for (auto& name : runFiles) { unlink(name.c_str()); }
+    runFiles.clear();
+  }
+
+  static void PrintSamples(FILE* f, const std::vector<uint64_t>& ids) {
+    for (auto id : ids) {
+      uint64_t ts;
+      uint16_t counter, node;
+      IdNode::IdToFields(ts, counter, node, id);
+      fprintf(f, "  %" PRIx64 " => {t:%" PRIu64 ", c:%u, n:%u}\n", id, ts, counter, node);
+    }
+  }
+};
@@ -0,0 +1,89 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+// Log-linear latency histogram (in the style of HdrHistogram).
+// Values (nanoseconds) are bucketed by power of two, and each power of two
+// is split into SUB_BUCKETS linear sub-buckets, so every recorded value is
+// within 1/32 (~3%) of its bucket, from 1 ns to ~18 minutes.
+// Plain data (no pointers), so it can be copied between processes as is.
+struct LatencyHistogram {
+  enum { SUB_BITS = 6, SUB_BUCKETS = 1 << SUB_BITS, MAGNITUDES = 40 - SUB_BITS + 1 };
+
+  uint64_t counts[MAGNITUDES * SUB_BUCKETS];
+  uint64_t total;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+
+  LatencyHistogram() { Reset(); }
+
+  void Reset() {
+    memset(this, 0, sizeof(*this));
+    min = UINT64_MAX;
+  }
+
+  // Records one value 'ns'.
+  void Record(uint64_t ns) {
+    ++counts[Index(ns)];
+    ++total;
+    sum += ns;
+    if (ns < min) { min = ns; }
+    if (ns > max) { max = ns; }
+  }
+
+  // Adds all values recorded by 'other'.
+  void Merge(const LatencyHistogram& other) {
+    for (unsigned i=0; i<MAGNITUDES * SUB_BUCKETS; ++i) { counts[i] += other.counts[i]; }
+    total += other.total;
+    sum += other.sum;
+    if (other.min < min) { min = other.min; }
+    if (other.max > max) { max = other.max; }
+  }
+
+  // Returns the value at percentile 'p' (0-100), i.e. the highest value of its bucket.
+  uint64_t Percentile(double p) const {
+    if (!total) { return 0; }
+    uint64_t rank = (uint64_t)(p/100.0 * total + 0.5);
+    if (rank < 1) { rank = 1; }
+    uint64_t seen = 0;
+    for (unsigned i=0; i<MAGNITUDES * SUB_BUCKETS; ++i) {
+      seen += counts[i];
+      if (seen >= rank) {
+        uint64_t high = HighestEquivalent(i);
+        return high < max ? high : max;
+      }
+    }
+    return max;
+  }
+
+  double Mean() const { return total ? (double)sum/total : 0; }
+
+  // Prints percentiles (in microseconds) on one line, with 'label' first.
+  void Print(FILE* f, const char* label) const {
+    fprintf(f, "%-12s n=%-10" PRIu64 " mean %9.2f  p50 %9.2f  p90 %9.2f  p99 %9.2f  p99.9 %9.2f  p99.99 %9.2f  max %9.2f us\n",
+        label, total, Mean()/1000, Percentile(50)/1000.0, Percentile(90)/1000.0, Percentile(99)/1000.0,
+        Percentile(99.9)/1000.0, Percentile(99.99)/1000.0, (total ? max : 0)/1000.0);
+  }
+
+  // Returns the bucket index of value 'v'.
+  static unsigned Index(uint64_t v) {
+    if (v < SUB_BUCKETS) { return v; } // magnitude 0 is linear, 1 ns per bucket
+    unsigned magnitude = 63 - __builtin_clzll(v) - SUB_BITS + 1; // shift that leaves SUB_BITS bits
+    if (magnitude >= MAGNITUDES) { return MAGNITUDES * SUB_BUCKETS - 1; }
+    // the top bit is always set, so sub-buckets SUB_BUCKETS/2..SUB_BUCKETS-1 are used above magnitude 0
+    return magnitude * SUB_BUCKETS + (v >> magnitude);
+  }
+
+  // Returns the highest value that maps to bucket 'index'.
+  static uint64_t HighestEquivalent(unsigned index) {
+    unsigned magnitude = index / SUB_BUCKETS;
+    uint64_t sub = index % SUB_BUCKETS;
+    if (magnitude == 0) { return sub; }
+    return ((sub + 1) << magnitude) - 1;
+  }
+};
@@ -0,0 +1,127 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "DistId.hpp"
+
+// Central time-lease server (consistency-first mode, see IdNode::InitializeTimeLease()).
+// Grants exclusive ranges of timestamps [start,end) per node-id, over UDP. 
+// The end of the last grant of every node-id is persisted (and synced) in a 
+// StructArrayStore before the grant is sent, so a restarted server never hands 
+// out a range twice, and ranges of a node-id never overlap, even if two nodes 
+// use the same node-id.
+class TimeLeaseServer {
+public:
+  struct Stats {
+    uint64_t requests;   // valid requests received
+    uint64_t grants;     // new leases granted
+    uint64_t repeats;    // retransmitted requests (answered with the same grant)
+    uint64_t denied;     // requests refused (invalid node-id, or store failures)
+
+    Stats() { memset(this, 0, sizeof(*this)); }
+  };
+
+private:
+  UDPSocket socket;
+  StructArrayStore<IdNodeState> store;  // per node-id: the end of the last grant (timestamp), and its holder
+  std::vector<TimeLeaseMsg> last;       // per node-id: the last grant (for retransmitted requests)
+  SystemClock systemClock;
+  IdClock*    clock;
+  uint64_t    maxLeaseMs;
+  Stats       stats;
+
+public:
+  TimeLeaseServer() : last(MAX_NODES), clock(&systemClock), maxLeaseMs(TIME_LEASE_MAX_MS) {
+    memset((void*)&last[0], 0, sizeof(TimeLeaseMsg)*MAX_NODES);
+  }
+
+  // Opens the server socket at 'addr' (e.g. "0.0.0.0:26981", port 0 picks a free port),
+  // and the lease store 'stateFile' (NULL to keep it in memory, e.g. for tests).
+  bool Open(const char* addr, const char* stateFile) {
+    if (!OpenStateStore(store, stateFile)) { return false; }
+    if (0 != socket.address.SetAddress(addr) || 0 != socket.Open()) {
+      fprintf(stderr, "ERROR: Failed to open lease server socket (%s)\n", addr);
+      return false;
+    }
+    return true;
+  }
+
+  // Returns the bound address of the server socket (with the actual port).
+  bool GetAddress(IPAddress& addr) { return socket.GetAddress(addr); }
+
+  // Replaces the time source (not owned).
+  void SetClock(IdClock* c) { clock = c ? c : &systemClock; }
+
+  // Limits the length of granted leases.
+  void SetMaxLeaseMs(uint64_t ms) { maxLeaseMs = ms ? ms : TIME_LEASE_MAX_MS; }
+
+  const Stats& GetStats() { return stats; }
+
+  // Waits up to 'waitUs' microseconds for requests, and answers all queued ones.
+  // Returns true if any request was processed.
+  bool Poll(int waitUs) {
+    bool any = false;
+    while (socket.Wait(waitUs)) {
+      waitUs = 0;
+      TimeLeaseMsg msg;
+      IPAddress from;
+      int read = socket.Read((char*)&msg, sizeof(msg), from);
+      if (read != sizeof(msg) || !msg.HasMode("TQ")) {
+        if (debug) { fprintf(stderr, "INFO: Ignoring unexpected lease server message (%d bytes).\n", read); }
+        continue;
+      }
+      TimeLeaseMsg reply = Grant(msg);
+      socket.WriteTo(from, (const char*)&reply, sizeof(reply));
+      any = true;
+    }
+    return any;
+  }
+
+  // Answers lease request 'req': a new range of at most the requested length, 
+  // starting after every earlier grant of the node-id, and no earlier than now 
+  // (or the requested start). Retransmitted requests get the previous answer.
+  TimeLeaseMsg Grant(const TimeLeaseMsg& req) {
+    ++stats.requests;
+    TimeLeaseMsg reply = req;
+    reply.SetMode("TD");
+    if (req.id >= MAX_NODES) { ++stats.denied; return reply; }
+    TimeLeaseMsg& prev = last[req.id];
+    if (prev.seq == req.seq && prev.instance == req.instance && prev.end) {
+      ++stats.repeats;
+      return prev;
+    }
+    IdNodeState rec;
+    if (!store.Read(rec, req.id)) { ++stats.denied; return reply; }
+    uint64_t start = clock->RtMs();
+    if (req.start > start) { start = req.start; }
+    if (rec.timestamp > start) { start = rec.timestamp; }
+    uint64_t length = req.end ? req.end : TIME_LEASE_MS;
+    if (length > maxLeaseMs) { length = maxLeaseMs; }
+
+    // persist the grant before anyone can use it
+    rec.timestamp = start + length;
+    rec.id = req.id;
+    rec.instance = req.instance;
+    rec.version = STATE_VERSION;
+    rec.SetMode("TG");
+    if (!store.Write(rec, req.id) || !store.Sync()) {
+      fprintf(stderr, "ERROR: Failed to persist time-lease for Node-Id %u!\n", req.id);
+      ++stats.denied;
+      return reply;
+    }
+    reply.start = start;
+    reply.end = start + length;
+    reply.SetMode("TG");
+    prev = reply;
+    ++stats.grants;
+    if (debug) {
+      fprintf(stderr, "INFO: Granted node %u timestamps [%" PRIu64 ",%" PRIu64 ")\n", req.id, reply.start, reply.end);
+    }
+    return reply;
+  }
+};
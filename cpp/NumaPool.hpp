@@ -0,0 +1,237 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include <functional>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "DistId.hpp"
+
+// CPUs per NUMA node, from /sys/devices/system/node (no libnuma).
+struct NumaTopology {
+  std::vector<std::vector<int>> cpus; // per NUMA node (index)
+  std::vector<int> hostNode;          // the host's number of each NUMA node (-1 if simulated)
+  std::vector<int> cpuNode;           // NUMA node (index) of each CPU
+
+  // Reads the host topology. Without NUMA information, all CPUs are on node 0.
+  void Discover() {
+    cpus.clear();
+    hostNode.clear();
+    DIR* dir = opendir("/sys/devices/system/node");
+    struct dirent* entry;
+    while (dir && (entry = readdir(dir))) {
+      char* end;
+      if (strncmp(entry->d_name, "node", 4)) { continue; }
+      long node = strtol(entry->d_name + 4, &end, 10);
+      if (*end || end == entry->d_name + 4 || node < 0 || node > 1023) { continue; }
+      char path[128];
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%ld/cpulist", node);
+      std::vector<int> list;
+      if (!ReadCpuList(path, list) || list.empty()) { continue; } // (memory-only nodes)
+      // (in node order)
+      size_t at = 0;
+      while (at < hostNode.size() && hostNode[at] < node) { ++at; }
+      cpus.insert(cpus.begin() + at, list);
+      hostNode.insert(hostNode.begin() + at, node);
+    }
+    if (dir) { closedir(dir); }
+    if (cpus.empty()) {
+      long n = sysconf(_SC_NPROCESSORS_CONF);
+      cpus.resize(1);
+      hostNode.assign(1, -1);
+      for (long c=0; c<(n > 0 ? n : 1); ++c) { cpus[0].push_back(c); }
+    }
+    IndexCpus();
+  }
+
+  // Splits the CPUs round-robin into 'nodes' pretend NUMA nodes (e.g. to test pools on one socket),
+  // at most one per CPU.
+  void Simulate(unsigned nodes) {
+    Discover();
+    std::vector<int> all;
+    for (auto& list : cpus) { all.insert(all.end(), list.begin(), list.end()); }
+    if (nodes > all.size()) { nodes = all.size(); }
+    cpus.assign(nodes ? nodes : 1, std::vector<int>());
+    hostNode.assign(cpus.size(), -1);
+    for (size_t i=0; i<all.size(); ++i) { cpus[i % cpus.size()].push_back(all[i]); }
+    IndexCpus();
+  }
+
+  unsigned NodeCount() const { return cpus.size(); }
+
+  // Returns the NUMA node (index) of 'cpu' (0 if unknown).
+  unsigned NodeOfCpu(int cpu) const {
+    return cpu >= 0 && (size_t)cpu < cpuNode.size() && cpuNode[cpu] >= 0 ? cpuNode[cpu] : 0;
+  }
+
+  // Returns the NUMA node of the CPU the calling thread runs on (it may migrate right after).
+  unsigned CurrentNode() const { return NodeOfCpu(sched_getcpu()); }
+
+  // Restricts the calling thread to the CPUs of 'node'.
+  bool PinThread(unsigned node) const {
+    if (node >= cpus.size()) { return false; }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus[node]) { if (cpu < CPU_SETSIZE) { CPU_SET(cpu, &set); } }
+    return 0 == sched_setaffinity(0, sizeof(set), &set);
+  }
+
+  // Parses a "0-3,8,10-11" CPU list file.
+  static bool ReadCpuList(const char* path, std::vector<int>& list) {
+    FILE* f = fopen(path, "r");
+    if (!f) { return false; }
+    char buf[4096];
+    bool ok = NULL != fgets(buf, sizeof(buf), f);
+    fclose(f);
+    for (char* p = buf; ok && *p && *p != '\n'; ) {
+      char* end;
+      long first = strtol(p, &end, 10), last = first;
+      if (end == p) { return false; }
+      if (*end == '-') { p = end + 1; last = strtol(p, &end, 10); }
+      for (long c=first; c<=last; ++c) { list.push_back(c); }
+      p = (*end == ',') ? end + 1 : end;
+    }
+    return ok;
+  }
+
+private:
+  void IndexCpus() {
+    cpuNode.clear();
+    for (unsigned n=0; n<cpus.size(); ++n) {
+      for (int cpu : cpus[n]) {
+        if ((size_t)cpu >= cpuNode.size()) { cpuNode.resize(cpu + 1, -1); }
+        cpuNode[cpu] = n;
+      }
+    }
+  }
+};
+
+// Allocates 'size' bytes (page aligned) preferably from the memory of NUMA node 'node'
+// (the host's node number, -1 for anywhere). Falls back to any memory if the kernel won't place it.
+inline void* NumaAlloc(size_t size, int node) {
+  void* p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) { return NULL; }
+  if (node >= 0 && node < 1024) {
+    unsigned long mask[1024 / (8*sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8*sizeof(unsigned long))] |= 1ul << (node % (8*sizeof(unsigned long)));
+    // (before the pages are touched, so they're allocated there)
+    syscall(__NR_mbind, p, size, MPOL_PREFERRED, mask, 1024 + 1, 0);
+  }
+  return p;
+}
+inline void NumaFree(void* p, size_t size) { if (p) { munmap(p, size); } }
+
+// One IdNode (node-id block) per NUMA node, behind a per-node lock.
+// Threads get IDs from the IdNode of the socket they run on (sched_getcpu()),
+// so generator state stays in that socket's caches and memory, instead of
+// bouncing between sockets as with one IdNode shared by all threads.
+// Each IdNode is constructed and initialized by a thread pinned to its NUMA
+// node, in memory bound to that node (its own allocations are first-touched there).
+// Unlike IdNode, GetId() is thread-safe.
+class IdNumaPool {
+private:
+  struct alignas(64) Shard {
+    std::mutex lock;
+    IdNode     node;
+  };
+
+  NumaTopology        topo;
+  std::vector<Shard*> shards; // per NUMA node (index)
+
+public:
+  // Called on each IdNode before it's initialized (e.g. to set the multicast group).
+  std::function<void(IdNode&)> configure;
+
+  IdNumaPool() { }
+  ~IdNumaPool() { Close(); }
+
+  // Starts one IdNode per NUMA node (or 'simulate' pretend nodes, if not 0),
+  // owning 'count' node-ids each: firstNodeId, firstNodeId+count, ...
+  // Returns false if any of them failed to initialize.
+  bool Initialize(uint16_t firstNodeId, uint16_t count=1, unsigned simulate=0) {
+    Close();
+    if (simulate) { topo.Simulate(simulate); } else { topo.Discover(); }
+    unsigned n = topo.NodeCount();
+    if (count < 1 || firstNodeId + n*count > MAX_NODES) {
+      fprintf(stderr, "ERROR: Not enough node-ids for %u NUMA nodes (%u+%u each)\n", n, firstNodeId, count);
+      return false;
+    }
+    shards.assign(n, NULL);
+    std::vector<char> ok(n, 0);
+    std::vector<std::thread> starters;
+    for (unsigned s=0; s<n; ++s) {
+      starters.push_back(std::thread([this, s, firstNodeId, count, &ok]() {
+        topo.PinThread(s);
+        void* mem = NumaAlloc(sizeof(Shard), topo.hostNode[s]);
+        if (!mem) { return; }
+        shards[s] = new (mem) Shard();
+        if (configure) { configure(shards[s]->node); }
+        ok[s] = shards[s]->node.Initialize(firstNodeId + s*count, count);
+      }));
+    }
+    for (auto& t : starters) { t.join(); }
+    for (unsigned s=0; s<n; ++s) {
+      if (!ok[s]) {
+        fprintf(stderr, "ERROR: Failed to initialize the IdNode of NUMA node %u\n", s);
+        Close(); // stop the shards that did start
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void Close() {
+    for (Shard* shard : shards) {
+      if (!shard) { continue; }
+      shard->~Shard();
+      NumaFree(shard, sizeof(Shard));
+    }
+    shards.clear();
+  }
+
+  unsigned GetShardCount() const { return shards.size(); }
+  const NumaTopology& GetTopology() const { return topo; }
+
+  // The IdNode of NUMA node (index) 'shard' (lock it with GetLock() while in use, once the pool runs).
+  IdNode& GetNode(unsigned shard) { return shards[shard]->node; }
+  std::mutex& GetLock(unsigned shard) { return shards[shard]->lock; }
+
+  // Returns the shard the calling thread is routed to.
+  unsigned CurrentShard() const {
+    unsigned s = topo.CurrentNode();
+    return s < shards.size() ? s : 0;
+  }
+
+  // Returns true if an ID (in 'id') could be generated by the calling thread's NUMA node.
+  bool GetId(uint64_t& id) { return GetId(id, CurrentShard()); }
+
+  // Returns true if an ID could be generated by shard 'shard' (e.g. to measure remote access).
+  bool GetId(uint64_t& id, unsigned shard) {
+    if (shard >= shards.size() || !shards[shard]) { return false; }
+    std::lock_guard<std::mutex> guard(shards[shard]->lock);
+    return shards[shard]->node.GetId(id);
+  }
+
+  // Processes peer messages (and lease renewals) of every IdNode, for idle pools.
+  void Poll() {
+    for (Shard* shard : shards) {
+      if (!shard) { continue; }
+      std::lock_guard<std::mutex> guard(shard->lock);
+      shard->node.Poll();
+    }
+  }
+};
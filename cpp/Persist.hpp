@@ -0,0 +1,232 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Uring.hpp"
+
+#define PERSIST_MAX_RECORD 64  // largest record Submit() accepts
+#define PERSIST_SLOTS      32  // writes in flight
+
+// Asynchronous durable writes of small records: each write is followed by
+// fdatasync(), and only reported as complete once both are done.
+// Callers keep at most one write per file offset in flight (writes to the
+// same offset may otherwise be reordered).
+struct IdPersister {
+  virtual ~IdPersister() { }
+  virtual const char* Name() = 0;
+  // Starts writing 'len' bytes of 'buf' (copied) at 'offset' of file 'fd', followed by fdatasync().
+  // Returns false if too many writes are in flight (reap some first), or on errors.
+  virtual bool Submit(int fd, const void* buf, size_t len, off_t offset, uint64_t tag) = 0;
+  // Reaps one completed write (waiting up to 'waitUs' for it): its 'tag', and 'ok' if it's durable.
+  // Returns false if none completed.
+  virtual bool Reap(uint64_t& tag, bool& ok, int waitUs) = 0;
+
+  // Returns an io_uring persister if 'useUring' and the kernel allows it, otherwise a thread based one.
+  static IdPersister* Create(bool useUring=true);
+};
+
+// io_uring persister: a linked write + fdatasync pair per record, no threads.
+class UringPersister : public IdPersister {
+private:
+  struct Slot {
+    char     buf[PERSIST_MAX_RECORD];
+    size_t   len;
+    uint64_t tag;
+    bool     busy;
+    bool     failed;
+  };
+  IoUring           ring;
+  Slot              slots[PERSIST_SLOTS];
+  unsigned          inFlight;
+
+public:
+  UringPersister() : inFlight(0) { memset((void*)slots, 0, sizeof(slots)); }
+
+  // the kernel may still read the buffers, so wait for outstanding writes
+  ~UringPersister() {
+    uint64_t tag;
+    bool ok;
+    for (unsigned i=0; inFlight && i<1000; ++i) { Reap(tag, ok, 10000); }
+  }
+
+  bool Init() { return ring.Init(2*PERSIST_SLOTS); }
+
+  virtual const char* Name() { return "io_uring"; }
+
+  virtual bool Submit(int fd, const void* buf, size_t len, off_t offset, uint64_t tag) {
+    if (len > PERSIST_MAX_RECORD) { return false; }
+    unsigned s = 0;
+    while (s < PERSIST_SLOTS && slots[s].busy) { ++s; }
+    if (s == PERSIST_SLOTS) { return false; }
+    io_uring_sqe* write = ring.GetSqe();
+    io_uring_sqe* sync = write ? ring.GetSqe() : NULL;
+    if (!sync) { // (can't happen, the ring has room for every slot)
+      if (write) { ring.Discard(1); }
+      return false;
+    }
+    Slot& slot = slots[s];
+    memcpy(slot.buf, buf, len);
+    slot.len = len;
+    slot.tag = tag;
+    slot.failed = false;
+    write->opcode = IORING_OP_WRITE;
+    write->flags = IOSQE_IO_LINK;   // the sync only runs after the write succeeded
+    write->fd = fd;
+    write->addr = (uint64_t)(uintptr_t)slot.buf;
+    write->len = len;
+    write->off = offset;
+    write->user_data = 2*s;
+    sync->opcode = IORING_OP_FSYNC;
+    sync->fd = fd;
+    sync->fsync_flags = IORING_FSYNC_DATASYNC;
+    sync->user_data = 2*s + 1;
+    int ret = ring.Submit();
+    if (ret < 0) {
+      // nothing was submitted: take the pair back, the slot stays free
+      ring.Discard(2);
+      fprintf(stderr, "ERROR: io_uring submit failed (%s)!\n", strerror(-ret));
+      return false;
+    }
+    slot.busy = true;
+    ++inFlight;
+    return true;
+  }
+
+  virtual bool Reap(uint64_t& tag, bool& ok, int waitUs) {
+    io_uring_cqe cqe;
+    while (ring.Reap(cqe, waitUs)) {
+      Slot& slot = slots[cqe.user_data / 2];
+      bool write = 0 == cqe.user_data % 2;
+      // (a failed write cancels its sync)
+      if (cqe.res < 0 || (write && cqe.res != (int)slot.len)) { slot.failed = true; }
+      if (write) { continue; } // wait for its sync
+      tag = slot.tag;
+      ok = !slot.failed;
+      slot.busy = false;
+      --inFlight;
+      return true;
+    }
+    return false;
+  }
+};
+
+// Fallback persister: a background thread does the writes, and one fdatasync()
+// per file for everything queued up meanwhile (group commit).
+class ThreadPersister : public IdPersister {
+private:
+  struct Job {
+    int      fd;
+    char     buf[PERSIST_MAX_RECORD];
+    size_t   len;
+    off_t    offset;
+    uint64_t tag;
+    bool     ok;
+  };
+  std::mutex              mutex;
+  std::condition_variable wake;  // new jobs (or stopping)
+  std::condition_variable done;  // completed jobs
+  std::deque<Job>         queue;
+  std::deque<Job>         completed;
+  unsigned                inFlight;
+  bool                    stop;
+  std::thread             worker;
+
+public:
+  ThreadPersister() : inFlight(0), stop(false) {
+    worker = std::thread(&ThreadPersister::Run, this);
+  }
+  ~ThreadPersister() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    wake.notify_one();
+    worker.join();
+  }
+
+  virtual const char* Name() { return "thread"; }
+
+  virtual bool Submit(int fd, const void* buf, size_t len, off_t offset, uint64_t tag) {
+    if (len > PERSIST_MAX_RECORD) { return false; }
+    Job job;
+    job.fd = fd;
+    memcpy(job.buf, buf, len);
+    job.len = len;
+    job.offset = offset;
+    job.tag = tag;
+    job.ok = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (inFlight >= PERSIST_SLOTS) { return false; }
+      ++inFlight;
+      queue.push_back(job);
+    }
+    wake.notify_one();
+    return true;
+  }
+
+  virtual bool Reap(uint64_t& tag, bool& ok, int waitUs) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (completed.empty() && waitUs) {
+      if (waitUs < 0) {
+        done.wait(lock, [this]() { return !completed.empty(); });
+      } else {
+        done.wait_for(lock, std::chrono::microseconds(waitUs), [this]() { return !completed.empty(); });
+      }
+    }
+    if (completed.empty()) { return false; }
+    tag = completed.front().tag;
+    ok = completed.front().ok;
+    completed.pop_front();
+    --inFlight;
+    return true;
+  }
+
+private:
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      wake.wait(lock, [this]() { return stop || !queue.empty(); });
+      if (queue.empty()) { return; } // stopping, and nothing left
+      std::deque<Job> batch;
+      batch.swap(queue);
+      lock.unlock();
+      std::vector<int> fds;
+      for (Job& job : batch) {
+        job.ok = (ssize_t)job.len == pwrite(job.fd, job.buf, job.len, job.offset);
+        bool seen = false;
+        for (int fd : fds) { seen = seen || fd == job.fd; }
+        if (!seen) { fds.push_back(job.fd); }
+      }
+      for (int fd : fds) {
+        bool synced = 0 == fdatasync(fd);
+        for (Job& job : batch) {
+          if (job.fd == fd) { job.ok = job.ok && synced; }
+        }
+      }
+      lock.lock();
+      completed.insert(completed.end(), batch.begin(), batch.end());
+      done.notify_all();
+    }
+  }
+};
+
+inline IdPersister* IdPersister::Create(bool useUring) {
+  if (useUring) {
+    UringPersister* uring = new UringPersister();
+    if (uring->Init()) { return uring; }
+    delete uring;
+    fprintf(stderr, "NOTICE: io_uring unavailable, persisting with a thread.\n");
+  }
+  return new ThreadPersister();
+}
@@ -0,0 +1,95 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+#pragma once
+
+#include <stdint.h>
+
+// USDT (user-level statically defined tracing) probes, for bpftrace, perf,
+// SystemTap and friends, e.g.:
+//   bpftrace -l 'usdt:./client:distid:*'
+//   bpftrace trace_getid.bt ./client
+// Each probe compiles to a single nop, plus an ELF note (.note.stapsdt) that
+// tells the tracer where the nop is and where its arguments live; attaching
+// turns the nop into a breakpoint. Arguments are only moved into registers
+// (or left in place), so keep them cheap to compute.
+// Uses <sys/sdt.h> (systemtap-sdt-dev) when it's installed, otherwise emits the
+// same notes itself (x86-64 and aarch64, GCC or clang). Elsewhere, or built with
+// -DDISTID_NO_PROBES, the probes are compiled out.
+// All probes are in provider "distid", arguments are 64-bit.
+
+#if defined(DISTID_NO_PROBES)
+#define DISTID_PROBES 0
+#elif defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define DISTID_PROBES 1
+#define DISTID_PROBE0(name) DTRACE_PROBE(distid, name)
+#define DISTID_PROBE1(name, a) DTRACE_PROBE1(distid, name, (uint64_t)(a))
+#define DISTID_PROBE2(name, a, b) DTRACE_PROBE2(distid, name, (uint64_t)(a), (uint64_t)(b))
+#define DISTID_PROBE3(name, a, b, c) DTRACE_PROBE3(distid, name, (uint64_t)(a), (uint64_t)(b), (uint64_t)(c))
+#define DISTID_PROBE4(name, a, b, c, d) \
+  DTRACE_PROBE4(distid, name, (uint64_t)(a), (uint64_t)(b), (uint64_t)(c), (uint64_t)(d))
+#endif
+#endif
+
+#if !defined(DISTID_PROBES) && defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+#define DISTID_PROBES 1
+// The stapsdt note (version 3): probe address, base address (for prelinked
+// binaries), semaphore (none), provider, name, and the argument locations
+// ("8@%rdi", "8@-16(%rbp)", "8@$5" on x86-64).
+#define DISTID_SDT_NOTE(name, args) \
+  "990: nop\n" \
+  ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+  ".balign 4\n" \
+  ".4byte 992f-991f, 994f-993f, 3\n" \
+  "991: .asciz \"stapsdt\"\n" \
+  "992: .balign 4\n" \
+  "993: .8byte 990b\n" \
+  ".8byte _.stapsdt.base\n" \
+  ".8byte 0\n" \
+  ".asciz \"distid\"\n" \
+  ".asciz \"" name "\"\n" \
+  ".asciz \"" args "\"\n" \
+  "994: .balign 4\n" \
+  ".popsection\n" \
+  ".ifndef _.stapsdt.base\n" \
+  ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+  ".weak _.stapsdt.base\n" \
+  ".hidden _.stapsdt.base\n" \
+  "_.stapsdt.base: .space 1\n" \
+  ".size _.stapsdt.base, 1\n" \
+  ".popsection\n" \
+  ".endif\n"
+#define DISTID_SDT_ARG(a) "nor"((uint64_t)(a))
+#define DISTID_PROBE0(name) __asm__ __volatile__(DISTID_SDT_NOTE(#name, ""))
+#define DISTID_PROBE1(name, a) __asm__ __volatile__(DISTID_SDT_NOTE(#name, "8@%0") :: DISTID_SDT_ARG(a))
+#define DISTID_PROBE2(name, a, b) \
+  __asm__ __volatile__(DISTID_SDT_NOTE(#name, "8@%0 8@%1") :: DISTID_SDT_ARG(a), DISTID_SDT_ARG(b))
+#define DISTID_PROBE3(name, a, b, c) \
+  __asm__ __volatile__(DISTID_SDT_NOTE(#name, "8@%0 8@%1 8@%2") :: DISTID_SDT_ARG(a), DISTID_SDT_ARG(b), DISTID_SDT_ARG(c))
+#define DISTID_PROBE4(name, a, b, c, d) \
+  __asm__ __volatile__(DISTID_SDT_NOTE(#name, "8@%0 8@%1 8@%2 8@%3") \
+    :: DISTID_SDT_ARG(a), DISTID_SDT_ARG(b), DISTID_SDT_ARG(c), DISTID_SDT_ARG(d))
+#endif
+
+#if !defined(DISTID_PROBES) || !DISTID_PROBES
+#undef DISTID_PROBES
+#define DISTID_PROBES 0
+#define DISTID_PROBE0(name) do { } while (0)
+#define DISTID_PROBE1(name, a) do { } while (0)
+#define DISTID_PROBE2(name, a, b) do { } while (0)
+#define DISTID_PROBE3(name, a, b, c) do { } while (0)
+#define DISTID_PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+// Probes (arguments):
+//   get_id_entry      (node-id)                       IdNode::GetId() and GetPriorityId() (not GetIds())
+//   get_id_exit       (node-id, id, ok)
+//   counter_wrap      (node-id, counter, timestamp)   a shard needs a new timestamp
+//   throttle          (node-id, retry, timestamp)     the millisecond is used up, sleeping 0.1 ms
+//   throttle_fail     (node-id, timestamp)            gave up waiting for the next millisecond
+//   clock_backwards   (now, timestamp)                the clock is behind the high-water mark
+//   message           (mode, node-id, timestamp, from-port)  a peer message ('mode' is a C string)
+//   collision         (node-id, from-port)            another node uses an owned node-id
+//   store_read        (index, ok)                     StructArrayStore reads and writes
+//   store_write       (index, ok)
@@ -0,0 +1,301 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/select.h>
+
+#include <string>
+#include <vector>
+
+#include "DistId.hpp"
+
+#define RELAY_ADDR "0.0.0.0:26982"
+// state changes are collected this long before a digest goes out to the other relays
+// (requests, and answers to relayed requests, go out at once)
+#ifndef RELAY_DIGEST_MS
+#  define RELAY_DIGEST_MS 5
+#endif
+
+// Multicast relay (gateway) between subnets (or datacenters), one per subnet.
+// Peer messages are multicast with a TTL of 3, so a cluster spanning networks
+// that don't route multicast is split into groups that can't hear each other.
+// A relay joins its local group (as an IdNode would, through SocketTransport),
+// and keeps the newest UP/HW record of every node-id it hears there. Records
+// that tell something new (a newer high-water mark, or another instance) are
+// collected for RELAY_DIGEST_MS, at most one per node-id, and sent to the other
+// relays over unicast UDP as a digest: an IdSnapshot (mode "RD") with the
+// records, in their original modes. The other relays multicast them to their
+// own groups, where nodes store them (UP) or use them (HW) as if they came from
+// a local peer. Repeated state (e.g. every peer's HW answer to a request, or
+// the records a relay multicasts itself) goes nowhere, so the traffic between
+// relays grows with the number of changes, not with the number of nodes.
+// Requests (RQ, CL) are relayed at once, and so are the answers to them (for a
+// listen window, even if they repeat known state), so starting nodes find owners
+// (collisions) and high-water marks in other subnets within their listen window.
+// Relays only forward what they heard locally (one hop, over a full mesh of
+// relays), so nothing loops. A starting relay says hello ("RH") to the others,
+// which answer with everything they heard locally. Snapshot requests (SQ) aren't
+// relayed, as every node's table already holds the whole cluster.
+class IdRelay {
+public:
+  struct Stats {
+    uint64_t localIn;   // messages heard from the local group (not counting our own)
+    uint64_t dropped;   // local UP/HW messages with nothing new
+    uint64_t forwarded; // records sent to the other relays (once per digest, not per relay)
+    uint64_t digestsOut; // digests sent (to each relay)
+    uint64_t digestsIn; // valid digests received
+    uint64_t invalid;   // invalid datagrams from relays
+    uint64_t injected;  // records multicast to the local group
+
+    Stats() { memset(this, 0, sizeof(*this)); }
+  };
+
+private:
+  SocketTransport transport;   // the local group
+  UDPSocket    link;           // digests from (and to) the other relays
+  IPAddress    local;          // the transport's sending address (our own multicasts come from it)
+  std::vector<IPAddress>   peers;   // the other relays
+  std::vector<IdNodeState> table;   // per node-id, the newest record heard (locally, or from relays)
+  std::vector<bool>        heardHere; // per node-id, the record in 'table' was heard locally
+  std::vector<uint64_t>    askedMs; // per node-id, when a relayed request for it was multicast here
+  std::vector<uint64_t>    requestedMs; // per node-id, when a local request for it was relayed
+  std::vector<IdNodeState> pending; // records for the next digest
+  std::vector<int>         pendingIndex; // per node-id, its UP/HW record in 'pending' (-1 if none)
+  uint64_t     pendingSinceMs; // when the oldest pending record was added
+  bool         urgent;         // send the digest at once
+  IdNodeState  self;           // the relay's identity (header of its digests)
+  Stats        stats;
+
+  // Returns true if node-id 'id' had a request within the last listen window (at 'ms').
+  static bool Recent(const std::vector<uint64_t>& requests, uint16_t id, uint64_t now) {
+    return requests[id] && now < requests[id] + LISTEN_TIME;
+  }
+
+  // Returns true if 'rec' tells more than 'prev' (a newer high-water mark, or another instance).
+  static bool IsNews(const IdNodeState& rec, const IdNodeState& prev) {
+    if (!prev.timestamp || rec.timestamp > prev.timestamp) { return true; }
+    return rec.HasMode("UP") && rec.instance && !rec.SameInstance(prev);
+  }
+
+  // Queues 'rec' for the next digest (replacing an older record of its node-id).
+  void Queue(const IdNodeState& rec, bool now) {
+    bool request = rec.HasMode("RQ") || rec.HasMode("CL");
+    if (!request && pendingIndex[rec.id] >= 0) {
+      pending[pendingIndex[rec.id]] = rec;
+    } else {
+      if (!request) { pendingIndex[rec.id] = pending.size(); }
+      if (pending.empty()) { pendingSinceMs = IdNode::GetMonoTimestampMs(); }
+      pending.push_back(rec);
+    }
+    urgent = urgent || now;
+    if (pending.size() >= MAX_NODES) { SendDigest(); }
+  }
+
+  // Handles message 'buf' ('len' bytes) from the local group.
+  void HandleLocal(const char* buf, int len, const IPAddress& from) {
+    // (our own multicasts loop back)
+    if (local.IsAny() ? local.GetPort() == from.GetPort() : local == from) { return; }
+    IdNodeState rec;
+    if (!rec.Decode(buf, len) || rec.id >= MAX_NODES) { return; }
+    ++stats.localIn;
+    uint64_t now = IdNode::GetMonoTimestampMs();
+    if (rec.HasMode("RQ") || rec.HasMode("CL")) {
+      if (debug) { fprintf(stderr, "INFO: Relaying a request for node %u.\n", rec.id); }
+      requestedMs[rec.id] = now;
+      Queue(rec, true);
+      return;
+    }
+    if (!rec.HasMode("UP") && !rec.HasMode("HW")) { return; }
+    // (answers to relayed requests repeat what's known, but the requester doesn't know it yet)
+    bool answer = Recent(askedMs, rec.id, now);
+    if (!answer && !IsNews(rec, table[rec.id])) {
+      ++stats.dropped;
+      return;
+    }
+    table[rec.id] = rec;
+    heardHere[rec.id] = true;
+    if (debug) { fprintf(stderr, "INFO: Relaying node %u (timestamp %" PRIu64 ")%s.\n", rec.id, rec.timestamp, answer ? ", an answer" : ""); }
+    Queue(rec, answer);
+  }
+
+  // Handles datagram 'buf' ('len' bytes) from relay 'from': a digest, or a hello.
+  void HandleRelay(char* buf, int len, const IPAddress& from) {
+    IdSnapshot hdr;
+    bool valid = len >= (int)sizeof(hdr);
+    if (valid) {
+      // (the checksum covers the datagram with its own field 0)
+      memcpy(&hdr, buf, sizeof(hdr));
+      uint64_t checksum = hdr.checksum;
+      memset(buf + offsetof(IdSnapshot, checksum), 0, sizeof(checksum));
+      valid = checksum == IdSnapshot::Checksum(buf, len) && hdr.count <= MAX_NODES &&
+              len == (int)(sizeof(hdr) + hdr.count*sizeof(IdNodeState)) && (hdr.from.HasMode("RD") || hdr.from.HasMode("RH"));
+    }
+    if (!valid) {
+      std::string addr;
+      IPAddress(from).GetString(addr);
+      fprintf(stderr, "ERROR: Invalid relay digest (%d bytes from %s)!\n", len, addr.c_str());
+      ++stats.invalid;
+      return;
+    }
+    ++stats.digestsIn;
+    if (debug) { fprintf(stderr, "INFO: Received relay %s (%u records).\n", hdr.from.HasMode("RH") ? "hello" : "digest", hdr.count); }
+    if (hdr.from.HasMode("RH")) {
+      // a (re)started relay, tell it everything heard here
+      std::vector<IdNodeState> recs;
+      for (unsigned i=0; i<MAX_NODES; ++i) {
+        if (heardHere[i] && table[i].timestamp) { recs.push_back(table[i]); }
+      }
+      SendDigest(from, "RD", recs);
+    }
+    uint64_t now = IdNode::GetMonoTimestampMs();
+    for (unsigned i=0; i<hdr.count; ++i) {
+      IdNodeState rec;
+      memcpy(&rec, buf + sizeof(hdr) + i*sizeof(rec), sizeof(rec));
+      if (rec.id >= MAX_NODES) { continue; }
+      if (rec.HasMode("RQ") || rec.HasMode("CL")) {
+        askedMs[rec.id] = now;
+      } else if (IsNews(rec, table[rec.id])) {
+        table[rec.id] = rec;
+        heardHere[rec.id] = false;
+      } else if (!Recent(requestedMs, rec.id, now)) {
+        continue;
+      }
+      ++stats.injected;
+      transport.Send((const char*)&rec, sizeof(rec));
+    }
+    transport.Flush();
+  }
+
+  // Sends 'recs' to relay 'to', in mode 'mode': one datagram per SNAPSHOT_CHUNK_RECORDS records
+  // (each a digest of its own, so none is fragmented), or an empty one.
+  bool SendDigest(const IPAddress& to, const char* mode, const std::vector<IdNodeState>& recs) {
+    IdSnapshot hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.from = self;
+    hdr.from.timestamp = IdNode::GetRtTimestampMs();
+    hdr.from.SetMode(mode);
+    IPAddress dest = to;
+    ++stats.digestsOut;
+    bool sent = true;
+    size_t first = 0;
+    do {
+      hdr.count = std::min(recs.size() - first, (size_t)SNAPSHOT_CHUNK_RECORDS);
+      hdr.checksum = 0;
+      std::vector<char> buf(sizeof(hdr) + hdr.count*sizeof(IdNodeState));
+      memcpy(&buf[0], &hdr, sizeof(hdr));
+      if (hdr.count) { memcpy(&buf[sizeof(hdr)], &recs[first], hdr.count*sizeof(IdNodeState)); }
+      hdr.checksum = IdSnapshot::Checksum(&buf[0], buf.size());
+      memcpy(&buf[0], &hdr, sizeof(hdr));
+      // (not UDPSocket::WriteTo(), which closes the socket if a single send fails)
+      sent = (ssize_t)buf.size() == sendto(link.sock, &buf[0], buf.size(), 0, dest.GetSockAddr(), dest.GetLength()) && sent;
+      first += hdr.count;
+    } while (first < recs.size());
+    return sent;
+  }
+
+  // Sends the pending records to all other relays.
+  void SendDigest() {
+    if (pending.empty()) { return; }
+    for (const IPAddress& peer : peers) { SendDigest(peer, "RD", pending); }
+    stats.forwarded += pending.size();
+    for (const IdNodeState& rec : pending) { pendingIndex[rec.id] = -1; }
+    pending.clear();
+    urgent = false;
+  }
+
+  // Waits up to 'waitUs' microseconds for datagrams on the local group or the relay link.
+  // Returns a bitmask of the ready ones (1 local, 2 link).
+  int Wait(int waitUs) {
+    timeval howlong = { waitUs / 1000000, waitUs % 1000000 };
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(transport.mcSocket.sock, &fds);
+    FD_SET(link.sock, &fds);
+    int maxFd = transport.mcSocket.sock > link.sock ? transport.mcSocket.sock : link.sock;
+    if (select(maxFd + 1, &fds, NULL, NULL, &howlong) <= 0) { return 0; }
+    return (FD_ISSET(transport.mcSocket.sock, &fds) ? 1 : 0) | (FD_ISSET(link.sock, &fds) ? 2 : 0);
+  }
+
+public:
+  IdRelay() : table(MAX_NODES), heardHere(MAX_NODES, false), askedMs(MAX_NODES, 0), requestedMs(MAX_NODES, 0),
+      pendingIndex(MAX_NODES, -1), pendingSinceMs(0), urgent(false) {
+    memset((void*)&table[0], 0, sizeof(IdNodeState)*MAX_NODES);
+    memset(&self, 0, sizeof(self));
+  }
+
+  // Options of the local group (before Open()): multicast group "addr:port", and interface.
+  void SetMulticastAddress(const char* addr) { transport.mcAddressStr = addr; }
+  bool SetInterface(const char* ifname) { return transport.iface.Lookup(ifname); }
+
+  // Joins the local group, and opens the relay socket at 'addr' (e.g. "0.0.0.0:26982",
+  // port 0 picks a free port).
+  bool Open(const char* addr) {
+    if (0 != link.address.SetAddress(addr) || 0 != link.Open()) {
+      fprintf(stderr, "ERROR: Failed to open relay socket (%s)\n", addr);
+      return false;
+    }
+    if (!transport.Open(local)) { return false; }
+    IPAddress bound;
+    link.GetAddress(bound);
+    self.SetAddress(bound);
+    self.version = STATE_VERSION;
+    self.instance = IdNode::Mix64(IdNode::GetRtTimestampMs() ^ ((uint64_t)getpid() << 32) ^ bound.GetPort());
+    return true;
+  }
+
+  // Returns the bound address of the relay socket (with the actual port).
+  bool GetAddress(IPAddress& addr) { return link.GetAddress(addr); }
+
+  // Adds another relay ("addr:port"), and says hello to it (it answers with what it knows).
+  bool AddPeer(const char* addr) {
+    IPAddress peer;
+    if (0 != peer.SetAddress(addr)) {
+      fprintf(stderr, "ERROR: Invalid relay address (%s)\n", addr);
+      return false;
+    }
+    peers.push_back(peer);
+    return SendDigest(peer, "RH", std::vector<IdNodeState>());
+  }
+
+  // Returns the newest record of node-id 'id' the relay knows of (timestamp 0 if none).
+  const IdNodeState& GetRecord(uint16_t id) const { return table[id % MAX_NODES]; }
+
+  const Stats& GetStats() const { return stats; }
+
+  // Waits up to 'waitUs' (>= 0) microseconds for messages, handles all queued ones,
+  // and sends the digest when it's due.
+  // Returns true if any message was handled.
+  bool Poll(int waitUs) {
+    bool any = false;
+    char buf[SNAPSHOT_MAX_SIZE];
+    while (true) {
+      if (!pending.empty()) {
+        uint64_t dueMs = pendingSinceMs + RELAY_DIGEST_MS, now = IdNode::GetMonoTimestampMs();
+        if (urgent || now >= dueMs) {
+          SendDigest();
+        } else if ((uint64_t)waitUs > (dueMs - now) * 1000) {
+          waitUs = (dueMs - now) * 1000;
+        }
+      }
+      int ready = Wait(waitUs);
+      if (!ready) { break; }
+      waitUs = 0;
+      any = true;
+      IPAddress from;
+      if (ready & 1) {
+        int read = transport.Read(buf, sizeof(buf), from);
+        if (read > 0) { HandleLocal(buf, read, from); }
+      }
+      if (ready & 2) {
+        int read = link.Read(buf, sizeof(buf), from);
+        if (read > 0) { HandleRelay(buf, read, from); }
+      }
+    }
+    if (!pending.empty() && (urgent || IdNode::GetMonoTimestampMs() >= pendingSinceMs + RELAY_DIGEST_MS)) { SendDigest(); }
+    return any;
+  }
+};
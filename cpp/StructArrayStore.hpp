@@ -1,5 +1,7 @@
 // Copyright 2020, Tim Crowder, All rights reserved.
 
+#pragma once
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -10,10 +12,15 @@
 
 #include <string>
 #include <type_traits>
+#include <vector>
+
+#include "Probes.hpp"
 
 // File-based storage for a fixed-size array of uniformly-sized structured data elements.
 // Provides functions to individually read and write individual elements.
 // New files are zero-padded.
+// Can also be kept in memory only (e.g. for simulations), optionally in a 
+// caller-owned vector, so the contents outlive the store.
 template<typename S> class StructArrayStore {
   // ensure it's a "plain-old-data" type...
   static_assert(std::is_pod<S>::value, "S must be POD");
@@ -21,20 +28,26 @@ private:
   int fd;
   unsigned size;
   std::string name;
+  std::vector<S>  own; // records, when in memory (and not caller-owned)
+  std::vector<S>* mem; // records, when in memory
 
 public:
-  StructArrayStore() : fd(-1) { }
+  StructArrayStore() : fd(-1), size(0), mem(NULL) { }
   ~StructArrayStore() { Close(); }
 
   void Close() {
     if (fd >= 0) { close(fd); }
     fd = -1;
+    mem = NULL;
+    own.clear();
   }
 
   // Open the StructArrayStore for reading and writing.
-  //   fname - filename for storage
+  //   fname - filename for storage (NULL to keep it in memory only)
   //   size  - the number of records to store
   bool Open(const char* fname, unsigned size) {
+    Close();
+    if (!fname) { return Open(own, size); }
     name = fname;
     this->size = size;
     fd = open(fname, O_RDWR);
@@ -50,10 +63,33 @@ public:
       for (unsigned i=0; i<size; ++i) {
         Write(*(S*)buf, i);
       }
+    } else {
+      // existing file, make sure it was written with the same record size
+      struct stat st;
+      if (0 != fstat(fd, &st) || st.st_size != (off_t)(sizeof(S)*size)) {
+        fprintf(stderr, "ERROR: StructArrayStore '%s' has unexpected size (record size changed?) !\n", fname);
+        Close();
+        return false;
+      }
     }
     return true;
   }
 
+  // Open the StructArrayStore in memory, using (and keeping) the records in 'records'.
+  // 'records' is zero-padded to 'size' elements, and must outlive the store.
+  bool Open(std::vector<S>& records, unsigned size) {
+    if (&records != &own) { Close(); }
+    name = "<memory>";
+    this->size = size;
+    if (records.size() < size) {
+      S zero;
+      memset((void*)&zero, 0, sizeof(S));
+      records.resize(size, zero);
+    }
+    mem = &records;
+    return true;
+  }
+
   // Reads a single entry from the file by array index.
   // Returns true on success.
   //   'entry' - the data element to fill with data from the file.
@@ -63,7 +99,9 @@ public:
       fprintf(stderr, "ERROR: Invalid StructArrayStore read index (%u vs %u)\n", index, size);
       return false;
     }
+    if (mem) { entry = (*mem)[index]; return true; }
     ssize_t ret = pread(fd, (void*)&entry, sizeof(S), sizeof(S)*index);
+    DISTID_PROBE2(store_read, index, ret == sizeof(S));
     return ret == sizeof(S);
   }
 
@@ -76,10 +114,23 @@ public:
       fprintf(stderr, "ERROR: Invalid StructArrayStore write index (%u vs %u)\n", index, size);
       return false;
     }
+    if (mem) { (*mem)[index] = entry; return true; }
     // TODO add checksum or duplicate record to catch write-tearing on unclean shutdown
     ssize_t ret = pwrite(fd, (const void*)&entry, sizeof(S), sizeof(S)*index);
     //if (flush) { fsync(fd); }
+    DISTID_PROBE2(store_write, index, ret == sizeof(S));
     return ret == sizeof(S);
   }
+
+  // Returns the file descriptor (-1 if in memory), and the file offset of entry 'index'.
+  int GetFd() const { return mem ? -1 : fd; }
+  off_t GetOffset(unsigned index) const { return (off_t)sizeof(S)*index; }
+
+  // Flushes written entries to stable storage (e.g. before acknowledging them).
+  // Returns true on success.
+  bool Sync() {
+    if (mem) { return true; }
+    return fd >= 0 && 0 == fdatasync(fd);
+  }
 };
 
@@ -1,5 +1,7 @@
 // Copyright 2020, Tim Crowder, All rights reserved.
 
+#pragma once
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -10,6 +12,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <ifaddrs.h>
 #include <netdb.h>
 #include <net/if.h>
 #include <netinet/in.h>
@@ -22,7 +25,10 @@
 
 typedef sockaddr       SOCKADDR;
 typedef sockaddr_in    SOCKADDR_IN;
+typedef sockaddr_in6   SOCKADDR_IN6;
+typedef sockaddr_storage SOCKADDR_STORAGE;
 typedef struct ip_mreq MREQ; 
+typedef struct ipv6_mreq MREQ6; 
 typedef int            SOCKET;
 typedef hostent        HOSTENT;
 typedef in_addr        IN_ADDR; 
@@ -32,55 +38,95 @@ typedef void*          SOCKBUF_P;
 typedef const void*    SOCKOPT_P;
 
 // WARNING: there is a nasty bug in inet_ntop that uses one extra byte
-//#define ADDR_STRLEN     (INET6_ADDRSTRLEN+1)
-#define ADDR_STRLEN      (INET_ADDRSTRLEN+1)  
+#define ADDR_STRLEN     (INET6_ADDRSTRLEN+1)
+//#define ADDR_STRLEN      (INET_ADDRSTRLEN+1)  
 #define INVALID_SOCKET   -1
 #define SOCKET_ERROR     -1
 #define closesocket      close
 
 
+// An IPv4 or IPv6 socket address.
+// 'ip' is the IPv4 view, 'ip6' the IPv6 view, of the same storage.
 class IPAddress {
 public:
-  SOCKADDR_IN ip;
+  union {
+    SOCKADDR_IN      ip;
+    SOCKADDR_IN6     ip6;
+    SOCKADDR_STORAGE ss;
+  };
 
 public:
   IPAddress(const char* addr=NULL, int port=-1) {
-    memset(&ip, 0, sizeof(ip));
+    memset(&ss, 0, sizeof(ss));
+    ip.sin_family = AF_INET;
     SetPort(port);
     if (addr) { SetAddress(addr); }
   }
-  virtual ~IPAddress() {
+  IPAddress(const IPAddress& other) {
+    memcpy(&ss, &other.ss, sizeof(ss));
+  }
+  IPAddress& operator=(const IPAddress& other) {
+    memcpy(&ss, &other.ss, sizeof(ss));
+    return *this;
+  }
+  ~IPAddress() {
   }
 
-  bool operator==(IPAddress& other) {
+  bool operator==(const IPAddress& other) const {
+    if (GetFamily() != other.GetFamily()) { return false; }
+    if (IsV6()) {
+      return
+        (0 == memcmp(&ip6.sin6_addr, &other.ip6.sin6_addr, sizeof(ip6.sin6_addr))) &&
+        (ip6.sin6_port == other.ip6.sin6_port);
+    }
     return 
       (ip.sin_addr.s_addr == other.ip.sin_addr.s_addr) &&
       (ip.sin_port == other.ip.sin_port);
   }
-  bool operator!=(IPAddress& other) {
+  bool operator!=(const IPAddress& other) const {
     return ! (*this == other);
   }
 
-  virtual uint16_t GetPort() const { 
-    return htons(ip.sin_port);
+  int  GetFamily() const { return ss.ss_family; }
+  bool IsV6() const { return ss.ss_family == AF_INET6; }
+  // size of the sockaddr, for bind/sendto/etc.
+  SOCKLEN_T GetLength() const { return IsV6() ? sizeof(ip6) : sizeof(ip); }
+  SOCKADDR* GetSockAddr() { return (SOCKADDR*)&ss; }
+  // true for the wildcard address (0.0.0.0 or ::)
+  bool IsAny() const {
+    if (IsV6()) { return IN6_IS_ADDR_UNSPECIFIED(&ip6.sin6_addr); }
+    return ip.sin_addr.s_addr == htonl(INADDR_ANY);
   }
-  virtual void SetPort(int port) { 
-    ip.sin_port = ntohs(port);
+
+  uint16_t GetPort() const { 
+    return htons(IsV6() ? ip6.sin6_port : ip.sin_port);
+  }
+  void SetPort(int port) { 
+    if (IsV6()) { ip6.sin6_port = ntohs(port); }
+    else        { ip.sin_port = ntohs(port); }
   }
-  virtual int SetPort(const char* portStr) {
+  int SetPort(const char* portStr) {
     int tmpPort = strtol(portStr, NULL, 10);
     if (tmpPort >=0) { 
       SetPort(tmpPort);
     } else { fprintf(stderr, "IPAddress - Invalid port value '%d'\n", tmpPort); }
     return tmpPort;
   }
-  // sets the address and port from "a.b.c.d:port" form
-  virtual int SetAddress(const char* addr) {
+  // sets the address and port from "a.b.c.d:port", "[v6addr]:port" or "v6addr" form
+  // (an IPv6 address may have a "%interface" scope suffix)
+  int SetAddress(const char* addr) {
     if (!addr) { return -1; }
     // parse out {"a.b.c.d"|"host.domain"} ":" "port"
     if (!(addr && addr[0])) { return -1; }
+    if (addr[0] == '[' || (strchr(addr, ':') != strrchr(addr, ':'))) {
+      return SetAddress6(addr);
+    }
     char* colonp = (char*)strchr(addr, ':');
     std::string addrOnlyStr(addr);
+    uint16_t port = GetPort();
+    memset(&ss, 0, sizeof(ss));
+    ip.sin_family = AF_INET;
+    SetPort(port);
     if (colonp) {
       addrOnlyStr.assign(addr, colonp-addr);
       if (SetPort(colonp + 1) < 0) {
@@ -117,12 +163,131 @@ public:
     return 0;
   }
 
-  virtual void GetString(std::string& addr) { // dotted numeric address
+  // sets an IPv6 address (and port) from "[v6addr%scope]:port" or "v6addr" form.
+  int SetAddress6(const char* addr) {
+    std::string addrOnlyStr(addr);
+    uint16_t port = GetPort();
+    memset(&ss, 0, sizeof(ss));
+    ip6.sin6_family = AF_INET6;
+    SetPort(port);
+    if (addr[0] == '[') {
+      const char* close = strchr(addr, ']');
+      if (!close) {
+        fprintf(stderr, "IPAddress - Invalid IPv6 address '%s'\n", addr);
+        return -1;
+      }
+      addrOnlyStr.assign(addr+1, close-addr-1);
+      if (close[1] == ':' && SetPort(close + 2) < 0) {
+        fprintf(stderr, "IPAddress - Invalid port string '%s'\n", close+1);
+        return -1;
+      }
+    }
+    size_t pct = addrOnlyStr.find('%');
+    if (pct != std::string::npos) {
+      ip6.sin6_scope_id = if_nametoindex(addrOnlyStr.c_str() + pct + 1);
+      addrOnlyStr.resize(pct);
+    }
+    if (addrOnlyStr == "*") {
+      ip6.sin6_addr = in6addr_any;
+    } else if (1 != inet_pton(AF_INET6, addrOnlyStr.c_str(), &ip6.sin6_addr)) {
+      fprintf(stderr, "IPAddress - Invalid IPv6 address '%s'\n", addrOnlyStr.c_str());
+      return 1;
+    }
+    return 0;
+  }
+
+  void GetString(std::string& addr) { // dotted numeric address
     char buf[ADDR_STRLEN];
+    if (IsV6()) {
+      inet_ntop(AF_INET6, (void*)&ip6.sin6_addr, buf, ADDR_STRLEN-1);
+      addr="["; addr+=buf; addr+="]:"; addr+=std::to_string(GetPort());
+      return;
+    }
     inet_ntop(AF_INET, (void*)&ip.sin_addr, buf, ADDR_STRLEN-1);
     addr=buf; addr+=":"; addr+=std::to_string(htons(ip.sin_port));
   }
-  virtual bool IsMulticast() { return IN_MULTICAST(ntohl(ip.sin_addr.s_addr)); }
+  bool IsMulticast() { 
+    if (IsV6()) { return IN6_IS_ADDR_MULTICAST(&ip6.sin6_addr); }
+    return IN_MULTICAST(ntohl(ip.sin_addr.s_addr)); 
+  }
+};
+
+
+// A local network interface, to pin multicast traffic to (e.g. a specific NIC).
+struct NetInterface {
+  std::string name;
+  unsigned    index;  // interface index (0 is "any")
+  in_addr     addr4;  // primary IPv4 address (INADDR_ANY if none)
+  in6_addr    addr6;  // preferred IPv6 address (global over link-local, :: if none)
+
+  NetInterface() : index(0) {
+    addr4.s_addr = htonl(INADDR_ANY);
+    addr6 = in6addr_any;
+  }
+
+  bool IsSet() const { return index != 0; }
+
+  // Look up the interface 'ifname' (e.g. "eth0") and its addresses.
+  // "auto" picks the first interface that is up, multicast capable, and not loopback.
+  // Returns false (and leaves this unchanged) if there's no such interface.
+  bool Lookup(const char* ifname) {
+    std::string autoName;
+    if (0 == strcmp(ifname, "auto")) {
+      struct ifaddrs *list = NULL;
+      if (getifaddrs(&list) < 0) { return false; }
+      for (struct ifaddrs *ifa = list; ifa; ifa = ifa->ifa_next) {
+        unsigned flags = ifa->ifa_flags;
+        if ((flags & IFF_UP) && (flags & IFF_MULTICAST) && !(flags & IFF_LOOPBACK)) {
+          autoName = ifa->ifa_name;
+          break;
+        }
+      }
+      freeifaddrs(list);
+      if (autoName.empty()) {
+        fprintf(stderr, "NetInterface - No multicast capable interface\n");
+        return false;
+      }
+      ifname = autoName.c_str();
+    }
+    unsigned ifindex = if_nametoindex(ifname);
+    if (!ifindex) {
+      fprintf(stderr, "NetInterface - Unknown interface '%s'\n", ifname);
+      return false;
+    }
+    *this = NetInterface();
+    index = ifindex;
+    name = ifname;
+    struct ifaddrs *list = NULL;
+    if (getifaddrs(&list) < 0) { return false; }
+    bool haveGlobal6 = false;
+    for (struct ifaddrs *ifa = list; ifa; ifa = ifa->ifa_next) {
+      if (!ifa->ifa_addr || name != ifa->ifa_name) { continue; }
+      if (ifa->ifa_addr->sa_family == AF_INET && addr4.s_addr == htonl(INADDR_ANY)) {
+        addr4 = ((SOCKADDR_IN*)ifa->ifa_addr)->sin_addr;
+      } else if (ifa->ifa_addr->sa_family == AF_INET6 && !haveGlobal6) {
+        const in6_addr& a6 = ((SOCKADDR_IN6*)ifa->ifa_addr)->sin6_addr;
+        if (!IN6_IS_ADDR_LINKLOCAL(&a6)) { haveGlobal6 = true; }
+        if (haveGlobal6 || IN6_IS_ADDR_UNSPECIFIED(&addr6)) { addr6 = a6; }
+      }
+    }
+    freeifaddrs(list);
+    return true;
+  }
+
+  // Fills 'addr' with this interface's address of the given family (port is kept).
+  void GetAddress(IPAddress& addr, int family) const {
+    uint16_t port = addr.GetPort();
+    memset(&addr.ss, 0, sizeof(addr.ss));
+    if (family == AF_INET6) {
+      addr.ip6.sin6_family = AF_INET6;
+      addr.ip6.sin6_addr = addr6;
+      if (IN6_IS_ADDR_LINKLOCAL(&addr6)) { addr.ip6.sin6_scope_id = index; }
+    } else {
+      addr.ip.sin_family = AF_INET;
+      addr.ip.sin_addr = addr4;
+    }
+    addr.SetPort(port);
+  }
 };
 
 
@@ -143,8 +308,8 @@ public:
     virtual bool IsOpen() { return open; }
 
     virtual bool GetAddress(IPAddress &addrActual) {
-      socklen_t length = sizeof(addrActual.ip);
-      if (SOCKET_ERROR == getsockname(sock, (struct sockaddr *) &addrActual.ip, &length)) {
+      socklen_t length = sizeof(addrActual.ss);
+      if (SOCKET_ERROR == getsockname(sock, addrActual.GetSockAddr(), &length)) {
         fprintf(stderr, "ERROR Socket::getsockname() FAILED!\n");
         return false;
       }
@@ -154,11 +319,11 @@ public:
     virtual int Open(const char* addr=NULL) {
       // address may have already been set, so addr can be NULL
       if (addr) { address.SetAddress(addr); }
-      sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+      sock = socket(address.GetFamily(), SOCK_DGRAM, IPPROTO_UDP);
       if (sock==INVALID_SOCKET) return 1;
       int yes = 1;
       setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-      int ret=bind(sock, (SOCKADDR*)&(address.ip), sizeof(address.ip));
+      int ret=bind(sock, address.GetSockAddr(), address.GetLength());
       open=(ret!=SOCKET_ERROR);
       IPAddress addrActual;
       if (open && GetAddress(addrActual)) { 
@@ -175,11 +340,13 @@ public:
       return 0;
     }
 
+    // Returns true if the socket is readable (or writable, if not 'read'), waiting up to
+    // 'timeout' microseconds (negative: forever).
     virtual bool Wait(int timeout=-1, bool read=true) {
       if (sock==INVALID_SOCKET) { return false; }
       int status;
-      //                tv_sec,  tv_usec
-      timeval howlong = {0,      timeout};
+      //                tv_sec,             tv_usec
+      timeval howlong = {timeout / 1000000, timeout % 1000000};
       // negative timeout is infinite (NULL value to select)
       timeval *tp = timeout>=0 ? &howlong : NULL;
       if (tp == NULL) {
@@ -208,7 +375,7 @@ public:
     virtual int WriteTo(IPAddress& addr, const char* buff, int sz) {
       if (!open) { return 1; }
       //fprintf(stderr, "UDPSocket - Send [%*.*s] to [%s:%d]\n", sz, sz, buff, addr.GetDotted(), addr.port);
-      int ret=sendto(sock, (SOCKBUF_P)buff, sz, 0, (SOCKADDR*)&(addr.ip), sizeof(addr.ip));
+      int ret=sendto(sock, (SOCKBUF_P)buff, sz, 0, addr.GetSockAddr(), addr.GetLength());
       if (ret==0 || ret==SOCKET_ERROR) { ret=0; open=false; }
       return ret;
     }
@@ -221,8 +388,8 @@ public:
     // reads data and puts sender address info in addr
     virtual int Read(char* buff, int maxSz, IPAddress& addr) {
       if (!open) { return 0; }
-      SOCKLEN_T addrLen = sizeof(addr.ip);
-      int ret = recvfrom(sock, (SOCKBUF_P)buff, maxSz, 0, (SOCKADDR*)&(addr.ip), &addrLen);
+      SOCKLEN_T addrLen = sizeof(addr.ss);
+      int ret = recvfrom(sock, (SOCKBUF_P)buff, maxSz, 0, addr.GetSockAddr(), &addrLen);
       if (ret==0 || ret==SOCKET_ERROR) { ret=0; open=false; }
       return ret;
     }
@@ -230,16 +397,43 @@ public:
       if (!open) { return 0; }
       char dummy[8];
       int ret=0;
-      SOCKLEN_T foo;
+      SOCKLEN_T foo = sizeof(addr.ss);
       int flags=MSG_TRUNC|MSG_PEEK;
-      ret = recvfrom(sock, (SOCKBUF_P)dummy, 2, flags, (SOCKADDR*)&(addr.ip), &foo);
+      ret = recvfrom(sock, (SOCKBUF_P)dummy, 2, flags, addr.GetSockAddr(), &foo);
       if (ret>0) {
         buff.resize(ret); 
-        ret = recvfrom(sock, (SOCKBUF_P)buff.data(), ret, 0, (SOCKADDR*)&(addr.ip), &foo);
+        foo = sizeof(addr.ss);
+        ret = recvfrom(sock, (SOCKBUF_P)&buff[0], ret, 0, addr.GetSockAddr(), &foo);
       }
       if (ret==0 || ret==SOCKET_ERROR) { ret=0; open=false; }
       return ret;
     }
+
+    // Send multicast packets out of interface 'iface' (instead of the default route).
+    virtual bool SetMulticastInterface(const NetInterface& iface) {
+      int ret;
+      if (address.IsV6()) {
+        unsigned index = iface.index;
+        ret = setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_IF, &index, sizeof(index));
+      } else {
+        ret = setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &iface.addr4, sizeof(iface.addr4));
+      }
+      if (ret < 0) {
+        fprintf(stderr, "UDPSocket - Failed to set multicast interface '%s'\n", iface.name.c_str());
+        return false;
+      }
+      return true;
+    }
+    // Sets the hop limit (TTL) of outgoing multicast packets.
+    virtual bool SetMulticastTTL(int t) {
+      int ret;
+      if (address.IsV6()) {
+        ret = setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &t, sizeof(t));
+      } else {
+        ret = setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &t, sizeof(t));
+      }
+      return ret >= 0;
+    }
 };
 
 
@@ -247,12 +441,18 @@ class MulticastSocket : public UDPSocket {
 public:
     int open_flags;
     bool in_mc_group;
+    NetInterface iface; // interface to join the group on (any, if not set)
 
 public:
     MulticastSocket() {
       in_mc_group = false;
       open_flags = 0;
     }
+
+    // Join the multicast group on interface 'ifname' only (call before Open()).
+    bool SetInterface(const char* ifname) {
+      return iface.Lookup(ifname);
+    }
     virtual ~MulticastSocket() {
     }
 
@@ -263,7 +463,7 @@ public:
       // address may have already been set, so addr can be NULL
       if (addr) { address.SetAddress(addr); }
       //sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
-      sock = socket(AF_INET, SOCK_DGRAM, 0);
+      sock = socket(address.GetFamily(), SOCK_DGRAM, 0);
       if (sock==INVALID_SOCKET) {
         fprintf(stderr, "MulticastSocket - Failed to create Socket\n");
         return 1;
@@ -274,14 +474,18 @@ public:
       if (flags==O_WRONLY && !address.IsMulticast()) {
         // special case ... if it's not multicast, 
         // then the reader and writer can't both be on the given address
-        IPAddress tmpAddr;
-        tmpAddr.ip.sin_family = AF_INET;
-        tmpAddr.ip.sin_addr.s_addr = INADDR_ANY;
-        ret=bind(sock, (SOCKADDR*)&(tmpAddr.ip), sizeof(tmpAddr.ip));
+        IPAddress tmpAddr(address.IsV6() ? "[::]:0" : "0.0.0.0:0");
+        ret=bind(sock, tmpAddr.GetSockAddr(), tmpAddr.GetLength());
       } else {
         setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
-        setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &yes, sizeof(yes));
-        ret=bind(sock, (SOCKADDR*)&(address.ip), sizeof(address.ip));
+        if (address.IsV6()) {
+          setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &yes, sizeof(yes));
+          // link-local groups need a scope
+          if (iface.IsSet() && !address.ip6.sin6_scope_id) { address.ip6.sin6_scope_id = iface.index; }
+        } else {
+          setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &yes, sizeof(yes));
+        }
+        ret=bind(sock, address.GetSockAddr(), address.GetLength());
       }
       if (ret) {
         fprintf(stderr, "MulticastSocket - Failed to bind Socket\n");
@@ -304,11 +508,21 @@ public:
     }
 
     virtual bool JoinMulticast(IPAddress &multi) {
+      if (multi.IsV6()) {
+        MREQ6 request6;
+        memset(&request6, 0, sizeof(request6));
+        request6.ipv6mr_multiaddr = multi.ip6.sin6_addr;
+        request6.ipv6mr_interface = iface.index;
+        if (setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, &request6, sizeof(request6)) < 0) {
+          fprintf(stderr, "Failed to join IPv6 multicast (errno %d)\n", errno);
+          return false;
+        }
+        return true;
+      }
       MREQ request;
       memset(&request, 0, sizeof(request));
       request.imr_multiaddr = multi.ip.sin_addr;
-      // TODO accept an interface arg at some point
-      request.imr_interface.s_addr = INADDR_ANY;
+      request.imr_interface = iface.addr4;
       if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request, sizeof(request)) < 0) {
         fprintf(stderr, "Failed to join multicast\n");
         return false;
@@ -317,10 +531,21 @@ public:
     }
 
     virtual bool LeaveMulticast(IPAddress &multi) {
+      if (multi.IsV6()) {
+        MREQ6 request6;
+        memset(&request6, 0, sizeof(request6));
+        request6.ipv6mr_multiaddr = multi.ip6.sin6_addr;
+        request6.ipv6mr_interface = iface.index;
+        if (setsockopt(sock, IPPROTO_IPV6, IPV6_LEAVE_GROUP, &request6, sizeof(request6)) < 0) {
+          fprintf(stderr, "Failed to leave IPv6 multicast\n");
+          return false;
+        }
+        return true;
+      }
       MREQ request;
       memset(&request, 0, sizeof(request));
       request.imr_multiaddr = multi.ip.sin_addr;
-      request.imr_interface.s_addr = INADDR_ANY;
+      request.imr_interface = iface.addr4;
       if (setsockopt(sock, IPPROTO_IP, IP_DROP_MEMBERSHIP, &request, sizeof(request)) < 0) {
         fprintf(stderr, "Failed to leave multicast\n");
         return false;
@@ -330,7 +555,7 @@ public:
 
     virtual bool SetTTL(int t) {
       if (address.IsMulticast()) {
-        if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, (void*)&t, sizeof(t)) < 0) {
+        if (!SetMulticastTTL(t)) {
           fprintf(stderr, "MulticastSocket - Failed to set multicast ttl\n");
           return -1;
         }
@@ -338,10 +563,12 @@ public:
       return 0;
     }
     virtual int GetTTL() {
-      unsigned char ttl = 0;
+      int           ttl = 0;
       socklen_t     len=sizeof (ttl);
       if (address.IsMulticast()) {
-        if (getsockopt (sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, &len) < 0) {
+        int ret = address.IsV6() ? getsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, &len)
+                                 : getsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, &len);
+        if (ret < 0) {
           fprintf(stderr, "MulticastSocket - Failed to get multicast ttl\n");
           return -1;
         }
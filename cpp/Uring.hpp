@@ -0,0 +1,156 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper on the raw system calls (no liburing).
+// One submitter thread: get SQEs, fill them in, Submit(), then reap CQEs.
+// Init() fails (and callers fall back to something else) if the kernel
+// doesn't support io_uring, or it's disabled (e.g. by seccomp or sysctl).
+class IoUring {
+private:
+  int       fd;
+  // submission queue
+  void*     sqRing;
+  size_t    sqRingSize;
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned* sqMask;
+  unsigned* sqArray;
+  io_uring_sqe* sqes;
+  size_t    sqesSize;
+  unsigned  sqLocalTail; // SQEs handed out, but not yet published
+  unsigned  toSubmit;
+  // completion queue
+  void*     cqRing;
+  size_t    cqRingSize;
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned* cqMask;
+  io_uring_cqe* cqes;
+
+public:
+  uint64_t  syscalls;    // io_uring_enter() and poll() calls (for measuring batching)
+
+  IoUring() : fd(-1), sqRing(MAP_FAILED), sqRingSize(0), sqes((io_uring_sqe*)MAP_FAILED), sqesSize(0),
+    sqLocalTail(0), toSubmit(0), cqRing(MAP_FAILED), cqRingSize(0), syscalls(0) { }
+  ~IoUring() { Close(); }
+
+  bool IsOpen() const { return fd >= 0; }
+
+  // Sets up a ring with (at least) 'entries' submission entries.
+  // Returns false if io_uring isn't available.
+  bool Init(unsigned entries) {
+    Close();
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) { return false; }
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+      if (cqRingSize > sqRingSize) { sqRingSize = cqRingSize; }
+      cqRingSize = sqRingSize;
+    }
+    sqRing = mmap(NULL, sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) { Close(); return false; }
+    cqRing = single ? sqRing :
+      mmap(NULL, cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cqRing == MAP_FAILED) { Close(); return false; }
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe*)mmap(NULL, sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) { Close(); return false; }
+
+    char* sq = (char*)sqRing;
+    sqHead  = (unsigned*)(sq + params.sq_off.head);
+    sqTail  = (unsigned*)(sq + params.sq_off.tail);
+    sqMask  = (unsigned*)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned*)(sq + params.sq_off.array);
+    char* cq = (char*)cqRing;
+    cqHead  = (unsigned*)(cq + params.cq_off.head);
+    cqTail  = (unsigned*)(cq + params.cq_off.tail);
+    cqMask  = (unsigned*)(cq + params.cq_off.ring_mask);
+    cqes    = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    sqLocalTail = *sqTail;
+    toSubmit = 0;
+    return true;
+  }
+
+  void Close() {
+    if (sqes != MAP_FAILED) { munmap(sqes, sqesSize); }
+    if (cqRing != MAP_FAILED && cqRing != sqRing) { munmap(cqRing, cqRingSize); }
+    if (sqRing != MAP_FAILED) { munmap(sqRing, sqRingSize); }
+    sqes = (io_uring_sqe*)MAP_FAILED;
+    sqRing = cqRing = MAP_FAILED;
+    if (fd >= 0) { close(fd); }
+    fd = -1;
+  }
+
+  // Returns a cleared submission entry, or NULL if the queue is full.
+  io_uring_sqe* GetSqe() {
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (sqLocalTail - head > *sqMask) { return NULL; }
+    unsigned index = sqLocalTail & *sqMask;
+    io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    ++sqLocalTail;
+    ++toSubmit;
+    return sqe;
+  }
+
+  // Submits the entries from GetSqe().
+  // Returns the number submitted, or -errno.
+  int Submit() {
+    __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+    if (!toSubmit) { return 0; }
+    ++syscalls;
+    int ret = syscall(__NR_io_uring_enter, fd, toSubmit, 0, 0, NULL, 0);
+    if (ret < 0) { return -errno; }
+    toSubmit -= ret;
+    return ret;
+  }
+
+  // Takes back the last 'count' entries from GetSqe(), after a failed Submit()
+  // (the kernel only reads them in io_uring_enter(), no SQPOLL thread).
+  void Discard(unsigned count) {
+    if (count > toSubmit) { count = toSubmit; }
+    sqLocalTail -= count;
+    toSubmit -= count;
+    __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+  }
+
+  // Registers resources with the ring (io_uring_register(2) 'opcode').
+  // Returns false (errno set) on errors.
+  bool Register(unsigned opcode, void* arg, unsigned count) {
+    return 0 == syscall(__NR_io_uring_register, fd, opcode, arg, count);
+  }
+
+  // Copies the next completion into 'cqe' (waiting up to 'waitUs', -1 forever).
+  // Returns false if there was none.
+  bool Reap(io_uring_cqe& cqe, int waitUs=0) {
+    unsigned head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+      if (!waitUs) { return false; }
+      // the ring fd is readable while there are completions
+      pollfd pfd = { fd, POLLIN, 0 };
+      int ms = waitUs < 0 ? -1 : (waitUs + 999) / 1000;
+      ++syscalls;
+      if (poll(&pfd, 1, ms) <= 0) { return false; }
+      if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) { return false; }
+    }
+    cqe = cqes[head & *cqMask];
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+};
@@ -0,0 +1,285 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <deque>
+
+#include "UDP.hpp"
+#include "Uring.hpp"
+
+#define URING_RECV_BUFFERS  64    // provided receive buffers (a power of two)
+#define URING_RECV_BUF_SIZE 2048  // per buffer (header + sender address + payload)
+#define URING_SEND_SLOTS    32    // sends in flight
+#define URING_SEND_MAX      1500  // largest datagram SendTo() accepts
+#define URING_BUF_GROUP     1
+
+// io_uring datagram I/O on already opened (and bound) UDP sockets.
+// Receiving uses one multishot recvmsg on a ring of provided buffers, so the
+// kernel keeps filling buffers without a system call per datagram, and
+// Wait(0)/Read() only look at the completion queue in memory.
+// Sends are queued, and submitted together by the next Wait() (or Flush()).
+// Single threaded, like the sockets it replaces.
+class UringSocket {
+private:
+  struct SendSlot {
+    msghdr    msg;
+    iovec     iov;
+    IPAddress to;
+    char      buf[URING_SEND_MAX];
+    bool      busy;
+  };
+
+  IoUring           ring;
+  int               recvFd;
+  int               sendFd;
+  io_uring_buf_ring* bufRing;   // provided buffer ring (shared with the kernel)
+  char*             bufs;       // URING_RECV_BUFFERS buffers of URING_RECV_BUF_SIZE
+  unsigned          bufTail;
+  msghdr            recvMsg;    // template for the multishot recvmsg (sender address space)
+  bool              armed;      // the multishot recvmsg is active
+  std::deque<io_uring_cqe> ready; // received datagrams, not yet read
+  SendSlot          slots[URING_SEND_SLOTS];
+  unsigned          queued;     // sends not yet submitted
+  int               recvQueued; // position of the recvmsg among the SQEs not yet submitted (-1: none)
+  unsigned          inFlight;   // sends submitted, not yet completed
+  uint64_t          sendErrors;
+
+public:
+  UringSocket() : recvFd(-1), sendFd(-1), bufRing((io_uring_buf_ring*)MAP_FAILED), bufs((char*)MAP_FAILED),
+    bufTail(0), armed(false), queued(0), recvQueued(-1), inFlight(0), sendErrors(0) {
+    memset(&recvMsg, 0, sizeof(recvMsg));
+    for (auto& slot : slots) { slot.busy = false; }
+  }
+  ~UringSocket() { Close(); }
+
+  // Receives on socket 'rfd', and sends from socket 'sfd' (may be the same).
+  // Returns false if the kernel lacks io_uring, provided buffer rings (5.19+)
+  // or multishot recvmsg (6.0+), so callers can stay on plain socket calls.
+  bool Init(int rfd, int sfd) {
+    Close();
+    recvFd = rfd;
+    sendFd = sfd;
+    if (!ring.Init(2*URING_SEND_SLOTS)) { return false; }
+    size_t ringSize = URING_RECV_BUFFERS * sizeof(io_uring_buf);
+    bufRing = (io_uring_buf_ring*)mmap(NULL, ringSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    bufs = (char*)mmap(NULL, URING_RECV_BUFFERS * URING_RECV_BUF_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (bufRing == MAP_FAILED || bufs == MAP_FAILED) { Close(); return false; }
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)bufRing;
+    reg.ring_entries = URING_RECV_BUFFERS;
+    reg.bgid = URING_BUF_GROUP;
+    if (!ring.Register(IORING_REGISTER_PBUF_RING, &reg, 1)) { Close(); return false; }
+    bufTail = 0;
+    for (unsigned b=0; b<URING_RECV_BUFFERS; ++b) { AddBuffer(b); }
+    PublishBuffers();
+    recvMsg.msg_namelen = sizeof(SOCKADDR_STORAGE);
+    if (!Arm()) { Close(); return false; }
+    // an old kernel rejects the multishot flag on the first completion
+    io_uring_cqe cqe;
+    if (ring.Reap(cqe, 0)) {
+      if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) { Close(); return false; }
+      Complete(cqe);
+    }
+    return true;
+  }
+
+  // Sends what's queued, and waits for the sends in flight (the kernel reads their buffers).
+  void Close() {
+    if (ring.IsOpen()) {
+      Flush();
+      io_uring_cqe cqe;
+      for (unsigned i=0; inFlight && i<100 && ring.Reap(cqe, 10000); ++i) { Complete(cqe); }
+    }
+    ring.Close(); // (cancels the receive)
+    if (bufRing != MAP_FAILED) { munmap(bufRing, URING_RECV_BUFFERS * sizeof(io_uring_buf)); }
+    if (bufs != MAP_FAILED) { munmap(bufs, URING_RECV_BUFFERS * URING_RECV_BUF_SIZE); }
+    bufRing = (io_uring_buf_ring*)MAP_FAILED;
+    bufs = (char*)MAP_FAILED;
+    ready.clear();
+    for (auto& slot : slots) { slot.busy = false; }
+    armed = false;
+    queued = inFlight = 0;
+    recvQueued = -1;
+  }
+
+  bool IsOpen() const { return ring.IsOpen(); }
+
+  // io_uring system calls so far (submits, and waits for completions).
+  uint64_t GetSyscalls() const { return ring.syscalls; }
+  uint64_t GetSendErrors() const { return sendErrors; }
+
+  // Submits queued sends, then returns true if a datagram is ready to be read
+  // (waiting up to 'waitUs' for one, -1 forever).
+  bool Wait(int waitUs) {
+    Flush();
+    Drain(0);
+    if (!armed && ready.empty()) { Arm(); }
+    while (ready.empty() && waitUs) {
+      io_uring_cqe cqe;
+      if (!ring.Reap(cqe, waitUs)) { break; }
+      Complete(cqe); // (may be a send completion, then keep waiting)
+      Drain(0);
+    }
+    return !ready.empty();
+  }
+
+  // Reads the next datagram into 'buf' (truncated to 'maxSz'), and its sender into 'from'.
+  // Returns the size read (0 if none was ready, see Wait()).
+  int Read(char* buf, int maxSz, IPAddress& from) {
+    if (ready.empty()) { Drain(0); }
+    if (ready.empty()) { return 0; }
+    io_uring_cqe cqe = ready.front();
+    ready.pop_front();
+    unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    const char* b = bufs + bid * URING_RECV_BUF_SIZE;
+    const io_uring_recvmsg_out* out = (const io_uring_recvmsg_out*)b;
+    const char* name = b + sizeof(io_uring_recvmsg_out);
+    const char* payload = name + recvMsg.msg_namelen + recvMsg.msg_controllen;
+    memset(&from.ss, 0, sizeof(from.ss));
+    memcpy(&from.ss, name, out->namelen < sizeof(from.ss) ? out->namelen : sizeof(from.ss));
+    int size = out->payloadlen < (unsigned)maxSz ? out->payloadlen : maxSz;
+    memcpy(buf, payload, size);
+    AddBuffer(bid);
+    PublishBuffers();
+    if (!armed) { Arm(); }
+    return size;
+  }
+
+  // Queues 'sz' bytes of 'buf' (copied) to 'to'; sent by the next Wait() or Flush().
+  // Returns false if the datagram is too large, or the send slots stay full.
+  bool SendTo(const IPAddress& to, const char* buf, int sz) {
+    if (sz > URING_SEND_MAX) { return false; }
+    unsigned s = FreeSlot();
+    if (s == URING_SEND_SLOTS) {
+      // everything is in flight: submit, and wait for a completion
+      Flush();
+      io_uring_cqe cqe;
+      for (unsigned i=0; i<100 && s == URING_SEND_SLOTS && ring.Reap(cqe, 10000); ++i) {
+        Complete(cqe);
+        s = FreeSlot();
+      }
+      if (s == URING_SEND_SLOTS) { return false; }
+    }
+    io_uring_sqe* sqe = ring.GetSqe();
+    if (!sqe) { Flush(); sqe = ring.GetSqe(); }
+    if (!sqe) { return false; }
+    SendSlot& slot = slots[s];
+    slot.busy = true;
+    slot.to = to;
+    memcpy(slot.buf, buf, sz);
+    slot.iov.iov_base = slot.buf;
+    slot.iov.iov_len = sz;
+    memset(&slot.msg, 0, sizeof(slot.msg));
+    slot.msg.msg_name = slot.to.GetSockAddr();
+    slot.msg.msg_namelen = slot.to.GetLength();
+    slot.msg.msg_iov = &slot.iov;
+    slot.msg.msg_iovlen = 1;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sendFd;
+    sqe->addr = (uint64_t)(uintptr_t)&slot.msg;
+    sqe->len = 1;
+    sqe->user_data = s;
+    ++queued;
+    return true;
+  }
+
+  // Submits the queued sends (one system call for all of them).
+  void Flush() {
+    if (queued || recvQueued >= 0) { Submit(); }
+  }
+
+private:
+  enum { RECV_TAG = URING_SEND_SLOTS };
+
+  unsigned FreeSlot() const {
+    unsigned s = 0;
+    while (s < URING_SEND_SLOTS && slots[s].busy) { ++s; }
+    return s;
+  }
+
+  void AddBuffer(unsigned bid) {
+    // (not bufRing->bufs: in C++ the header's flexible array member lands at offset 8, not 0,
+    // the tail overlays the 'resv' field of entry 0)
+    io_uring_buf& buf = ((io_uring_buf*)bufRing)[bufTail & (URING_RECV_BUFFERS - 1)];
+    buf.addr = (uint64_t)(uintptr_t)(bufs + bid * URING_RECV_BUF_SIZE);
+    buf.len = URING_RECV_BUF_SIZE;
+    buf.bid = bid;
+    ++bufTail;
+  }
+  void PublishBuffers() {
+    __atomic_store_n(&bufRing->tail, (uint16_t)bufTail, __ATOMIC_RELEASE);
+  }
+
+  // Starts the multishot recvmsg (again, after the kernel ended it, e.g. when out of buffers).
+  bool Arm() {
+    io_uring_sqe* sqe = ring.GetSqe();
+    if (!sqe) { return false; }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = recvFd;
+    sqe->addr = (uint64_t)(uintptr_t)&recvMsg;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = RECV_TAG;
+    recvQueued = queued;
+    // (also submits any queued sends)
+    if (!Submit()) {
+      ring.Discard(1);
+      recvQueued = -1;
+      return false;
+    }
+    // (if the kernel took fewer SQEs, the recvmsg goes with the next Flush())
+    armed = true;
+    return true;
+  }
+
+  // Submits the SQEs not yet submitted. The kernel may take fewer than all of them:
+  // only those taken (the first ones, in order) are in flight, the rest stay queued.
+  // Returns false on errors.
+  bool Submit() {
+    int ret = ring.Submit();
+    if (ret < 0) {
+      fprintf(stderr, "ERROR: io_uring submit failed (%s)!\n", strerror(-ret));
+      return false;
+    }
+    unsigned sends = ret;
+    if (recvQueued >= 0) {
+      if (recvQueued < ret) { --sends; recvQueued = -1; } else { recvQueued -= ret; }
+    }
+    inFlight += sends;
+    queued -= sends;
+    return true;
+  }
+
+  // Reaps the completions that are already there (no system call).
+  void Drain(int waitUs) {
+    io_uring_cqe cqe;
+    while (ring.Reap(cqe, waitUs)) { Complete(cqe); waitUs = 0; }
+  }
+
+  void Complete(const io_uring_cqe& cqe) {
+    if (cqe.user_data == RECV_TAG) {
+      if (!(cqe.flags & IORING_CQE_F_MORE)) { armed = false; }
+      if (cqe.flags & IORING_CQE_F_BUFFER) {
+        if (cqe.res >= 0) {
+          ready.push_back(cqe);
+        } else {
+          AddBuffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+          PublishBuffers();
+        }
+      }
+      return;
+    }
+    if (cqe.user_data < URING_SEND_SLOTS) {
+      if (cqe.res < 0) { ++sendErrors; }
+      slots[cqe.user_data].busy = false;
+      --inFlight;
+    }
+  }
+};
@@ -0,0 +1,68 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+// Benchmark for the ID stream codec (IdCodec.hpp): encoded size and
+// encode/decode speed, for dense runs (IdNode output) and sparse IDs.
+//
+//   usage: bench_codec [ids]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include "IdCodec.hpp"
+
+static uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+static void Run(const char* name, const std::vector<uint64_t>& ids) {
+  std::vector<uint8_t> buf;
+  uint64_t t0 = NowNs();
+  IdEncoder::Encode(&ids[0], ids.size(), buf);
+  uint64_t t1 = NowNs();
+  std::vector<uint64_t> out;
+  out.reserve(ids.size());
+  bool ok = IdDecoder::Decode(&buf[0], buf.size(), out);
+  uint64_t t2 = NowNs();
+  // decode only (no vector appends), block by block
+  IdDecoder dec(&buf[0], buf.size());
+  uint64_t block[CODEC_BLOCK];
+  uint64_t sum = 0, n = 0;
+  while (unsigned c = dec.Next(block)) { sum += block[c-1]; n += c; }
+  uint64_t t3 = NowNs();
+  ok = ok && out.size() == ids.size() && n == ids.size();
+  fprintf(stdout, "%-8s %10zu IDs: %6.3f bytes/ID, encode %7.1f M IDs/s, decode %7.1f M IDs/s (%5.2f GB/s of IDs), "
+      "blocks only %7.1f M IDs/s (%5.2f GB/s)%s\n",
+      name, ids.size(), (double)buf.size()/ids.size(), ids.size()*1e3/(t1-t0), ids.size()*1e3/(t2-t1),
+      ids.size()*8.0/(t2-t1), ids.size()*1e3/(t3-t2), ids.size()*8.0/(t3-t2), ok ? "" : " DECODE ERROR");
+  if (sum == 42) { fprintf(stdout, "\n"); } // keep the sum alive
+}
+
+int main(int argc, char* argv[]) {
+  size_t count = argc > 1 ? strtoull(argv[1], NULL, 10) : 20000000;
+  std::vector<uint64_t> ids;
+  ids.reserve(count);
+
+  // one node, generating as fast as it can (IdGenerator wraps at MAX_COUNTER-1)
+  uint64_t ts = 1600000000000ull;
+  for (size_t i=0; i<count; ++i) {
+    ids.push_back(IdNode::FieldsToId(ts, i % (MAX_COUNTER-1), 42));
+    if (i % (MAX_COUNTER-1) == MAX_COUNTER-2) { ++ts; }
+  }
+  Run("dense", ids);
+
+  // 8 nodes interleaved, a few IDs per millisecond
+  ids.clear();
+  ts = 1600000000000ull;
+  uint16_t counter[8] = { 0 };
+  for (size_t i=0; i<count; ++i) {
+    unsigned node = i % 8;
+    if (rand() % 4 == 0) { ++ts; for (auto& c : counter) { c = 0; } }
+    ids.push_back(IdNode::FieldsToId(ts, counter[node]++ % MAX_COUNTER, 100 + node));
+  }
+  Run("sparse", ids);
+  return 0;
+}
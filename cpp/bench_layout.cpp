@@ -0,0 +1,281 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+// Micro-benchmark for the IdGenerator memory layout.
+// Compares the legacy IdNode field layout (hot fields packed next to each other
+// and next to cold members) against the cache-line aligned IdGenerator, using
+// hardware cache-miss counters (perf_event_open) when the kernel allows it.
+// Then measures the real IdNode::GetId() (peer-message checks and timestamp
+// updates included), without peers (LocalIdNode) and with the multicast sockets,
+// and GetId(id, shard) throughput with 1, 2, 4 and 8 threads (one shard each).
+//
+//   usage: bench_layout [threads] [ids-per-generator]
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include <thread>
+#include <vector>
+
+#include "DistId.hpp"
+
+// The hot fields of the original IdNode, in their original order.
+// Two of these share a single 64-byte cache line.
+struct LegacyGenerator {
+  uint16_t nodeId;
+  uint64_t minTimeMs;
+  uint64_t deltaTimeMs;
+  uint64_t idCounter;
+
+  bool NeedsTimestamp() const { return idCounter >= (MAX_COUNTER-1) || !minTimeMs; }
+  uint64_t NextId() {
+    uint64_t id = (((minTimeMs << COUNTER_BITS) + idCounter) << NODE_BITS) + nodeId;
+    ++idCounter;
+    return id;
+  }
+};
+
+// The cold members of the default IdNode.
+typedef IdCoordinator<SystemClock, StructArrayStore<IdNodeState>, SocketTransport> ColdState;
+
+// Approximation of the original IdNode: hot fields first, then the cold
+// members, with the validity flags at the far end of the object.
+struct LegacyNode {
+  LegacyGenerator gen;
+  char            cold[sizeof(ColdState)];
+  bool            initialized;
+  bool            hasCollision;
+
+  bool IsValid() const { return initialized && !hasCollision; }
+  void SetValid() { initialized = true; }
+};
+
+// Split layout: one cache line of hot state, cold members afterwards.
+struct SplitNode {
+  IdGenerator gen;
+  char        cold[sizeof(ColdState)];
+
+  bool IsValid() const { return gen.valid; }
+  void SetValid() { gen.valid = true; }
+};
+
+////////////////////////////////////////////////////////////
+// perf counter helpers
+
+struct PerfCounter {
+  int fd;
+
+  PerfCounter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;        // include threads spawned after opening
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+  ~PerfCounter() { if (fd >= 0) { close(fd); } }
+
+  bool IsValid() const { return fd >= 0; }
+  void Start() {
+    if (fd < 0) { return; }
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  // Returns the counter value, or -1 if counters are unavailable.
+  int64_t Stop() {
+    if (fd < 0) { return -1; }
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    int64_t value = 0;
+    if (sizeof(value) != read(fd, &value, sizeof(value))) { return -1; }
+    return value;
+  }
+};
+
+static uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+// Generate 'count' IDs from 'gen', bumping the timestamp by one on each wrap
+// (no clock reads, so the loop is dominated by the memory layout).
+template<typename G> uint64_t Generate(G& gen, uint64_t count) {
+  uint64_t sum = 0;
+  for (uint64_t i=0; i<count; ++i) {
+    if (gen.NeedsTimestamp()) { ++gen.minTimeMs; gen.idCounter = 0; }
+    sum += gen.NextId();
+  }
+  return sum;
+}
+
+// Round-robin single IDs across an array of nodes (many generators, one core).
+template<typename N> uint64_t RoundRobin(std::vector<N>& nodes, uint64_t count) {
+  uint64_t sum = 0;
+  size_t n = nodes.size();
+  for (uint64_t i=0; i<count; ++i) {
+    N& node = nodes[i % n];
+    if (!node.IsValid()) { continue; }
+    if (node.gen.NeedsTimestamp()) { ++node.gen.minTimeMs; node.gen.idCounter = 0; }
+    sum += node.gen.NextId();
+  }
+  return sum;
+}
+
+static void Report(const char* name, uint64_t ids, uint64_t ns, int64_t misses, int64_t l1) {
+  char missBuf[32], l1Buf[32];
+  if (misses >= 0) { snprintf(missBuf, 32, "%10.4f", (double)misses/ids); } else { snprintf(missBuf, 32, "%10s", "n/a"); }
+  if (l1 >= 0)     { snprintf(l1Buf, 32, "%10.4f", (double)l1/ids); }         else { snprintf(l1Buf, 32, "%10s", "n/a"); }
+  fprintf(stdout, "%-34s %8.2f ns/id  %s LLC-miss/id  %s L1D-miss/id\n", name, (double)ns/ids, missBuf, l1Buf);
+}
+
+volatile uint64_t sink;
+
+// One generator per thread, all generators in one contiguous array.
+template<typename G> void BenchThreads(const char* name, unsigned threads, uint64_t count) {
+  std::vector<G> gens(threads);
+  for (unsigned t=0; t<threads; ++t) { gens[t].nodeId = t; gens[t].minTimeMs = 1; }
+
+  PerfCounter misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  PerfCounter l1(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+      (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  misses.Start(); l1.Start();
+  uint64_t start = NowNs();
+  std::vector<std::thread> workers;
+  for (unsigned t=0; t<threads; ++t) {
+    workers.push_back(std::thread([&gens, t, count]() { sink = Generate(gens[t], count); }));
+  }
+  for (auto& w : workers) { w.join(); }
+  uint64_t end = NowNs();
+  Report(name, count*threads, end-start, misses.Stop(), l1.Stop());
+}
+
+template<typename N> void BenchRoundRobin(const char* name, unsigned nodeCount, uint64_t count) {
+  std::vector<N> nodes(nodeCount);
+  for (unsigned i=0; i<nodeCount; ++i) {
+    memset((void*)&nodes[i], 0, sizeof(N));
+    nodes[i].gen.nodeId = i % MAX_NODES;
+    nodes[i].gen.minTimeMs = 1;
+    nodes[i].SetValid();
+  }
+
+  PerfCounter misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  PerfCounter l1(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+      (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  misses.Start(); l1.Start();
+  uint64_t start = NowNs();
+  sink = RoundRobin(nodes, count);
+  uint64_t end = NowNs();
+  Report(name, count, end-start, misses.Stop(), l1.Stop());
+}
+
+// IdNode::GetId() round-robin over 'shards' owned node-ids (starting at 'first').
+template<typename N> void BenchNode(const char* name, uint16_t first, unsigned shards, uint64_t count) {
+  N node;
+  if (!node.Initialize(first, shards)) {
+    fprintf(stderr, "ERROR: Failed to initialize %s\n", name);
+    return;
+  }
+  IdNodeStats before = node.GetStats();
+
+  PerfCounter misses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  PerfCounter l1(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+      (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  misses.Start(); l1.Start();
+  uint64_t start = NowNs();
+  uint64_t sum = 0, id;
+  for (uint64_t i=0; i<count; ++i) {
+    if (!node.GetId(id)) {
+      fprintf(stderr, "ERROR: GetId failed after %" PRIu64 " IDs\n", i);
+      return;
+    }
+    sum += id;
+  }
+  sink = sum;
+  uint64_t end = NowNs();
+  Report(name, count, end-start, misses.Stop(), l1.Stop());
+  const IdNodeStats& after = node.GetStats();
+  fprintf(stdout, "%-34s %8.4f polls/id  %10.4f ts-updates/id  %10" PRIu64 " throttles\n", "",
+      (double)(after.polls - before.polls)/count, (double)(after.tsUpdates - before.tsUpdates)/count,
+      after.throttles - before.throttles);
+}
+
+// IdNode::GetId(id, shard) from 'threads' threads, each on its own shard (of node-ids from 'first').
+// Shards don't share a generator, so the total should scale with the threads (and cores), 
+// up to MAX_COUNTER IDs per millisecond per shard, unless the coordinator lock serializes them.
+template<typename N> void BenchShardThreads(const char* name, uint16_t first, unsigned threads, uint64_t count) {
+  N node;
+  if (!node.Initialize(first, threads)) {
+    fprintf(stderr, "ERROR: Failed to initialize %s\n", name);
+    return;
+  }
+  IdNodeStats before = node.GetStats();
+  std::vector<uint64_t> failures(threads, 0);
+  uint64_t start = NowNs();
+  std::vector<std::thread> workers;
+  for (unsigned t=0; t<threads; ++t) {
+    workers.push_back(std::thread([&node, &failures, t, count]() {
+      uint64_t sum = 0, id;
+      for (uint64_t i=0; i<count; ++i) {
+        if (node.GetId(id, t)) { sum += id; } else { ++failures[t]; }
+      }
+      sink = sum;
+    }));
+  }
+  for (auto& w : workers) { w.join(); }
+  uint64_t end = NowNs();
+  uint64_t failed = 0;
+  for (uint64_t f : failures) { failed += f; }
+  const IdNodeStats& after = node.GetStats();
+  char label[64];
+  snprintf(label, 64, "%s, %u thread%s", name, threads, threads > 1 ? "s" : "");
+  fprintf(stdout, "%-34s %8.2f ns/id  %10.2f M ids/s  %10" PRIu64 " throttles  %" PRIu64 " failures\n", label,
+      (double)(end-start)/(count*threads), count*threads*1000.0/(end-start),
+      after.throttles - before.throttles, failed);
+}
+
+int main(int argc, char* argv[]) {
+  unsigned threads = std::thread::hardware_concurrency();
+  uint64_t count = 50000000;
+  if (threads < 2) { threads = 2; }
+  if (argc > 1) { threads = strtol(argv[1], NULL, 10); }
+  if (argc > 2) { count = strtoull(argv[2], NULL, 10); }
+
+  fprintf(stdout, "sizeof(LegacyGenerator)=%zu sizeof(IdGenerator)=%zu alignof(IdGenerator)=%zu\n",
+      sizeof(LegacyGenerator), sizeof(IdGenerator), alignof(IdGenerator));
+  {
+    PerfCounter probe(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    if (!probe.IsValid()) {
+      fprintf(stderr, "WARN: perf counters unavailable (errno %d, check /proc/sys/kernel/perf_event_paranoid).\n", errno);
+    }
+  }
+
+  fprintf(stdout, "-- %u threads, one generator each, %" PRIu64 " IDs per thread\n", threads, count);
+  BenchThreads<LegacyGenerator>("legacy (packed, false-sharing)", threads, count);
+  BenchThreads<IdGenerator>("IdGenerator (alignas 64)", threads, count);
+
+  unsigned nodeCount = 16384;
+  fprintf(stdout, "-- 1 thread, round-robin over %u nodes, %" PRIu64 " IDs\n", nodeCount, count);
+  BenchRoundRobin<LegacyNode>("legacy IdNode layout", nodeCount, count);
+  BenchRoundRobin<SplitNode>("hot/cold split layout", nodeCount, count);
+
+  // (each shard hands out at most MAX_COUNTER-1 IDs per millisecond)
+  unsigned shards = 64;
+  uint64_t nodeIds = count < 10000000 ? count : 10000000;
+  fprintf(stdout, "-- 1 thread, IdNode::GetId() over %u shards, %" PRIu64 " IDs\n", shards, nodeIds);
+  BenchNode<LocalIdNode>("LocalIdNode (no peers)", 512, shards, nodeIds);
+  BenchNode<IdNode>("IdNode (multicast)", 512, shards, nodeIds);
+
+  uint64_t perThread = count < 2000000 ? count : 2000000;
+  fprintf(stdout, "-- IdNode::GetId(id, shard), one shard per thread, %" PRIu64 " IDs per thread\n", perThread);
+  for (unsigned n=1; n<=8; n*=2) { BenchShardThreads<IdNode>("IdNode (multicast)", 576, n, perThread); }
+  return 0;
+}
@@ -0,0 +1,155 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+// Benchmark for NUMA placement of ID generators (see NumaPool.hpp).
+// 1. Generator core only: threads pinned to one NUMA node share a locked
+//    IdGenerator whose memory is on the same (local) or another (remote)
+//    node, for every pair of nodes.
+// 2. Full IdNodes: all threads share one IdNode (one lock, one shard per
+//    NUMA node, so both have the same IDs per millisecond), versus an
+//    IdNumaPool (one IdNode per NUMA node, threads routed by sched_getcpu()).
+// On a single-socket host only the local numbers exist (use -s to split the
+// CPUs into pretend nodes, which shows the routing overhead, not NUMA effects).
+//
+//   usage: bench_numa [-t threads-per-node] [-n ids-per-thread] [-s simulated-nodes] [-f first-node-id]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "NumaPool.hpp"
+
+static uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+// A generator and its lock, on one cache line pair.
+struct alignas(64) LockedGenerator {
+  IdGenerator gen;
+  std::mutex  lock;
+};
+
+volatile uint64_t sink;
+
+// 'threads' threads pinned to NUMA node 'threadNode' generate 'count' IDs each
+// from one shared generator allocated on node 'memNode'. Returns ns per ID.
+static double GeneratorRun(const NumaTopology& topo, unsigned threadNode, unsigned memNode, unsigned threads, uint64_t count) {
+  void* mem = NumaAlloc(sizeof(LockedGenerator), topo.hostNode[memNode]);
+  if (!mem) { return 0; }
+  LockedGenerator* shared = NULL;
+  // first touch from the memory node, as NumaAlloc only prefers it
+  std::thread([&]() { topo.PinThread(memNode); shared = new (mem) LockedGenerator(); }).join();
+  shared->gen.nodeId = 1;
+  shared->gen.minTimeMs = 1;
+  uint64_t start = NowNs();
+  std::vector<std::thread> workers;
+  for (unsigned t=0; t<threads; ++t) {
+    workers.push_back(std::thread([&]() {
+      topo.PinThread(threadNode);
+      uint64_t sum = 0;
+      for (uint64_t i=0; i<count; ++i) {
+        std::lock_guard<std::mutex> guard(shared->lock);
+        if (shared->gen.NeedsTimestamp()) { ++shared->gen.minTimeMs; shared->gen.idCounter = 0; }
+        sum += shared->gen.NextId();
+      }
+      sink = sum;
+    }));
+  }
+  for (auto& w : workers) { w.join(); }
+  double ns = (double)(NowNs() - start) / (count * threads);
+  shared->~LockedGenerator();
+  NumaFree(mem, sizeof(LockedGenerator));
+  return ns;
+}
+
+// Every thread (pinned round-robin to the NUMA nodes) calls 'getId' 'count' times.
+// Returns ns per ID (over all threads), and the failures in 'failures'.
+template<typename F> double NodeRun(const NumaTopology& topo, unsigned threads, uint64_t count, F getId, uint64_t& failures) {
+  std::vector<uint64_t> failed(threads, 0);
+  uint64_t start = NowNs();
+  std::vector<std::thread> workers;
+  for (unsigned t=0; t<threads; ++t) {
+    workers.push_back(std::thread([&, t]() {
+      topo.PinThread(t % topo.NodeCount());
+      uint64_t id, sum = 0;
+      for (uint64_t i=0; i<count; ++i) {
+        if (getId(id)) { sum += id; } else { ++failed[t]; }
+      }
+      sink = sum;
+    }));
+  }
+  for (auto& w : workers) { w.join(); }
+  failures = 0;
+  for (uint64_t f : failed) { failures += f; }
+  return (double)(NowNs() - start) / (count * threads);
+}
+
+int main(int argc, char* argv[]) {
+  unsigned threadsPerNode = 0;
+  uint64_t count = 2000000;
+  unsigned simulate = 0;
+  unsigned firstNode = 900;
+  int c;
+  while ((c = getopt(argc, argv, "t:n:s:f:")) != -1) {
+    switch (c) {
+      case 't': threadsPerNode = strtoul(optarg, NULL, 10); break;
+      case 'n': count = strtoull(optarg, NULL, 10); break;
+      case 's': simulate = strtoul(optarg, NULL, 10); break;
+      case 'f': firstNode = strtoul(optarg, NULL, 10); break;
+      default:
+        fprintf(stderr, "usage: %s [-t threads-per-node] [-n ids-per-thread] [-s simulated-nodes] [-f first-node-id]\n", argv[0]);
+        return 1;
+    }
+  }
+  NumaTopology topo;
+  if (simulate) { topo.Simulate(simulate); } else { topo.Discover(); }
+  unsigned nodes = topo.NodeCount();
+  for (unsigned n=0; n<nodes; ++n) {
+    fprintf(stdout, "NUMA node %u (host node %d): %zu CPUs\n", n, topo.hostNode[n], topo.cpus[n].size());
+  }
+  if (!threadsPerNode) {
+    threadsPerNode = topo.cpus[0].size() > 1 ? topo.cpus[0].size() : 2;
+  }
+
+  fprintf(stdout, "-- generator core, %u threads on one node, shared locked IdGenerator, %" PRIu64 " IDs per thread\n",
+      threadsPerNode, count);
+  for (unsigned t=0; t<nodes; ++t) {
+    for (unsigned m=0; m<nodes; ++m) {
+      double ns = GeneratorRun(topo, t, m, threadsPerNode, count);
+      fprintf(stdout, "threads on node %u, generator on node %u (%s): %8.2f ns/id\n", t, m, t == m ? "local " : "remote", ns);
+    }
+  }
+
+  unsigned threads = threadsPerNode * nodes;
+  uint64_t nodeCount = count / 10;
+  auto configure = [](IdNode& node) { node.SetIoUring(); };
+  fprintf(stdout, "-- IdNodes, %u threads over %u nodes, %" PRIu64 " IDs per thread\n", threads, nodes, nodeCount);
+  {
+    IdNode shared;
+    std::mutex lock;
+    configure(shared);
+    if (!shared.Initialize(firstNode, nodes)) { fprintf(stderr, "ERROR: Failed to initialize node %u\n", firstNode); return 1; }
+    uint64_t failures;
+    double ns = NodeRun(topo, threads, nodeCount, [&](uint64_t& id) {
+      std::lock_guard<std::mutex> guard(lock);
+      return shared.GetId(id);
+    }, failures);
+    fprintf(stdout, "one shared IdNode (%u shards):  %8.2f ns/id (%" PRIu64 " failures)\n", nodes, ns, failures);
+  }
+  {
+    IdNumaPool pool;
+    pool.configure = configure;
+    if (!pool.Initialize(firstNode + nodes, 1, simulate)) { return 1; }
+    uint64_t failures;
+    double ns = NodeRun(topo, threads, nodeCount, [&](uint64_t& id) { return pool.GetId(id); }, failures);
+    fprintf(stdout, "IdNumaPool (%u IdNodes):        %8.2f ns/id (%" PRIu64 " failures)\n",
+        pool.GetShardCount(), ns, failures);
+  }
+  return 0;
+}
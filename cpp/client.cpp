@@ -2,14 +2,43 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 
 #include "DistId.hpp"
+#include "IdCodec.hpp"
 
 
 int main(int argc, char* argv[]) {
   IdNode node;
   uint64_t id;
   unsigned idCount = 1000000;
+  const char* leaseServer = NULL;
+  bool compress = false;
+
+  // options: -6 (IPv6 multicast), -m <group:port>, -i <interface|auto>, 
+  //          -T <server:port> (lease timestamps from a server, instead of multicast),
+  //          -z (write a compressed binary stream, see IdCodec.hpp, instead of hex lines),
+  //          -D (crash-safe high-water marks, synced asynchronously),
+  //          -U (io_uring sockets)
+  int opt;
+  while ((opt = getopt(argc, argv, "6m:i:T:zDU")) != -1) {
+    switch (opt) {
+      case '6': node.SetMulticastAddress(MULTICAST_ADDR6); break;
+      case 'm': node.SetMulticastAddress(optarg); break;
+      case 'i':
+        if (!node.SetInterface(optarg)) { return 1; }
+        break;
+      case 'T': leaseServer = optarg; break;
+      case 'z': compress = true; break;
+      case 'D': node.SetDurable(); break;
+      case 'U': node.SetIoUring(); break;
+      default:
+        fprintf(stderr, "Usage: %s [-6] [-m group:port] [-i interface] [-T lease-server] [-z] [-D] [-U] <nodeId> [count]\n", argv[0]);
+        return 1;
+    }
+  }
+  argc -= optind-1;
+  argv += optind-1;
 
   if (argc < 2) {
     fprintf(stderr, "Missing NodeId argument!\n");
@@ -21,12 +50,37 @@ int main(int argc, char* argv[]) {
     return 1;
   }
   // TODO validate it's a number...
-  id = strtol(argv[1], NULL, 10);
+  // "<nodeId>+<count>" owns a block of 'count' node-ids
+  // "auto[+<count>]" leases free node-ids from peers
+  char* end = NULL;
+  bool lease = (0 == strncmp(argv[1], "auto", 4));
+  id = lease ? 0 : strtol(argv[1], &end, 10);
+  if (lease) { end = argv[1] + 4; }
+  unsigned nodeCount = 1;
+  if (end && *end == '+') {
+    nodeCount = strtol(end+1, NULL, 10);
+  }
 
-  if (!node.Initialize(id)) {
+  if (lease && leaseServer) {
+    fprintf(stderr, "ERROR: Time-leases need a static node-id!\n");
+    return 1;
+  }
+  bool ok = leaseServer ? node.InitializeTimeLease(leaseServer, id, nodeCount) :
+            lease ? node.InitializeLease("lease.state", nodeCount) : node.Initialize(id, nodeCount);
+  if (!ok) {
     fprintf(stderr,"ERROR: Failed to initialize IdNode properly!\n");
     return 2;
   }
+  if (compress) {
+    IdEncoder enc;
+    for (unsigned i=0; i<idCount; ++i) {
+      if (!node.GetId(id)) { continue; }
+      enc.Add(id);
+      if (enc.Data().size() >= 65536 && !enc.Drain(stdout)) { return 3; }
+    }
+    enc.Flush();
+    return enc.Drain(stdout) ? 0 : 3;
+  }
   for (unsigned i=0; i<idCount; ++i) {
     node.GetId(id);
     fprintf(stdout, "%" PRIx64 "\n", id);
@@ -0,0 +1,139 @@
+/* Copyright 2020, Tim Crowder, All rights reserved. */
+
+/* C interface to IdNode (libdistid.so), for other languages (FFI) and C programs.
+ *
+ * Stable ABI: only opaque handles, fixed-width integers and plain structs
+ * cross the boundary, no C++ exceptions escape, and no call allocates
+ * (except distid_create()). New functions may be added, existing ones keep
+ * their signatures; distid_get_stats() takes the caller's struct size, so
+ * the struct can grow.
+ *
+ * Calls on one node are serialized internally (a node is one generator,
+ * so use one node per process, or per NUMA node). Batch calls amortize the
+ * cost of crossing the FFI boundary (and of polling peer messages).
+ *
+ *   distid_node* node = distid_create();
+ *   if (!node || distid_start(node, 42, 1) != DISTID_OK) { ... }
+ *   uint64_t ids[256];
+ *   long n = distid_get_batch(node, ids, 256);
+ *   distid_destroy(node);
+ */
+
+#ifndef DISTID_H
+#define DISTID_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DISTID_API_VERSION 2
+
+#if defined(__GNUC__)
+#define DISTID_API __attribute__((visibility("default")))
+#else
+#define DISTID_API
+#endif
+
+/* Return codes (negative are errors). */
+enum {
+  DISTID_OK         =  0,
+  DISTID_EINVAL     = -1, /* invalid argument (or field out of range) */
+  DISTID_ESTATE     = -2, /* not started, or already started */
+  DISTID_EINIT      = -3, /* failed to start (e.g. socket, state file, or lease errors) */
+  DISTID_ECOLLISION = -4, /* another node uses the same node-id, no more IDs */
+  DISTID_EUNAVAIL   = -5, /* no ID available right now (e.g. time lease expired, or a bulk request shed) */
+  DISTID_EINTERNAL  = -6  /* unexpected internal error */
+};
+
+/* Request priority classes (see distid_set_admission()). */
+enum {
+  DISTID_PRIORITY_CRITICAL = 0,
+  DISTID_PRIORITY_NORMAL   = 1, /* distid_get() and distid_get_batch() */
+  DISTID_PRIORITY_BULK     = 2
+};
+
+typedef struct distid_node distid_node;
+
+/* The fields of an ID. */
+typedef struct distid_fields {
+  uint64_t timestamp; /* creation time, milliseconds since the Unix epoch */
+  uint16_t counter;
+  uint16_t node;
+  uint32_t reserved;
+} distid_fields;
+
+/* Coordination counters of a node (see IdNodeStats). */
+typedef struct distid_stats {
+  uint64_t ids;          /* IDs returned through this interface */
+  uint64_t polls;        /* transport polls */
+  uint64_t packets_in;   /* peer messages received */
+  uint64_t packets_out;  /* peer messages sent */
+  uint64_t store_writes; /* state store writes */
+  uint64_t ts_updates;   /* timestamp updates */
+  uint64_t throttles;    /* throttling sleeps */
+  uint64_t syncs;        /* durable high-water mark writes */
+  uint64_t sync_waits;   /* waits for a durable high-water mark */
+  uint64_t shed;         /* bulk requests refused (version 2) */
+} distid_stats;
+
+/* Returns DISTID_API_VERSION of the library. */
+DISTID_API int distid_api_version(void);
+
+/* Returns a new (not yet started) node, or NULL if out of memory. */
+DISTID_API distid_node* distid_create(void);
+/* Stops and frees 'node' (NULL is ignored). */
+DISTID_API void distid_destroy(distid_node* node);
+
+/* Options, before starting. */
+DISTID_API int distid_set_multicast(distid_node* node, const char* group);   /* "addr:port" (IPv4 or IPv6) */
+DISTID_API int distid_set_interface(distid_node* node, const char* ifname);  /* name, or "auto" */
+DISTID_API int distid_set_io_uring(distid_node* node, int enable);
+/* Makes the stored high-water marks crash safe. Enable-only: 'enable' 0 returns DISTID_EINVAL. */
+DISTID_API int distid_set_durable(distid_node* node, int enable);
+
+/* Starts the node with the static node-ids [first, first+count).
+ * Blocks for the startup listen window: LISTEN_TIME the library was built with (3 s by default),
+ * cut short once a peer has answered for every node-id. */
+DISTID_API int distid_start(distid_node* node, uint16_t first, uint16_t count);
+/* Starts the node with 'count' leased node-ids (state file 'state_file', or NULL for the default). */
+DISTID_API int distid_start_lease(distid_node* node, const char* state_file, uint16_t count);
+/* Starts the node with timestamps leased from the time-lease server 'server' ("addr:port"). */
+DISTID_API int distid_start_time_lease(distid_node* node, const char* server, uint16_t first, uint16_t count);
+
+/* Returns the first owned node-id in 'first' (and the number of them in 'count', if not NULL). */
+DISTID_API int distid_node_ids(distid_node* node, uint16_t* first, uint16_t* count);
+
+/* Stores the next ID in '*id'. */
+DISTID_API int distid_get(distid_node* node, uint64_t* id);
+/* Stores up to 'count' IDs in 'ids'.
+ * Returns the number stored (less than 'count' if IDs ran out), or a negative error if none. */
+DISTID_API long distid_get_batch(distid_node* node, uint64_t* ids, size_t count);
+
+/* Reserves the top 'critical_reserve' counters of each millisecond for critical requests,
+ * and the 'normal_reserve' below them for normal (and critical) ones. Bulk requests get the
+ * rest, and fail with DISTID_EUNAVAIL once it's used (or wait for the next millisecond, with 'wait_bulk'). (version 2) */
+DISTID_API int distid_set_admission(distid_node* node, uint16_t critical_reserve, uint16_t normal_reserve, int wait_bulk);
+/* Stores the next ID of priority class 'priority' in '*id'. (version 2) */
+DISTID_API int distid_get_priority(distid_node* node, int priority, uint64_t* id);
+/* Returns the number of IDs class 'priority' can get now without waiting (back off near 0),
+ * or a negative error. (version 2) */
+DISTID_API long distid_headroom(distid_node* node, int priority);
+
+/* Splits 'count' IDs into their fields (no node needed). */
+DISTID_API void distid_decode_batch(const uint64_t* ids, distid_fields* fields, size_t count);
+/* Extracts the creation timestamps (milliseconds) of 'count' IDs. */
+DISTID_API void distid_timestamps_batch(const uint64_t* ids, uint64_t* timestamps, size_t count);
+/* Builds an ID from its fields (e.g. range bounds for queries), DISTID_EINVAL if one is out of range. */
+DISTID_API int distid_encode(uint64_t timestamp, uint16_t counter, uint16_t node_id, uint64_t* id);
+
+/* Copies the counters into 'stats' (of 'size' bytes, normally sizeof(distid_stats)). */
+DISTID_API int distid_get_stats(distid_node* node, distid_stats* stats, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DISTID_H */
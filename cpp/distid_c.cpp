@@ -0,0 +1,216 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+// C interface to IdNode (see distid.h), built as libdistid.so.
+// Everything else in the library is hidden (-fvisibility=hidden), and every
+// entry point catches exceptions, so none cross into C (or other languages).
+
+#include <limits.h>
+#include <string.h>
+
+#include <mutex>
+#include <new>
+
+#include "distid.h"
+#include "DistId.hpp"
+
+struct distid_node {
+  std::mutex lock;    // serializes calls (IdNode isn't thread-safe)
+  IdNode     node;
+  bool       started;
+  uint64_t   ids;
+
+  distid_node() : started(false), ids(0) { }
+};
+
+// Runs 'body' with the node locked, mapping exceptions to DISTID_EINTERNAL.
+template<typename F> static long Locked(distid_node* n, F body) {
+  if (!n) { return DISTID_EINVAL; }
+  try {
+    std::lock_guard<std::mutex> guard(n->lock);
+    return body(*n);
+  } catch (...) {
+    return DISTID_EINTERNAL;
+  }
+}
+
+// Returns the error for a node that returned no ID.
+static int NoIdError(distid_node& n) {
+  if (!n.started) { return DISTID_ESTATE; }
+  return n.node.HasCollision() ? DISTID_ECOLLISION : DISTID_EUNAVAIL;
+}
+
+extern "C" {
+
+DISTID_API int distid_api_version(void) { return DISTID_API_VERSION; }
+
+DISTID_API distid_node* distid_create(void) {
+  try {
+    return new (std::nothrow) distid_node();
+  } catch (...) {
+    return NULL;
+  }
+}
+
+DISTID_API void distid_destroy(distid_node* node) {
+  try {
+    delete node;
+  } catch (...) {
+  }
+}
+
+DISTID_API int distid_set_multicast(distid_node* node, const char* group) {
+  return Locked(node, [group](distid_node& n) -> long {
+    if (!group) { return DISTID_EINVAL; }
+    if (n.started) { return DISTID_ESTATE; }
+    n.node.SetMulticastAddress(group);
+    return DISTID_OK;
+  });
+}
+
+DISTID_API int distid_set_interface(distid_node* node, const char* ifname) {
+  return Locked(node, [ifname](distid_node& n) -> long {
+    if (!ifname) { return DISTID_EINVAL; }
+    if (n.started) { return DISTID_ESTATE; }
+    return n.node.SetInterface(ifname) ? DISTID_OK : DISTID_EINVAL;
+  });
+}
+
+DISTID_API int distid_set_io_uring(distid_node* node, int enable) {
+  return Locked(node, [enable](distid_node& n) -> long {
+    if (n.started) { return DISTID_ESTATE; }
+    n.node.SetIoUring(enable != 0);
+    return DISTID_OK;
+  });
+}
+
+DISTID_API int distid_set_durable(distid_node* node, int enable) {
+  return Locked(node, [enable](distid_node& n) -> long {
+    if (n.started) { return DISTID_ESTATE; }
+    if (!enable) { return DISTID_EINVAL; } // (can't be turned off once set)
+    n.node.SetDurable();
+    return DISTID_OK;
+  });
+}
+
+DISTID_API int distid_start(distid_node* node, uint16_t first, uint16_t count) {
+  return Locked(node, [first, count](distid_node& n) -> long {
+    if (n.started) { return DISTID_ESTATE; }
+    if (count < 1 || first + count > MAX_NODES) { return DISTID_EINVAL; }
+    n.started = n.node.Initialize(first, count);
+    return n.started ? DISTID_OK : DISTID_EINIT;
+  });
+}
+
+DISTID_API int distid_start_lease(distid_node* node, const char* state_file, uint16_t count) {
+  return Locked(node, [state_file, count](distid_node& n) -> long {
+    if (n.started) { return DISTID_ESTATE; }
+    if (count < 1 || count > MAX_NODES) { return DISTID_EINVAL; }
+    n.started = n.node.InitializeLease(state_file ? state_file : "lease.state", count);
+    return n.started ? DISTID_OK : DISTID_EINIT;
+  });
+}
+
+DISTID_API int distid_start_time_lease(distid_node* node, const char* server, uint16_t first, uint16_t count) {
+  return Locked(node, [server, first, count](distid_node& n) -> long {
+    if (n.started) { return DISTID_ESTATE; }
+    if (!server || count < 1 || first + count > MAX_NODES) { return DISTID_EINVAL; }
+    n.started = n.node.InitializeTimeLease(server, first, count);
+    return n.started ? DISTID_OK : DISTID_EINIT;
+  });
+}
+
+DISTID_API int distid_node_ids(distid_node* node, uint16_t* first, uint16_t* count) {
+  return Locked(node, [first, count](distid_node& n) -> long {
+    if (!first) { return DISTID_EINVAL; }
+    if (!n.started) { return DISTID_ESTATE; }
+    *first = n.node.GetNodeId();
+    if (count) { *count = n.node.GetShardCount(); }
+    return DISTID_OK;
+  });
+}
+
+DISTID_API int distid_get(distid_node* node, uint64_t* id) {
+  return Locked(node, [id](distid_node& n) -> long {
+    if (!id) { return DISTID_EINVAL; }
+    if (!n.started || !n.node.GetId(*id)) { return NoIdError(n); }
+    ++n.ids;
+    return DISTID_OK;
+  });
+}
+
+DISTID_API long distid_get_batch(distid_node* node, uint64_t* ids, size_t count) {
+  return Locked(node, [ids, count](distid_node& n) -> long {
+    if (!ids || count > (size_t)LONG_MAX) { return DISTID_EINVAL; }
+    if (!count) { return 0; }
+    if (!n.started) { return DISTID_ESTATE; }
+    size_t got = n.node.GetIds(ids, count);
+    n.ids += got;
+    return got ? (long)got : NoIdError(n);
+  });
+}
+
+DISTID_API int distid_set_admission(distid_node* node, uint16_t critical_reserve, uint16_t normal_reserve, int wait_bulk) {
+  return Locked(node, [critical_reserve, normal_reserve, wait_bulk](distid_node& n) -> long {
+    return n.node.SetAdmission(critical_reserve, normal_reserve, wait_bulk != 0) ? DISTID_OK : DISTID_EINVAL;
+  });
+}
+
+DISTID_API int distid_get_priority(distid_node* node, int priority, uint64_t* id) {
+  return Locked(node, [priority, id](distid_node& n) -> long {
+    if (!id || priority < 0 || priority >= PRIORITY_CLASSES) { return DISTID_EINVAL; }
+    if (!n.started || !n.node.GetPriorityId(*id, (IdPriority)priority)) { return NoIdError(n); }
+    ++n.ids;
+    return DISTID_OK;
+  });
+}
+
+DISTID_API long distid_headroom(distid_node* node, int priority) {
+  return Locked(node, [priority](distid_node& n) -> long {
+    if (priority < 0 || priority >= PRIORITY_CLASSES) { return DISTID_EINVAL; }
+    if (!n.started) { return DISTID_ESTATE; }
+    return n.node.GetHeadroom((IdPriority)priority);
+  });
+}
+
+DISTID_API void distid_decode_batch(const uint64_t* ids, distid_fields* fields, size_t count) {
+  if (!ids || !fields) { return; }
+  for (size_t i=0; i<count; ++i) {
+    distid_fields& f = fields[i];
+    IdNode::IdToFields(f.timestamp, f.counter, f.node, ids[i]);
+    f.reserved = 0;
+  }
+}
+
+DISTID_API void distid_timestamps_batch(const uint64_t* ids, uint64_t* timestamps, size_t count) {
+  if (!ids || !timestamps) { return; }
+  IdNode::IdsToTimestamps(ids, timestamps, count);
+}
+
+DISTID_API int distid_encode(uint64_t timestamp, uint16_t counter, uint16_t node_id, uint64_t* id) {
+  if (!id) { return DISTID_EINVAL; }
+  return IdNode::TryFieldsToId(*id, timestamp, counter, node_id) ? DISTID_OK : DISTID_EINVAL;
+}
+
+DISTID_API int distid_get_stats(distid_node* node, distid_stats* stats, size_t size) {
+  return Locked(node, [stats, size](distid_node& n) -> long {
+    if (!stats) { return DISTID_EINVAL; }
+    const IdNodeStats& s = n.node.GetStats();
+    distid_stats out;
+    out.ids = n.ids;
+    out.polls = s.polls;
+    out.packets_in = s.packetsIn;
+    out.packets_out = s.packetsOut;
+    out.store_writes = s.storeWrites;
+    out.ts_updates = s.tsUpdates;
+    out.throttles = s.throttles;
+    out.syncs = s.syncs;
+    out.sync_waits = s.syncWaits;
+    out.shed = s.shed;
+    // (older callers pass a smaller struct, newer ones get zeros past ours)
+    memset(stats, 0, size);
+    memcpy(stats, &out, size < sizeof(out) ? size : sizeof(out));
+    return DISTID_OK;
+  });
+}
+
+} // extern "C"
@@ -0,0 +1,84 @@
+/* Copyright 2020, Tim Crowder, All rights reserved. */
+
+/* Example (and smoke test) of the C interface in libdistid.so.
+ *
+ *   usage: distid_example [node-id] [count]
+ *
+ * Gets 'count' IDs in batches, checks they're increasing, decodes a few,
+ * and prints the node's counters. Exits non-zero on any failure.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "distid.h"
+
+#define BATCH 256
+
+static int failures = 0;
+
+static void check(int ok, const char* what) {
+  if (!ok) {
+    fprintf(stderr, "ERROR: %s\n", what);
+    ++failures;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  uint16_t nodeId = argc > 1 ? (uint16_t)atoi(argv[1]) : 950;
+  long count = argc > 2 ? atol(argv[2]) : 100000;
+  uint64_t ids[BATCH];
+  distid_fields fields[4];
+  distid_stats stats;
+  uint64_t last = 0, id = 0;
+  long total = 0;
+  uint16_t first = 0, owned = 0;
+
+  check(distid_api_version() == DISTID_API_VERSION, "API version");
+  check(distid_encode(1, 1024, 0, &id) == DISTID_EINVAL, "counter range check");
+  check(distid_encode(1, 0, 1024, &id) == DISTID_EINVAL, "node range check");
+  check(distid_encode(1, 2, 3, &id) == DISTID_OK && id == ((((uint64_t)1 << 10) + 2) << 10) + 3, "encode");
+
+  distid_node* node = distid_create();
+  check(node != NULL, "create");
+  if (!node) { return 1; }
+  check(distid_get(node, &id) == DISTID_ESTATE, "get before start");
+  check(distid_set_durable(node, 0) == DISTID_EINVAL, "durable is enable-only");
+  check(distid_start(node, nodeId, 2) == DISTID_OK, "start");
+  check(distid_set_io_uring(node, 1) == DISTID_ESTATE, "options after start");
+  check(distid_node_ids(node, &first, &owned) == DISTID_OK && first == nodeId && owned == 2, "node ids");
+
+  check(distid_get(node, &last) == DISTID_OK, "get");
+  while (total < count) {
+    long n = distid_get_batch(node, ids, BATCH);
+    if (n <= 0) { check(0, "get batch"); break; }
+    for (long i=0; i<n; ++i) {
+      /* (per node-id increasing; the two shards alternate) */
+      if ((ids[i] & 1023) == (last & 1023) && ids[i] <= last) { check(0, "increasing IDs"); }
+      if ((ids[i] & 1023) == (last & 1023)) { last = ids[i]; }
+    }
+    total += n;
+  }
+
+  distid_decode_batch(ids, fields, 4);
+  for (int i=0; i<4; ++i) {
+    check(fields[i].node == nodeId || fields[i].node == nodeId + 1, "decoded node-id");
+    printf("%016" PRIx64 " => {t:%" PRIu64 ", c:%u, n:%u}\n", ids[i], fields[i].timestamp, fields[i].counter, fields[i].node);
+  }
+  check(distid_get_stats(node, &stats, sizeof(stats)) == DISTID_OK && stats.ids == (uint64_t)total + 1, "stats");
+  printf("ids %" PRIu64 ", polls %" PRIu64 ", packets in %" PRIu64 " out %" PRIu64 ", store writes %" PRIu64 "\n",
+      stats.ids, stats.polls, stats.packets_in, stats.packets_out, stats.store_writes);
+
+  /* reserve counters for critical requests, bulk ones are shed first */
+  check(distid_set_admission(node, 1024, 0, 0) == DISTID_EINVAL, "admission range check");
+  check(distid_set_admission(node, 100, 200, 0) == DISTID_OK, "admission");
+  /* (bulk requests get at most the unreserved counters of both shards) */
+  check(distid_headroom(node, DISTID_PRIORITY_BULK) >= 0 && distid_headroom(node, DISTID_PRIORITY_BULK) <= 2*(1023 - 300), "headroom");
+  check(distid_get_priority(node, DISTID_PRIORITY_CRITICAL, &id) == DISTID_OK, "critical get");
+  check(distid_get_priority(node, 3, &id) == DISTID_EINVAL, "priority range check");
+  distid_destroy(node);
+
+  if (failures) { fprintf(stderr, "%d failures\n", failures); }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,142 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+// Shows the peer tables (state files) of IdNodes: every known node-id, its
+// high-water mark, owner, and the load it announced in its UP messages
+// (IDs per second, counter use per millisecond, throttling, clock drift).
+// Any node's table is a view of the whole cluster, so hot node-ids can be
+// spotted (and rebalanced) before they throttle. Files are only read, in any
+// format version.
+//
+//   usage: idstat [options] [file...]   (all *.state files if none)
+//     -a <ms>    skip node-ids whose high-water mark is older than this (e.g. stopped nodes)
+//     -H <pct>   counter use (percent) that counts as hot (default 80, throttling always does)
+//     -h         only hot node-ids
+//     -s         sort by load (IDs per second), instead of node-id
+//
+//   exit status: 0, 1 if a hot node-id was shown, 2 on errors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "DistId.hpp"
+
+// Reads every non-empty record of state file 'fname' into 'recs' (without converting the file).
+// Returns false if it can't be read, or isn't a state file.
+static bool ReadStateFile(const char* fname, std::vector<IdNodeState>& recs) {
+  struct stat st;
+  if (0 != stat(fname, &st)) {
+    fprintf(stderr, "ERROR: Can't read '%s'!\n", fname);
+    return false;
+  }
+  unsigned recSize = st.st_size / MAX_NODES;
+  if (st.st_size % MAX_NODES || (recSize != STATE_V1_SIZE && recSize != STATE_V2_SIZE && recSize != STATE_V3_SIZE && recSize != sizeof(IdNodeState))) {
+    fprintf(stderr, "ERROR: '%s' isn't a state file (size %ld)!\n", fname, (long)st.st_size);
+    return false;
+  }
+  std::vector<char> data(st.st_size);
+  FILE* f = fopen(fname, "rb");
+  bool ok = f && (1 == fread(&data[0], data.size(), 1, f));
+  if (f) { fclose(f); }
+  if (!ok) {
+    fprintf(stderr, "ERROR: Can't read '%s'!\n", fname);
+    return false;
+  }
+  for (unsigned i=0; i<MAX_NODES; ++i) {
+    IdNodeState rec;
+    if (rec.Decode(&data[i*recSize], recSize) && rec.timestamp) { recs.push_back(rec); }
+  }
+  return true;
+}
+
+static void PrintRecord(const IdNodeState& rec, uint64_t now, unsigned hotPct) {
+  char mode[3] = { 0, 0, 0 };
+  memcpy(mode, &rec.mode, 2);
+  char addr[INET6_ADDRSTRLEN + 8];
+  if (rec.IsV6()) {
+    char ip[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, rec.ip6, ip, sizeof(ip));
+    snprintf(addr, sizeof(addr), "[%s]:%u", ip, rec.port);
+  } else {
+    // (older peers' IPv6 addresses are only there folded, and print as IPv4)
+    snprintf(addr, sizeof(addr), "%u.%u.%u.%u:%u", rec.ipaddr >> 24, (rec.ipaddr >> 16) & 255,
+        (rec.ipaddr >> 8) & 255, rec.ipaddr & 255, rec.port);
+  }
+  double age = rec.timestamp < now ? (now - rec.timestamp) / 1000.0 : 0;
+  fprintf(stdout, "%4u  %-2s v%u  %13" PRIu64 " %9.1f  %5u  %016" PRIx64 "  %-21s",
+      rec.id, mode, rec.version, rec.timestamp, age, rec.boot, rec.instance, addr);
+  if (rec.version >= 3) {
+    fprintf(stdout, "  %9u %5u%% %6u %8d%s\n", rec.qps, rec.counterUse, rec.throttles, rec.driftMs,
+        rec.IsHot(hotPct) ? "  HOT" : "");
+  } else {
+    fprintf(stdout, "  %9s %6s %6s %8s\n", "-", "-", "-", "-");
+  }
+}
+
+int main(int argc, char* argv[]) {
+  uint64_t maxAgeMs = 0;
+  unsigned hotPct = 80;
+  bool onlyHot = false;
+  bool byLoad = false;
+  int c;
+  while ((c = getopt(argc, argv, "a:H:hs")) != -1) {
+    switch (c) {
+      case 'a': maxAgeMs = strtoull(optarg, NULL, 10); break;
+      case 'H': hotPct = strtoul(optarg, NULL, 10); break;
+      case 'h': onlyHot = true; break;
+      case 's': byLoad = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-a max-age-ms] [-H hot-percent] [-h] [-s] [file...]\n", argv[0]);
+        return 2;
+    }
+  }
+  std::vector<std::string> files(argv + optind, argv + argc);
+  if (files.empty()) {
+    glob_t g;
+    if (0 == glob("*.state", 0, NULL, &g)) {
+      files.assign(g.gl_pathv, g.gl_pathv + g.gl_pathc);
+    }
+    globfree(&g);
+  }
+  if (files.empty()) {
+    fprintf(stderr, "ERROR: No state files!\n");
+    return 2;
+  }
+
+  uint64_t now = IdNode::GetRtTimestampMs();
+  bool failed = false, anyHot = false;
+  for (const std::string& file : files) {
+    std::vector<IdNodeState> recs;
+    if (!ReadStateFile(file.c_str(), recs)) { failed = true; continue; }
+    std::vector<IdNodeState> shown;
+    uint64_t qps = 0;
+    unsigned hot = 0;
+    for (const IdNodeState& rec : recs) {
+      if (maxAgeMs && rec.timestamp + maxAgeMs < now) { continue; }
+      bool isHot = rec.version >= 3 && rec.IsHot(hotPct);
+      if (onlyHot && !isHot) { continue; }
+      shown.push_back(rec);
+      qps += rec.qps;
+      hot += isHot;
+    }
+    if (byLoad) {
+      std::stable_sort(shown.begin(), shown.end(),
+          [](const IdNodeState& a, const IdNodeState& b) { return a.qps > b.qps; });
+    }
+    fprintf(stdout, "------ %s ------\n", file.c_str());
+    fprintf(stdout, "node  mode     high-water ms     age s   boot  instance          address              "
+        "       ids/s   use  thrtl  drift ms\n");
+    for (const IdNodeState& rec : shown) { PrintRecord(rec, now, hotPct); }
+    fprintf(stdout, "%zu node-ids, %" PRIu64 " ids/s, %u hot\n", shown.size(), qps, hot);
+    anyHot = anyHot || hot;
+  }
+  return failed ? 2 : anyHot ? 1 : 0;
+}
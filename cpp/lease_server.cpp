@@ -0,0 +1,40 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+// Central time-lease server for IdNodes in consistency-first mode
+// (client -T <server>, or IdNode::InitializeTimeLease()).
+//
+//   usage: lease_server [options]
+//     -a <addr:port>  listen address (default 0.0.0.0:26981)
+//     -f <file>       lease state file (default timelease.state)
+//     -l <ms>         longest lease granted (default 600000)
+//     -v              log every grant
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "LeaseServer.hpp"
+
+int main(int argc, char* argv[]) {
+  const char* addr = "0.0.0.0:26981";
+  const char* stateFile = "timelease.state";
+  TimeLeaseServer server;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "a:f:l:v")) != -1) {
+    switch (opt) {
+      case 'a': addr = optarg; break;
+      case 'f': stateFile = optarg; break;
+      case 'l': server.SetMaxLeaseMs(strtoull(optarg, NULL, 10)); break;
+      case 'v': debug = 1; break;
+      default:
+        fprintf(stderr, "Usage: %s [-a addr:port] [-f state-file] [-l max-lease-ms] [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (!server.Open(addr, stateFile)) { return 2; }
+  fprintf(stderr, "INFO: Lease server listening on %s (state in %s)\n", addr, stateFile);
+  while (true) {
+    server.Poll(100000);
+  }
+}
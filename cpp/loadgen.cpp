@@ -0,0 +1,286 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+// Load generator: runs N IdNodes (threads, or processes) on one multicast
+// group, each calling GetId() at a fixed open-loop rate (in bursts), and
+// reports latency percentiles and per-node coordination counters.
+// Latency is measured from when each burst was scheduled to start, so a node
+// that falls behind its schedule shows it (no "coordinated omission"), and
+// split into the schedule lag (scheduled start to the start of the burst) and
+// the service time of each GetId() call. Bursts are started by sleeping with a
+// 1 ns timer slack, and spinning for the last SPIN_NS, so the lag is the
+// node's own (not the kernel's default 50 us timer slack).
+//
+//   usage: loadgen [options]
+//     -n <nodes>    number of IdNodes (default 4)
+//     -f <node-id>  first node-id (default 800), nodes use consecutive node-ids
+//     -r <rate>     IDs per second, per node (default 100000)
+//     -b <burst>    IDs per burst (default 1), bursts are spaced burst/rate apart
+//     -d <seconds>  duration of the measurement (default 5)
+//     -P            one process per node (default: one thread per node)
+//     -U            io_uring sockets (multishot receive, batched sends)
+//     -i <iface>    multicast interface (default lo, '' for the default route)
+//     -m <group>    multicast group addr:port
+//     -v            per-node results
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DistId.hpp"
+#include "LatencyHistogram.hpp"
+
+// Bursts are waited for by spinning for their last SPIN_NS (after sleeping until then).
+#define SPIN_NS 50000
+
+struct Options {
+  unsigned    nodes;
+  unsigned    firstNode;
+  double      rate;
+  unsigned    burst;
+  double      seconds;
+  bool        processes;
+  bool        uring;
+  std::string iface;
+  std::string group;
+  bool        verbose;
+};
+
+// Results of one node (plain data, sent over a pipe in process mode).
+struct NodeResult {
+  uint16_t         nodeId;
+  bool             ok;        // initialized, and ran to the end
+  uint64_t         ids;       // IDs generated
+  uint64_t         failures;  // GetId() failures
+  uint64_t         lateBursts; // bursts that started after the next one was due
+  double           seconds;   // actual measurement duration
+  IdNodeStats      stats;     // counters during the measurement
+  LatencyHistogram latency;   // per ID, from the scheduled start of its burst
+  LatencyHistogram lag;       // per burst, from its scheduled to its actual start
+  LatencyHistogram service;   // per ID, the GetId() call
+
+  NodeResult() : nodeId(0), ok(false), ids(0), failures(0), lateBursts(0), seconds(0) { }
+};
+
+static uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+// Sleeps until CLOCK_MONOTONIC time 'ns'.
+static void SleepUntilNs(uint64_t ns) {
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000ull;
+  ts.tv_nsec = ns % 1000000000ull;
+  while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) { }
+}
+
+// Waits until CLOCK_MONOTONIC time 'ns': sleeps until SPIN_NS before it, then spins. Returns the time.
+static uint64_t WaitUntilNs(uint64_t ns) {
+  uint64_t now = NowNs();
+  if (now + SPIN_NS < ns) {
+    SleepUntilNs(ns - SPIN_NS);
+    now = NowNs();
+  }
+  while (now < ns) { now = NowNs(); }
+  return now;
+}
+
+static IdNodeStats StatsDelta(const IdNodeStats& a, const IdNodeStats& b) {
+  IdNodeStats d;
+  d.polls = a.polls - b.polls;
+  d.packetsIn = a.packetsIn - b.packetsIn;
+  d.packetsOut = a.packetsOut - b.packetsOut;
+  d.storeWrites = a.storeWrites - b.storeWrites;
+  d.tsUpdates = a.tsUpdates - b.tsUpdates;
+  d.throttles = a.throttles - b.throttles;
+  return d;
+}
+
+// Runs one node: initializes it, waits for the common start time 'startNs',
+// then generates IDs on schedule for the configured duration.
+static void RunNode(const Options& opt, unsigned index, uint64_t startNs, NodeResult& res) {
+  res.nodeId = opt.firstNode + index;
+  // the timer slack is per thread (and inherited by forked processes): 1 ns instead of 50 us
+  prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+  IdNode node;
+  if (!opt.group.empty()) { node.SetMulticastAddress(opt.group.c_str()); }
+  node.SetIoUring(opt.uring);
+  if (!opt.iface.empty() && !node.SetInterface(opt.iface.c_str())) { return; }
+  if (!node.Initialize(res.nodeId)) {
+    fprintf(stderr, "ERROR: Failed to initialize node %u!\n", res.nodeId);
+    return;
+  }
+  if (NowNs() < startNs) { SleepUntilNs(startNs); }
+
+  IdNodeStats before = node.GetStats();
+  uint64_t interval = (uint64_t)(1e9 * opt.burst / opt.rate);
+  uint64_t endNs = startNs + (uint64_t)(opt.seconds * 1e9);
+  uint64_t id;
+  for (uint64_t k=0; ; ++k) {
+    uint64_t scheduled = startNs + k*interval;
+    if (scheduled >= endNs) { break; }
+    uint64_t now = NowNs();
+    if (now < scheduled) {
+      now = WaitUntilNs(scheduled);
+    } else if (now >= scheduled + interval) {
+      ++res.lateBursts;
+    }
+    res.lag.Record(now - scheduled);
+    for (unsigned b=0; b<opt.burst; ++b) {
+      if (node.GetId(id)) { ++res.ids; } else { ++res.failures; }
+      uint64_t done = NowNs();
+      res.service.Record(done - now);
+      res.latency.Record(done - scheduled);
+      now = done;
+    }
+  }
+  res.seconds = (NowNs() - startNs) / 1e9;
+  res.stats = StatsDelta(node.GetStats(), before);
+  res.ok = !node.HasCollision();
+}
+
+static void PrintNode(const NodeResult& r) {
+  char label[32];
+  snprintf(label, 32, "node %u", r.nodeId);
+  double s = r.seconds > 0 ? r.seconds : 1;
+  fprintf(stdout, "%-12s %s ids %" PRIu64 " (%.0f/s), failures %" PRIu64 ", late bursts %" PRIu64 ", throttles %" PRIu64
+      ", polls/id %.2f, pkts in %.0f/s out %.0f/s, store writes %.0f/s\n",
+      label, r.ok ? "ok " : "BAD", r.ids, r.ids/s, r.failures, r.lateBursts, r.stats.throttles,
+      r.ids ? (double)r.stats.polls/r.ids : 0.0, r.stats.packetsIn/s, r.stats.packetsOut/s, r.stats.storeWrites/s);
+  r.latency.Print(stdout, label);
+  r.lag.Print(stdout, "  lag");
+  r.service.Print(stdout, "  service");
+}
+
+int main(int argc, char* argv[]) {
+  Options opt;
+  opt.nodes = 4;
+  opt.firstNode = 800;
+  opt.rate = 100000;
+  opt.burst = 1;
+  opt.seconds = 5;
+  opt.processes = false;
+  opt.uring = false;
+  opt.iface = "lo";
+  opt.verbose = false;
+
+  int c;
+  while ((c = getopt(argc, argv, "n:f:r:b:d:PUi:m:v")) != -1) {
+    switch (c) {
+      case 'n': opt.nodes = strtoul(optarg, NULL, 10); break;
+      case 'f': opt.firstNode = strtoul(optarg, NULL, 10); break;
+      case 'r': opt.rate = atof(optarg); break;
+      case 'b': opt.burst = strtoul(optarg, NULL, 10); break;
+      case 'd': opt.seconds = atof(optarg); break;
+      case 'P': opt.processes = true; break;
+      case 'U': opt.uring = true; break;
+      case 'i': opt.iface = optarg; break;
+      case 'm': opt.group = optarg; break;
+      case 'v': opt.verbose = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-n nodes] [-f first-node-id] [-r ids/s] [-b burst] [-d seconds] [-P] [-U] "
+            "[-i iface] [-m group:port] [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (opt.nodes < 1 || opt.firstNode + opt.nodes > MAX_NODES || opt.rate <= 0 || opt.burst < 1) {
+    fprintf(stderr, "ERROR: Invalid options (nodes %u, first node-id %u, rate %.0f, burst %u)\n",
+        opt.nodes, opt.firstNode, opt.rate, opt.burst);
+    return 1;
+  }
+
+  // everyone starts generating at the same time, after the startup listen window
+  uint64_t startNs = NowNs() + (LISTEN_TIME + 1000) * 1000000ull;
+  std::vector<NodeResult> results(opt.nodes);
+
+  if (opt.processes) {
+    std::vector<int> pipes(opt.nodes);
+    std::vector<pid_t> pids(opt.nodes);
+    for (unsigned i=0; i<opt.nodes; ++i) {
+      int fds[2];
+      if (0 != pipe(fds)) { perror("pipe"); return 1; }
+      pid_t pid = fork();
+      if (pid < 0) { perror("fork"); return 1; }
+      if (0 == pid) {
+        close(fds[0]);
+        RunNode(opt, i, startNs, results[i]);
+        const char* p = (const char*)&results[i];
+        size_t left = sizeof(NodeResult);
+        while (left) {
+          ssize_t ret = write(fds[1], p, left);
+          if (ret <= 0) { _exit(1); }
+          p += ret;
+          left -= ret;
+        }
+        _exit(0);
+      }
+      close(fds[1]);
+      pipes[i] = fds[0];
+      pids[i] = pid;
+    }
+    for (unsigned i=0; i<opt.nodes; ++i) {
+      char* p = (char*)&results[i];
+      size_t left = sizeof(NodeResult);
+      while (left) {
+        ssize_t ret = read(pipes[i], p, left);
+        if (ret <= 0) { break; }
+        p += ret;
+        left -= ret;
+      }
+      if (left) { results[i] = NodeResult(); } // the child failed
+      close(pipes[i]);
+      waitpid(pids[i], NULL, 0);
+    }
+  } else {
+    std::vector<std::thread> workers;
+    for (unsigned i=0; i<opt.nodes; ++i) {
+      workers.push_back(std::thread(RunNode, std::cref(opt), i, startNs, std::ref(results[i])));
+    }
+    for (auto& w : workers) { w.join(); }
+  }
+
+  LatencyHistogram all, lag, service;
+  NodeResult total;
+  unsigned ok = 0;
+  double seconds = 0;
+  for (auto& r : results) {
+    if (opt.verbose) { PrintNode(r); }
+    if (r.ok) { ++ok; }
+    all.Merge(r.latency);
+    lag.Merge(r.lag);
+    service.Merge(r.service);
+    total.ids += r.ids;
+    total.failures += r.failures;
+    total.lateBursts += r.lateBursts;
+    total.stats.polls += r.stats.polls;
+    total.stats.packetsIn += r.stats.packetsIn;
+    total.stats.packetsOut += r.stats.packetsOut;
+    total.stats.storeWrites += r.stats.storeWrites;
+    total.stats.tsUpdates += r.stats.tsUpdates;
+    total.stats.throttles += r.stats.throttles;
+    if (r.seconds > seconds) { seconds = r.seconds; }
+  }
+  if (seconds <= 0) { seconds = 1; }
+  fprintf(stdout, "%u %s%s, %u ok, target %.0f IDs/s per node in bursts of %u, %.1f s\n",
+      opt.nodes, opt.processes ? "processes" : "threads", opt.uring ? " (io_uring)" : "", ok, opt.rate, opt.burst, seconds);
+  fprintf(stdout, "IDs:          %" PRIu64 " (%.0f/s total, %.0f/s per node), %" PRIu64 " failures, %" PRIu64 " late bursts\n",
+      total.ids, total.ids/seconds, total.ids/seconds/opt.nodes, total.failures, total.lateBursts);
+  fprintf(stdout, "Per node:     %.0f pkts in/s, %.0f pkts out/s, %.0f store writes/s, %.0f timestamp updates/s, %.0f throttles/s\n",
+      total.stats.packetsIn/seconds/opt.nodes, total.stats.packetsOut/seconds/opt.nodes,
+      total.stats.storeWrites/seconds/opt.nodes, total.stats.tsUpdates/seconds/opt.nodes,
+      total.stats.throttles/seconds/opt.nodes);
+  fprintf(stdout, "Polls per ID: %.2f\n", total.ids ? (double)total.stats.polls/total.ids : 0.0);
+  all.Print(stdout, "latency");
+  lag.Print(stdout, "lag");
+  service.Print(stdout, "service");
+  return ok == opt.nodes ? 0 : 2;
+}
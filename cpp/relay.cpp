@@ -0,0 +1,65 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+// Multicast relay between subnets (or datacenters) that don't route the peer
+// multicast group: run one per subnet, each with the addresses of the others.
+// See IdRelay (Relay.hpp).
+//
+//   usage: relay [options] -p <addr:port> [-p <addr:port>...]
+//     -a <addr:port>  relay listen address (default 0.0.0.0:26982)
+//     -m <group:port> local multicast group (default 239.0.0.152:26980)
+//     -i <interface>  interface to join the group on (name, or "auto")
+//     -p <addr:port>  another relay (repeat for each)
+//     -s <seconds>    print the counters this often (default never)
+//     -v              log every message
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "Relay.hpp"
+
+int main(int argc, char* argv[]) {
+  const char* addr = RELAY_ADDR;
+  std::vector<const char*> peers;
+  unsigned statsSecs = 0;
+  IdRelay relay;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "a:m:i:p:s:v")) != -1) {
+    switch (opt) {
+      case 'a': addr = optarg; break;
+      case 'm': relay.SetMulticastAddress(optarg); break;
+      case 'i':
+        if (!relay.SetInterface(optarg)) { return 2; }
+        break;
+      case 'p': peers.push_back(optarg); break;
+      case 's': statsSecs = strtoul(optarg, NULL, 10); break;
+      case 'v': debug = 1; break;
+      default:
+        fprintf(stderr, "Usage: %s [-a addr:port] [-m group:port] [-i interface] [-s seconds] [-v] -p relay-addr:port...\n", argv[0]);
+        return 1;
+    }
+  }
+  if (peers.empty()) {
+    fprintf(stderr, "ERROR: No other relays (-p)!\n");
+    return 1;
+  }
+  if (!relay.Open(addr)) { return 2; }
+  for (const char* peer : peers) {
+    if (!relay.AddPeer(peer)) { return 2; }
+  }
+  fprintf(stderr, "INFO: Relay listening on %s, %zu other relays\n", addr, peers.size());
+  uint64_t nextStatsMs = IdNode::GetMonoTimestampMs() + statsSecs*1000;
+  while (true) {
+    relay.Poll(100000);
+    if (statsSecs && IdNode::GetMonoTimestampMs() >= nextStatsMs) {
+      const IdRelay::Stats& s = relay.GetStats();
+      fprintf(stderr, "INFO: local in %" PRIu64 ", dropped %" PRIu64 ", forwarded %" PRIu64 " in %" PRIu64 " digests, "
+          "received %" PRIu64 " digests (%" PRIu64 " invalid), injected %" PRIu64 "\n",
+          s.localIn, s.dropped, s.forwarded, s.digestsOut, s.digestsIn, s.invalid, s.injected);
+      nextStatsMs += statsSecs*1000;
+    }
+  }
+}
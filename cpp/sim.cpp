@@ -0,0 +1,220 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+// Runs IdNode clusters in the simulator (sim.hpp), and reports startup
+// failures, collision detection, duplicate IDs and protocol traffic.
+//
+//   usage: sim [options] <scenario>
+//     scenarios:
+//       cold      - all nodes start at once, with empty disks
+//       restart   - a running node crashes, and restarts on a fresh host (empty disk, warped clock),
+//                   reports the high-water replies to its request, and its startup time
+//       duplicate - a second node is started with an already running node-id
+//       lease     - all nodes lease a node-id at once
+//     options:
+//       -n <nodes>      cluster size (default 16, max 1024)
+//       -r <runs>       number of scenarios to run (default 100)
+//       -l <loss>       message loss rate (0-1, default 0)
+//       -u <dup>        message duplication rate (0-1, default 0)
+//       -d <delay>      one-way delay in ms (default 0.2)
+//       -j <jitter>     max extra random delay in ms (default 0.1)
+//       -w <warp>       clock warp in ms of restarted nodes (default -1000)
+//       -q <delay>      high-water reply delay window in ms (default REPLY_DELAY_MS, 0 for no suppression)
+//       -s <seed>       first random seed (default 1)
+//       -v              verbose (per-scenario results, node error messages)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim.hpp"
+
+struct Totals {
+  unsigned runs;
+  unsigned failed;     // scenarios where some expected node didn't come up
+  unsigned detected;   // scenarios where a collision was detected
+  unsigned shared;     // scenarios where a node-id was owned twice (while up)
+  unsigned dupRuns;    // scenarios with duplicate IDs
+  uint64_t dupMs;      // milliseconds with duplicate IDs
+  uint64_t sent;
+  uint64_t delivered;
+  uint64_t dropped;
+  uint64_t nodes;
+  uint64_t replies;    // high-water replies to restarted nodes
+  uint64_t suppressed; // replies dropped, because another peer answered first
+  uint64_t startupMs;  // total startup time of restarted nodes (until up)
+  uint64_t errors;     // error messages of the nodes (not printed, unless verbose)
+  unsigned restarts;
+
+  Totals() { memset(this, 0, sizeof(*this)); }
+};
+
+struct Options {
+  unsigned  nodes;
+  unsigned  runs;
+  SimParams params;
+  int64_t   warpMs;
+  unsigned  replyDelayMs;
+  uint64_t  seed;
+  bool      verbose;
+};
+
+// Brings up 'n' nodes (node-ids 0..n-1) on new hosts, and runs until they are up.
+static void StartCluster(SimCluster& sim, unsigned n) {
+  for (unsigned i=0; i<n; ++i) {
+    unsigned h = sim.AddHost();
+    sim.Start(h, i);
+  }
+  sim.Run(LISTEN_TIME + 100);
+}
+
+// Every up node generates a few IDs, once per millisecond, for 'ms' milliseconds.
+static void Generate(SimCluster& sim, unsigned ms, unsigned perMs=4) {
+  for (unsigned t=0; t<ms; ++t) {
+    for (unsigned h=0; h<sim.hosts.size(); ++h) {
+      if (sim.hosts[h]->IsUp()) { sim.GenerateIds(h, perMs); }
+    }
+    sim.Run(1);
+  }
+}
+
+// Runs until the node on host 'h' is up (or 'maxMs' passed), returns the milliseconds it took.
+static uint64_t RunUntilUp(SimCluster& sim, unsigned h, uint64_t maxMs) {
+  uint64_t ms = 0;
+  while (ms < maxMs && !sim.hosts[h]->IsUp()) { sim.Run(1); ++ms; }
+  return ms;
+}
+
+// Runs one scenario, and adds its results to 't'.
+static void RunScenario(const char* scenario, const Options& opt, uint64_t seed, Totals& t) {
+  SimCluster sim(seed);
+  sim.net.params = opt.params;
+  sim.replyDelayMs = opt.replyDelayMs;
+  sim.printErrors = opt.verbose;
+
+  if (0 == strcmp(scenario, "cold")) {
+    StartCluster(sim, opt.nodes);
+    Generate(sim, 10);
+  } else if (0 == strcmp(scenario, "restart")) {
+    StartCluster(sim, opt.nodes);
+    Generate(sim, 50);
+    // the node moves to a new host, with a slow clock and no disk
+    unsigned victim = sim.net.Random() % opt.nodes;
+    sim.Stop(victim);
+    unsigned h = sim.AddHost();
+    sim.Warp(h, opt.warpMs);
+    uint64_t suppressed, replies = sim.CountReplies(&suppressed);
+    sim.Start(h, victim);
+    uint64_t ms = RunUntilUp(sim, h, LISTEN_TIME + 100);
+    sim.Run(LISTEN_TIME + 100 - ms);
+    uint64_t suppressedAfter, repliesAfter = sim.CountReplies(&suppressedAfter);
+    t.replies += repliesAfter - replies;
+    t.suppressed += suppressedAfter - suppressed;
+    t.startupMs += ms;
+    ++t.restarts;
+    Generate(sim, 50);
+  } else if (0 == strcmp(scenario, "duplicate")) {
+    StartCluster(sim, opt.nodes);
+    Generate(sim, 10);
+    unsigned victim = sim.net.Random() % opt.nodes;
+    unsigned h = sim.AddHost();
+    sim.Start(h, victim);
+    sim.Run(LISTEN_TIME + 100);
+    Generate(sim, 10);
+  } else if (0 == strcmp(scenario, "lease")) {
+    for (unsigned i=0; i<opt.nodes; ++i) {
+      unsigned h = sim.AddHost();
+      sim.StartLease(h);
+    }
+    sim.Run(LEASE_CLAIM_ATTEMPTS*LISTEN_TIME + 100);
+    Generate(sim, 10);
+  } else {
+    fprintf(stderr, "ERROR: Unknown scenario '%s'\n", scenario);
+    exit(1);
+  }
+
+  unsigned up = sim.CountUp();
+  unsigned collisions = sim.CountCollisions();
+  unsigned shared = sim.CountSharedNodeIds();
+  uint64_t dups = sim.CountDuplicates();
+  // the original nodes should all be up (a redundant node should exit)
+  bool failed = up < opt.nodes;
+  ++t.runs;
+  if (failed) { ++t.failed; }
+  if (collisions) { ++t.detected; }
+  if (shared) { ++t.shared; }
+  if (dups) { ++t.dupRuns; }
+  t.dupMs += dups;
+  t.sent += sim.net.stats.sent;
+  t.delivered += sim.net.stats.delivered;
+  t.dropped += sim.net.stats.dropped;
+  t.nodes += sim.hosts.size();
+  t.errors += sim.errors;
+  if (opt.verbose) {
+    fprintf(stdout, "seed %" PRIu64 ": up %u/%u, collisions %u, shared node-ids %u, duplicate-ms %" PRIu64
+        ", sent %" PRIu64 "\n", seed, up, (unsigned)sim.hosts.size(), collisions, shared, dups, sim.net.stats.sent);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  Options opt;
+  opt.nodes = 16;
+  opt.runs = 100;
+  opt.warpMs = -1000;
+  opt.replyDelayMs = REPLY_DELAY_MS;
+  opt.seed = 1;
+  opt.verbose = false;
+
+  int c;
+  while ((c = getopt(argc, argv, "n:r:l:u:d:j:w:q:s:v")) != -1) {
+    switch (c) {
+      case 'n': opt.nodes = strtoul(optarg, NULL, 10); break;
+      case 'r': opt.runs = strtoul(optarg, NULL, 10); break;
+      case 'l': opt.params.lossRate = atof(optarg); break;
+      case 'u': opt.params.dupRate = atof(optarg); break;
+      case 'd': opt.params.delayUs = atof(optarg)*1000; break;
+      case 'j': opt.params.jitterUs = atof(optarg)*1000; break;
+      case 'w': opt.warpMs = strtoll(optarg, NULL, 10); break;
+      case 'q': opt.replyDelayMs = strtoul(optarg, NULL, 10); break;
+      case 's': opt.seed = strtoull(optarg, NULL, 10); break;
+      case 'v': opt.verbose = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-n nodes] [-r runs] [-l loss] [-u dup] [-d delay-ms] [-j jitter-ms] "
+            "[-w warp-ms] [-q reply-delay-ms] [-s seed] [-v] <cold|restart|duplicate|lease>\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "ERROR: missing scenario (cold, restart, duplicate or lease)\n");
+    return 1;
+  }
+  if (opt.nodes < 1 || opt.nodes > MAX_NODES) {
+    fprintf(stderr, "ERROR: Invalid number of nodes %u\n", opt.nodes);
+    return 1;
+  }
+  const char* scenario = argv[optind];
+
+  Totals t;
+  uint64_t start = IdNode::GetMonoTimestampMs();
+  for (unsigned r=0; r<opt.runs; ++r) {
+    RunScenario(scenario, opt, opt.seed + r, t);
+  }
+  uint64_t elapsed = IdNode::GetMonoTimestampMs() - start;
+
+  fprintf(stdout, "scenario %s: %u runs of %u nodes, loss %.4f, dup %.4f, delay %.2f+%.2f ms (%" PRIu64 " ms, %.1f runs/s)\n",
+      scenario, t.runs, opt.nodes, opt.params.lossRate, opt.params.dupRate, opt.params.delayUs/1000.0,
+      opt.params.jitterUs/1000.0, elapsed, elapsed ? t.runs*1000.0/elapsed : 0.0);
+  fprintf(stdout, "  startup failures:      %u (%.4f)\n", t.failed, (double)t.failed/t.runs);
+  fprintf(stdout, "  collisions detected:   %u (%.4f)\n", t.detected, (double)t.detected/t.runs);
+  fprintf(stdout, "  node-id owned twice:   %u (%.4f)\n", t.shared, (double)t.shared/t.runs);
+  fprintf(stdout, "  duplicate IDs:         %u (%.4f), %" PRIu64 " duplicate milliseconds\n", t.dupRuns, (double)t.dupRuns/t.runs, t.dupMs);
+  fprintf(stdout, "  messages per node:     %.1f sent, %.1f delivered, %.1f dropped\n",
+      (double)t.sent/t.nodes, (double)t.delivered/t.nodes, (double)t.dropped/t.nodes);
+  fprintf(stdout, "  node error messages:   %" PRIu64 " (%.1f per run, -v prints them)\n", t.errors, (double)t.errors/t.runs);
+  if (t.restarts) {
+    fprintf(stdout, "  replies per restart:   %.1f sent, %.1f suppressed (delay window %u ms)\n",
+        (double)t.replies/t.restarts, (double)t.suppressed/t.restarts, opt.replyDelayMs);
+    fprintf(stdout, "  restart startup time:  %.1f ms\n", (double)t.startupMs/t.restarts);
+  }
+  return 0;
+}
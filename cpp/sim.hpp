@@ -0,0 +1,441 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+#pragma once
+
+// Deterministic in-process cluster simulator for IdNode.
+// Every simulated host gets a virtual clock (which can be warped), an in-memory
+// state store ("disk", which survives restarts) and an endpoint on a virtual
+// multicast network, with configurable loss, delay, jitter (re-ordering) and
+// duplication. Nodes are driven with IdNode::Step(), so nothing blocks, and runs
+// are reproducible from the seed. Time is event-driven: it jumps to the next
+// tick with a delivery or a node's timer (IdNode::NextStepMs()), and only the
+// nodes with messages or due timers are stepped then, which gives the same runs
+// as stepping every node on every tick.
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "DistId.hpp"
+
+// Network conditions of a simulation.
+struct SimParams {
+  double   lossRate;  // probability that a message is lost (per receiver)
+  double   dupRate;   // probability that a message is delivered twice (per receiver)
+  unsigned delayUs;   // one-way delay
+  unsigned jitterUs;  // additional random delay (up to), which re-orders messages
+  unsigned tickUs;    // granularity of virtual time (nodes are stepped at most once per tick)
+
+  SimParams() : lossRate(0), dupRate(0), delayUs(200), jitterUs(100), tickUs(1000) { }
+};
+
+// Traffic counters of a simulation.
+struct SimStats {
+  uint64_t sent;       // messages sent (once per sender, multicast or unicast)
+  uint64_t bytes;      // bytes sent
+  uint64_t largest;    // largest message sent (bytes)
+  uint64_t delivered;  // messages delivered (per receiver)
+  uint64_t dropped;    // messages lost (per receiver, incl. to hosts that are down)
+  uint64_t duplicated; // extra copies delivered
+
+  SimStats() { memset(this, 0, sizeof(*this)); }
+};
+
+// Virtual multicast network, and the virtual time shared by all hosts.
+class SimNetwork {
+public:
+  // A message in flight to a single receiver.
+  struct Packet {
+    uint64_t atUs;  // delivery time
+    unsigned to;    // receiving endpoint
+    unsigned from;  // sending endpoint
+    bool     direct; // unicast (for the receiver alone)
+    std::shared_ptr<std::vector<char> > data;
+  };
+
+  SimParams params;
+  SimStats  stats;
+  uint64_t  nowUs;  // virtual "real" time (microseconds since the epoch)
+
+  SimNetwork(uint64_t seed=1) : nowUs(1600000000000ull*1000), rng(seed ? seed : 1) { }
+
+  // Adds an endpoint to the network (initially down), returns its index.
+  unsigned Attach() {
+    unsigned ep = addrs.size();
+    char buf[64];
+    snprintf(buf, 64, "10.%u.%u.%u:%u", (ep >> 16) & 255, (ep >> 8) & 255, ep & 255, 20000 + (ep & 0x3fff));
+    IPAddress addr;
+    addr.SetAddress(buf);
+    addrs.push_back(addr);
+    up.push_back(false);
+    inbox.push_back(std::deque<Packet>());
+    direct.push_back(std::deque<Packet>());
+    return ep;
+  }
+
+  // Brings endpoint 'ep' up (receiving), or down (losing anything queued or in flight).
+  void SetUp(unsigned ep, bool isUp) {
+    up[ep] = isUp;
+    if (!isUp) { inbox[ep].clear(); direct[ep].clear(); }
+  }
+
+  const IPAddress& GetAddress(unsigned ep) const { return addrs[ep]; }
+
+  uint64_t NowMs() const { return nowUs/1000; }
+
+  // Multicasts 'sz' bytes of 'buf' from endpoint 'from' to every endpoint (including itself).
+  void Send(unsigned from, const char* buf, int sz) {
+    ++stats.sent;
+    stats.bytes += sz;
+    stats.largest = std::max(stats.largest, (uint64_t)sz);
+    std::shared_ptr<std::vector<char> > data(new std::vector<char>(buf, buf + sz));
+    for (unsigned to=0; to<addrs.size(); ++to) {
+      if (!up[to]) { continue; }
+      unsigned copies = 1;
+      if (params.dupRate > 0 && Chance(params.dupRate)) { ++copies; ++stats.duplicated; }
+      for (unsigned c=0; c<copies; ++c) {
+        if (params.lossRate > 0 && Chance(params.lossRate)) { ++stats.dropped; continue; }
+        Packet p;
+        p.atUs = nowUs + params.delayUs + (params.jitterUs ? Random() % (params.jitterUs + 1) : 0);
+        p.to = to;
+        p.from = from;
+        p.direct = false;
+        p.data = data;
+        flight[p.atUs].push_back(p);
+      }
+    }
+  }
+
+  // Sends 'sz' bytes of 'buf' from endpoint 'from' to the endpoint with address 'to' alone.
+  // Returns false if there's no such endpoint.
+  bool SendTo(unsigned from, const IPAddress& to, const char* buf, int sz) {
+    unsigned ep = 0;
+    while (ep < addrs.size() && addrs[ep] != to) { ++ep; }
+    if (ep == addrs.size()) { return false; }
+    ++stats.sent;
+    stats.bytes += sz;
+    stats.largest = std::max(stats.largest, (uint64_t)sz);
+    if (!up[ep] || (params.lossRate > 0 && Chance(params.lossRate))) { ++stats.dropped; return true; }
+    Packet p;
+    p.atUs = nowUs + params.delayUs + (params.jitterUs ? Random() % (params.jitterUs + 1) : 0);
+    p.to = ep;
+    p.from = from;
+    p.direct = true;
+    p.data.reset(new std::vector<char>(buf, buf + sz));
+    flight[p.atUs].push_back(p);
+    return true;
+  }
+
+  // Advances virtual time to 'toUs', moving arrived messages into the receivers' inboxes
+  // (and adding the receivers to 'arrived', if given).
+  void Advance(uint64_t toUs, std::vector<unsigned>* arrived=NULL) {
+    if (toUs > nowUs) { nowUs = toUs; }
+    while (!flight.empty() && flight.begin()->first <= nowUs) {
+      for (Packet& p : flight.begin()->second) {
+        if (up[p.to]) {
+          if (arrived) { arrived->push_back(p.to); }
+          (p.direct ? direct : inbox)[p.to].push_back(std::move(p));
+          ++stats.delivered;
+        } else {
+          ++stats.dropped;
+        }
+      }
+      flight.erase(flight.begin());
+    }
+  }
+
+  // Passes time without delivering anything (e.g. a throttling node).
+  void Sleep(unsigned us) { nowUs += us; }
+
+  bool HasMessage(unsigned ep) const { return !inbox[ep].empty(); }
+
+  // Returns the delivery time of the next message in flight (UINT64_MAX if none).
+  uint64_t NextDeliveryUs() const { return flight.empty() ? UINT64_MAX : flight.begin()->first; }
+
+  // Pops the next message for endpoint 'ep' into 'buf' (of the unicast ones, if 'unicast').
+  // Returns its size (0 if none).
+  int Receive(unsigned ep, char* buf, int maxSz, IPAddress& from, bool unicast=false) {
+    std::deque<Packet>& q = unicast ? direct[ep] : inbox[ep];
+    if (q.empty()) { return 0; }
+    Packet& p = q.front();
+    int sz = std::min((int)p.data->size(), maxSz);
+    memcpy(buf, &(*p.data)[0], sz);
+    from = addrs[p.from];
+    q.pop_front();
+    return sz;
+  }
+
+  // Returns the next value of the network's xorshift random number generator.
+  uint64_t Random() {
+    rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+    return rng;
+  }
+  // Returns true with probability 'p'.
+  bool Chance(double p) { return (Random() >> 11) * (1.0/9007199254740992.0) < p; }
+
+private:
+  uint64_t rng;
+  std::vector<IPAddress> addrs;
+  std::vector<bool>      up;
+  std::vector<std::deque<Packet> > inbox;
+  std::vector<std::deque<Packet> > direct; // unicast messages
+  // messages in flight, by delivery time (each time's in the order sent, which keeps delivery deterministic)
+  std::map<uint64_t, std::vector<Packet> > flight;
+};
+
+// Virtual clock of a simulated host: network time, plus a (warpable) offset.
+struct SimClock : IdClock {
+  SimNetwork* net;
+  int64_t     rtOffsetMs;   // real-time error of this host (warps)
+  int64_t     monoOffsetMs; // arbitrary origin of the monotonic clock
+
+  SimClock() : net(NULL), rtOffsetMs(0), monoOffsetMs(0) { }
+
+  virtual uint64_t RtMs() { return net->NowMs() + rtOffsetMs; }
+  virtual uint64_t MonoMs() { return net->NowMs() + monoOffsetMs; }
+  virtual void SleepUs(unsigned us) { net->Sleep(us); }
+};
+
+// A simulated host's endpoint on the virtual network.
+struct SimTransport : IdTransport {
+  SimNetwork* net;
+  unsigned    ep;
+
+  SimTransport() : net(NULL), ep(0) { }
+
+  virtual bool Open(IPAddress& local) {
+    net->SetUp(ep, true);
+    local = net->GetAddress(ep);
+    return true;
+  }
+  // Never blocks (time only passes between ticks).
+  virtual bool Wait(int) { return net->HasMessage(ep); }
+  virtual int Read(char* buf, int maxSz, IPAddress& from) { return net->Receive(ep, buf, maxSz, from); }
+  virtual bool Send(const char* buf, int sz) { net->Send(ep, buf, sz); return true; }
+  virtual bool SendTo(const IPAddress& to, const char* buf, int sz) { return net->SendTo(ep, to, buf, sz); }
+  virtual int ReadUnicast(char* buf, int maxSz, IPAddress& from) { return net->Receive(ep, buf, maxSz, from, true); }
+};
+
+// A simulated machine: clock, network endpoint, persistent "disk", and the
+// current incarnation of its IdNode (if running).
+struct SimHost {
+  SimClock     clock;
+  SimTransport transport;
+  std::vector<IdNodeState> disk;
+  std::unique_ptr<DynamicIdNode> node;
+  unsigned     incarnation;  // number of times a node was started on this host
+  std::vector<uint64_t> stamps; // distinct ID timestamps issued by the current incarnation (ascending)
+
+  SimHost() : incarnation(0) { }
+
+  bool IsUp() { return node && PHASE_UP == node->GetPhase(); }
+};
+
+// Timestamps used by one incarnation of a node-id (see SimCluster::CountDuplicates()).
+struct SimUsage {
+  uint16_t nodeId;
+  std::vector<uint64_t> stamps;
+};
+
+// A cluster of simulated hosts on one virtual network.
+class SimCluster {
+public:
+  SimNetwork net;
+  std::vector<std::unique_ptr<SimHost> > hosts;
+  std::vector<SimUsage> usage;  // timestamps issued by stopped incarnations
+  uint64_t seed;
+  unsigned replyDelayMs;        // high-water reply delay window of new nodes (IdNode::SetReplyDelay())
+  bool     snapshots;           // new nodes ask for peer-table snapshots (IdNode::SetSnapshots())
+  uint64_t errors;              // error messages of the nodes (e.g. detected collisions), counted instead of printed
+  bool     printErrors;         // print them too (to stderr)
+
+  SimCluster(uint64_t seed=1) : net(seed), seed(seed), replyDelayMs(REPLY_DELAY_MS), snapshots(true),
+    errors(0), printErrors(false) { }
+
+  // Adds a host (with an empty disk), returns its index.
+  unsigned AddHost() {
+    std::unique_ptr<SimHost> host(new SimHost);
+    host->clock.net = &net;
+    host->clock.monoOffsetMs = (int64_t)(net.Random() % 1000000) - (int64_t)net.NowMs();
+    host->transport.net = &net;
+    host->transport.ep = net.Attach();
+    hosts.push_back(std::move(host));
+    return hosts.size() - 1;
+  }
+
+  // Starts a node on host 'h', with node-ids [node, node+count).
+  // The node is up after its listen window, see Run().
+  bool Start(unsigned h, uint16_t node, uint16_t count=1) {
+    if (!NewNode(h)) { return false; }
+    return hosts[h]->node->InitNode(node, count);
+  }
+
+  // Starts a node on host 'h', leasing 'count' free node-ids.
+  bool StartLease(unsigned h, uint16_t count=1) {
+    if (!NewNode(h)) { return false; }
+    return hosts[h]->node->BeginLease("<memory>", count);
+  }
+
+  // Stops (crashes) the node on host 'h'. Its disk is kept, unless 'wipe' (e.g. migrated).
+  void Stop(unsigned h, bool wipe=false) {
+    SimHost& host = *hosts[h];
+    RecordUsage(host);
+    host.node.reset();
+    net.SetUp(host.transport.ep, false);
+    if (wipe) { host.disk.clear(); }
+  }
+
+  // Warps the real-time clock of host 'h' by 'deltaMs' (negative is backwards).
+  void Warp(unsigned h, int64_t deltaMs) { hosts[h]->clock.rtOffsetMs += deltaMs; }
+
+  // Runs the simulation for 'ms' milliseconds of virtual time.
+  // Skips the ticks without deliveries or due timers, and steps only the nodes that
+  // have messages or a due timer (the others' steps would do nothing).
+  void Run(uint64_t ms) {
+    uint64_t endUs = net.nowUs + ms*1000;
+    uint64_t tickUs = net.params.tickUs ? net.params.tickUs : 1;
+    std::vector<uint64_t> due(hosts.size());
+    for (unsigned h=0; h<hosts.size(); ++h) { due[h] = NextStepUs(h); }
+    std::vector<unsigned> arrived;
+    while (net.nowUs < endUs) {
+      // the first tick at or after the next event (ticks count from the current time)
+      uint64_t next = net.NextDeliveryUs();
+      for (uint64_t d : due) { next = std::min(next, d); }
+      uint64_t ticks = next > net.nowUs ? (next - net.nowUs + tickUs - 1) / tickUs : 1;
+      uint64_t toUs = next == UINT64_MAX ? endUs : net.nowUs + std::max(ticks, (uint64_t)1) * tickUs;
+      arrived.clear();
+      net.Advance(std::min(endUs, toUs), &arrived);
+      // (endpoints are attached with their hosts, so an endpoint is its host's index)
+      for (unsigned ep : arrived) { due[ep] = 0; }
+      for (unsigned h=0; h<hosts.size(); ++h) {
+        if (due[h] > net.nowUs) { continue; }
+        if (hosts[h]->node) { hosts[h]->node->Step(); }
+        due[h] = NextStepUs(h);
+      }
+    }
+  }
+
+  // Generates up to 'count' IDs on host 'h' (at the current virtual time).
+  // Returns the number of IDs generated.
+  unsigned GenerateIds(unsigned h, unsigned count) {
+    SimHost& host = *hosts[h];
+    if (!host.node) { return 0; }
+    unsigned n = 0;
+    uint64_t id;
+    for (; n<count && host.node->GetId(id); ++n) {
+      uint64_t ts;
+      uint16_t counter, node;
+      IdNode::IdToFields(ts, counter, node, id);
+      if (host.stamps.empty() || host.stamps.back() != ts) { host.stamps.push_back(ts); }
+    }
+    return n;
+  }
+
+  // Returns the number of hosts whose node is up.
+  unsigned CountUp() {
+    unsigned n = 0;
+    for (auto& host : hosts) { if (host->IsUp()) { ++n; } }
+    return n;
+  }
+
+  // Returns the high-water replies sent by the running nodes (and the dropped ones in 'suppressed').
+  uint64_t CountReplies(uint64_t* suppressed=NULL) {
+    uint64_t n = 0, s = 0;
+    for (auto& host : hosts) {
+      if (!host->node) { continue; }
+      n += host->node->GetStats().replies;
+      s += host->node->GetStats().suppressed;
+    }
+    if (suppressed) { *suppressed = s; }
+    return n;
+  }
+
+  // Returns the number of hosts whose node detected a collision.
+  unsigned CountCollisions() {
+    unsigned n = 0;
+    for (auto& host : hosts) { if (host->node && host->node->HasCollision()) { ++n; } }
+    return n;
+  }
+
+  // Returns the number of node-ids owned by more than one running node.
+  unsigned CountSharedNodeIds() {
+    std::vector<unsigned> owners(MAX_NODES, 0);
+    unsigned n = 0;
+    for (auto& host : hosts) {
+      if (!host->IsUp()) { continue; }
+      for (unsigned s=0; s<host->node->GetShardCount(); ++s) {
+        if (2 == ++owners[host->node->GetNodeId(s)]) { ++n; }
+      }
+    }
+    return n;
+  }
+
+  // Returns the number of (node-id, timestamp) pairs issued by more than one
+  // incarnation, i.e. the number of milliseconds with duplicate IDs (every
+  // incarnation starts each millisecond with counter 0).
+  // Only valid for single node-id hosts.
+  uint64_t CountDuplicates() {
+    std::vector<SimUsage> all = usage;
+    for (auto& host : hosts) {
+      if (host->node && !host->stamps.empty()) {
+        SimUsage u;
+        u.nodeId = host->node->GetNodeId();
+        u.stamps = host->stamps;
+        all.push_back(u);
+      }
+    }
+    uint64_t dups = 0;
+    for (size_t i=0; i<all.size(); ++i) {
+      for (size_t j=i+1; j<all.size(); ++j) {
+        if (all[i].nodeId != all[j].nodeId) { continue; }
+        std::vector<uint64_t> both;
+        std::set_intersection(all[i].stamps.begin(), all[i].stamps.end(),
+                              all[j].stamps.begin(), all[j].stamps.end(), std::back_inserter(both));
+        dups += both.size();
+      }
+    }
+    return dups;
+  }
+
+private:
+  // Returns when the node on host 'h' has to be stepped without a message (network time),
+  // at once if messages are still queued for it.
+  uint64_t NextStepUs(unsigned h) {
+    SimHost& host = *hosts[h];
+    if (!host.node) { return UINT64_MAX; }
+    if (net.HasMessage(host.transport.ep)) { return 0; }
+    uint64_t ms = host.node->NextStepMs();
+    if (ms == UINT64_MAX) { return UINT64_MAX; }
+    int64_t netMs = (int64_t)ms - host.clock.rtOffsetMs;
+    return netMs > 0 ? (uint64_t)netMs * 1000 : 0;
+  }
+
+  bool NewNode(unsigned h) {
+    SimHost& host = *hosts[h];
+    if (host.node) { Stop(h); }
+    host.node.reset(new DynamicIdNode);
+    host.node->SetClock(&host.clock);
+    host.node->SetTransport(&host.transport);
+    host.node->SetStateMemory(&host.disk);
+    host.node->SetRandomSeed(IdNode::Mix64(seed + ((uint64_t)h << 20) + host.incarnation++));
+    host.node->SetReplyDelay(replyDelayMs);
+    host.node->SetSnapshots(snapshots);
+    host.node->onError = [this](const char* msg) {
+      ++errors;
+      if (printErrors) { fprintf(stderr, "%s\n", msg); }
+    };
+    return true;
+  }
+
+  void RecordUsage(SimHost& host) {
+    if (host.node && !host.stamps.empty()) {
+      SimUsage u;
+      u.nodeId = host.node->GetNodeId();
+      u.stamps.swap(host.stamps);
+      usage.push_back(u);
+    }
+    host.stamps.clear();
+  }
+};
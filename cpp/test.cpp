@@ -4,7 +4,11 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <set>
+#include <string>
+#include <thread>
 #include <vector>
 
 using namespace std;
@@ -13,6 +17,14 @@ using namespace std;
 #define LISTEN_TIME 500
 
 #include "DistId.hpp"
+#include "sim.hpp"
+#include "IdVerifier.hpp"
+#include "DupDetector.hpp"
+#include "LatencyHistogram.hpp"
+#include "LeaseServer.hpp"
+#include "Relay.hpp"
+#include "IdCodec.hpp"
+#include "NumaPool.hpp"
 
 ////////////////////////////////////////////////////////////
 // Super minimal test framework
@@ -70,7 +82,7 @@ int TEST_SUMMARY() {
 // Pull identifiers from a group of IdNodes and verify uniqueness.
 //   nodes - 
 bool CheckIdentifiers(vector<IdNode*>& nodes, unsigned idCount, bool monotonic=false, bool canFail=false) {
-  set<uint64_t> ids;
+  IdVerifier ids;
   unsigned nodeCount = nodes.size();
   uint64_t lastId = 0;
   unsigned validIds = 0;
@@ -81,14 +93,7 @@ bool CheckIdentifiers(vector<IdNode*>& nodes, unsigned idCount, bool monotonic=f
     IdNode &curNode = *nodes[index];
     if (curNode.GetId(id)) {
       ++validIds;
-      if (ids.find(id) != ids.end()) {
-        uint16_t node, counter;
-        uint64_t ts;
-        curNode.IdToFields(ts, counter, node, id);
-        fprintf(stderr, "ERROR: Node %u returned duplicate ID %" PRIx64 " => {t:%" PRIu64 ", c:%u, n:%u} (i=%u) !\n", index, id, ts, counter, node, i);
-        return false;
-      }
-      ids.insert(id);
+      ids.Add(id);
       if (monotonic && lastId >= id) {
         fprintf(stderr, "ERROR: Node %u returned non-monotonic ID %" PRIx64 " vs %" PRIx64  " (i=%u)!\n", i%nodeCount, id, lastId, i);
         return false;
@@ -101,6 +106,11 @@ bool CheckIdentifiers(vector<IdNode*>& nodes, unsigned idCount, bool monotonic=f
       }
     }
   }
+  if (!ids.Finish()) {
+    fprintf(stderr, "ERROR: Nodes returned duplicate (or non-monotonic) IDs!\n");
+    ids.Report(stderr);
+    return false;
+  }
   // at least one node should be functioning...
   unsigned expectedIds = idCount/nodeCount;
   if (validIds < expectedIds) {
@@ -137,6 +147,11 @@ int main(int argc, char* argv[]) {
     TEST_BANNER("Invalid ID fields");
       TEST_THROW(node.FieldsToId(1, 1, MAX_NODES));
       TEST_THROW(node.FieldsToId(1, MAX_COUNTER, 1));
+      id1 = 7;
+      TEST_CONDITION(!IdNode::TryFieldsToId(id1, 1, 1, MAX_NODES) && id1 == 7);
+      TEST_CONDITION(!IdNode::TryFieldsToId(id1, 1, MAX_COUNTER, 1) && id1 == 7);
+      TEST_CONDITION(!IdNode::TryFieldsToId(id1, MAX_TIMESTAMP+1, 1, 1) && id1 == 7);
+      TEST_CONDITION(IdNode::TryFieldsToId(id1, 1234567, 123, 45) && id1 == node.FieldsToId(1234567, 123, 45));
 
     TEST_BANNER("ID field boundary conditions (node)");
       id1 = node.FieldsToId(1234567, 123, MAX_NODES-2);
@@ -154,6 +169,277 @@ int main(int argc, char* argv[]) {
 
   }
 
+  { // Test time window queries
+    TEST_BANNER("Time range to ID range");
+      uint64_t lo, hi;
+      TEST_CONDITION(IdNode::TimeRangeToIdRange(1000, 1002, lo, hi));
+      TEST_CONDITION(lo == IdNode::FieldsToId(1000, 0, 0) && hi == IdNode::FieldsToId(1002, MAX_COUNTER-1, MAX_NODES-1));
+      TEST_CONDITION(hi + 1 == IdNode::FieldsToId(1003, 0, 0));
+      TEST_CONDITION(IdNode::TimeRangeToIdRange(1000, 1002, lo, hi, 5) && IdNode::IdToTimestamp(hi) == 1007);
+      TEST_CONDITION(!IdNode::TimeRangeToIdRange(1003, 1002, lo, hi));
+      TEST_CONDITION(IdNode::TimeRangeToIdRange(0, UINT64_MAX, lo, hi, 10) && hi == UINT64_MAX);
+      vector<uint16_t> someNodes = { 5, 7, 6, MAX_NODES-1, 0 };
+      TEST_CONDITION(IdNode::TimeRangeToIdRange(1000, 1002, someNodes, lo, hi));
+      TEST_CONDITION(lo == IdNode::FieldsToId(1000, 0, 0) && hi == IdNode::FieldsToId(1002, MAX_COUNTER-1, MAX_NODES-1));
+      vector<uint16_t> midNodes = { 300, 302 };
+      TEST_CONDITION(IdNode::TimeRangeToIdRange(1000, 1002, midNodes, lo, hi));
+      TEST_CONDITION(lo == IdNode::FieldsToId(1000, 0, 300) && hi == IdNode::FieldsToId(1002, MAX_COUNTER-1, 302));
+
+    TEST_BANNER("Time range to exact ID ranges (node set)");
+      vector<IdRange> ranges;
+      // runs {0}, {5-7} and {1023}: the last run merges with node 0 of the next counter
+      TEST_CONDITION(IdNode::TimeRangeToIdRanges(1000, 1001, someNodes, ranges, 10000) == 2*2*MAX_COUNTER + 1);
+      bool exact = true;
+      size_t r = 0;
+      for (uint64_t ts=999; ts<=1002; ++ts) {
+        for (uint16_t c : { 0, 1, MAX_COUNTER-1 }) {
+          for (uint16_t n=0; n<MAX_NODES; ++n) {
+            uint64_t id = IdNode::FieldsToId(ts, c, n);
+            bool want = ts >= 1000 && ts <= 1001 && (n == 0 || (n >= 5 && n <= 7) || n == MAX_NODES-1);
+            while (r > 0 && ranges[r-1].lo > id) { --r; }
+            while (r < ranges.size() && ranges[r].hi < id) { ++r; }
+            bool in = r < ranges.size() && ranges[r].lo <= id;
+            if (in != want) { exact = false; }
+          }
+        }
+      }
+      TEST_CONDITION(exact);
+      for (size_t i=1; i<ranges.size(); ++i) {
+        if (ranges[i].lo <= ranges[i-1].hi + 1) { exact = false; } // sorted, disjoint, not adjacent
+      }
+      TEST_CONDITION(exact);
+      // too many ranges, or all node-ids: one bounding range
+      TEST_CONDITION(IdNode::TimeRangeToIdRanges(1000, 1100, someNodes, ranges, 1000) == 1);
+      TEST_CONDITION(ranges[0].lo == IdNode::FieldsToId(1000, 0, 0));
+      TEST_CONDITION(IdNode::TimeRangeToIdRanges(1000, 1100, vector<uint16_t>(), ranges) == 1);
+      TEST_CONDITION(0 == IdNode::TimeRangeToIdRanges(1001, 1000, someNodes, ranges));
+
+    TEST_BANNER("Batch timestamp extraction");
+      vector<uint64_t> ids, times(1000);
+      for (unsigned i=0; i<1000; ++i) { ids.push_back(IdNode::FieldsToId(1600000000000ull + i*7, i%MAX_COUNTER, i%MAX_NODES)); }
+      IdNode::IdsToTimestamps(&ids[0], &times[0], ids.size());
+      bool same = true;
+      for (unsigned i=0; i<1000; ++i) {
+        uint64_t ts;
+        uint16_t counter, node;
+        IdNode::IdToFields(ts, counter, node, ids[i]);
+        if (times[i] != ts || ts != 1600000000000ull + i*7 || IdNode::IdToTimestamp(ids[i]) != ts) { same = false; }
+      }
+      TEST_CONDITION(same);
+  }
+
+  { // Test address parsing and comparison
+    IPAddress a4("239.0.0.152:26980");
+    IPAddress b4("239.0.0.152:26981");
+    IPAddress a6("[ff05::152]:26980");
+    IPAddress b6("[ff05::152]:26980");
+    IPAddress c6("[fd00::1]:26980");
+    std::string str;
+
+    TEST_BANNER("IPv4/IPv6 addresses");
+      TEST_CONDITION(!a4.IsV6() && a4.IsMulticast() && a4.GetPort() == 26980);
+      TEST_CONDITION(a4 != b4);
+      TEST_CONDITION(a6.IsV6() && a6.IsMulticast() && a6.GetPort() == 26980);
+      TEST_CONDITION(a6 == b6);
+      TEST_CONDITION(a6 != c6 && !c6.IsMulticast());
+      TEST_CONDITION(a4 != a6);
+      a6.GetString(str);
+      TEST_CONDITION(str == "[ff05::152]:26980");
+      TEST_CONDITION(IPAddress("[::]:0").IsAny() && IPAddress(ANY_ADDR).IsAny() && !c6.IsAny());
+  }
+
+  { // Test the ID verifier (radix sort, external merge)
+    vector<uint64_t> data(300000), sorted;
+    uint64_t x = 88172645463325252ull;
+    for (auto& d : data) { x ^= x << 13; x ^= x >> 7; x ^= x << 17; d = x >> (x & 31); }
+    sorted = data;
+    std::sort(sorted.begin(), sorted.end());
+    vector<uint64_t> tmp(data.size());
+
+    TEST_BANNER("ID verifier radix sort");
+      IdVerifier::RadixSort(&data[0], &tmp[0], data.size(), 4);
+      TEST_CONDITION(data == sorted);
+
+    TEST_BANNER("ID verifier duplicates and monotonicity");
+    for (size_t runSize : { (size_t)1<<20, (size_t)1000 }) { // in memory, and spilled to runs
+      IdVerifier ok(runSize, 2);
+      IdVerifier dup(runSize, 2);
+      IdVerifier order(runSize, 2);
+      for (uint64_t ts=1000; ts<1500; ++ts) {
+        for (uint16_t n=0; n<20; ++n) {
+          for (uint16_t c=0; c<3; ++c) {
+            uint64_t id = IdNode::FieldsToId(ts, c, n);
+            ok.Add(id);
+            dup.Add(id);
+            order.Add(ts == 1200 && n == 7 ? IdNode::FieldsToId(ts - 100, c + 3, n) : id);
+          }
+        }
+      }
+      dup.Add(IdNode::FieldsToId(1499, 2, 19)); // repeats the last ID
+      dup.NewStream();
+      dup.Add(IdNode::FieldsToId(1000, 0, 0));  // repeats the first ID (in another stream)
+      TEST_CONDITION(ok.Finish());
+      TEST_CONDITION(ok.GetStats().count == 30000 && ok.GetStats().nodes == 20);
+      TEST_CONDITION(ok.GetStats().runs == (runSize < 30000 ? 30u : 0u));
+      TEST_CONDITION(!dup.Finish());
+      TEST_CONDITION(dup.GetStats().duplicates == 2 && dup.GetStats().nonMonotonic == 1);
+      TEST_CONDITION(!order.Finish());
+      TEST_CONDITION(order.GetStats().duplicates == 0 && order.GetStats().nonMonotonic == 1);
+    }
+
+    TEST_BANNER("Probabilistic duplicate detector (rotating blocked Bloom filters)");
+    {
+      // 1000 IDs per ms, windows of 100 ms sized for them at 1% false positives
+      IdDupDetector detector(100000, 0.01, 100, 4);
+      uint64_t alerts = 0, caught = 0, injected = 0;
+      detector.alert = [&alerts](uint64_t) { ++alerts; };
+      vector<uint64_t> batch(1000);
+      uint64_t start = IdNode::GetMonoTimestampMs();
+      for (uint64_t ts=10000; ts<12000; ++ts) {
+        for (uint16_t c=0; c<1000; ++c) { batch[c] = IdNode::FieldsToId(ts, c, 1); }
+        detector.AddBatch(&batch[0], batch.size());
+        if (ts >= 10300 && ts % 37 == 0) { // a duplicate from up to 299 ms before
+          ++injected;
+          caught += detector.Add(IdNode::FieldsToId(ts - (ts % 300), ts % 1000, 1));
+        }
+      }
+      uint64_t elapsed = IdNode::GetMonoTimestampMs() - start;
+      const IdDupStats& st = detector.GetStats();
+      uint64_t falsePositives = st.suspects - caught;
+      fprintf(stderr, "INFO: %" PRIu64 " IDs in %" PRIu64 " ms, %.2f MiB, %u hashes, %" PRIu64 " false positives (expected %.0f)\n",
+          st.count, elapsed, detector.MemoryBytes() / 1048576.0, detector.GetHashes(), falsePositives,
+          detector.FpRate(100000) * st.count);
+      TEST_CONDITION(caught == injected && injected == 46);
+      TEST_CONDITION(alerts == st.suspects && st.samples.size() == 10);
+      TEST_CONDITION(falsePositives < st.count / 50); // 1% at full load, less before
+      TEST_CONDITION(st.rotations == 19 && st.late == 0);
+      TEST_CONDITION(!detector.Add(IdNode::FieldsToId(11500, 0, 1)) && st.late == 1); // rotated out
+      TEST_CONDITION(detector.Add(IdNode::FieldsToId(11999, 999, 1)));
+      // a memory cap far below the load: the rate is about 1 (not an underflow to 0)
+      TEST_CONDITION(detector.FpRate(100000) > 0.005 && detector.FpRate(100000) <= 0.01);
+      TEST_CONDITION(IdDupDetector::FpRate(12800, 16, 1) > 0.7 && IdDupDetector::FpRate(12800, 16, 1) < 0.9);
+      IdDupDetector capped(1000000, 0.01, 100, 4, 4096);
+      TEST_CONDITION(capped.FpRate(1000000) > 0.99 && capped.GetHashes() >= 1 && capped.GetHashes() <= 16);
+
+      // the verifier's streaming mode
+      IdDupDetector small(1000, 1e-6, 10, 8);
+      IdVerifier streaming;
+      streaming.SetDetector(&small);
+      for (uint64_t ts=1000; ts<1100; ++ts) {
+        for (uint16_t c=0; c<100; ++c) { streaming.Add(IdNode::FieldsToId(ts, c, 2)); }
+      }
+      streaming.NewStream();
+      streaming.Add(IdNode::FieldsToId(1090, 5, 2));
+      TEST_CONDITION(!streaming.Finish());
+      TEST_CONDITION(streaming.GetStats().duplicates == 1 && streaming.GetStats().dupSamples[0] == IdNode::FieldsToId(1090, 5, 2));
+    }
+
+    TEST_BANNER("ID codec bit-packing (SIMD and scalar)");
+    {
+      bool same = true;
+      uint32_t vals[CODEC_BLOCK], words[4*32], a[CODEC_BLOCK], b[CODEC_BLOCK];
+      for (unsigned bits=0; bits<=32; ++bits) {
+        for (unsigned i=0; i<CODEC_BLOCK; ++i) { vals[i] = (uint32_t)IdNode::Mix64(i + 1000*bits); }
+        IdEncoder::Pack(vals, bits, words);
+        IdDecoder::Unpack((const uint8_t*)words, bits, a);
+        IdDecoder::UnpackScalar((const uint8_t*)words, bits, b);
+        uint32_t mask = bits == 32 ? 0xFFFFFFFFu : (1u << bits) - 1;
+        for (unsigned i=0; i<CODEC_BLOCK; ++i) {
+          if (a[i] != (vals[i] & mask) || b[i] != a[i]) { same = false; }
+        }
+      }
+      TEST_CONDITION(same);
+    }
+
+    TEST_BANNER("ID codec round trips");
+    {
+      vector<uint64_t> dense, mixed, random;
+      for (unsigned i=0; i<100000; ++i) {
+        dense.push_back(IdNode::FieldsToId(1600000000000ull + i/(MAX_COUNTER-1), i%(MAX_COUNTER-1), 42));
+      }
+      for (unsigned i=0; i<100000; ++i) {
+        // interleaved nodes, time gaps, a counter reset (new incarnation) and a duplicate
+        uint64_t ts = 1600000000000ull + i/50 + (i > 60000 ? 100000 : 0) - (i > 80000 ? 200000 : 0);
+        mixed.push_back(IdNode::FieldsToId(ts, (i/7)%MAX_COUNTER, i%7 * 100));
+      }
+      mixed.push_back(mixed.back());
+      for (unsigned i=0; i<10000; ++i) { random.push_back(IdNode::Mix64(i)); }
+      bool ok = true;
+      for (auto* ids : { &dense, &mixed, &random }) {
+        vector<uint8_t> buf;
+        vector<uint64_t> out;
+        IdEncoder::Encode(&(*ids)[0], ids->size(), buf);
+        ok = IdDecoder::Decode(&buf[0], buf.size(), out) && ok;
+        // per node-id order is kept, but not across node-ids
+        vector<uint64_t> sortedIn = *ids;
+        vector<uint64_t> sortedOut = out;
+        sort(sortedIn.begin(), sortedIn.end());
+        sort(sortedOut.begin(), sortedOut.end());
+        ok = ok && sortedIn == sortedOut;
+        if (ids == &dense) {
+          TEST_CONDITION(out == dense);
+          TEST_CONDITION(buf.size() < dense.size()/10); // well under 2 bytes per ID
+        }
+      }
+      TEST_CONDITION(ok);
+
+      // streaming, in pieces
+      IdEncoder enc;
+      vector<uint8_t> stream;
+      for (unsigned i=0; i<dense.size(); ++i) {
+        enc.Add(dense[i]);
+        if (i % 1000 == 999) { stream.insert(stream.end(), enc.Data().begin(), enc.Data().end()); enc.Clear(); }
+      }
+      enc.Flush();
+      stream.insert(stream.end(), enc.Data().begin(), enc.Data().end());
+      vector<uint64_t> out;
+      TEST_CONDITION(IdDecoder::Decode(&stream[0], stream.size(), out) && out == dense);
+
+      // truncated and corrupt streams are detected
+      out.clear();
+      TEST_CONDITION(!IdDecoder::Decode(&stream[0], stream.size() - 1, out));
+      stream[0] = 'X';
+      TEST_CONDITION(!IdDecoder::Decode(&stream[0], stream.size(), out));
+    }
+
+    TEST_BANNER("USDT probes (in the .note.stapsdt of this binary)");
+    if (DISTID_PROBES) {
+      string exe;
+      FILE* f = fopen("/proc/self/exe", "rb");
+      TEST_CONDITION(f != NULL);
+      char buf[65536];
+      size_t n;
+      while (f && (n = fread(buf, 1, sizeof(buf), f)) > 0) { exe.append(buf, n); }
+      if (f) { fclose(f); }
+      for (const char* name : { "get_id_entry", "get_id_exit", "counter_wrap", "throttle", "throttle_fail",
+                                "clock_backwards", "message", "collision", "store_read", "store_write" }) {
+        // (provider and probe name, as in the note)
+        string note = string("distid") + '\0' + name + '\0';
+        TEST_CONDITION(exe.find(note) != string::npos);
+      }
+    } else {
+      fprintf(stderr, "INFO: probes compiled out\n");
+    }
+
+    TEST_BANNER("Latency histogram percentiles");
+    {
+      LatencyHistogram h, h2;
+      for (uint64_t v=1; v<=100000; ++v) { h.Record(v * 1000); } // 1 us .. 100 ms
+      TEST_CONDITION(h.total == 100000 && h.min == 1000 && h.max == 100000000);
+      for (double p : { 1.0, 50.0, 90.0, 99.0, 99.9 }) {
+        double exact = p * 1000 * 1000;
+        TEST_CONDITION(h.Percentile(p) >= exact && h.Percentile(p) <= exact * 1.032);
+      }
+      TEST_CONDITION(h.Percentile(100) == h.max);
+      for (uint64_t v=0; v<LatencyHistogram::SUB_BUCKETS; ++v) { h2.Record(v); } // exact below SUB_BUCKETS
+      TEST_CONDITION(h2.Percentile(50) == LatencyHistogram::SUB_BUCKETS/2 - 1);
+      h2.Merge(h);
+      TEST_CONDITION(h2.total == 100000 + LatencyHistogram::SUB_BUCKETS && h2.min == 0 && h2.max == h.max);
+      h2.Record(UINT64_MAX); // clamped to the last bucket
+      TEST_CONDITION(h2.max == UINT64_MAX && h2.Percentile(100) > h.max);
+    }
+  }
+
   TEST_BANNER("Single Node, normal functioning");
   {
     unsigned idCount = MAX_NODES*MAX_COUNTER + 2;
@@ -163,10 +449,55 @@ int main(int argc, char* argv[]) {
 
     TEST_CONDITION(node1.Initialize(nodeId1));
     nodes.push_back(&node1);
+    const IdNodeStats& stats = node1.GetStats();
+    uint64_t startPolls = stats.polls, startPackets = stats.packetsIn;
     uint64_t start = node1.GetRtTimestampMs();
     TEST_CONDITION(CheckIdentifiers(nodes, idCount, true));
     uint64_t end = node1.GetRtTimestampMs();
     fprintf(stderr, "Generated %u IDs in %5.3f seconds.\n", idCount, (end-start)/1000.0);
+    // peer messages are checked at most once per PEER_POLL_MS (and for every one that arrived), not per ID
+    TEST_CONDITION(stats.polls > startPolls);
+    TEST_CONDITION(stats.polls - startPolls <= (end-start)/PEER_POLL_MS + stats.packetsIn - startPackets + 2);
+    TEST_CONDITION(stats.tsUpdates >= idCount/MAX_COUNTER && stats.storeWrites >= stats.tsUpdates);
+    TEST_CONDITION(stats.packetsOut >= stats.tsUpdates);
+
+    // batches continue the same sequence, polling once per batch
+    vector<uint64_t> batch(3*MAX_COUNTER);
+    uint64_t last, polls = stats.polls;
+    TEST_CONDITION(node1.GetId(last));
+    TEST_CONDITION(node1.GetIds(&batch[0], batch.size()) == batch.size());
+    TEST_CONDITION(last < batch[0] && std::is_sorted(batch.begin(), batch.end()));
+    TEST_CONDITION(std::adjacent_find(batch.begin(), batch.end()) == batch.end());
+    TEST_CONDITION(stats.polls - polls <= 4);
+  }
+
+  TEST_BANNER("Policy-based nodes (null transport, shared lock)");
+  {
+    // no peers: nothing is sent or received, IDs come from the state file alone
+    LocalIdNode local;
+    TEST_CONDITION(local.Initialize(960));
+    vector<uint64_t> batch(3*MAX_COUNTER);
+    TEST_CONDITION(local.GetIds(&batch[0], batch.size()) == batch.size());
+    TEST_CONDITION(std::is_sorted(batch.begin(), batch.end()));
+    TEST_CONDITION(std::adjacent_find(batch.begin(), batch.end()) == batch.end());
+    TEST_CONDITION(local.GetStats().packetsIn == 0 && local.GetMinTimestamp() > 0);
+
+    // threads share one node without their own lock
+    SharedIdNode shared;
+    TEST_CONDITION(shared.Initialize(961, 2));
+    const unsigned threads = 4, perThread = 20000;
+    vector<vector<uint64_t>> got(threads);
+    vector<std::thread> workers;
+    for (unsigned t=0; t<threads; ++t) {
+      workers.push_back(std::thread([&, t]() {
+        uint64_t id;
+        for (unsigned i=0; i<perThread && shared.GetId(id); ++i) { got[t].push_back(id); }
+      }));
+    }
+    for (auto& w : workers) { w.join(); }
+    std::set<uint64_t> all;
+    for (auto& ids : got) { all.insert(ids.begin(), ids.end()); }
+    TEST_CONDITION(all.size() == threads*perThread);
   }
 
   TEST_BANNER("Peer Nodes, normal functioning");
@@ -208,6 +539,881 @@ int main(int argc, char* argv[]) {
     TEST_CONDITION(CheckIdentifiers(nodes, idCount, false, true));
   }
 
+  TEST_BANNER("io_uring sockets (multishot receive, batched sends)");
+  {
+    SocketTransport sender, receiver;
+    sender.useUring = receiver.useUring = true;
+    IPAddress senderAddr, receiverAddr;
+    TEST_CONDITION(sender.Open(senderAddr) && receiver.Open(receiverAddr));
+    if (receiver.uring && sender.uring) {
+      // more datagrams than receive buffers, in a few batches
+      unsigned sent = 0, received = 0, fromSender = 0;
+      char buf[2048];
+      IPAddress from;
+      for (unsigned batch=0; batch<10; ++batch) {
+        for (unsigned i=0; i<20; ++i) {
+          snprintf(buf, sizeof(buf), "datagram %u", sent);
+          sent += sender.Send(buf, strlen(buf) + 1) ? 1 : 0;
+        }
+        sender.Wait(0); // submits the batch
+        while (receiver.Wait(1000)) {
+          int sz = receiver.Read(buf, sizeof(buf), from);
+          if (sz > 0 && 0 == strncmp(buf, "datagram ", 9)) { ++received; }
+          if (from.GetPort() == senderAddr.GetPort()) { ++fromSender; } // (bound to the any address)
+        }
+      }
+      fprintf(stderr, "INFO: %u of %u datagrams, %" PRIu64 " receive syscalls, %" PRIu64 " send syscalls\n",
+          received, sent, receiver.uring->GetSyscalls(), sender.uring->GetSyscalls());
+      TEST_CONDITION(sent == 200 && received == sent && fromSender == received);
+      // one submit per batch, and (mostly) no receive syscalls per datagram
+      TEST_CONDITION(receiver.uring->GetSyscalls() < received / 4);
+      TEST_CONDITION(sender.uring->GetSyscalls() < sent / 4);
+    } else {
+      fprintf(stderr, "NOTICE: skipping io_uring socket checks (not supported)\n");
+    }
+  }
+
+  TEST_BANNER("Peer Nodes over io_uring sockets, redundant peer should exit");
+  {
+    IdNode node1;
+    IdNode node2;
+    node1.SetIoUring();
+    node2.SetIoUring();
+    vector<IdNode*> nodes;
+    TEST_CONDITION(node1.InitNode(123));
+    TEST_CONDITION(node2.InitNode(123));
+    bool net1 = node1.InitNetwork();
+    bool net2 = node2.InitNetwork();
+    TEST_CONDITION(net1 != net2);
+    nodes.push_back(&node1);
+    nodes.push_back(&node2);
+    TEST_CONDITION(CheckIdentifiers(nodes, 100000, false, true));
+  }
+  {
+    IdNode node1;
+    IdNode node2;
+    node1.SetIoUring();
+    vector<IdNode*> nodes;
+    TEST_CONDITION(node1.Initialize(123));
+    nodes.push_back(&node1);
+    TEST_CONDITION(node2.Initialize(234));
+    nodes.push_back(&node2);
+    TEST_CONDITION(CheckIdentifiers(nodes, 1000000, false));
+  }
+
+  TEST_BANNER("NUMA pool (one IdNode per NUMA node, routed by CPU)");
+  {
+    const char* file = "cpulist.tmp";
+    FILE* f = fopen(file, "w");
+    fputs("0-3,8,10-11\n", f);
+    fclose(f);
+    vector<int> list;
+    TEST_CONDITION(NumaTopology::ReadCpuList(file, list));
+    TEST_CONDITION(list == vector<int>({ 0, 1, 2, 3, 8, 10, 11 }));
+    unlink(file);
+
+    NumaTopology topo;
+    topo.Discover();
+    TEST_CONDITION(topo.NodeCount() >= 1 && topo.hostNode.size() == topo.NodeCount());
+    TEST_CONDITION(topo.CurrentNode() < topo.NodeCount());
+    NumaTopology split;
+    split.Simulate(2);
+    size_t cpus = 0;
+    for (auto& l : split.cpus) { cpus += l.size(); TEST_CONDITION(!l.empty()); }
+    TEST_CONDITION(split.NodeCount() <= 2 && cpus == topo.cpuNode.size() - std::count(topo.cpuNode.begin(), topo.cpuNode.end(), -1));
+
+    IdNumaPool pool;
+    pool.configure = [](IdNode& node) { node.SetIoUring(); };
+    TEST_CONDITION(pool.Initialize(940, 2, 2));
+    TEST_CONDITION(pool.GetShardCount() == pool.GetTopology().NodeCount());
+    unsigned threads = 4, perThread = 5000;
+    vector<vector<uint64_t>> ids(threads);
+    vector<std::thread> workers;
+    for (unsigned t=0; t<threads; ++t) {
+      workers.push_back(std::thread([&pool, &ids, t, perThread]() {
+        pool.GetTopology().PinThread(t % pool.GetShardCount());
+        uint64_t id;
+        for (unsigned i=0; i<perThread; ++i) { if (pool.GetId(id)) { ids[t].push_back(id); } }
+      }));
+    }
+    for (auto& w : workers) { w.join(); }
+    IdVerifier verifier;
+    set<uint16_t> nodeIds;
+    for (auto& list : ids) {
+      TEST_CONDITION(list.size() == perThread);
+      verifier.NewStream(); // (each thread's IDs are in order, but not across threads)
+      for (uint64_t id : list) { verifier.Add(id); nodeIds.insert(id & (MAX_NODES-1)); }
+    }
+    TEST_CONDITION(verifier.Finish());
+    // every shard owns its own node-ids
+    for (uint16_t n : nodeIds) { TEST_CONDITION(n >= 940 && n < 940 + 2*pool.GetShardCount()); }
+    uint64_t id;
+    TEST_CONDITION(pool.GetId(id, pool.GetShardCount() - 1) && !pool.GetId(id, pool.GetShardCount()));
+
+    // a failed start leaves no shard running
+    IdNumaPool broken;
+    broken.configure = [](IdNode& node) { node.SetMulticastAddress("not-an-address"); };
+    TEST_CONDITION(!broken.Initialize(940, 2, 2));
+    TEST_CONDITION(broken.GetShardCount() == 0 && !broken.GetId(id));
+    broken.Poll();
+  }
+
+  TEST_BANNER("Peer Nodes, IPv6 multicast pinned to an interface");
+  {
+    unsigned idCount = 10000;
+    IdNode node1;
+    IdNode node2;
+    IdNode node3;
+    vector<IdNode*> nodes;
+
+    node1.SetMulticastAddress(MULTICAST_ADDR6);
+    node2.SetMulticastAddress(MULTICAST_ADDR6);
+    node3.SetMulticastAddress(MULTICAST_ADDR6);
+    TEST_CONDITION(node1.SetInterface("auto"));
+    TEST_CONDITION(node2.SetInterface("auto"));
+    TEST_CONDITION(node3.SetInterface("auto"));
+    TEST_CONDITION(!node1.SetInterface("no-such-if0"));
+
+    // node1 and node3 collide, node2 is a peer (exact address checks)
+    TEST_CONDITION(node1.InitNode(401));
+    TEST_CONDITION(node2.InitNode(402));
+    TEST_CONDITION(node3.InitNode(401));
+    bool net1 = node1.InitNetwork();
+    bool net2 = node2.InitNetwork();
+    bool net3 = node3.InitNetwork();
+    TEST_CONDITION(net1 != net3);
+    TEST_CONDITION(net2);
+    nodes.push_back(&node1);
+    nodes.push_back(&node2);
+    nodes.push_back(&node3);
+    TEST_CONDITION(CheckIdentifiers(nodes, idCount, false, true));
+  }
+
+  TEST_BANNER("Multiple node-ids in one process (sharding)");
+  {
+    unsigned shards = 4;
+    unsigned idCount = shards*MAX_COUNTER*4;
+    IdNode node1;
+    uint16_t nodeId1 = 300;
+    vector<IdNode*> nodes;
+
+    TEST_CONDITION(node1.Initialize(nodeId1, shards));
+    TEST_CONDITION(node1.GetShardCount() == shards);
+    TEST_CONDITION(node1.GetNodeId(shards-1) == nodeId1+shards-1);
+    nodes.push_back(&node1);
+    TEST_CONDITION(CheckIdentifiers(nodes, idCount, false));
+
+    // every shard hands out its own node-id, monotonically
+    for (unsigned i=0; i<shards; ++i) {
+      uint64_t id1, id2, ts;
+      uint16_t counter, node;
+      TEST_CONDITION(node1.GetId(id1, i));
+      TEST_CONDITION(node1.GetId(id2, i));
+      TEST_CONDITION(id1 < id2);
+      node1.IdToFields(ts, counter, node, id2);
+      TEST_CONDITION(node == nodeId1+i);
+    }
+    // out of range shard
+    uint64_t tmpId;
+    TEST_CONDITION(!node1.GetId(tmpId, shards));
+  }
+
+  TEST_BANNER("Per-shard IDs from several threads (no global lock)");
+  {
+    unsigned shards = 4, perThread = 50*MAX_COUNTER;
+    IdNode node1;
+    IdNode peer;
+    uint16_t nodeId1 = 320;
+    TEST_CONDITION(node1.Initialize(nodeId1, shards));
+    TEST_CONDITION(peer.Initialize(nodeId1 + shards));
+    vector<vector<uint64_t>> ids(shards);
+    std::atomic<bool> done(false);
+    vector<std::thread> workers;
+    for (unsigned t=0; t<shards; ++t) {
+      workers.push_back(std::thread([&node1, &ids, t, perThread]() {
+        uint64_t id;
+        for (unsigned i=0; i<perThread; ++i) { if (node1.GetId(id, t)) { ids[t].push_back(id); } }
+      }));
+    }
+    // meanwhile a peer announces its timestamps, and this thread polls as well
+    std::thread announcer([&peer, &done]() {
+      uint64_t id;
+      while (!done) { peer.GetId(id); peer.Poll(); }
+    });
+    for (unsigned i=0; i<20; ++i) { node1.Poll(1000); }
+    for (auto& w : workers) { w.join(); }
+    done = true;
+    announcer.join();
+    IdVerifier verifier;
+    for (unsigned t=0; t<shards; ++t) {
+      TEST_CONDITION(ids[t].size() == perThread);
+      TEST_CONDITION(std::adjacent_find(ids[t].begin(), ids[t].end(), std::greater_equal<uint64_t>()) == ids[t].end());
+      uint64_t ts;
+      uint16_t counter, node;
+      node1.IdToFields(ts, counter, node, ids[t].back());
+      TEST_CONDITION(node == nodeId1 + t);
+      verifier.NewStream();
+      for (uint64_t id : ids[t]) { verifier.Add(id); }
+    }
+    TEST_CONDITION(verifier.Finish());
+    TEST_CONDITION(node1.GetStats().packetsIn > 0);
+    TEST_CONDITION(!node1.HasCollision() && !peer.HasCollision());
+  }
+
+  TEST_BANNER("Multiple node-ids, overlapping peer should exit");
+  {
+    IdNode node1;
+    IdNode node2;
+
+    TEST_CONDITION(node1.InitNode(310, 4));
+    TEST_CONDITION(node2.InitNode(312));
+
+    bool net1 = node1.InitNetwork();
+    bool net2 = node2.InitNetwork();
+    // one should be up, the other down
+    TEST_CONDITION(net1 != net2);
+  }
+
+  TEST_BANNER("Node-id leasing, concurrent claims");
+  {
+    // Mark every node-id as recently used, except two, in each node's peer table.
+    const char* files[3] = { "lease1.state", "lease2.state", "lease3.state" };
+    uint64_t now = IdNode::GetRtTimestampMs();
+    for (unsigned f=0; f<3; ++f) {
+      unlink(files[f]);
+      StructArrayStore<IdNodeState> store;
+      TEST_CONDITION(store.Open(files[f], MAX_NODES));
+      for (unsigned i=0; i<MAX_NODES; ++i) {
+        IdNodeState rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.id = i;
+        rec.timestamp = (i == 700 || i == 701 || i == 702) ? now - 2*LEASE_TIMEOUT_MS : now;
+        store.Write(rec, i);
+      }
+    }
+
+    IdNode node1;
+    IdNode node2;
+    IdNode node3;
+    vector<IdNode*> nodes;
+    // claim "simultaneously", before either resolves its claim
+    TEST_CONDITION(node1.BeginLease(files[0]));
+    TEST_CONDITION(node2.BeginLease(files[1]));
+    TEST_CONDITION(node3.BeginLease(files[2]));
+    TEST_CONDITION(node1.FinishLease());
+    TEST_CONDITION(node2.FinishLease());
+    TEST_CONDITION(node3.FinishLease());
+    uint16_t id1 = node1.GetNodeId();
+    uint16_t id2 = node2.GetNodeId();
+    uint16_t id3 = node3.GetNodeId();
+    fprintf(stderr, "INFO: leased node-ids %u, %u, %u.\n", id1, id2, id3);
+    TEST_CONDITION(id1 >= 700 && id1 <= 702);
+    TEST_CONDITION(id2 >= 700 && id2 <= 702);
+    TEST_CONDITION(id3 >= 700 && id3 <= 702);
+    TEST_CONDITION(id1 != id2 && id2 != id3 && id1 != id3);
+    nodes.push_back(&node1);
+    nodes.push_back(&node2);
+    nodes.push_back(&node3);
+    TEST_CONDITION(CheckIdentifiers(nodes, 5000, false));
+    TEST_CONDITION(!node1.HasCollision() && !node2.HasCollision() && !node3.HasCollision());
+  }
+
+  TEST_BANNER("Node-id leasing, live owner keeps its node-id");
+  {
+    const char* file = "lease1.state";
+    uint64_t now = IdNode::GetRtTimestampMs();
+    unlink(file);
+    {
+      StructArrayStore<IdNodeState> store;
+      TEST_CONDITION(store.Open(file, MAX_NODES));
+      for (unsigned i=0; i<MAX_NODES; ++i) {
+        IdNodeState rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.id = i;
+        rec.timestamp = (i == 710 || i == 711) ? 0 : now;
+        store.Write(rec, i);
+      }
+    }
+    // statically assigned owner of 710, the lease table doesn't know about it
+    IdNode owner;
+    TEST_CONDITION(owner.Initialize(710));
+
+    IdNode node1;
+    TEST_CONDITION(node1.BeginLease(file));
+    owner.Poll(); // the owner answers any claim on 710
+    TEST_CONDITION(node1.FinishLease());
+    TEST_CONDITION(node1.GetNodeId() == 711);
+    TEST_CONDITION(!owner.HasCollision());
+
+    // renewal re-announces, with a fresh timestamp
+    uint64_t tmpId;
+    TEST_CONDITION(node1.GetId(tmpId));
+    TEST_CONDITION(!node1.RenewLease());
+  }
+
+  TEST_BANNER("Time-lease server grants");
+  {
+    const char* file = "timelease_test.state";
+    unlink(file);
+    TimeLeaseMsg req;
+    memset(&req, 0, sizeof(req));
+    req.id = 800;
+    req.instance = 42;
+    req.seq = 1;
+    req.end = 1000;
+    req.SetMode("TQ");
+    TimeLeaseMsg g1, g2, g3;
+    {
+      TimeLeaseServer server;
+      TEST_CONDITION(server.Open("127.0.0.1:0", file));
+      g1 = server.Grant(req);
+      TEST_CONDITION(g1.HasMode("TG") && g1.end == g1.start + 1000);
+      TEST_CONDITION(g1.start + 100 >= IdNode::GetRtTimestampMs());
+      // a retransmitted request gets the same lease
+      g2 = server.Grant(req);
+      TEST_CONDITION(g2.start == g1.start && g2.end == g1.end);
+      TEST_CONDITION(server.GetStats().grants == 1 && server.GetStats().repeats == 1);
+      // another holder of the same node-id gets the following range
+      req.instance = 43;
+      g2 = server.Grant(req);
+      TEST_CONDITION(g2.HasMode("TG") && g2.start == g1.end);
+      req.id = MAX_NODES;
+      TEST_CONDITION(server.Grant(req).HasMode("TD"));
+      req.id = 800;
+    }
+    // a restarted server never grants a range twice
+    TimeLeaseServer server;
+    TEST_CONDITION(server.Open("127.0.0.1:0", file));
+    req.seq = 2;
+    g3 = server.Grant(req);
+    TEST_CONDITION(g3.HasMode("TG") && g3.start == g2.end);
+    unlink(file);
+  }
+
+  TEST_BANNER("Time-lease mode (consistency-first), shared node-ids");
+  {
+    // the server and the nodes share a virtual clock: time only passes when the 
+    // test (or a throttling node) advances it, so leases expire by count, not by load
+    SimNetwork net;
+    SimClock clock;
+    clock.net = &net;
+    TimeLeaseServer server;
+    IPAddress serverAddr;
+    server.SetClock(&clock);
+    TEST_CONDITION(server.Open("127.0.0.1:0", NULL));
+    TEST_CONDITION(server.GetAddress(serverAddr));
+    string addr = "127.0.0.1:" + to_string(serverAddr.GetPort());
+
+    // short leases, so both nodes renew many times
+    DynamicIdNode node1;
+    DynamicIdNode node2;
+    node1.SetClock(&clock);
+    node2.SetClock(&clock);
+    node1.SetTimeLeaseLength(20);
+    node2.SetTimeLeaseLength(20);
+    uint64_t start = net.NowMs();
+    {
+      // (initialization blocks until the grant, so the server answers from a thread meanwhile)
+      atomic<bool> stop(false);
+      thread serverThread([&]() { while (!stop) { server.Poll(10000); } });
+      TEST_CONDITION(node1.InitializeTimeLease(addr.c_str(), 600, 2));
+      // the same node-id, still unique (disjoint time ranges)
+      TEST_CONDITION(node2.InitializeTimeLease(addr.c_str(), 600));
+      stop = true;
+      serverThread.join();
+    }
+    TEST_CONDITION(net.NowMs() == start); // no listen window
+    TEST_CONDITION(node2.GetMinTimestamp() >= node1.GetTimeLeaseEnd());
+    // (both use node-id 600, but each is only monotonic by itself, so one verifier stream per node)
+    // (a node without a granted lease fails at once, instead of waiting for the server: 
+    // its failed calls take no time, and one server round trip ends them)
+    vector<uint64_t> ids[2];
+    unsigned misses = 0, longestMiss = 0;
+    uint64_t slowest = 0;
+    for (unsigned i=0; i<200000; ++i) {
+      uint64_t id;
+      DynamicIdNode& node = i%2 ? node2 : node1;
+      unsigned missed = 0;
+      uint64_t callStart = net.NowMs();
+      while (!node.GetId(id) && missed < 100) {
+        slowest = std::max(slowest, net.NowMs() - callStart);
+        ++misses;
+        ++missed;
+        server.Poll(0);
+        node.Poll(0);
+        callStart = net.NowMs();
+      }
+      longestMiss = std::max(longestMiss, missed);
+      ids[i%2].push_back(id);
+    }
+    fprintf(stderr, "INFO: %u calls without a lease (at most %u in a row, the slowest took %" PRIu64 " ms), in %" PRIu64 " virtual ms.\n",
+        misses, longestMiss, slowest, net.NowMs() - start);
+    TEST_CONDITION(slowest < TIME_LEASE_RETRY_MS && longestMiss <= 2);
+    IdVerifier verifier;
+    for (auto& stream : ids) {
+      verifier.NewStream();
+      for (uint64_t id : stream) { verifier.Add(id); }
+    }
+    TEST_CONDITION(verifier.Finish());
+    TEST_CONDITION(node1.GetMinTimestamp() < node1.GetTimeLeaseEnd());
+    TEST_CONDITION(node1.GetStats().packetsOut > 3);
+    // no per-ID polling (lease replies are checked once per PEER_POLL_MS, and on timestamp updates)
+    TEST_CONDITION(node1.GetStats().polls < (net.NowMs() - start)/PEER_POLL_MS + 200000/MAX_COUNTER + 2*misses);
+    // idle nodes renew ahead of time
+    server.Poll(0);
+    node1.Poll(0);
+    net.Sleep(60000);
+    TEST_CONDITION(node1.RenewLease());
+    TEST_CONDITION(!node1.HasCollision() && !node2.HasCollision());
+
+    // unavailable (not duplicated) without a server: once its leases are used up, 
+    // a running node fails at once, instead of blocking in GetId()
+    net.Sleep(3*20*1000);
+    uint64_t id, callStart = 0;
+    bool ok = true;
+    for (unsigned n=0; ok && n<4*MAX_COUNTER; ++n) {
+      callStart = net.NowMs();
+      ok = node2.GetId(id);
+    }
+    TEST_CONDITION(!ok && net.NowMs() == callStart);
+    TEST_CONDITION(!node2.GetId(id));
+    IdNode node3;
+    TEST_CONDITION(!node3.InitializeTimeLease(addr.c_str(), 602));
+    TEST_CONDITION(!node3.GetId(id));
+  }
+
+  TEST_BANNER("Node identity (instance and boot sequence)");
+  {
+    IdNodeState state;
+    char buf[sizeof(IdNodeState)];
+    memset(buf, 0, sizeof(buf));
+    buf[0] = 42;
+    TEST_CONDITION(state.Decode(buf, STATE_V1_SIZE));
+    TEST_CONDITION(state.version == 1 && state.instance == 0 && state.timestamp == 42);
+    TEST_CONDITION(!state.Decode(buf, sizeof(buf))); // version 0
+    TEST_CONDITION(!state.Decode(buf, 20));
+
+    // v2 (32 bytes) decodes without load telemetry, v3 keeps it
+    buf[offsetof(IdNodeState, version)] = 2;
+    TEST_CONDITION(state.Decode(buf, STATE_V2_SIZE) && state.version == 2 && state.qps == 0);
+    IdNodeState v3;
+    memset(&v3, 0, sizeof(v3));
+    v3.version = 3;
+    v3.qps = 12345;
+    v3.driftMs = -7;
+    v3.counterUse = 90;
+    TEST_CONDITION(state.Decode((const char*)&v3, sizeof(v3)) && state.qps == 12345 && state.driftMs == -7);
+    TEST_CONDITION(state.IsHot() && !state.IsHot(95));
+    buf[offsetof(IdNodeState, version)] = 0;
+
+    // v4 carries the full IPv6 address (v3 messages only the folded one)
+    IPAddress v6, back;
+    TEST_CONDITION(0 == v6.SetAddress("[2001:db8::1:2]:26980"));
+    v3.SetAddress(v6);
+    v3.GetAddress(back);
+    TEST_CONDITION(v3.IsV6() && back == v6);
+    TEST_CONDITION(state.Decode((const char*)&v3, STATE_V3_SIZE) && !state.IsV6() && state.ipaddr == v3.ipaddr);
+    IPAddress v4;
+    TEST_CONDITION(0 == v4.SetAddress("10.1.2.3:26980"));
+    v3.SetAddress(v4);
+    v3.GetAddress(back);
+    TEST_CONDITION(!v3.IsV6() && back == v4);
+
+    const char* files[2] = { "0501.state", "0502.state" };
+    for (unsigned f=0; f<2; ++f) { unlink(files[f]); }
+    UDPSocket sock;
+    IPAddress mcAddr;
+    mcAddr.SetAddress(MULTICAST_ADDR);
+    TEST_CONDITION(0 == sock.Open(ANY_ADDR));
+
+    // an 'UP' for our node-id, from a previous incarnation, is stale (no collision)
+    IdNode peer;
+    TEST_CONDITION(peer.Initialize(501));
+    {
+      IdNode first;
+      TEST_CONDITION(first.Initialize(502));
+    }
+    StructArrayStore<IdNodeState> store;
+    TEST_CONDITION(store.Open(files[1], MAX_NODES));
+    IdNodeState prev;
+    TEST_CONDITION(store.Read(prev, 502));
+    TEST_CONDITION(prev.boot == 1 && prev.instance != 0);
+    IdNode node1;
+    TEST_CONDITION(node1.Initialize(502));
+    peer.Poll(100); // learn about 502
+    IdNodeState msg = prev;
+    msg.SetMode("UP");
+    TEST_CONDITION(sizeof(msg) == sock.WriteTo(mcAddr, (const char*)&msg, sizeof(msg)));
+    node1.Poll(100);
+    TEST_CONDITION(!node1.HasCollision());
+
+    // ... but one from another instance of the current incarnation is a collision
+    TEST_CONDITION(store.Read(state, 502));
+    TEST_CONDITION(state.boot == 2 && state.instance != prev.instance);
+    msg.instance = state.instance + 1;
+    msg.boot = state.boot;
+    msg.timestamp = node1.GetMinTimestamp();
+    TEST_CONDITION(sizeof(msg) == sock.WriteTo(mcAddr, (const char*)&msg, sizeof(msg)));
+    node1.Poll(100);
+    TEST_CONDITION(node1.HasCollision());
+
+    // restart with a peer that knows the previous incarnation: 
+    // the boot sequence increases, and the listen window ends early
+    {
+      IdNode node2;
+      TEST_CONDITION(node2.InitNode(502));
+      // (stepped like InitNetwork(), to see the window's end move: by state, not by elapsed time)
+      uint64_t listenEnd = node2.NextStepMs();
+      unsigned polls = 0;
+      for (; polls<LISTEN_TIME && node2.NextStepMs() == listenEnd; ++polls) {
+        peer.Poll(1000); // answer the request
+        TEST_CONDITION(PHASE_LISTEN == node2.Step());
+      }
+      fprintf(stderr, "INFO: restarted node-id after %u peer polls.\n", polls);
+      TEST_CONDITION(node2.NextStepMs() < listenEnd);
+      TEST_CONDITION(node2.InitNetwork());
+      TEST_CONDITION(store.Read(state, 502));
+      TEST_CONDITION(state.boot == 3);
+      TEST_CONDITION(!node2.HasCollision() && !peer.HasCollision());
+    }
+  }
+
+  TEST_BANNER("Simulated cluster (virtual clock and network)");
+  {
+    uint64_t sent[2];
+    for (unsigned run=0; run<2; ++run) {
+      SimCluster sim(7);
+      sim.net.params.lossRate = 0.05;
+      sim.net.params.jitterUs = 1000; // re-orders
+      for (unsigned i=0; i<32; ++i) { sim.Start(sim.AddHost(), i); }
+      sim.Run(LISTEN_TIME + 10);
+      TEST_CONDITION(sim.CountUp() == 32);
+      TEST_CONDITION(sim.CountCollisions() == 0);
+      // idle static nodes have no timers, only messages wake them
+      TEST_CONDITION(sim.hosts[0]->node->NextStepMs() == UINT64_MAX);
+      for (unsigned h=0; h<32; ++h) { TEST_CONDITION(sim.GenerateIds(h, 2000) == 2000); }
+      sent[run] = sim.net.stats.sent;
+    }
+    // same seed, same run
+    TEST_CONDITION(sent[0] == sent[1]);
+
+    // redundant node exits, restarted (migrated) node doesn't re-use IDs despite a slow clock
+    SimCluster sim(11);
+    for (unsigned i=0; i<8; ++i) { sim.Start(sim.AddHost(), i); }
+    sim.Run(LISTEN_TIME + 10);
+    for (unsigned h=0; h<8; ++h) { sim.GenerateIds(h, 3000); }
+    sim.Run(5);
+    unsigned dup = sim.AddHost();
+    sim.Start(dup, 3);
+    sim.Run(LISTEN_TIME + 10);
+    TEST_CONDITION(!sim.hosts[dup]->IsUp() && sim.hosts[dup]->node->HasCollision());
+    TEST_CONDITION(sim.hosts[3]->IsUp());
+    sim.Stop(dup);
+    sim.Stop(5);
+    unsigned moved = sim.AddHost();
+    sim.Warp(moved, -10*LISTEN_TIME);
+    sim.Start(moved, 5);
+    sim.Run(LISTEN_TIME + 10);
+    TEST_CONDITION(sim.hosts[moved]->IsUp());
+    TEST_CONDITION(sim.GenerateIds(moved, 3000) == 3000);
+    TEST_CONDITION(sim.CountDuplicates() == 0);
+  }
+
+  TEST_BANNER("Priority classes (reserved counters, bulk shed first)");
+  {
+    // (virtual time only moves when the node throttles, so a millisecond can be used up)
+    SimCluster sim(3);
+    unsigned h = sim.AddHost();
+    sim.Start(h, 40);
+    sim.Run(LISTEN_TIME + 10);
+    DynamicIdNode& node = *sim.hosts[h]->node;
+    TEST_CONDITION(!node.SetAdmission(MAX_COUNTER/2, MAX_COUNTER/2));
+    TEST_CONDITION(node.SetAdmission(100, 200));
+    unsigned bulk = MAX_COUNTER-1 - 300;
+    TEST_CONDITION(node.GetHeadroom(PRIORITY_BULK) == bulk);
+    uint64_t id, last = 0, now = sim.net.NowMs();
+    unsigned got = 0;
+    while (node.GetPriorityId(id, PRIORITY_BULK)) { TEST_CONDITION(id > last); last = id; ++got; }
+    // bulk used its share (of this and maybe the next millisecond) without waiting, then was shed
+    TEST_CONDITION((got == bulk || got == 2*bulk) && sim.net.NowMs() == now);
+    TEST_CONDITION(node.GetStats().shed == 1 && node.GetStats().throttles == 0);
+    TEST_CONDITION(node.GetHeadroom(PRIORITY_BULK) == 0);
+    TEST_CONDITION(node.GetHeadroom(PRIORITY_NORMAL) == 200 && node.GetHeadroom(PRIORITY_CRITICAL) == 300);
+    // normal (GetId()) and critical requests still get the reserved counters, in the same millisecond
+    for (unsigned i=0; i<200; ++i) { TEST_CONDITION(node.GetId(id) && id > last); last = id; }
+    TEST_CONDITION(node.GetHeadroom(PRIORITY_NORMAL) == 0 && node.GetHeadroom(PRIORITY_CRITICAL) == 100);
+    for (unsigned i=0; i<100; ++i) { TEST_CONDITION(node.GetPriorityId(id, PRIORITY_CRITICAL) && id > last); last = id; }
+    TEST_CONDITION(node.GetHeadroom(PRIORITY_CRITICAL) == 0 && sim.net.NowMs() == now);
+    TEST_CONDITION(node.GetStats().throttles == 0);
+    // then critical requests wait for the next millisecond, and bulk ones can too
+    TEST_CONDITION(node.GetPriorityId(id, PRIORITY_CRITICAL) && id > last && sim.net.NowMs() > now);
+    TEST_CONDITION(node.GetStats().throttles > 0);
+    TEST_CONDITION(node.SetAdmission(100, 200, true));
+    for (unsigned i=0; i<2*bulk; ++i) { TEST_CONDITION(node.GetPriorityId(id, PRIORITY_BULK) && id > last); last = id; }
+    TEST_CONDITION(node.GetStats().shed == 1);
+  }
+
+  TEST_BANNER("High-water reply suppression (randomized delays)");
+  {
+    uint64_t replies[2], startMs[2];
+    for (unsigned run=0; run<2; ++run) {
+      SimCluster sim(9);
+      sim.replyDelayMs = run ? REPLY_DELAY_MS : 0;
+      for (unsigned i=0; i<256; ++i) { sim.Start(sim.AddHost(), i); }
+      sim.Run(LISTEN_TIME + 10);
+      for (unsigned h=0; h<256; ++h) { sim.GenerateIds(h, 10); }
+      sim.Run(10);
+      // node 17 moves to a new host (no disk, slow clock), every peer knows its high-water mark
+      uint64_t before = sim.CountReplies();
+      sim.Stop(17);
+      unsigned moved = sim.AddHost();
+      sim.Warp(moved, -1000);
+      sim.Start(moved, 17);
+      for (startMs[run]=0; startMs[run]<LISTEN_TIME && !sim.hosts[moved]->IsUp(); ++startMs[run]) { sim.Run(1); }
+      TEST_CONDITION(sim.hosts[moved]->IsUp());
+      TEST_CONDITION(sim.GenerateIds(moved, 100) == 100 && sim.CountDuplicates() == 0);
+      replies[run] = sim.CountReplies() - before;
+    }
+    fprintf(stderr, "INFO: replies to a restart: %" PRIu64 " at once, %" PRIu64 " delayed (startup %" PRIu64 " vs %" PRIu64 " ms)\n",
+        replies[0], replies[1], startMs[0], startMs[1]);
+    TEST_CONDITION(replies[0] >= 255 && replies[1] < replies[0]/4);
+    TEST_CONDITION(startMs[1] <= startMs[0] + REPLY_DELAY_MS);
+  }
+
+  TEST_BANNER("Peer-table snapshot at startup");
+  {
+    // without snapshots, with them, and with them on a lossy network (a lost chunk is asked for again)
+    unsigned learned[3], learnMs = 0, lossyMs = 0;
+    uint64_t snapshots = 0, largest = 0;
+    for (unsigned run=0; run<3; ++run) {
+      SimCluster sim(11);
+      sim.snapshots = run >= 1;
+      for (unsigned i=0; i<128; ++i) { sim.Start(sim.AddHost(), i); }
+      sim.Run(LISTEN_TIME + 10);
+      for (unsigned h=0; h<128; ++h) { sim.GenerateIds(h, 10); }
+      sim.Run(10);
+      // a brand-new node (unused node-id, empty disk) joins the idle cluster
+      if (run == 2) { sim.net.params.lossRate = 0.4; }
+      unsigned fresh = sim.AddHost();
+      sim.Start(fresh, 500);
+      auto known = [&]() {
+        unsigned n = 0;
+        for (const IdNodeState& rec : sim.hosts[fresh]->disk) { n += rec.timestamp && rec.id != 500; }
+        return n;
+      };
+      unsigned ms;
+      for (ms=0; ms<LISTEN_TIME && known() < 128; ++ms) { sim.Run(1); }
+      learned[run] = known();
+      if (run == 1) {
+        learnMs = ms;
+        largest = sim.net.stats.largest;
+        for (auto& host : sim.hosts) { snapshots += host->node->GetStats().snapshots; }
+      }
+      if (run == 2) { lossyMs = ms; }
+    }
+    fprintf(stderr, "INFO: new node knows %u peers without, %u with a snapshot (after %u ms, %" PRIu64 " sent, "
+        "datagrams up to %" PRIu64 " bytes), %u with 40%% loss (after %u ms)\n",
+        learned[0], learned[1], learnMs, snapshots, largest, learned[2], lossyMs);
+    TEST_CONDITION(learned[0] == 0 && learned[1] == 128 && learned[2] == 128);
+    TEST_CONDITION(learnMs < LISTEN_TIME/2 && snapshots >= 1 && snapshots <= 8);
+    // (128 records are 8 chunks, none of them fragmented)
+    TEST_CONDITION(largest <= SNAPSHOT_CHUNK_SIZE && SNAPSHOT_CHUNK_SIZE + 48 <= 1280);
+
+    // corrupt or truncated snapshots are rejected
+    SimCluster sim(12);
+    unsigned a = sim.AddHost(), b = sim.AddHost();
+    sim.Start(a, 10);
+    sim.Run(LISTEN_TIME + 10);
+    sim.GenerateIds(a, 10);
+    sim.Start(b, 11);
+    sim.Run(10);
+    TEST_CONDITION(sim.hosts[a]->node->GetStats().snapshots == 1 && sim.hosts[b]->node->GetStats().snapshotRecords == 1);
+    IdSnapshot hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.from.SetMode("SN");
+    hdr.count = 1;
+    vector<char> msg(sizeof(hdr) + sizeof(IdNodeState), 0);
+    memcpy(&msg[0], &hdr, sizeof(hdr));
+    hdr.checksum = IdSnapshot::Checksum(&msg[0], msg.size());
+    memcpy(&msg[0], &hdr, sizeof(hdr));
+    vector<char> bad = msg;
+    bad.back() ^= 1;
+    DynamicIdNode node;
+    IPAddress from;
+    TEST_CONDITION(!node.MergeSnapshot(&bad[0], bad.size(), from));
+    TEST_CONDITION(!node.MergeSnapshot(&msg[0], msg.size() - 1, from));
+    TEST_CONDITION(node.MergeSnapshot(&msg[0], msg.size(), from));
+    // and so are chunks out of their snapshot's range
+    for (unsigned chunk=0; chunk<3; ++chunk) {
+      hdr.chunk = chunk;
+      hdr.chunks = 2;
+      hdr.checksum = 0;
+      memcpy(&msg[0], &hdr, sizeof(hdr));
+      hdr.checksum = IdSnapshot::Checksum(&msg[0], msg.size());
+      memcpy(&msg[0], &hdr, sizeof(hdr));
+      TEST_CONDITION(node.MergeSnapshot(&msg[0], msg.size(), from) == (chunk < 2));
+    }
+  }
+
+  TEST_BANNER("Load telemetry in UP messages (cluster view)");
+  {
+    SimCluster sim(5);
+    unsigned busy = sim.AddHost(), idle = sim.AddHost();
+    sim.Start(busy, 60, 2);
+    sim.Start(idle, 62);
+    sim.Run(LISTEN_TIME + 10);
+    // ~2000 IDs per 10 ms on one shard (more than a millisecond's counters, so it throttles), for 2 s
+    for (unsigned i=0; i<200; ++i) {
+      for (unsigned n=0; n<2000; ++n) { uint64_t id; sim.hosts[busy]->node->GetId(id, 0); }
+      sim.Run(10);
+    }
+    sim.GenerateIds(idle, 10);
+    sim.Run(10);
+    vector<IdNodeState> view;
+    TEST_CONDITION(sim.hosts[idle]->node->GetClusterView(view) == 3);
+    for (const IdNodeState& rec : view) {
+      if (rec.id == 60) {
+        fprintf(stderr, "INFO: node 60: %u ids/s, %u%% counter use, %u throttles, drift %d ms\n",
+            rec.qps, rec.counterUse, rec.throttles, rec.driftMs);
+        TEST_CONDITION(rec.version == STATE_VERSION && rec.qps > 100000 && rec.qps < 300000);
+        TEST_CONDITION(rec.counterUse == 100 && rec.throttles > 0 && rec.IsHot());
+      } else {
+        TEST_CONDITION(!rec.IsHot() && rec.qps < 1000);
+      }
+    }
+    // the busy host's own table has the same view (it stores its own records)
+    TEST_CONDITION(sim.hosts[busy]->node->GetClusterView(view) == 3);
+    // and stopped (old) node-ids can be skipped
+    sim.Stop(idle);
+    sim.Run(2000);
+    sim.hosts[busy]->node->Poll();
+    TEST_CONDITION(sim.hosts[busy]->node->GetClusterView(view, 1000) == 0);
+  }
+
+  TEST_BANNER("Multicast relays (three groups on loopback, as separate subnets)");
+  {
+    const char* groups[3] = { "239.0.1.1:26991", "239.0.1.2:26992", "239.0.1.3:26993" };
+    IdRelay relays[3];
+    string addrs[3];
+    for (unsigned i=0; i<3; ++i) {
+      IPAddress addr;
+      relays[i].SetMulticastAddress(groups[i]);
+      TEST_CONDITION(relays[i].Open("127.0.0.1:0") && relays[i].GetAddress(addr));
+      addrs[i] = "127.0.0.1:" + to_string(addr.GetPort());
+    }
+    for (unsigned i=0; i<3; ++i) {
+      for (unsigned j=0; j<3; ++j) {
+        if (i != j) { TEST_CONDITION(relays[i].AddPeer(addrs[j].c_str())); }
+      }
+    }
+    atomic<bool> stop(false);
+    thread relayThread([&]() { while (!stop) { for (auto& r : relays) { r.Poll(500); } } });
+
+    IdNode node1, node2, node3, node4;
+    vector<IdNodeState> tables[4]; // (one peer table per node, as on separate hosts)
+    node1.SetStateMemory(&tables[0]);
+    node2.SetStateMemory(&tables[1]);
+    node3.SetStateMemory(&tables[2]);
+    node4.SetStateMemory(&tables[3]);
+    node1.SetMulticastAddress(groups[0]);
+    node2.SetMulticastAddress(groups[1]);
+    node3.SetMulticastAddress(groups[2]);
+    node4.SetMulticastAddress(groups[1]);
+    TEST_CONDITION(node3.Initialize(972));
+    TEST_CONDITION(node1.Initialize(970));
+    // the owner of node-id 970 is in another group, but answers through the relays
+    atomic<bool> stopOwner(false);
+    thread owner([&]() { while (!stopOwner) { node1.Poll(1000); } });
+    TEST_CONDITION(!node2.Initialize(970));
+    TEST_CONDITION(node2.HasCollision());
+    stopOwner = true;
+    owner.join();
+    TEST_CONDITION(node4.Initialize(971));
+
+    // a busy node sends an UP for every new timestamp, the relay only the newest of each digest
+    uint64_t id = 0;
+    while (node1.GetStats().tsUpdates < 200) { node1.GetId(id); }
+    node1.Poll(); // (the newest timestamp goes out with the next poll)
+    // (until the newest record went through the relays, by polls, not by elapsed time)
+    vector<IdNodeState> view;
+    bool seen970 = false, seen971 = false;
+    for (unsigned n=0; n<1000 && !(seen970 && seen971); ++n) {
+      node3.Poll(1000);
+      node3.GetClusterView(view);
+      for (const IdNodeState& rec : view) {
+        seen970 = seen970 || (rec.id == 970 && rec.timestamp >= IdNode::IdToTimestamp(id));
+        seen971 = seen971 || rec.id == 971;
+      }
+    }
+    stop = true;
+    relayThread.join();
+    TEST_CONDITION(!node1.HasCollision() && !node3.HasCollision() && !node4.HasCollision());
+    TEST_CONDITION(seen970 && seen971);
+    const IdRelay::Stats& s = relays[0].GetStats();
+    fprintf(stderr, "INFO: node 970 sent %" PRIu64 " messages, its relay forwarded %" PRIu64 " records in %" PRIu64 " digests (%" PRIu64 " dropped)\n",
+        node1.GetStats().packetsOut, s.forwarded, s.digestsOut, s.dropped);
+    TEST_CONDITION(relays[0].GetRecord(970).timestamp >= IdNode::IdToTimestamp(id));
+    TEST_CONDITION(s.forwarded < node1.GetStats().packetsOut / 2);
+    TEST_CONDITION(relays[1].GetStats().injected > 0 && relays[2].GetStats().injected > 0);
+    TEST_CONDITION(s.invalid == 0 && relays[1].GetStats().invalid == 0 && relays[2].GetStats().invalid == 0);
+  }
+
+  TEST_BANNER("Legacy (v2) state file conversion");
+  {
+    const char* file = "0730.state";
+    unlink(file);
+    unlink("0730.state.v2");
+    vector<char> old(STATE_V2_SIZE*MAX_NODES, 0);
+    IdNodeState rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.timestamp = IdNode::GetRtTimestampMs() + 5000;
+    rec.id = 730;
+    rec.version = 2;
+    rec.boot = 3;
+    memcpy(&old[730*STATE_V2_SIZE], &rec, STATE_V2_SIZE);
+    FILE* f = fopen(file, "wb");
+    TEST_CONDITION(f && 1 == fwrite(&old[0], old.size(), 1, f));
+    if (f) { fclose(f); }
+    IdNode node;
+    TEST_CONDITION(node.Initialize(730));
+    uint64_t id, ts;
+    uint16_t counter, nodeId;
+    TEST_CONDITION(node.GetId(id));
+    IdNode::IdToFields(ts, counter, nodeId, id);
+    // (after the stored high-water mark, with the next boot sequence)
+    TEST_CONDITION(ts > rec.timestamp && nodeId == 730);
+    struct stat st;
+    TEST_CONDITION(0 == stat("0730.state.v2", &st) && 0 == stat(file, &st) && st.st_size == (off_t)sizeof(IdNodeState)*MAX_NODES);
+    unlink(file);
+    unlink("0730.state.v2");
+  }
+
+  TEST_BANNER("Durable high-water marks (io_uring, and thread fallback)");
+  for (bool useUring : { true, false }) {
+    const char* file = "0720.state";
+    unlink(file);
+    uint64_t lastTs = 0;
+    {
+      IdNode node;
+      const char* name = node.SetDurable(useUring);
+      fprintf(stderr, "INFO: persisting with %s\n", name);
+      TEST_CONDITION(0 == strcmp(name, useUring ? "io_uring" : "thread") || useUring);
+      TEST_CONDITION(node.Initialize(720));
+      vector<IdNode*> nodes;
+      nodes.push_back(&node);
+      TEST_CONDITION(CheckIdentifiers(nodes, 20*MAX_COUNTER, true));
+      lastTs = node.GetMinTimestamp();
+      // the synced (and stored) mark is ahead of every timestamp used
+      TEST_CONDITION(node.GetDurableTimestamp() >= lastTs);
+      TEST_CONDITION(node.GetStats().syncs > 0);
+    }
+    StructArrayStore<IdNodeState> store;
+    IdNodeState rec;
+    TEST_CONDITION(store.Open(file, MAX_NODES) && store.Read(rec, 720));
+    TEST_CONDITION(rec.timestamp >= lastTs && rec.timestamp <= lastTs + DURABLE_AHEAD_MS);
+    unlink(file);
+  }
+
   TEST_BANNER("Node timestamp high-water mark from StructArrayStore");
   {
     uint16_t nodeId1 = 123;
@@ -0,0 +1,114 @@
+// Copyright 2020, Tim Crowder, All rights reserved.
+
+// Verifies that IDs are unique (and monotonic per node-id), e.g. the
+// combined 'client' output of many nodes.
+//
+//   usage: verify [options] [file...]   (stdin if no files, or '-')
+//     -b           files are binary (native-endian 64-bit IDs), instead of hex text
+//     -z           input is compressed (IdCodec.hpp, e.g. 'client -z' output)
+//     -m <MiB>     memory for in-memory sorting (default 1024), larger inputs
+//                  are sorted in runs, and merged from temporary files
+//     -t <threads> sort threads (default: one per CPU)
+//     -T <dir>     directory for temporary files (default /tmp)
+//     -s <ids/s>   probabilistic streaming check (DupDetector.hpp), instead of sorting: for about
+//                  this many IDs per second (of ID timestamps), in at most -m MiB; duplicates more
+//                  than -w seconds apart are missed, and about 1 in 1000 IDs may be a false positive
+//     -w <s>       seconds covered by -s (default 10)
+//
+//   exit status: 0 if all IDs are unique and monotonic, 1 if not, 2 on errors.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <memory>
+
+#include "IdVerifier.hpp"
+#include "IdCodec.hpp"
+
+// Adds the IDs of a compressed stream 'f' (read completely into memory, it's small).
+// Returns false on read errors, or invalid streams.
+static bool AddCompressedStream(IdVerifier& verifier, FILE* f) {
+  std::vector<uint8_t> data;
+  uint8_t buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) { data.insert(data.end(), buf, buf + n); }
+  if (ferror(f)) {
+    fprintf(stderr, "ERROR: Failed to read compressed input!\n");
+    return false;
+  }
+  IdDecoder dec(data.empty() ? NULL : &data[0], data.size());
+  uint64_t block[CODEC_BLOCK];
+  while (unsigned count = dec.Next(block)) {
+    for (unsigned i=0; i<count; ++i) { verifier.Add(block[i]); }
+  }
+  return !dec.HasError();
+}
+
+int main(int argc, char* argv[]) {
+  bool binary = false;
+  bool compressed = false;
+  size_t memMiB = 1024;
+  unsigned threads = 0;
+  const char* tmpDir = "/tmp";
+  uint64_t streamRate = 0;
+  unsigned streamSecs = 10;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "bzm:t:T:s:w:")) != -1) {
+    switch (opt) {
+      case 'b': binary = true; break;
+      case 'z': compressed = true; break;
+      case 'm': memMiB = strtoul(optarg, NULL, 10); break;
+      case 't': threads = strtoul(optarg, NULL, 10); break;
+      case 'T': tmpDir = optarg; break;
+      case 's': streamRate = strtoull(optarg, NULL, 10); break;
+      case 'w': streamSecs = strtoul(optarg, NULL, 10); break;
+      default:
+        fprintf(stderr, "Usage: %s [-b|-z] [-m MiB] [-t threads] [-T tmpdir] [-s ids/s [-w seconds]] [file...]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  // the buffer and the sort scratch space, 16 bytes per ID
+  IdVerifier verifier((memMiB << 20) / 16, threads, tmpDir);
+  std::unique_ptr<IdDupDetector> detector;
+  if (streamRate) {
+    detector.reset(new IdDupDetector(streamRate, 0.001, 1000, streamSecs + 1, memMiB << 20));
+    verifier.SetDetector(detector.get());
+  }
+  uint64_t start = IdNode::GetMonoTimestampMs();
+  bool ok = true;
+  if (optind >= argc) {
+    if (binary) {
+      fprintf(stderr, "ERROR: Binary input must be a file!\n");
+      return 2;
+    }
+    ok = compressed ? AddCompressedStream(verifier, stdin) : verifier.AddHexStream(stdin);
+  }
+  for (int i=optind; ok && i<argc; ++i) {
+    verifier.NewStream();
+    if (binary) {
+      ok = verifier.AddBinaryFile(argv[i]);
+    } else if (0 == strcmp(argv[i], "-")) {
+      ok = compressed ? AddCompressedStream(verifier, stdin) : verifier.AddHexStream(stdin);
+    } else {
+      FILE* f = fopen(argv[i], "r");
+      if (!f) {
+        fprintf(stderr, "ERROR: Failed to open '%s'!\n", argv[i]);
+        return 2;
+      }
+      ok = compressed ? AddCompressedStream(verifier, f) : verifier.AddHexStream(f);
+      fclose(f);
+    }
+  }
+  if (!ok) { return 2; }
+
+  bool valid = verifier.Finish();
+  uint64_t elapsed = IdNode::GetMonoTimestampMs() - start;
+  verifier.Report(stdout);
+  fprintf(stdout, "Elapsed:       %" PRIu64 " ms\n", elapsed);
+  if (verifier.HasError()) { return 2; }
+  return valid ? 0 : 1;
+}